@@ -0,0 +1,488 @@
+#define FUSE_USE_VERSION 35
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "defs.h"
+#include "journal.h"
+#include "operations.h"
+
+// Benchmark of the filesystem, calling the functions of operations.c
+// in-process, without a FUSE mount:
+//
+//   fisopfs-bench [-t threads] [-d depth] [-w width] [-f files]
+//                 [-s size] [-l lookups] [-j always|batch|none]
+//                 [-p image] [-W workers]
+//
+// Every thread builds a tree of its own under /t<thread>: directories
+// `depth` levels deep with `width` subdirectories each, and `files`
+// files of `size` bytes in each directory of the last level. Then the
+// phases below run one after the other, all threads at once, and each
+// one reports its operations per second and the percentiles of their
+// latencies. save and load are single calls: unmounting, which writes
+// the whole image, and mounting it again. read-cold reads everything
+// again right after load, paying for loading it lazily from the image.
+// -W sets the threads that encode and decode the image (see workers.c),
+// one per CPU by default.
+#define DEFAULT_THREADS 4
+#define DEFAULT_DEPTH 3
+#define DEFAULT_WIDTH 8
+#define DEFAULT_FILES 8
+#define DEFAULT_SIZE 4096
+#define DEFAULT_LOOKUPS 100000
+#define DEFAULT_IMAGE "/tmp/fisopfs-bench.fisopfs"
+
+// Bytes per read and write call, the most the kernel sends at once.
+#define CHUNK (128 * 1024)
+
+typedef enum phase {
+	PHASE_MKDIR,
+	PHASE_CREATE,
+	PHASE_WRITE,
+	PHASE_READ,
+	PHASE_LOOKUP,
+	PHASE_SAVE,
+	PHASE_LOAD,
+	PHASE_READ_COLD,
+	PHASES,
+} phase;
+
+static const char *const phase_names[PHASES] = {
+	[PHASE_MKDIR] = "mkdir",   [PHASE_CREATE] = "create",
+	[PHASE_WRITE] = "write",   [PHASE_READ] = "read",
+	[PHASE_LOOKUP] = "lookup", [PHASE_SAVE] = "save",
+	[PHASE_LOAD] = "load",     [PHASE_READ_COLD] = "read-cold",
+};
+
+// Latencies of the operations of a phase, in nanoseconds.
+typedef struct samples {
+	uint64_t *ns;
+	size_t count;
+	size_t capacity;
+} samples;
+
+// The paths a thread works on and the latencies it measured.
+typedef struct worker {
+	int id;
+	char **dirs;
+	size_t ndirs;
+	char **files;
+	size_t nfiles;
+	phase current;
+	samples latencies;
+} worker;
+
+typedef struct result {
+	size_t ops;
+	double seconds;
+	samples latencies;
+} result;
+
+static int threads = DEFAULT_THREADS;
+static int depth = DEFAULT_DEPTH;
+static int width = DEFAULT_WIDTH;
+static int files_per_dir = DEFAULT_FILES;
+static size_t file_size = DEFAULT_SIZE;
+static size_t lookups = DEFAULT_LOOKUPS;
+
+static char *data;  // What every file is written with
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void
+add_sample(samples *s, uint64_t ns)
+{
+	if (s->count == s->capacity) {
+		s->capacity = s->capacity > 0 ? s->capacity * 2 : 1024;
+		s->ns = realloc(s->ns, s->capacity * sizeof(uint64_t));
+		if (s->ns == NULL) {
+			fprintf(stderr, "Error: out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	s->ns[s->count++] = ns;
+}
+
+static void
+append_samples(samples *to, const samples *from)
+{
+	for (size_t i = 0; i < from->count; i++) {
+		add_sample(to, from->ns[i]);
+	}
+}
+
+static int
+compare_ns(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+	return (x > y) - (x < y);
+}
+
+// Latency in microseconds below which `fraction` of the sorted samples
+// are.
+static double
+percentile(const samples *s, double fraction)
+{
+	if (s->count == 0) {
+		return 0;
+	}
+	size_t index = (size_t) (fraction * (s->count - 1));
+	return s->ns[index] / 1000.0;
+}
+
+static char *
+copy_path(const char *path)
+{
+	char *copy = strdup(path);
+	if (copy == NULL) {
+		fprintf(stderr, "Error: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	return copy;
+}
+
+// Adds to `w` the directories below `parent`, `level` levels above the
+// last one, and the files of the last level.
+static void
+plan_tree(worker *w, const char *parent, int level)
+{
+	char path[PATH_MAX];
+	if (level == 0) {
+		for (int i = 0; i < files_per_dir; i++) {
+			snprintf(path, sizeof(path), "%s/f%d", parent, i);
+			w->files[w->nfiles++] = copy_path(path);
+		}
+		return;
+	}
+	for (int i = 0; i < width; i++) {
+		snprintf(path, sizeof(path), "%s/d%d", parent, i);
+		w->dirs[w->ndirs++] = copy_path(path);
+		plan_tree(w, path, level - 1);
+	}
+}
+
+static void
+plan_worker(worker *w, int id)
+{
+	size_t dirs = 1, leaves = 1;
+	for (int i = 0; i < depth; i++) {
+		leaves *= width;
+		dirs += leaves;
+	}
+
+	*w = (worker){ .id = id };
+	w->dirs = malloc(dirs * sizeof(char *));
+	w->files = malloc(leaves * files_per_dir * sizeof(char *));
+	if (w->dirs == NULL || w->files == NULL) {
+		fprintf(stderr, "Error: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	char root[32];
+	snprintf(root, sizeof(root), "/t%d", id);
+	w->dirs[w->ndirs++] = copy_path(root);
+	plan_tree(w, root, depth);
+}
+
+static void
+check(int ret, const char *what, const char *path)
+{
+	if (ret < 0) {
+		fprintf(stderr,
+		        "Error: %s %s: %s\n",
+		        what,
+		        path,
+		        strerror(-ret));
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Writes or reads the whole file at `path`, a chunk per call.
+static void
+transfer(worker *w, const char *path, bool write, char *buf)
+{
+	struct fuse_file_info fi = { .flags = write ? O_WRONLY : O_RDONLY };
+	check(filesystem_open(path, &fi), "open", path);
+	for (size_t done = 0; done < file_size; done += CHUNK) {
+		size_t chunk = file_size - done < CHUNK ? file_size - done
+		                                        : CHUNK;
+		uint64_t start = now_ns();
+		int ret = write ? filesystem_write(path, data, chunk, done, &fi)
+		                : filesystem_read(path, buf, chunk, done, &fi);
+		add_sample(&w->latencies, now_ns() - start);
+		check(ret, write ? "write" : "read", path);
+	}
+	filesystem_release(path, &fi);
+}
+
+static void
+lookup_files(worker *w)
+{
+	unsigned seed = w->id + 1;
+	for (size_t i = 0; i < lookups; i++) {
+		const char *path = w->files[rand_r(&seed) % w->nfiles];
+		inode *node;
+		uint64_t start = now_ns();
+		pthread_rwlock_rdlock(&fs.lock);
+		int ret = search_inode(path, &node);
+		pthread_rwlock_unlock(&fs.lock);
+		add_sample(&w->latencies, now_ns() - start);
+		check(ret, "lookup", path);
+	}
+}
+
+static void
+make_dirs(worker *w)
+{
+	for (size_t i = 0; i < w->ndirs; i++) {
+		uint64_t start = now_ns();
+		int ret = filesystem_mkdir(w->dirs[i], 0755);
+		add_sample(&w->latencies, now_ns() - start);
+		check(ret, "mkdir", w->dirs[i]);
+	}
+}
+
+static void
+create_files(worker *w)
+{
+	for (size_t i = 0; i < w->nfiles; i++) {
+		struct fuse_file_info fi = { .flags = O_WRONLY };
+		uint64_t start = now_ns();
+		int ret = filesystem_create(w->files[i], 0644, &fi);
+		add_sample(&w->latencies, now_ns() - start);
+		check(ret, "create", w->files[i]);
+		filesystem_release(w->files[i], &fi);
+	}
+}
+
+static void *
+run_worker(void *arg)
+{
+	worker *w = arg;
+	char *buf = malloc(CHUNK);
+	if (buf == NULL) {
+		fprintf(stderr, "Error: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	switch (w->current) {
+	case PHASE_MKDIR:
+		make_dirs(w);
+		break;
+	case PHASE_CREATE:
+		create_files(w);
+		break;
+	case PHASE_WRITE:
+	case PHASE_READ:
+	case PHASE_READ_COLD:
+		for (size_t i = 0; i < w->nfiles; i++) {
+			bool write = w->current == PHASE_WRITE;
+			transfer(w, w->files[i], write, buf);
+		}
+		break;
+	case PHASE_LOOKUP:
+		lookup_files(w);
+		break;
+	default:
+		break;
+	}
+
+	free(buf);
+	return NULL;
+}
+
+// Runs `p` on every worker at once.
+static void
+run_phase(worker *workers, phase p, result *r)
+{
+	pthread_t *ids = malloc(threads * sizeof(pthread_t));
+	if (ids == NULL) {
+		fprintf(stderr, "Error: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	uint64_t start = now_ns();
+	for (int i = 0; i < threads; i++) {
+		workers[i].current = p;
+		workers[i].latencies.count = 0;
+		pthread_create(&ids[i], NULL, run_worker, &workers[i]);
+	}
+	for (int i = 0; i < threads; i++) {
+		pthread_join(ids[i], NULL);
+	}
+	r->seconds = (now_ns() - start) / 1e9;
+
+	for (int i = 0; i < threads; i++) {
+		append_samples(&r->latencies, &workers[i].latencies);
+	}
+	r->ops = r->latencies.count;
+	free(ids);
+}
+
+// Times a single call, mounting or unmounting.
+static void
+run_single(phase p, result *r)
+{
+	uint64_t start = now_ns();
+	if (p == PHASE_SAVE) {
+		filesystem_destroy(NULL);
+	} else {
+		filesystem_init(NULL);
+	}
+	uint64_t ns = now_ns() - start;
+	add_sample(&r->latencies, ns);
+	r->ops = 1;
+	r->seconds = ns / 1e9;
+}
+
+static void
+print_results(result *results)
+{
+	printf("\n%-10s %10s %9s %12s %10s %10s %10s %10s\n",
+	       "phase",
+	       "ops",
+	       "seconds",
+	       "ops/s",
+	       "p50_us",
+	       "p90_us",
+	       "p99_us",
+	       "max_us");
+	for (int p = 0; p < PHASES; p++) {
+		result *r = &results[p];
+		qsort(r->latencies.ns, r->latencies.count, sizeof(uint64_t),
+		      compare_ns);
+		printf("%-10s %10zu %9.3f %12.0f %10.1f %10.1f %10.1f %10.1f\n",
+		       phase_names[p],
+		       r->ops,
+		       r->seconds,
+		       r->seconds > 0 ? r->ops / r->seconds : 0,
+		       percentile(&r->latencies, 0.50),
+		       percentile(&r->latencies, 0.90),
+		       percentile(&r->latencies, 0.99),
+		       percentile(&r->latencies, 1.0));
+	}
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr,
+	        "usage: %s [-t threads] [-d depth] [-w width] [-f files]\n"
+	        "       [-s size] [-l lookups] [-j always|batch|none] "
+	        "[-p image] [-W workers]\n",
+	        name);
+	exit(EXIT_FAILURE);
+}
+
+static long
+parse_number(const char *arg, const char *name, long min)
+{
+	char *end;
+	long value = strtol(arg, &end, 10);
+	if (*arg == '\0' || *end != '\0' || value < min) {
+		fprintf(stderr,
+		        "Error: %s must be a number >= %ld\n",
+		        name,
+		        min);
+		exit(EXIT_FAILURE);
+	}
+	return value;
+}
+
+// Removes the image and journals of a previous run.
+static void
+remove_image(void)
+{
+	char path[PATH_MAX];
+	unlink(filedisk);
+	snprintf(path, sizeof(path), "%s.journal", filedisk);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s.journal.old", filedisk);
+	unlink(path);
+}
+
+int
+main(int argc, char *argv[])
+{
+	filedisk = DEFAULT_IMAGE;
+	checkpoint_interval = 0;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "t:d:w:f:s:l:j:p:W:")) != -1) {
+		switch (opt) {
+		case 't':
+			threads = parse_number(optarg, "-t", 1);
+			break;
+		case 'd':
+			depth = parse_number(optarg, "-d", 0);
+			break;
+		case 'w':
+			width = parse_number(optarg, "-w", 1);
+			break;
+		case 'f':
+			files_per_dir = parse_number(optarg, "-f", 1);
+			break;
+		case 's':
+			file_size = parse_number(optarg, "-s", 0);
+			break;
+		case 'l':
+			lookups = parse_number(optarg, "-l", 0);
+			break;
+		case 'j':
+			if (journal_parse_sync(optarg, &journal_mode) != 0) {
+				usage(argv[0]);
+			}
+			break;
+		case 'p':
+			filedisk = optarg;
+			break;
+		case 'W':
+			worker_threads = parse_number(optarg, "-W", 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	data = malloc(CHUNK);
+	worker *workers = calloc(threads, sizeof(worker));
+	result *results = calloc(PHASES, sizeof(result));
+	if (data == NULL || workers == NULL || results == NULL) {
+		fprintf(stderr, "Error: out of memory\n");
+		return EXIT_FAILURE;
+	}
+	memset(data, 'x', CHUNK);
+	for (int i = 0; i < threads; i++) {
+		plan_worker(&workers[i], i);
+	}
+
+	remove_image();
+	filesystem_init(NULL);
+	for (int p = 0; p < PHASES; p++) {
+		if (p == PHASE_SAVE || p == PHASE_LOAD) {
+			run_single(p, &results[p]);
+		} else {
+			run_phase(workers, p, &results[p]);
+		}
+	}
+	filesystem_destroy(NULL);
+	remove_image();
+
+	print_results(results);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,230 @@
+#include "blockmap.h"
+
+#include <limits.h>
+#include <stdlib.h>
+
+// Radix tree over the block index. A leaf holds the slots of FANOUT
+// consecutive blocks and each level of nodes above covers FANOUT times
+// more, up to a root just high enough for the largest index used. Only
+// the parts of the tree with slots are allocated, so a file takes memory
+// for the blocks it holds and not for its length: a byte written 1 TiB
+// past the end adds one leaf and a few nodes. blockmap_prune frees the
+// leaves left without slots in use, and the nodes left without leaves.
+//
+// Like the rest of a file, the tree is only changed with the file locked
+// for writing.
+
+#define FANOUT_BITS 6
+#define FANOUT (1 << FANOUT_BITS)
+
+typedef struct leaf {
+	block_slot slots[FANOUT];
+} leaf;
+
+typedef struct node {
+	void *children[FANOUT];  // Nodes one level down, or leaves
+} node;
+
+// Whether `index` lies in a tree `height` levels of nodes high.
+static bool
+fits(size_t index, unsigned height)
+{
+	unsigned bits = FANOUT_BITS * (height + 1);
+	return bits >= sizeof(size_t) * CHAR_BIT || index >> bits == 0;
+}
+
+static void
+destroy_subtree(void *p, unsigned height)
+{
+	if (height > 0) {
+		node *n = p;
+		for (size_t i = 0; i < FANOUT; i++) {
+			if (n->children[i] != NULL) {
+				destroy_subtree(n->children[i], height - 1);
+			}
+		}
+	}
+	free(p);
+}
+
+// Frees the tree, not what its slots hold.
+void
+blockmap_destroy(blockmap *map)
+{
+	if (map->root != NULL) {
+		destroy_subtree(map->root, map->height);
+	}
+	map->root = NULL;
+	map->height = 0;
+}
+
+// Whether `slot` holds a block: loaded, packed or pending.
+bool
+blockmap_used(const block_slot *slot)
+{
+	return slot->block != NULL || slot->packed != NULL ||
+	       slot->pending != 0;
+}
+
+// The slot at `index`, null if it was never allocated (a hole).
+block_slot *
+blockmap_get(const blockmap *map, size_t index)
+{
+	if (map->root == NULL || !fits(index, map->height)) {
+		return NULL;
+	}
+	void *p = map->root;
+	for (unsigned height = map->height; height > 0; height--) {
+		node *n = p;
+		p = n->children[index >> (FANOUT_BITS * height) & (FANOUT - 1)];
+		if (p == NULL) {
+			return NULL;
+		}
+	}
+	leaf *l = p;
+	return &l->slots[index & (FANOUT - 1)];
+}
+
+// The slot at `index`, allocated empty if needed. Null if out of memory.
+block_slot *
+blockmap_slot(blockmap *map, size_t index)
+{
+	if (map->root == NULL) {
+		map->height = 0;
+		while (!fits(index, map->height)) {
+			map->height++;
+		}
+	}
+	while (!fits(index, map->height)) {
+		node *n = calloc(1, sizeof(node));
+		if (n == NULL) {
+			return NULL;
+		}
+		n->children[0] = map->root;
+		map->root = n;
+		map->height++;
+	}
+
+	void **link = &map->root;
+	for (unsigned height = map->height;; height--) {
+		if (*link == NULL) {
+			size_t size = height > 0 ? sizeof(node) : sizeof(leaf);
+			*link = calloc(1, size);
+			if (*link == NULL) {
+				return NULL;
+			}
+		}
+		if (height == 0) {
+			break;
+		}
+		node *n = *link;
+		link = &n->children[index >> (FANOUT_BITS * height) &
+		                    (FANOUT - 1)];
+	}
+	leaf *l = *link;
+	return &l->slots[index & (FANOUT - 1)];
+}
+
+// First slot in use at or after `from` in the subtree `p`, `height`
+// levels of nodes high, whose first index is `base`. Sets `*index` to
+// its index.
+static block_slot *
+next_in(void *p, unsigned height, size_t base, size_t from, size_t *index)
+{
+	if (height == 0) {
+		leaf *l = p;
+		size_t first = from > base ? from - base : 0;
+		for (size_t i = first; i < FANOUT; i++) {
+			if (blockmap_used(&l->slots[i])) {
+				*index = base + i;
+				return &l->slots[i];
+			}
+		}
+		return NULL;
+	}
+
+	unsigned shift = FANOUT_BITS * height;
+	node *n = p;
+	size_t first = from > base ? (from - base) >> shift : 0;
+	for (size_t i = first; i < FANOUT; i++) {
+		if (n->children[i] == NULL) {
+			continue;
+		}
+		block_slot *slot = next_in(n->children[i],
+		                           height - 1,
+		                           base + (i << shift),
+		                           from,
+		                           index);
+		if (slot != NULL) {
+			return slot;
+		}
+	}
+	return NULL;
+}
+
+// First slot in use at or after `*index`, which is set to its index.
+// Null if there is none. Skips the holes without visiting them.
+block_slot *
+blockmap_next(const blockmap *map, size_t *index)
+{
+	if (map->root == NULL || !fits(*index, map->height)) {
+		return NULL;
+	}
+	return next_in(map->root, map->height, 0, *index, index);
+}
+
+// Frees the leaves of the subtree `p` (see next_in) that overlap [first,
+// last] and have no slot in use, and the nodes left empty. Returns
+// whether `p` itself was freed.
+static bool
+prune_in(void *p, unsigned height, size_t base, size_t first, size_t last)
+{
+	if (height == 0) {
+		leaf *l = p;
+		for (size_t i = 0; i < FANOUT; i++) {
+			if (blockmap_used(&l->slots[i])) {
+				return false;
+			}
+		}
+		free(l);
+		return true;
+	}
+
+	unsigned shift = FANOUT_BITS * height;
+	node *n = p;
+	size_t from = first > base ? (first - base) >> shift : 0;
+	size_t to = (last - base) >> shift;
+	if (to >= FANOUT) {
+		to = FANOUT - 1;
+	}
+	for (size_t i = from; i <= to; i++) {
+		if (n->children[i] != NULL &&
+		    prune_in(n->children[i],
+		             height - 1,
+		             base + (i << shift),
+		             first,
+		             last)) {
+			n->children[i] = NULL;
+		}
+	}
+	for (size_t i = 0; i < FANOUT; i++) {
+		if (n->children[i] != NULL) {
+			return false;
+		}
+	}
+	free(n);
+	return true;
+}
+
+// Gives back the memory of the slots of [first, last] no longer in use.
+void
+blockmap_prune(blockmap *map, size_t first, size_t last)
+{
+	if (map->root == NULL || !fits(first, map->height)) {
+		return;
+	}
+	if (prune_in(map->root, map->height, 0, first, last)) {
+		map->root = NULL;
+		map->height = 0;
+	}
+}
@@ -0,0 +1,21 @@
+#ifndef BLOCKMAP_H
+#define BLOCKMAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "defs.h"
+
+void blockmap_destroy(blockmap *map);
+
+bool blockmap_used(const block_slot *slot);
+
+block_slot *blockmap_get(const blockmap *map, size_t index);
+
+block_slot *blockmap_slot(blockmap *map, size_t index);
+
+block_slot *blockmap_next(const blockmap *map, size_t *index);
+
+void blockmap_prune(blockmap *map, size_t first, size_t last);
+
+#endif
@@ -0,0 +1,833 @@
+#include "blocks.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blockmap.h"
+#include "checkpoint.h"
+#include "idmap.h"
+#include "lz.h"
+#include "slab.h"
+
+// Blocks are only packed if they compress to this size or less.
+#define MAX_PACKED_SIZE (BLOCK_SIZE * 3 / 4)
+
+// Invariant kept by every function in this file: the bytes of a block that
+// lie past the end of the file are always zero. That way growing a file
+// (by truncate or by writing past its end) never has to clear anything.
+//
+// Copy on write: a checkpoint freezes the blocks it saves (BLOCK_FROZEN)
+// and writes them after releasing fs.lock. A frozen block is never
+// changed, writing to it replaces it with a copy, and freeing it only
+// marks it BLOCK_ORPHANED: the checkpoint frees it when it thaws it.
+//
+// Dedup (optional, see block_store_init): checkpoints and lazy loads hand
+// their blocks to block_dedup, which keeps one block per content in a
+// store indexed by a hash of the data. A block found there is shared by
+// every file slot holding the same bytes, and counts the extra ones in
+// `shared`. Stored blocks are never changed in place while shared:
+// writing to one gives the slot a private copy, and only the last holder
+// takes it out of the store to change it. The store lock protects the
+// index and `shared`; `stored` only changes under it too, or while the
+// block has a single holder that cannot be running.
+//
+// Clones (see file_clone_blocks): copying a range of a file shares its
+// whole blocks the same way, counting the new holders in `shared` but
+// leaving the store alone, and so does preserving a file for a snapshot
+// (see file_share) with all of them. So any block with extra holders,
+// stored or not, gets copied before a write and freed by its last
+// holder.
+//
+// Shared blocks are also saved once, so inode records of different files
+// may point at the same block record. That is why a changed block always
+// gets a new id when it is saved (see capture_block in persistence.c).
+//
+// Packing (with --compress, see cool_files in operations.c): the saved
+// blocks of a file nobody uses are compressed into their slots (packed)
+// and freed, and decompressed back all at once before the file is used
+// again. Only blocks that are clean and the file's alone are packed, so a
+// packed block is never written by a checkpoint: it only keeps the id
+// and record size of its record.
+
+static struct {
+	pthread_mutex_t lock;  // Protects blocks and block->shared
+	idmap blocks;          // Hash of the data -> stored block
+	bool enabled;
+} store = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+// 64-bit hash of the data of a block, never 0 (an empty key of idmap).
+static uint64_t
+hash_data(const char *data)
+{
+	uint64_t hash = 14695981039346656037ull;
+	for (size_t i = 0; i < BLOCK_SIZE; i += sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, data + i, sizeof(word));
+		hash = (hash ^ word) * 1099511628211ull;
+		hash ^= hash >> 29;
+	}
+	return hash != 0 ? hash : 1;
+}
+
+// Turns dedup on or off, before any block is loaded.
+void
+block_store_init(bool dedup)
+{
+	store.enabled = dedup;
+}
+
+// Empties the store on unmount, so that a later mount starts afresh.
+void
+block_store_clear(void)
+{
+	pthread_mutex_lock(&store.lock);
+	idmap_destroy(&store.blocks);
+	pthread_mutex_unlock(&store.lock);
+}
+
+// Takes `b` out of the store. The caller holds store.lock.
+static void
+store_remove(block *b)
+{
+	idmap_remove(&store.blocks, b->hash);
+	__atomic_store_n(&b->stored, false, __ATOMIC_RELAXED);
+}
+
+// Lets go of `b` for one file slot. Returns whether it was the last one.
+static bool
+block_put(block *b)
+{
+	if (!__atomic_load_n(&b->stored, __ATOMIC_ACQUIRE) &&
+	    __atomic_load_n(&b->shared, __ATOMIC_ACQUIRE) == 0) {
+		return true;
+	}
+
+	pthread_mutex_lock(&store.lock);
+	bool last = b->shared == 0;
+	if (!last) {
+		__atomic_sub_fetch(&b->shared, 1, __ATOMIC_RELEASE);
+	} else if (b->stored) {
+		store_remove(b);
+	}
+	pthread_mutex_unlock(&store.lock);
+	return last;
+}
+
+// Adds a file slot holding `b`.
+static void
+block_share(block *b)
+{
+	pthread_mutex_lock(&store.lock);
+	__atomic_add_fetch(&b->shared, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&store.lock);
+}
+
+// Creates an empty file with no data blocks.
+inode_file *
+file_new(void)
+{
+	// Zeroed: no blocks and nothing pending.
+	return slab_alloc(&file_slab);
+}
+
+// Frees `b` unless a checkpoint still holds it.
+static void
+block_release(block *b)
+{
+	if (__atomic_fetch_or(&b->cow, BLOCK_ORPHANED, __ATOMIC_ACQ_REL) &
+	    BLOCK_FROZEN) {
+		return;
+	}
+	free(b);
+}
+
+// Frees a data block, which may be null, once no other file holds it.
+void
+block_free(block *b)
+{
+	if (b != NULL && block_put(b)) {
+		uint32_t size =
+		        __atomic_load_n(&b->record_size, __ATOMIC_RELAXED);
+		checkpoint_drop_block(b->id, size);
+		block_release(b);
+	}
+}
+
+// Called by a checkpoint on the blocks it is going to write, with
+// fs.lock held for writing.
+void
+block_freeze(block *b)
+{
+	__atomic_store_n(&b->cow, BLOCK_FROZEN, __ATOMIC_RELEASE);
+}
+
+// Called by a checkpoint once it is done with `b`, which may have been
+// replaced or freed meanwhile.
+void
+block_thaw(block *b)
+{
+	if (__atomic_fetch_and(&b->cow, ~BLOCK_FROZEN, __ATOMIC_ACQ_REL) &
+	    BLOCK_ORPHANED) {
+		free(b);
+	}
+}
+
+// Frees the file and all of its data blocks.
+void
+file_free(inode_file *file)
+{
+	if (file == NULL) {
+		return;
+	}
+	size_t index = 0;
+	block_slot *slot;
+	while ((slot = blockmap_next(&file->blocks, &index)) != NULL) {
+		block_free(slot->block);
+		checkpoint_drop_block(slot->pending, 0);
+		if (slot->packed != NULL) {
+			checkpoint_drop_block(slot->packed->id,
+			                      slot->packed->record_size);
+			free(slot->packed);
+		}
+		index++;
+	}
+	blockmap_destroy(&file->blocks);
+	slab_free(&file_slab, file);
+}
+
+// Returns the block at `index`, allocated if it was a hole, that can be
+// changed in place: a frozen or shared one is replaced by a copy. Null
+// if out of memory. The blocks of the file must be loaded.
+static block *
+writable_block(inode_file *file, size_t index)
+{
+	block_slot *slot = blockmap_slot(&file->blocks, index);
+	if (slot == NULL) {
+		return NULL;
+	}
+	block *b = slot->block;
+	if (b == NULL) {
+		b = calloc(1, sizeof(block));
+		slot->block = b;
+		if (b != NULL) {
+			file->used++;
+		}
+		return b;
+	}
+
+	bool shared = false;
+	if (__atomic_load_n(&b->stored, __ATOMIC_ACQUIRE) ||
+	    __atomic_load_n(&b->shared, __ATOMIC_ACQUIRE) > 0) {
+		pthread_mutex_lock(&store.lock);
+		shared = b->shared > 0;
+		if (!shared && b->stored) {
+			store_remove(b);
+		}
+		pthread_mutex_unlock(&store.lock);
+	}
+	if (!shared &&
+	    !(__atomic_load_n(&b->cow, __ATOMIC_ACQUIRE) & BLOCK_FROZEN)) {
+		return b;
+	}
+
+	// Only data, id and record_size are copied: the checkpoint may be
+	// clearing dirty, and the copy is about to change anyway.
+	block *copy = malloc(sizeof(block));
+	if (copy == NULL) {
+		return NULL;
+	}
+	memcpy(copy->data, b->data, BLOCK_SIZE);
+	copy->id = b->id;
+	copy->record_size = __atomic_load_n(&b->record_size, __ATOMIC_RELAXED);
+	copy->dirty = true;
+	copy->cow = 0;
+	copy->stored = false;
+	copy->shared = 0;
+	slot->block = copy;
+	if (shared) {
+		// The record stays with the other holders.
+		copy->id = 0;
+		copy->record_size = 0;
+		block_free(b);
+	} else {
+		block_release(b);
+	}
+	return copy;
+}
+
+// With dedup on, replaces the block in `slot` by an identical one of the
+// store, or adds it to the store if it has none like it. Returns the
+// block left in the slot. The caller must hold the lock of the file for
+// writing, or fs.lock, and the block must not be frozen.
+block *
+block_dedup(block **slot)
+{
+	block *b = *slot;
+	if (!store.enabled || b == NULL ||
+	    __atomic_load_n(&b->stored, __ATOMIC_ACQUIRE) ||
+	    __atomic_load_n(&b->shared, __ATOMIC_ACQUIRE) > 0) {
+		return b;
+	}
+
+	uint64_t hash = hash_data(b->data);
+	uint64_t value;
+	pthread_mutex_lock(&store.lock);
+	if (!idmap_get(&store.blocks, hash, &value)) {
+		// Failing to add it only loses the sharing.
+		if (idmap_put(&store.blocks, hash, (uintptr_t) b) == 0) {
+			b->hash = hash;
+			__atomic_store_n(&b->stored, true, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&store.lock);
+		return b;
+	}
+	block *same = (block *) (uintptr_t) value;
+	if (memcmp(same->data, b->data, BLOCK_SIZE) != 0) {
+		pthread_mutex_unlock(&store.lock);
+		return b;
+	}
+	__atomic_add_fetch(&same->shared, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&store.lock);
+
+	*slot = same;
+	if (b->dirty) {
+		// Its last record will not be saved again.
+		uint32_t size =
+		        __atomic_load_n(&b->record_size, __ATOMIC_RELAXED);
+		checkpoint_drop_block(b->id, size);
+	}
+	block_release(b);
+	return same;
+}
+
+// Allocates the missing blocks of [offset, offset + size), zeroed, so
+// that writing there later needs no memory. The blocks allocated before
+// failing stay so.
+int
+file_allocate_blocks(inode_file *file, off_t offset, off_t size)
+{
+	if (size == 0) {
+		return 0;
+	}
+
+	size_t first = offset / BLOCK_SIZE;
+	size_t last = (offset + size - 1) / BLOCK_SIZE;
+	for (size_t i = first; i <= last; i++) {
+		const block_slot *slot = blockmap_get(&file->blocks, i);
+		if (slot != NULL && slot->block != NULL) {
+			continue;
+		}
+		block *b = writable_block(file, i);
+		if (b == NULL) {
+			return -ENOMEM;
+		}
+		b->dirty = true;
+	}
+	return 0;
+}
+
+// Turns [offset, offset + size) into a hole: the blocks it covers whole
+// are freed and the parts of the others cleared. The caller must have
+// already clamped the range to the file size.
+int
+file_punch_blocks(inode_file *file, off_t offset, off_t size)
+{
+	off_t end = offset + size;
+	size_t first = offset / BLOCK_SIZE;
+	size_t index = first;
+	block_slot *slot;
+	while ((slot = blockmap_next(&file->blocks, &index)) != NULL &&
+	       (off_t) index * BLOCK_SIZE < end) {
+		off_t start = (off_t) index * BLOCK_SIZE;
+		off_t from = offset > start ? offset - start : 0;
+		off_t to = end < start + BLOCK_SIZE ? end - start : BLOCK_SIZE;
+		if (from == 0 && to == BLOCK_SIZE) {
+			block_free(slot->block);
+			slot->block = NULL;
+			file->used--;
+		} else {
+			block *b = writable_block(file, index);
+			if (b == NULL) {
+				return -ENOMEM;
+			}
+			memset(b->data + from, 0, to - from);
+			b->dirty = true;
+		}
+		index++;
+	}
+	blockmap_prune(&file->blocks, first, (end - 1) / BLOCK_SIZE);
+	return 0;
+}
+
+// First byte at or after `offset` and before `size` that lies in a block
+// (`data`) or in a hole, or `size` if there is none. Only whole blocks
+// are holes, so zeroed bytes of a block count as data. Blocks pending in
+// the image or packed count too.
+off_t
+file_seek(const inode_file *file, off_t offset, off_t size, bool data)
+{
+	size_t index = offset / BLOCK_SIZE;
+	size_t next = index;
+	if (data && blockmap_next(&file->blocks, &next) == NULL) {
+		return size;
+	} else if (data) {
+		index = next;
+	} else {
+		while (blockmap_next(&file->blocks, &next) != NULL &&
+		       next == index) {
+			next = ++index;
+		}
+	}
+
+	off_t found = (off_t) index * BLOCK_SIZE;
+	if (found < offset) {
+		found = offset;
+	}
+	return found < size ? found : size;
+}
+
+// Slots of [offset, offset + size) that hold no block, the ones writing
+// there would allocate.
+size_t
+file_holes(const inode_file *file, off_t offset, off_t size)
+{
+	if (size <= 0) {
+		return 0;
+	}
+	size_t first = offset / BLOCK_SIZE;
+	size_t last = (offset + size - 1) / BLOCK_SIZE;
+	size_t count = last - first + 1;
+	size_t index = first;
+	while (blockmap_next(&file->blocks, &index) != NULL && index <= last) {
+		count--;
+		index++;
+	}
+	return count;
+}
+
+// Makes slot `index` of `file` hold `b`, which may be null, besides
+// every slot already holding it.
+static int
+share_slot(inode_file *file, size_t index, block *b)
+{
+	block_slot *slot = b != NULL ? blockmap_slot(&file->blocks, index)
+	                             : blockmap_get(&file->blocks, index);
+	if (slot == NULL) {
+		return b != NULL ? -ENOMEM : 0;
+	}
+	block *old = slot->block;
+	if (old == b) {
+		return 0;
+	}
+	if (b != NULL) {
+		block_share(b);
+	}
+	if (old == NULL) {
+		file->used++;
+	} else if (b == NULL) {
+		file->used--;
+	}
+	slot->block = b;
+	block_free(old);
+	return 0;
+}
+
+// Whole blocks from `index` on, up to `limit`, where `file` has a hole.
+static size_t
+hole_length(const inode_file *file, size_t index, size_t limit)
+{
+	size_t next = index;
+	if (blockmap_next(&file->blocks, &next) == NULL ||
+	    next - index > limit) {
+		return limit;
+	}
+	return next - index;
+}
+
+// The loaded block at `index` of `file`, null if it has none.
+static block *
+block_at(const inode_file *file, size_t index)
+{
+	const block_slot *slot = blockmap_get(&file->blocks, index);
+	return slot != NULL ? slot->block : NULL;
+}
+
+static bool
+is_zero(const char *data, size_t size)
+{
+	for (size_t i = 0; i < size; i++) {
+		if (data[i] != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Copies `size` bytes at `src_offset` of `src` to `dst_offset` of `dst`,
+// which may be the same file if the ranges do not overlap. Where both
+// offsets lie at the same place of a block, the blocks the range covers
+// whole are shared instead, holes included, and so is the last one if
+// `share_tail`: the range ends at the end of `src` and at or past the
+// end of `dst`, so the rest of the block is zero on both sides. The
+// caller must hold `dst` exclusively and `src` at least for reading,
+// with their blocks loaded: sharing a block of `src` only changes its
+// count of holders, under the store lock.
+int
+file_clone_blocks(inode_file *dst,
+                  off_t dst_offset,
+                  const inode_file *src,
+                  off_t src_offset,
+                  size_t size,
+                  bool share_tail)
+{
+	if (size == 0) {
+		return 0;
+	}
+
+	int ret;
+	bool aligned = dst_offset % BLOCK_SIZE == src_offset % BLOCK_SIZE;
+	size_t done = 0;
+	while (done < size) {
+		off_t to = dst_offset + done;
+		off_t from = src_offset + done;
+		size_t index = to / BLOCK_SIZE;
+		size_t block_offset = to % BLOCK_SIZE;
+		size_t chunk = BLOCK_SIZE - block_offset;
+		if (chunk > size - done) {
+			chunk = size - done;
+		}
+
+		if (aligned && block_offset == 0 &&
+		    (chunk == BLOCK_SIZE || share_tail)) {
+			// Holes on both sides are skipped at once.
+			size_t at = from / BLOCK_SIZE;
+			size_t whole = (size - done) / BLOCK_SIZE;
+			size_t holes = hole_length(src, at, whole);
+			holes = hole_length(dst, index, holes);
+			if (holes > 0) {
+				done += holes * BLOCK_SIZE;
+				continue;
+			}
+			ret = share_slot(dst, index, block_at(src, at));
+			if (ret != 0) {
+				return ret;
+			}
+			done += chunk;
+			continue;
+		}
+
+		char buf[BLOCK_SIZE];
+		file_read_blocks(src, buf, chunk, from);
+		if (block_at(dst, index) != NULL || !is_zero(buf, chunk)) {
+			ret = file_write_blocks(dst, buf, chunk, to);
+			if (ret != 0) {
+				return ret;
+			}
+		}
+		done += chunk;
+	}
+	return 0;
+}
+
+// Returns a copy of `file` for a snapshot (see snapshot.c), sharing its
+// blocks like a clone and the records of those still pending in the
+// image. Packed blocks are copied as they are: their records may be
+// newer than the mapped image the copy would load them from. Null if
+// out of memory. The caller must hold `file` exclusively.
+inode_file *
+file_share(const inode_file *file)
+{
+	inode_file *copy = file_new();
+	if (copy == NULL) {
+		return NULL;
+	}
+
+	size_t index = 0;
+	const block_slot *slot;
+	bool failed = false;
+	while (!failed &&
+	       (slot = blockmap_next(&file->blocks, &index)) != NULL) {
+		block_slot *to = blockmap_slot(&copy->blocks, index);
+		const packed_block *p = slot->packed;
+		if (to != NULL && p != NULL) {
+			to->packed = malloc(sizeof(packed_block) + p->size);
+			if (to->packed != NULL) {
+				memcpy(to->packed,
+				       p,
+				       sizeof(packed_block) + p->size);
+			}
+		}
+		failed = to == NULL || (p != NULL && to->packed == NULL);
+		if (to != NULL) {
+			to->pending = slot->pending;
+		}
+		index++;
+	}
+	if (failed) {
+		// Nothing is shared yet, so file_free would count records
+		// that are still used as garbage.
+		index = 0;
+		block_slot *left;
+		while ((left = blockmap_next(&copy->blocks, &index)) != NULL) {
+			free(left->packed);
+			index++;
+		}
+		blockmap_destroy(&copy->blocks);
+		slab_free(&file_slab, copy);
+		return NULL;
+	}
+
+	index = 0;
+	while ((slot = blockmap_next(&file->blocks, &index)) != NULL) {
+		if (slot->block != NULL) {
+			block_share(slot->block);
+			blockmap_get(&copy->blocks, index)->block = slot->block;
+		}
+		index++;
+	}
+	copy->used = file->used;
+	copy->pending = file->pending;
+	copy->packed = file->packed;
+	return copy;
+}
+
+// Compresses the blocks of `file` that are saved, its own and worth it.
+// The caller must hold the lock of the file for writing, and the file
+// must have no blocks pending. Returns how many it packed.
+size_t
+file_pack(inode_file *file)
+{
+	char buf[MAX_PACKED_SIZE];
+	size_t count = 0;
+	size_t index = 0;
+	block_slot *slot;
+	for (; (slot = blockmap_next(&file->blocks, &index)) != NULL; index++) {
+		block *b = slot->block;
+		if (b == NULL || b->dirty || b->id == 0 ||
+		    __atomic_load_n(&b->cow, __ATOMIC_ACQUIRE) != 0 ||
+		    __atomic_load_n(&b->stored, __ATOMIC_ACQUIRE) ||
+		    __atomic_load_n(&b->shared, __ATOMIC_ACQUIRE) > 0) {
+			continue;
+		}
+		size_t size =
+		        lz_compress(b->data, BLOCK_SIZE, buf, sizeof(buf));
+		if (size == 0) {
+			continue;
+		}
+
+		packed_block *p = malloc(sizeof(packed_block) + size);
+		if (p == NULL) {
+			break;
+		}
+		p->id = b->id;
+		p->record_size =
+		        __atomic_load_n(&b->record_size, __ATOMIC_RELAXED);
+		p->size = size;
+		memcpy(p->data, buf, size);
+		slot->packed = p;
+		slot->block = NULL;
+		free(b);
+		__atomic_add_fetch(&file->packed, 1, __ATOMIC_RELEASE);
+		count++;
+	}
+	return count;
+}
+
+// Decompresses the packed blocks of `file` back into their slots. The
+// caller must hold the lock of the file for writing. If it fails, the
+// blocks unpacked so far stay so and the rest packed.
+int
+file_unpack(inode_file *file)
+{
+	size_t index = 0;
+	block_slot *slot;
+	for (; (slot = blockmap_next(&file->blocks, &index)) != NULL; index++) {
+		packed_block *p = slot->packed;
+		if (p == NULL) {
+			continue;
+		}
+		block *b = calloc(1, sizeof(block));
+		if (b == NULL) {
+			return -ENOMEM;
+		}
+		if (!lz_decompress(p->data, p->size, b->data, BLOCK_SIZE)) {
+			free(b);
+			return -EIO;
+		}
+		b->id = p->id;
+		b->record_size = p->record_size;
+		slot->block = b;
+		slot->packed = NULL;
+		free(p);
+		__atomic_sub_fetch(&file->packed, 1, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+// Copies up to `size` bytes starting at `offset` into `buf`. The caller
+// must have already clamped the range to the file size.
+size_t
+file_read_blocks(const inode_file *file, char *buf, size_t size, off_t offset)
+{
+	size_t done = 0;
+	while (done < size) {
+		size_t index = (offset + done) / BLOCK_SIZE;
+		size_t block_offset = (offset + done) % BLOCK_SIZE;
+		size_t chunk = BLOCK_SIZE - block_offset;
+		if (chunk > size - done) {
+			chunk = size - done;
+		}
+
+		const block *b = block_at(file, index);
+		if (b != NULL) {
+			memcpy(buf + done, b->data + block_offset, chunk);
+		} else {
+			memset(buf + done, 0, chunk);
+		}
+		done += chunk;
+	}
+	return done;
+}
+
+// Writes `size` bytes at `offset`, allocating the blocks it touches.
+int
+file_write_blocks(inode_file *file, const char *buf, size_t size, off_t offset)
+{
+	if (size == 0) {
+		return 0;
+	}
+
+	size_t done = 0;
+	while (done < size) {
+		size_t index = (offset + done) / BLOCK_SIZE;
+		size_t block_offset = (offset + done) % BLOCK_SIZE;
+		size_t chunk = BLOCK_SIZE - block_offset;
+		if (chunk > size - done) {
+			chunk = size - done;
+		}
+
+		block *b = writable_block(file, index);
+		if (b == NULL) {
+			return -ENOMEM;
+		}
+		memcpy(b->data + block_offset, buf + done, chunk);
+		b->dirty = true;
+		done += chunk;
+	}
+	return 0;
+}
+
+// Number of blocks the bytes [offset, offset + size) lie in: the
+// entries file_read_iov and file_write_iov fill in.
+size_t
+file_span(off_t offset, size_t size)
+{
+	if (size == 0) {
+		return 0;
+	}
+	return (offset + size - 1) / BLOCK_SIZE - offset / BLOCK_SIZE + 1;
+}
+
+// Points `iov` at the bytes [offset, offset + size) where they are, one
+// entry per block, without copying them. Missing blocks read as zeros.
+// The caller must have already clamped the range to the file size, and
+// must keep the file locked while it uses the entries.
+void
+file_read_iov(const inode_file *file,
+              struct iovec *iov,
+              size_t size,
+              off_t offset)
+{
+	static const char zeros[BLOCK_SIZE];
+
+	size_t done = 0;
+	for (size_t i = 0; done < size; i++) {
+		size_t index = (offset + done) / BLOCK_SIZE;
+		size_t block_offset = (offset + done) % BLOCK_SIZE;
+		size_t chunk = BLOCK_SIZE - block_offset;
+		if (chunk > size - done) {
+			chunk = size - done;
+		}
+
+		const char *data = zeros;
+		const block *b = block_at(file, index);
+		if (b != NULL) {
+			data = b->data;
+		}
+		iov[i].iov_base = (char *) data + block_offset;
+		iov[i].iov_len = chunk;
+		done += chunk;
+	}
+}
+
+// Points `iov` at the bytes [offset, offset + size), one entry per
+// block, for the caller to write them in place with the file locked for
+// writing. The blocks are allocated (or copied, see writable_block) and
+// marked dirty beforehand.
+int
+file_write_iov(inode_file *file, struct iovec *iov, size_t size, off_t offset)
+{
+	if (size == 0) {
+		return 0;
+	}
+
+	size_t done = 0;
+	for (size_t i = 0; done < size; i++) {
+		size_t index = (offset + done) / BLOCK_SIZE;
+		size_t block_offset = (offset + done) % BLOCK_SIZE;
+		size_t chunk = BLOCK_SIZE - block_offset;
+		if (chunk > size - done) {
+			chunk = size - done;
+		}
+
+		block *b = writable_block(file, index);
+		if (b == NULL) {
+			return -ENOMEM;
+		}
+		b->dirty = true;
+		iov[i].iov_base = b->data + block_offset;
+		iov[i].iov_len = chunk;
+		done += chunk;
+	}
+	return 0;
+}
+
+// Changes the file length from `old_size` to `new_size`. Shrinking frees
+// the blocks past the new end and clears the tail of the last one. On
+// error (-ENOMEM) the file is left as it was.
+int
+file_truncate_blocks(inode_file *file, off_t old_size, off_t new_size)
+{
+	if (new_size >= old_size) {
+		return 0;
+	}
+
+	// The last block kept may need a copy of its own, the only step that
+	// can fail, so it goes first.
+	size_t keep = (new_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	size_t tail = new_size % BLOCK_SIZE;
+	if (tail != 0 && block_at(file, keep - 1) != NULL) {
+		block *last = writable_block(file, keep - 1);
+		if (last == NULL) {
+			return -ENOMEM;
+		}
+		memset(last->data + tail, 0, BLOCK_SIZE - tail);
+		last->dirty = true;
+	}
+
+	size_t index = keep;
+	block_slot *slot;
+	while ((slot = blockmap_next(&file->blocks, &index)) != NULL) {
+		block_free(slot->block);
+		slot->block = NULL;
+		file->used--;
+		index++;
+	}
+	blockmap_prune(&file->blocks, keep, SIZE_MAX);
+	return 0;
+}
@@ -0,0 +1,76 @@
+#ifndef BLOCKS_H
+#define BLOCKS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "defs.h"
+
+// Flags of block->cow
+#define BLOCK_FROZEN 1    // Being written by a checkpoint
+#define BLOCK_ORPHANED 2  // No longer in a file, the checkpoint frees it
+
+inode_file *file_new(void);
+
+void file_free(inode_file *file);
+
+void block_free(block *b);
+
+void block_freeze(block *b);
+
+void block_thaw(block *b);
+
+void block_store_init(bool dedup);
+
+void block_store_clear(void);
+
+block *block_dedup(block **slot);
+
+size_t file_read_blocks(const inode_file *file,
+                        char *buf,
+                        size_t size,
+                        off_t offset);
+
+int file_write_blocks(inode_file *file,
+                      const char *buf,
+                      size_t size,
+                      off_t offset);
+
+size_t file_span(off_t offset, size_t size);
+
+void file_read_iov(const inode_file *file,
+                   struct iovec *iov,
+                   size_t size,
+                   off_t offset);
+
+int file_write_iov(inode_file *file,
+                   struct iovec *iov,
+                   size_t size,
+                   off_t offset);
+
+int file_truncate_blocks(inode_file *file, off_t old_size, off_t new_size);
+
+int file_allocate_blocks(inode_file *file, off_t offset, off_t size);
+
+int file_punch_blocks(inode_file *file, off_t offset, off_t size);
+
+off_t file_seek(const inode_file *file, off_t offset, off_t size, bool data);
+
+size_t file_holes(const inode_file *file, off_t offset, off_t size);
+
+int file_clone_blocks(inode_file *dst,
+                      off_t dst_offset,
+                      const inode_file *src,
+                      off_t src_offset,
+                      size_t size,
+                      bool share_tail);
+
+inode_file *file_share(const inode_file *file);
+
+size_t file_pack(inode_file *file);
+
+int file_unpack(inode_file *file);
+
+#endif
@@ -0,0 +1,360 @@
+#include "checkpoint.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "persistence.h"
+
+// Incremental checkpoints
+//
+// Every inode changed since the last checkpoint is marked dirty and kept
+// in a doubly linked list, and so is every changed data block (in the
+// block itself). A checkpoint appends one segment with the records of the
+// dirty inodes and their dirty blocks to the image, so its cost follows
+// the amount of change instead of the size of the tree. An image in an
+// older format is rewritten whole by the first checkpoint.
+//
+// Records left behind by newer ones, by removed inodes or by freed blocks
+// are garbage. Its size is estimated as it is created, and once it is
+// over half of the image, or the image has too many segments to search,
+// a background thread compacts it (see compact_image).
+//
+// A checkpoint only holds fs.lock for writing while it captures the
+// changes (see image_capture): the records of the dirty inodes are
+// encoded in memory and their dirty blocks are frozen, so writers copy
+// them instead of changing them. The segment is then written with no
+// lock of the tree held, while callbacks go on. Marking runs under the
+// inode locks. atime changes made by read do not mark the inode, they are
+// saved along with its next change.
+//
+// Inodes changed while a checkpoint is written must stay dirty, so
+// node->dirty holds the epoch of the checkpoint that will save it, and
+// capturing starts a new epoch. Once the segment is written only the
+// inodes of older epochs are taken out of the list. If it fails nothing
+// is, and the next checkpoint saves them again.
+//
+// Besides the one on unmount, checkpoints run every interval given to
+// checkpoint_start on a background thread, so the image follows the
+// journal and the journal can be trimmed.
+
+// Compaction is not worth it below this image size.
+#define COMPACT_MIN_SIZE (1 << 20)
+// Lookups in the image search every segment, so they are also compacted
+// once there are this many.
+#define COMPACT_MAX_SEGMENTS 32
+
+static struct {
+	pthread_mutex_t lock;  // Protects the dirty list
+	inode *head;
+	uint64_t epoch;    // Of the next checkpoint, atomic
+	uint64_t garbage;  // Estimated dead bytes in the image, atomic
+
+	pthread_mutex_t compact_lock;  // Protects the fields below
+	bool compacting;
+	bool joinable;  // compactor has not been joined yet
+	pthread_t compactor;
+	const char *path;
+
+	pthread_mutex_t timer_lock;  // Protects the fields below
+	pthread_cond_t stop_cond;
+	bool stop;
+	bool running;  // timer has been started and not joined
+	pthread_t timer;
+	unsigned interval;
+	void (*run)(void);
+} checkpoints = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.epoch = 1,
+	.compact_lock = PTHREAD_MUTEX_INITIALIZER,
+	.timer_lock = PTHREAD_MUTEX_INITIALIZER,
+	.stop_cond = PTHREAD_COND_INITIALIZER,
+};
+
+// Sets the garbage already in the image that was loaded.
+void
+checkpoint_init(uint64_t garbage)
+{
+	__atomic_store_n(&checkpoints.garbage, garbage, __ATOMIC_RELAXED);
+}
+
+// Adds `node` to the next checkpoint. The caller must hold its lock for
+// writing, or the lock of its parent if it is new.
+void
+checkpoint_mark_dirty(inode *node)
+{
+	// Cannot race with capturing, which holds fs.lock for writing.
+	uint64_t epoch = __atomic_load_n(&checkpoints.epoch, __ATOMIC_RELAXED);
+	if (__atomic_exchange_n(&node->dirty, epoch, __ATOMIC_ACQ_REL) != 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&checkpoints.lock);
+	node->dirty_prev = NULL;
+	node->dirty_next = checkpoints.head;
+	if (checkpoints.head != NULL) {
+		checkpoints.head->dirty_prev = node;
+	}
+	checkpoints.head = node;
+	pthread_mutex_unlock(&checkpoints.lock);
+}
+
+// Takes `node` out of the dirty list. The caller holds checkpoints.lock.
+static void
+unlink_dirty(inode *node)
+{
+	if (node->dirty_prev != NULL) {
+		node->dirty_prev->dirty_next = node->dirty_next;
+	} else {
+		checkpoints.head = node->dirty_next;
+	}
+	if (node->dirty_next != NULL) {
+		node->dirty_next->dirty_prev = node->dirty_prev;
+	}
+	node->dirty_prev = NULL;
+	node->dirty_next = NULL;
+}
+
+// Called before freeing `node`: takes it out of the dirty list and
+// accounts its last record as garbage.
+void
+checkpoint_forget(inode *node)
+{
+	__atomic_add_fetch(
+	        &checkpoints.garbage, node->record_size, __ATOMIC_RELAXED);
+	if (__atomic_load_n(&node->dirty, __ATOMIC_ACQUIRE) == 0) {
+		return;
+	}
+
+	// A checkpoint being written may have cleaned it meanwhile.
+	pthread_mutex_lock(&checkpoints.lock);
+	if (__atomic_load_n(&node->dirty, __ATOMIC_RELAXED) != 0) {
+		unlink_dirty(node);
+		__atomic_store_n(&node->dirty, 0, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&checkpoints.lock);
+}
+
+// Called before freeing the block saved as `id` (0 if it never was), its
+// record of `record_size` bytes becomes garbage. A size of 0 stands for
+// an unknown one, counted as the largest.
+void
+checkpoint_drop_block(uint64_t id, uint32_t record_size)
+{
+	if (id == 0) {
+		return;
+	}
+	if (record_size == 0) {
+		record_size = IMAGE_MAX_BLOCK_RECORD_SIZE;
+	}
+	__atomic_add_fetch(&checkpoints.garbage, record_size, __ATOMIC_RELAXED);
+}
+
+// Takes out of the dirty list the inodes last changed before `epoch`,
+// which a checkpoint has just saved.
+static void
+clean_before(uint64_t epoch)
+{
+	pthread_mutex_lock(&checkpoints.lock);
+	inode *node = checkpoints.head;
+	while (node != NULL) {
+		inode *next = node->dirty_next;
+		uint64_t dirty =
+		        __atomic_load_n(&node->dirty, __ATOMIC_RELAXED);
+		// Fails if it is marked again meanwhile, then it stays.
+		if (dirty < epoch &&
+		    __atomic_compare_exchange_n(&node->dirty,
+		                                &dirty,
+		                                0,
+		                                false,
+		                                __ATOMIC_ACQ_REL,
+		                                __ATOMIC_RELAXED)) {
+			unlink_dirty(node);
+		}
+		node = next;
+	}
+	pthread_mutex_unlock(&checkpoints.lock);
+}
+
+// Captures the changes since the last checkpoint, to be saved with
+// checkpoint_write. `lsn` is the last journal record they include. The
+// caller must hold fs.lock for writing, and only one checkpoint can be
+// in progress.
+checkpoint *
+checkpoint_capture(inode *root, uint64_t lsn)
+{
+	checkpoint *cp = malloc(sizeof(checkpoint));
+	if (cp == NULL) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&checkpoints.lock);
+	cp->snapshot = image_capture(root, checkpoints.head, lsn);
+	pthread_mutex_unlock(&checkpoints.lock);
+	if (cp->snapshot == NULL) {
+		free(cp);
+		fprintf(stderr, "Error: cannot capture checkpoint\n");
+		return NULL;
+	}
+	cp->epoch = __atomic_fetch_add(&checkpoints.epoch, 1, __ATOMIC_RELAXED);
+	cp->garbage = __atomic_load_n(&checkpoints.garbage, __ATOMIC_RELAXED);
+	return cp;
+}
+
+// Writes `cp` to the image at `path` and frees it. Needs no lock.
+int
+checkpoint_write(const char *path, checkpoint *cp)
+{
+	uint64_t before = cp->garbage;
+	uint64_t garbage = before;
+	int ret = image_write(path, cp->snapshot, &garbage);
+	if (ret == 0) {
+		clean_before(cp->epoch + 1);
+		// Wraps around when a whole image drops the garbage.
+		__atomic_add_fetch(&checkpoints.garbage,
+		                   garbage - before,
+		                   __ATOMIC_RELAXED);
+	}
+	free(cp);
+	return ret;
+}
+
+static void *
+timer_loop(void *arg)
+{
+	pthread_mutex_lock(&checkpoints.timer_lock);
+	while (!checkpoints.stop) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += checkpoints.interval;
+		int ret = pthread_cond_timedwait(&checkpoints.stop_cond,
+		                                 &checkpoints.timer_lock,
+		                                 &deadline);
+		if (checkpoints.stop || ret != ETIMEDOUT) {
+			continue;
+		}
+		pthread_mutex_unlock(&checkpoints.timer_lock);
+		checkpoints.run();
+		pthread_mutex_lock(&checkpoints.timer_lock);
+	}
+	pthread_mutex_unlock(&checkpoints.timer_lock);
+	return NULL;
+}
+
+// Calls `run` every `interval` seconds on a background thread, until
+// checkpoint_stop. An interval of 0 does nothing.
+void
+checkpoint_start(unsigned interval, void (*run)(void))
+{
+	if (interval == 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&checkpoints.timer_lock);
+	checkpoints.interval = interval;
+	checkpoints.run = run;
+	checkpoints.stop = false;
+	checkpoints.running = pthread_create(&checkpoints.timer,
+	                                     NULL,
+	                                     timer_loop,
+	                                     NULL) == 0;
+	pthread_mutex_unlock(&checkpoints.timer_lock);
+	if (!checkpoints.running) {
+		fprintf(stderr, "Error: cannot start checkpoint thread\n");
+	}
+}
+
+// Stops the thread started by checkpoint_start, waiting for a checkpoint
+// it is running.
+void
+checkpoint_stop(void)
+{
+	pthread_mutex_lock(&checkpoints.timer_lock);
+	bool running = checkpoints.running;
+	checkpoints.running = false;
+	checkpoints.stop = true;
+	pthread_cond_signal(&checkpoints.stop_cond);
+	pthread_mutex_unlock(&checkpoints.timer_lock);
+
+	if (running) {
+		pthread_join(checkpoints.timer, NULL);
+	}
+}
+
+static void *
+compact_thread(void *arg)
+{
+	uint64_t reclaimed;
+	if (compact_image(checkpoints.path, &reclaimed) == 0) {
+		uint64_t garbage =
+		        __atomic_load_n(&checkpoints.garbage, __ATOMIC_RELAXED);
+		uint64_t left;
+		do {
+			left = garbage > reclaimed ? garbage - reclaimed : 0;
+		} while (!__atomic_compare_exchange_n(&checkpoints.garbage,
+		                                      &garbage,
+		                                      left,
+		                                      false,
+		                                      __ATOMIC_RELAXED,
+		                                      __ATOMIC_RELAXED));
+	} else {
+		fprintf(stderr, "Error: cannot compact image\n");
+	}
+
+	pthread_mutex_lock(&checkpoints.compact_lock);
+	checkpoints.compacting = false;
+	pthread_mutex_unlock(&checkpoints.compact_lock);
+	return NULL;
+}
+
+// Starts compacting the image at `path` in the background if enough of
+// it is garbage, or it has too many segments, and no compaction is
+// running yet.
+void
+checkpoint_maybe_compact(const char *path)
+{
+	uint64_t size = image_size();
+	uint64_t garbage =
+	        __atomic_load_n(&checkpoints.garbage, __ATOMIC_RELAXED);
+	bool wasteful = size >= COMPACT_MIN_SIZE && 2 * garbage >= size;
+	if (!image_is_segmented() ||
+	    (!wasteful && image_segment_count() <= COMPACT_MAX_SEGMENTS)) {
+		return;
+	}
+
+	pthread_mutex_lock(&checkpoints.compact_lock);
+	if (checkpoints.compacting) {
+		pthread_mutex_unlock(&checkpoints.compact_lock);
+		return;
+	}
+	if (checkpoints.joinable) {
+		// Already finished, it only has to be reaped.
+		pthread_join(checkpoints.compactor, NULL);
+		checkpoints.joinable = false;
+	}
+	// compact_thread cannot clear compacting before it is set, it needs
+	// compact_lock for that.
+	checkpoints.path = path;
+	int ret = pthread_create(
+	        &checkpoints.compactor, NULL, compact_thread, NULL);
+	checkpoints.joinable = ret == 0;
+	checkpoints.compacting = ret == 0;
+	pthread_mutex_unlock(&checkpoints.compact_lock);
+}
+
+// Waits for a running compaction to finish.
+void
+checkpoint_shutdown(void)
+{
+	pthread_mutex_lock(&checkpoints.compact_lock);
+	bool joinable = checkpoints.joinable;
+	checkpoints.joinable = false;
+	pthread_mutex_unlock(&checkpoints.compact_lock);
+
+	if (joinable) {
+		pthread_join(checkpoints.compactor, NULL);
+	}
+}
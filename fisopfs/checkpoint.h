@@ -0,0 +1,34 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "defs.h"
+#include "persistence.h"
+
+// A checkpoint captured and not written yet.
+typedef struct checkpoint {
+	image_snapshot *snapshot;
+	uint64_t epoch;    // Of the changes it holds
+	uint64_t garbage;  // In the image when it was captured
+} checkpoint;
+
+void checkpoint_init(uint64_t garbage);
+
+void checkpoint_mark_dirty(inode *node);
+
+void checkpoint_forget(inode *node);
+
+void checkpoint_drop_block(uint64_t id, uint32_t record_size);
+
+checkpoint *checkpoint_capture(inode *root, uint64_t lsn);
+
+int checkpoint_write(const char *path, checkpoint *cp);
+
+void checkpoint_start(unsigned interval, void (*run)(void));
+
+void checkpoint_stop(void);
+
+void checkpoint_maybe_compact(const char *path);
+
+void checkpoint_shutdown(void);
+
+#endif
@@ -1,45 +1,129 @@
 #ifndef FS_DEFS_H
 #define FS_DEFS_H
 
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 
-#define MAX_CONTENT_SIZE 1024
-#define MAX_DENTRIES 128
+#define BLOCK_SIZE 4096
 #define MAX_FILENAME 256
 #define DEFAULT_FILE_DISK "persistence_file.fisopfs"
+#define DEFAULT_CHECKPOINT_INTERVAL 30  // Seconds, 0 turns them off
+#define ROOT_INO 1
 
 typedef struct inode inode;
 
 typedef struct dentry {
 	char filename[MAX_FILENAME];
+	uint32_t hash;  // Hash of filename, used by the directory index
 	inode *inode;
+	uint64_t cookie;  // Offset of the entry for readdir (see directory.c)
+	uint64_t ino;     // Frozen directories, whose inode is null: the
+	                  // number it names (see snapshot.c)
 } dentry;
 
+typedef struct block {
+	char data[BLOCK_SIZE];
+	uint64_t id;           // Id of its image record, 0 if never saved
+	uint32_t record_size;  // Bytes of its last image record. Atomic
+	bool dirty;            // Changed since it was last saved
+	uint8_t cow;           // Checkpoint flags, see blocks.c. Atomic
+	bool stored;           // In the dedup store, see blocks.c. Atomic
+	uint32_t shared;       // File slots holding it besides the first.
+	                       // Atomic
+	uint64_t hash;         // Of data, while stored
+} block;
+
+// A saved block kept compressed in memory while its file is cold (see
+// blocks.c).
+typedef struct packed_block {
+	uint64_t id;           // Of the block
+	uint32_t record_size;  // Of the block
+	uint32_t size;         // Bytes of data
+	char data[];           // The block, compressed by lz_compress
+} packed_block;
+
+// What a file holds at one block index: the block, loaded or compressed
+// in memory, or the id of its record if it is still in the image. Empty
+// slots are holes.
+typedef struct block_slot {
+	block *block;          // Loaded
+	packed_block *packed;  // Compressed in memory (see blocks.c)
+	uint64_t pending;      // Id of a block still in the image, 0 if none
+} block_slot;
+
+// Sparse array of block slots by index, see blockmap.c.
+typedef struct blockmap {
+	void *root;       // Null if empty
+	unsigned height;  // Levels of nodes above the leaves
+} blockmap;
+
 typedef struct inode_file {
-	char content[MAX_CONTENT_SIZE];
+	blockmap blocks;  // Slot i holds bytes [i * BLOCK_SIZE,
+	                  // (i + 1) * BLOCK_SIZE). Holes have no slot in
+	                  // use and read as zeros
+	size_t used;      // Slots holding a block: loaded, packed or pending
+	size_t pending;   // Slots whose block is still in the image. Atomic
+	size_t packed;    // Slots holding a packed block. Atomic
 } inode_file;
 
 typedef struct inode_dir {
-	dentry *entries[MAX_DENTRIES];
-	int size;
+	dentry **entries;    // Entries in insertion order, null if removed
+	int size;            // Number of live entries
+	int slots;           // Used slots of entries, live or removed
+	int capacity;        // Allocated slots of entries
+	int *index;          // Hash index by filename (see directory.c)
+	int index_capacity;  // Buckets in index, zero or a power of two
+	uint64_t cookies;    // Cookies handed out so far, never reset
 } inode_dir;
 
 typedef struct inode {
 	inode_file *file;  // Inode file or null if it is a directory
 	inode_dir *dir;    // Inode directory or null if it is a file
 	mode_t mode;       // Type and permissions of this inodes
-	nlink_t nlink;     // Number of links (2 for directory, 1 for file)
+	nlink_t nlink;     // Number of links (2 for directory, names of a file)
 	uid_t uid;         // UID of the owner
 	gid_t gid;         // GID of the group owner
 	time_t atime;      // Last access time
 	time_t mtime;      // Last modification time
 	time_t ctime;      // Creation time
 	off_t size;        // Size in bytes/chars for files or 0 for directories
+	pthread_rwlock_t lock;  // Protects entries or contents and attributes
+
+	uint64_t ino;          // Inode number, the key of its image records
+	uint64_t dirty;        // Checkpoint epoch of its last change, 0 if
+	                       // saved since. Atomic
+	inode *dirty_prev;     // Neighbours in the dirty list, see checkpoint.c
+	inode *dirty_next;
+	uint32_t record_size;  // Bytes of its last image record, 0 if none
+	bool stub;             // Only ino is set, the rest is still in the
+	                       // image (see persistence.c)
+	uint64_t refs;         // References held by the kernel: lookups of
+	                       // the low-level front end (see lowlevel.c)
+	                       // and open files. Atomic
+
+	uint64_t snapshot;  // Snapshots taken when it was created or last
+	                    // preserved, see snapshot.c
 } inode;
 
+// An open file, its address is the fh of the fuse_file_info. It holds a
+// reference to the inode, which lives on if it is removed meanwhile.
+typedef struct open_file {
+	inode *node;  // Null for the stats file and files of snapshots
+	int flags;    // Flags it was opened with
+	char *text;   // Stats file: the snapshot taken when opened
+	size_t size;  // Length of text
+
+	uint64_t view;  // File of a snapshot: its number, resolved again by
+	                // every read (see snapshot.c)
+} open_file;
+
 // Filesystem structure
 typedef struct filesystem {
-	inode *root;  // Inode root for the filesystem
+	inode *root;            // Inode root for the filesystem
+	pthread_rwlock_t lock;  // Namespace lock (see operations.c)
+	uint64_t next_ino;      // Inode number for the next new inode
 } filesystem;
 
 #endif
@@ -0,0 +1,228 @@
+#include "directory.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "slab.h"
+
+#define INITIAL_SLOTS 8
+#define INITIAL_INDEX_CAPACITY 16
+
+// Markers for the buckets of the hash index. Any other value is the
+// position of the entry in `entries` plus one.
+#define BUCKET_EMPTY 0
+#define BUCKET_REMOVED -1
+
+// The index keeps at least half of its buckets empty. Removed entries
+// leave a null slot in `entries` and a BUCKET_REMOVED in the index; both
+// are cleaned up together by dir_compact once they outnumber live ones.
+//
+// Each entry gets a cookie when it is added, one more than the previous
+// one, which readdir hands to the kernel as its offset. Compacting keeps
+// the order of `entries`, so their cookies stay sorted and a listing can
+// resume after any cookie, even one whose entry was removed meanwhile,
+// without skipping or repeating the others.
+
+// 32-bit FNV-1a hash of a filename.
+static uint32_t
+hash_name(const char *name)
+{
+	uint32_t hash = 2166136261u;
+	for (const unsigned char *p = (const unsigned char *) name; *p; p++) {
+		hash ^= *p;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// Creates an empty directory.
+inode_dir *
+dir_new(void)
+{
+	// Zeroed: no entries and no index.
+	return slab_alloc(&dir_slab);
+}
+
+// Frees the directory tables. The dentries are owned by the caller.
+void
+dir_free(inode_dir *dir)
+{
+	if (dir == NULL) {
+		return;
+	}
+	free(dir->entries);
+	free(dir->index);
+	slab_free(&dir_slab, dir);
+}
+
+// Returns the bucket holding `name`, or -1 if it is not in the index.
+static int
+dir_find_bucket(const inode_dir *dir, const char *name, uint32_t hash)
+{
+	if (dir->index_capacity == 0) {
+		return -1;
+	}
+
+	int mask = dir->index_capacity - 1;
+	for (int i = hash & mask;; i = (i + 1) & mask) {
+		int value = dir->index[i];
+		if (value == BUCKET_EMPTY) {
+			return -1;
+		}
+		if (value != BUCKET_REMOVED) {
+			const dentry *entry = dir->entries[value - 1];
+			if (entry->hash == hash &&
+			    strcmp(entry->filename, name) == 0) {
+				return i;
+			}
+		}
+	}
+}
+
+// Inserts the entry at `position` in an index known to have room for it.
+static void
+dir_index_insert(inode_dir *dir, int position)
+{
+	int mask = dir->index_capacity - 1;
+	int i = dir->entries[position]->hash & mask;
+	while (dir->index[i] != BUCKET_EMPTY && dir->index[i] != BUCKET_REMOVED) {
+		i = (i + 1) & mask;
+	}
+	dir->index[i] = position + 1;
+}
+
+// Drops removed slots from `entries`, keeping insertion order, and
+// rebuilds the index with `index_capacity` buckets.
+static int
+dir_rebuild(inode_dir *dir, int index_capacity)
+{
+	int *index = calloc(index_capacity, sizeof(int));
+	if (index == NULL) {
+		return -ENOMEM;
+	}
+
+	int live = 0;
+	for (int i = 0; i < dir->slots; i++) {
+		if (dir->entries[i] != NULL) {
+			dir->entries[live++] = dir->entries[i];
+		}
+	}
+	dir->slots = live;
+
+	free(dir->index);
+	dir->index = index;
+	dir->index_capacity = index_capacity;
+	for (int i = 0; i < dir->slots; i++) {
+		dir_index_insert(dir, i);
+	}
+	return 0;
+}
+
+// Looks up an entry by name in O(1) expected time.
+dentry *
+dir_lookup(const inode_dir *dir, const char *name)
+{
+	int bucket = dir_find_bucket(dir, name, hash_name(name));
+	if (bucket < 0) {
+		return NULL;
+	}
+	return dir->entries[dir->index[bucket] - 1];
+}
+
+// Appends the entry to the directory. The caller must have checked that
+// no entry with the same name exists.
+int
+dir_add(inode_dir *dir, dentry *entry)
+{
+	entry->hash = hash_name(entry->filename);
+	entry->cookie = DIR_DOTDOT_COOKIE + ++dir->cookies;
+
+	if (2 * (dir->slots + 1) > dir->index_capacity) {
+		// Rebuilding also drops removed slots, so it may be enough
+		// to make room without growing.
+		int index_capacity = dir->index_capacity > 0
+		                             ? dir->index_capacity
+		                             : INITIAL_INDEX_CAPACITY;
+		while (2 * (dir->size + 1) > index_capacity) {
+			index_capacity *= 2;
+		}
+		int ret = dir_rebuild(dir, index_capacity);
+		if (ret != 0) {
+			return ret;
+		}
+	}
+
+	if (dir->slots == dir->capacity) {
+		int capacity = dir->capacity > 0 ? dir->capacity * 2
+		                                 : INITIAL_SLOTS;
+		dentry **entries =
+		        realloc(dir->entries, capacity * sizeof(dentry *));
+		if (entries == NULL) {
+			return -ENOMEM;
+		}
+		dir->entries = entries;
+		dir->capacity = capacity;
+	}
+
+	dir->entries[dir->slots] = entry;
+	dir_index_insert(dir, dir->slots);
+	dir->slots++;
+	dir->size++;
+	return 0;
+}
+
+// Removes the entry called `name` and returns it, or null if there is
+// none. The freed slot is reclaimed lazily by the next rebuild.
+dentry *
+dir_remove(inode_dir *dir, const char *name)
+{
+	int bucket = dir_find_bucket(dir, name, hash_name(name));
+	if (bucket < 0) {
+		return NULL;
+	}
+
+	int position = dir->index[bucket] - 1;
+	dentry *entry = dir->entries[position];
+	dir->index[bucket] = BUCKET_REMOVED;
+	dir->entries[position] = NULL;
+	dir->size--;
+
+	if (dir->size == 0) {
+		// Release the tables of directories that become empty.
+		free(dir->entries);
+		free(dir->index);
+		dir->entries = NULL;
+		dir->index = NULL;
+		dir->slots = 0;
+		dir->capacity = 0;
+		dir->index_capacity = 0;
+	} else if (dir->slots - dir->size > dir->size) {
+		// Failing to compact is harmless, the tables stay valid.
+		dir_rebuild(dir, dir->index_capacity);
+	}
+	return entry;
+}
+
+// Returns the first slot holding an entry with a cookie above `cookie`,
+// or dir->slots if there is none. Removed slots are skipped over.
+int
+dir_seek(const inode_dir *dir, uint64_t cookie)
+{
+	int low = 0;
+	int high = dir->slots;
+	while (low < high) {
+		int middle = low + (high - low) / 2;
+		int live = middle;
+		while (live < high && dir->entries[live] == NULL) {
+			live++;
+		}
+		if (live < high && dir->entries[live]->cookie <= cookie) {
+			low = live + 1;
+		} else {
+			high = middle;
+		}
+	}
+	return low;
+}
@@ -0,0 +1,23 @@
+#ifndef DIRECTORY_H
+#define DIRECTORY_H
+
+#include "defs.h"
+
+// Offsets of readdir: "." and ".." take the first two, the entries get
+// increasing cookies after them.
+#define DIR_DOT_COOKIE 1
+#define DIR_DOTDOT_COOKIE 2
+
+inode_dir *dir_new(void);
+
+void dir_free(inode_dir *dir);
+
+dentry *dir_lookup(const inode_dir *dir, const char *name);
+
+int dir_add(inode_dir *dir, dentry *entry);
+
+dentry *dir_remove(inode_dir *dir, const char *name);
+
+int dir_seek(const inode_dir *dir, uint64_t cookie);
+
+#endif
@@ -5,11 +5,23 @@
 #define PARENT_DIRECTORY_NOT_FOUND "Error: parent directory not found.\n"
 #define DIRECTORY_NOT_FOUND "Error: directory not found: %s\n"
 #define PARENT_DIRECTORY_FULL                                                  \
-	"Error: parent directory is full, cannot create a new directory.\n"
+	"Error: not enough memory to add an entry to the parent directory.\n"
 #define DIRECTORY_ALREADY_EXISTS "Error: directory '%s' already exists\n"
 #define DIRECTORY_NOT_EMPTY "Error: directory is not empty: %s\n"
 #define FILE_ALREADY_EXISTS "Error: file '%s' already exists\n"
 #define INODE_NOT_FOUND "Error: directory or file not found for path: %s\n"
+#define INODE_NUMBER_NOT_FOUND "Error: no inode numbered %llu\n"
 #define OFFSET_OUT_OF_BOUNDS "Error: offset out of bounds.\n"
 #define INODE_NOT_FILE "Error: inode is not a file.\n"
-#define WRITE_EXCEEDS_SIZE "Error: write exceeds file size limit.\n"
+#define FILE_GROW_FAILED "Error: not enough memory to grow the file.\n"
+#define LINK_TO_DIRECTORY "Error: cannot link a directory: %s\n"
+#define MOVE_INTO_ITSELF "Error: cannot move a directory into itself: %s\n"
+#define NOT_A_DIRECTORY "Error: not a directory: %s\n"
+#define IS_A_DIRECTORY "Error: is a directory: %s\n"
+#define READ_ONLY_SNAPSHOT "Error: snapshots are read-only: %s\n"
+#define SNAPSHOT_ALREADY_EXISTS "Error: snapshot '%s' already exists\n"
+#define TOO_MANY_SNAPSHOTS "Error: no more snapshots can be taken\n"
+#define SNAPSHOT_NOT_FOUND "Error: snapshot '%s' does not exist\n"
+#define RESERVED_NAME "Error: name reserved for the snapshots: %s\n"
+#define NO_SPACE_LEFT "Error: no space left, see --max-size.\n"
+#define NO_INODES_LEFT "Error: no inodes left, see --max-inodes.\n"
@@ -1,49 +1,398 @@
-#define FUSE_USE_VERSION 30
+#define FUSE_USE_VERSION 35
 
+#include <errno.h>
 #include <fuse.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "defs.h"
+#include "journal.h"
+#include "lowlevel.h"
 #include "operations.h"
+#include "stats.h"
 
-// Global variables
-char *filedisk = DEFAULT_FILE_DISK;
-filesystem fs;
+// Instrumented callbacks: each one counts itself (see stats.c) around
+// the filesystem function it calls.
+
+static void *
+timed_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+	// Hand the kernel our own inode numbers, stable across remounts and
+	// the same as with --lowlevel, in stat and in readdir, instead of
+	// the ones libfuse makes up.
+	cfg->use_ino = 1;
+	uint64_t start = stats_now();
+	void *data = filesystem_init(conn);
+	stats_record(STATS_INIT, start, 0);
+	return data;
+}
+
+static void
+timed_destroy(void *private_data)
+{
+	uint64_t start = stats_now();
+	filesystem_destroy(private_data);
+	stats_record(STATS_DESTROY, start, 0);
+}
+
+static int
+timed_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
+{
+	uint64_t start = stats_now();
+	int ret = filesystem_getattr(path, stbuf);
+	stats_record(STATS_GETATTR, start, ret);
+	return ret;
+}
+
+static int
+timed_mkdir(const char *path, mode_t mode)
+{
+	uint64_t start = stats_now();
+	int ret = filesystem_mkdir(path, mode);
+	stats_record(STATS_MKDIR, start, ret);
+	return ret;
+}
+
+static int
+timed_readdir(const char *path,
+              void *buf,
+              fuse_fill_dir_t filler,
+              off_t offset,
+              struct fuse_file_info *fi,
+              enum fuse_readdir_flags flags)
+{
+	uint64_t start = stats_now();
+	int ret = filesystem_readdir(path, buf, filler, offset, fi, flags);
+	stats_record(STATS_READDIR, start, ret);
+	return ret;
+}
+
+static int
+timed_rmdir(const char *path)
+{
+	uint64_t start = stats_now();
+	int ret = filesystem_rmdir(path);
+	stats_record(STATS_RMDIR, start, ret);
+	return ret;
+}
+
+static int
+timed_utimens(const char *path,
+              const struct timespec tv[2],
+              struct fuse_file_info *fi)
+{
+	uint64_t start = stats_now();
+	int ret = filesystem_utimens(path, tv);
+	stats_record(STATS_UTIMENS, start, ret);
+	return ret;
+}
+
+static int
+timed_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	uint64_t start = stats_now();
+	int ret = filesystem_create(path, mode, fi);
+	stats_record(STATS_CREATE, start, ret);
+	return ret;
+}
+
+static int
+timed_read(const char *path,
+           char *buf,
+           size_t size,
+           off_t offset,
+           struct fuse_file_info *fi)
+{
+	uint64_t start = stats_now();
+	int ret = filesystem_read(path, buf, size, offset, fi);
+	stats_record(STATS_READ, start, ret);
+	if (ret > 0) {
+		stats_bytes(false, ret);
+	}
+	return ret;
+}
+
+static int
+timed_write(const char *path,
+            const char *buf,
+            size_t size,
+            off_t offset,
+            struct fuse_file_info *fi)
+{
+	uint64_t start = stats_now();
+	int ret = filesystem_write(path, buf, size, offset, fi);
+	stats_record(STATS_WRITE, start, ret);
+	if (ret > 0) {
+		stats_bytes(true, ret);
+	}
+	return ret;
+}
+
+static int
+timed_write_buf(const char *path,
+                struct fuse_bufvec *buf,
+                off_t offset,
+                struct fuse_file_info *fi)
+{
+	uint64_t start = stats_now();
+	int ret = filesystem_write_buf(path, buf, offset, fi);
+	stats_record(STATS_WRITE, start, ret);
+	if (ret > 0) {
+		stats_bytes(true, ret);
+	}
+	return ret;
+}
+
+static int
+timed_unlink(const char *path)
+{
+	uint64_t start = stats_now();
+	int ret = filesystem_unlink(path);
+	stats_record(STATS_UNLINK, start, ret);
+	return ret;
+}
+
+// RENAME_NOREPLACE and RENAME_EXCHANGE are not supported.
+static int
+timed_rename(const char *from, const char *to, unsigned int flags)
+{
+	uint64_t start = stats_now();
+	int ret = flags != 0 ? -EINVAL : filesystem_rename(from, to);
+	stats_record(STATS_RENAME, start, ret);
+	return ret;
+}
+
+static int
+timed_link(const char *from, const char *to)
+{
+	uint64_t start = stats_now();
+	int ret = filesystem_link(from, to);
+	stats_record(STATS_LINK, start, ret);
+	return ret;
+}
+
+static int
+timed_open(const char *path, struct fuse_file_info *fi)
+{
+	uint64_t start = stats_now();
+	int ret = filesystem_open(path, fi);
+	stats_record(STATS_OPEN, start, ret);
+	return ret;
+}
+
+static int
+timed_flush(const char *path, struct fuse_file_info *fi)
+{
+	uint64_t start = stats_now();
+	int ret = filesystem_flush(path, fi);
+	stats_record(STATS_FLUSH, start, ret);
+	return ret;
+}
+
+static int
+timed_release(const char *path, struct fuse_file_info *fi)
+{
+	uint64_t start = stats_now();
+	int ret = filesystem_release(path, fi);
+	stats_record(STATS_RELEASE, start, ret);
+	return ret;
+}
+
+// `fi` is only given for a file the caller has open (ftruncate).
+static int
+timed_truncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+	uint64_t start = stats_now();
+	int ret = fi != NULL ? filesystem_ftruncate(path, size, fi)
+	                     : filesystem_truncate(path, size);
+	stats_record(STATS_TRUNCATE, start, ret);
+	return ret;
+}
+
+static int
+timed_fallocate(const char *path,
+                int mode,
+                off_t offset,
+                off_t length,
+                struct fuse_file_info *fi)
+{
+	uint64_t start = stats_now();
+	int ret = filesystem_fallocate(path, mode, offset, length, fi);
+	stats_record(STATS_FALLOCATE, start, ret);
+	return ret;
+}
+
+static off_t
+timed_lseek(const char *path,
+            off_t offset,
+            int whence,
+            struct fuse_file_info *fi)
+{
+	uint64_t start = stats_now();
+	off_t ret = filesystem_lseek(path, offset, whence, fi);
+	stats_record(STATS_LSEEK, start, ret < 0 ? (int) ret : 0);
+	return ret;
+}
+
+static ssize_t
+timed_copy_file_range(const char *path_in,
+                      struct fuse_file_info *fi_in,
+                      off_t offset_in,
+                      const char *path_out,
+                      struct fuse_file_info *fi_out,
+                      off_t offset_out,
+                      size_t size,
+                      int flags)
+{
+	uint64_t start = stats_now();
+	ssize_t ret = filesystem_copy_file_range(path_in,
+	                                         fi_in,
+	                                         offset_in,
+	                                         path_out,
+	                                         fi_out,
+	                                         offset_out,
+	                                         size,
+	                                         flags);
+	stats_record(STATS_COPY_FILE_RANGE, start, ret < 0 ? (int) ret : 0);
+	return ret;
+}
+
+static int
+timed_statfs(const char *path, struct statvfs *stbuf)
+{
+	uint64_t start = stats_now();
+	int ret = filesystem_statfs(path, stbuf);
+	stats_record(STATS_STATFS, start, ret);
+	return ret;
+}
 
 static struct fuse_operations operations = {
-	.init = filesystem_init,
-	.getattr = filesystem_getattr,
-	.mkdir = filesystem_mkdir,
-	.readdir = filesystem_readdir,
-	.rmdir = filesystem_rmdir,
-	.utimens = filesystem_utimens,
-	.create = filesystem_create,
-	.write = filesystem_write,
-	.read = filesystem_read,
-	.unlink = filesystem_unlink,
-	.destroy = filesystem_destroy,  // Called on flush.
-	.open = filesystem_open,
-	.truncate = filesystem_truncate,
+	.init = timed_init,
+	.getattr = timed_getattr,
+	.mkdir = timed_mkdir,
+	.readdir = timed_readdir,
+	.rmdir = timed_rmdir,
+	.utimens = timed_utimens,
+	.create = timed_create,
+	.write = timed_write,
+	.write_buf = timed_write_buf,
+	.read = timed_read,
+	.unlink = timed_unlink,
+	.rename = timed_rename,
+	.link = timed_link,
+	.destroy = timed_destroy,  // Called on flush.
+	.open = timed_open,
+	.flush = timed_flush,
+	.release = timed_release,
+	.truncate = timed_truncate,
+	.fallocate = timed_fallocate,
+	.lseek = timed_lseek,
+	.copy_file_range = timed_copy_file_range,
+	.statfs = timed_statfs,
 };
 
+// Parses a whole decimal number into `value`.
+static bool
+parse_count(const char *arg, uint64_t *value)
+{
+	char *end;
+	errno = 0;
+	unsigned long long count = strtoull(arg, &end, 10);
+	if (*arg < '0' || *arg > '9' || *end != '\0' || errno == ERANGE) {
+		return false;
+	}
+	*value = count;
+	return true;
+}
+
 int
 main(int argc, char *argv[])
 {
+	bool lowlevel = false;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--lowlevel") == 0) {
+			lowlevel = true;
+		} else if (strcmp(argv[i], "--dedup") == 0) {
+			dedup = true;
+		} else if (strcmp(argv[i], "--compress") == 0) {
+			compression = true;
+		} else {
+			continue;
+		}
+
+		for (int j = i; j < argc - 1; j++) {
+			argv[j] = argv[j + 1];
+		}
+		argc--;
+		i--;
+	}
+
 	for (int i = 1; i < argc - 1; i++) {
 		if (strcmp(argv[i], "--filedisk") == 0) {
 			filedisk = argv[i + 1];
-
-			// We remove the argument so that fuse doesn't use our
-			// argument or name as folder.
-			// Equivalent to a pop.
-			for (int j = i; j < argc - 1; j++) {
-				argv[j] = argv[j + 2];
+		} else if (strcmp(argv[i], "--checkpoint-interval") == 0) {
+			char *end;
+			unsigned long seconds = strtoul(argv[i + 1], &end, 10);
+			if (*argv[i + 1] == '\0' || *end != '\0' ||
+			    seconds > UINT_MAX) {
+				fprintf(stderr,
+				        "Error: --checkpoint-interval must be "
+				        "a number of seconds\n");
+				return EXIT_FAILURE;
+			}
+			checkpoint_interval = seconds;
+		} else if (strcmp(argv[i], "--journal-sync") == 0) {
+			if (journal_parse_sync(argv[i + 1], &journal_mode) != 0) {
+				fprintf(stderr,
+				        "Error: --journal-sync must be always, "
+				        "batch or none\n");
+				return EXIT_FAILURE;
+			}
+		} else if (strcmp(argv[i], "--max-size") == 0) {
+			if (!parse_count(argv[i + 1], &max_size)) {
+				fprintf(stderr,
+				        "Error: --max-size must be a number "
+				        "of bytes\n");
+				return EXIT_FAILURE;
 			}
+		} else if (strcmp(argv[i], "--max-inodes") == 0) {
+			if (!parse_count(argv[i + 1], &max_inodes)) {
+				fprintf(stderr,
+				        "Error: --max-inodes must be a number "
+				        "of files and directories\n");
+				return EXIT_FAILURE;
+			}
+		} else if (strcmp(argv[i], "--threads") == 0) {
+			uint64_t count;
+			if (!parse_count(argv[i + 1], &count) ||
+			    count > UINT_MAX) {
+				fprintf(stderr,
+				        "Error: --threads must be a number "
+				        "of threads, 0 for one per CPU\n");
+				return EXIT_FAILURE;
+			}
+			worker_threads = count;
+		} else {
+			continue;
+		}
 
-			argc = argc - 2;
-			break;
+		// We remove the argument so that fuse doesn't use our
+		// argument or name as folder.
+		// Equivalent to a pop.
+		for (int j = i; j < argc - 1; j++) {
+			argv[j] = argv[j + 2];
 		}
+
+		argc = argc - 2;
+		i--;
 	}
 
+	if (lowlevel) {
+		return lowlevel_main(argc, argv);
+	}
 	return fuse_main(argc, argv, &operations, NULL);
 }
@@ -0,0 +1,140 @@
+#include "idmap.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+#define INITIAL_CAPACITY 16
+
+// Open addressing with linear probing. Removal shifts the following
+// entries back (no tombstones), so lookups stay short after churn.
+
+static size_t
+bucket_of(uint64_t key, size_t capacity)
+{
+	// Fibonacci hashing spreads sequential ids over the table.
+	return (key * 11400714819323198485ull) >> 32 & (capacity - 1);
+}
+
+void
+idmap_init(idmap *map)
+{
+	map->keys = NULL;
+	map->values = NULL;
+	map->size = 0;
+	map->capacity = 0;
+}
+
+void
+idmap_destroy(idmap *map)
+{
+	free(map->keys);
+	free(map->values);
+	idmap_init(map);
+}
+
+bool
+idmap_get(const idmap *map, uint64_t key, uint64_t *value)
+{
+	if (map->capacity == 0) {
+		return false;
+	}
+	size_t mask = map->capacity - 1;
+	for (size_t i = bucket_of(key, map->capacity);; i = (i + 1) & mask) {
+		if (map->keys[i] == 0) {
+			return false;
+		}
+		if (map->keys[i] == key) {
+			*value = map->values[i];
+			return true;
+		}
+	}
+}
+
+static int
+idmap_grow(idmap *map)
+{
+	size_t capacity = map->capacity > 0 ? map->capacity * 2
+	                                    : INITIAL_CAPACITY;
+	uint64_t *keys = calloc(capacity, sizeof(uint64_t));
+	uint64_t *values = malloc(capacity * sizeof(uint64_t));
+	if (keys == NULL || values == NULL) {
+		free(keys);
+		free(values);
+		return -ENOMEM;
+	}
+
+	for (size_t i = 0; i < map->capacity; i++) {
+		if (map->keys[i] == 0) {
+			continue;
+		}
+		size_t j = bucket_of(map->keys[i], capacity);
+		while (keys[j] != 0) {
+			j = (j + 1) & (capacity - 1);
+		}
+		keys[j] = map->keys[i];
+		values[j] = map->values[i];
+	}
+
+	free(map->keys);
+	free(map->values);
+	map->keys = keys;
+	map->values = values;
+	map->capacity = capacity;
+	return 0;
+}
+
+// Inserts or replaces the value for `key`, which must not be zero.
+int
+idmap_put(idmap *map, uint64_t key, uint64_t value)
+{
+	if (2 * (map->size + 1) > map->capacity) {
+		int ret = idmap_grow(map);
+		if (ret != 0) {
+			return ret;
+		}
+	}
+
+	size_t mask = map->capacity - 1;
+	size_t i = bucket_of(key, map->capacity);
+	while (map->keys[i] != 0 && map->keys[i] != key) {
+		i = (i + 1) & mask;
+	}
+	if (map->keys[i] == 0) {
+		map->size++;
+	}
+	map->keys[i] = key;
+	map->values[i] = value;
+	return 0;
+}
+
+bool
+idmap_remove(idmap *map, uint64_t key)
+{
+	if (map->capacity == 0) {
+		return false;
+	}
+	size_t mask = map->capacity - 1;
+	size_t i = bucket_of(key, map->capacity);
+	while (map->keys[i] != key) {
+		if (map->keys[i] == 0) {
+			return false;
+		}
+		i = (i + 1) & mask;
+	}
+
+	// Shift back the rest of the cluster to fill the hole.
+	size_t hole = i;
+	for (size_t j = (i + 1) & mask; map->keys[j] != 0; j = (j + 1) & mask) {
+		size_t home = bucket_of(map->keys[j], map->capacity);
+		// Move it if its home is not in (hole, j].
+		if ((j > hole && (home <= hole || home > j)) ||
+		    (j < hole && (home <= hole && home > j))) {
+			map->keys[hole] = map->keys[j];
+			map->values[hole] = map->values[j];
+			hole = j;
+		}
+	}
+	map->keys[hole] = 0;
+	map->size--;
+	return true;
+}
@@ -0,0 +1,26 @@
+#ifndef IDMAP_H
+#define IDMAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Hash map from non-zero 64-bit ids to 64-bit values.
+typedef struct idmap {
+	uint64_t *keys;  // Zero marks an empty bucket
+	uint64_t *values;
+	size_t size;
+	size_t capacity;  // Zero or a power of two
+} idmap;
+
+void idmap_init(idmap *map);
+
+void idmap_destroy(idmap *map);
+
+bool idmap_get(const idmap *map, uint64_t key, uint64_t *value);
+
+int idmap_put(idmap *map, uint64_t key, uint64_t value);
+
+bool idmap_remove(idmap *map, uint64_t key);
+
+#endif
@@ -0,0 +1,138 @@
+#include "inode_table.h"
+
+#include <pthread.h>
+#include <stdio.h>
+
+#include "idmap.h"
+#include "slab.h"
+
+// Every inode in memory, loaded or stub, by inode number. It is what
+// the low-level front end and inode based journal records resolve
+// numbers with, and it makes stubs unique: loading a directory reuses
+// the inode already created for a child (see new_stub in persistence.c).
+//
+// The map is split in INODE_TABLE_SHARDS by inode number, each with its
+// own lock, so lookups from different threads rarely contend.
+#define INODE_TABLE_SHARDS 16
+
+static struct {
+	pthread_rwlock_t lock;
+	idmap map;  // Inode number -> inode pointer
+} shards[INODE_TABLE_SHARDS] = {
+	[0 ... INODE_TABLE_SHARDS - 1] = { .lock = PTHREAD_RWLOCK_INITIALIZER },
+};
+
+static unsigned
+shard_of(uint64_t ino)
+{
+	return ino % INODE_TABLE_SHARDS;
+}
+
+// Creates a zeroed inode numbered `ino`, with its lock initialized, and
+// adds it to the table. Null if out of memory.
+inode *
+inode_table_new(uint64_t ino)
+{
+	inode *node = slab_alloc(&inode_slab);
+	if (node == NULL) {
+		return NULL;
+	}
+	node->ino = ino;
+	pthread_rwlock_init(&node->lock, NULL);
+
+	unsigned shard = shard_of(ino);
+	pthread_rwlock_wrlock(&shards[shard].lock);
+	int ret = idmap_put(&shards[shard].map, ino, (uintptr_t) node);
+	pthread_rwlock_unlock(&shards[shard].lock);
+	if (ret != 0) {
+		pthread_rwlock_destroy(&node->lock);
+		slab_free(&inode_slab, node);
+		return NULL;
+	}
+	return node;
+}
+
+// Returns the inode numbered `ino` or, if it is not in memory, a new stub
+// for it, in one step: threads reaching it at once through different
+// directories, or snapshots, share a single stub. Null if out of memory.
+inode *
+inode_table_get_stub(uint64_t ino)
+{
+	uint64_t value;
+	unsigned shard = shard_of(ino);
+	pthread_rwlock_wrlock(&shards[shard].lock);
+	if (idmap_get(&shards[shard].map, ino, &value)) {
+		pthread_rwlock_unlock(&shards[shard].lock);
+		return (inode *) (uintptr_t) value;
+	}
+
+	inode *node = slab_alloc(&inode_slab);
+	if (node != NULL) {
+		node->ino = ino;
+		node->stub = true;
+		pthread_rwlock_init(&node->lock, NULL);
+		if (idmap_put(&shards[shard].map, ino, (uintptr_t) node) != 0) {
+			pthread_rwlock_destroy(&node->lock);
+			slab_free(&inode_slab, node);
+			node = NULL;
+		}
+	}
+	pthread_rwlock_unlock(&shards[shard].lock);
+	return node;
+}
+
+// Returns the inode numbered `ino`, or null if it is not in memory.
+inode *
+inode_table_get(uint64_t ino)
+{
+	uint64_t value;
+	unsigned shard = shard_of(ino);
+	pthread_rwlock_rdlock(&shards[shard].lock);
+	bool found = idmap_get(&shards[shard].map, ino, &value);
+	pthread_rwlock_unlock(&shards[shard].lock);
+	return found ? (inode *) (uintptr_t) value : NULL;
+}
+
+// Takes `node` out of the table and frees it. Its file or directory must
+// have been freed already.
+void
+inode_table_delete(inode *node)
+{
+	unsigned shard = shard_of(node->ino);
+	pthread_rwlock_wrlock(&shards[shard].lock);
+	idmap_remove(&shards[shard].map, node->ino);
+	pthread_rwlock_unlock(&shards[shard].lock);
+
+	pthread_rwlock_destroy(&node->lock);
+	slab_free(&inode_slab, node);
+}
+
+// Calls `fn` on every inode in the table, holding the lock of its shard,
+// so `fn` must neither use the table nor lock inodes. The caller must
+// hold fs.lock, so that none is freed meanwhile.
+void
+inode_table_for_each(void (*fn)(inode *node, void *arg), void *arg)
+{
+	for (unsigned i = 0; i < INODE_TABLE_SHARDS; i++) {
+		pthread_rwlock_rdlock(&shards[i].lock);
+		const idmap *map = &shards[i].map;
+		for (size_t j = 0; j < map->capacity; j++) {
+			if (map->keys[j] != 0) {
+				fn((inode *) (uintptr_t) map->values[j], arg);
+			}
+		}
+		pthread_rwlock_unlock(&shards[i].lock);
+	}
+}
+
+// Empties the table on unmount, so that a later mount starts afresh. The
+// inodes themselves go away with the process.
+void
+inode_table_clear(void)
+{
+	for (unsigned i = 0; i < INODE_TABLE_SHARDS; i++) {
+		pthread_rwlock_wrlock(&shards[i].lock);
+		idmap_destroy(&shards[i].map);
+		pthread_rwlock_unlock(&shards[i].lock);
+	}
+}
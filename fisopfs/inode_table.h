@@ -0,0 +1,20 @@
+#ifndef INODE_TABLE_H
+#define INODE_TABLE_H
+
+#include <stdint.h>
+
+#include "defs.h"
+
+inode *inode_table_new(uint64_t ino);
+
+inode *inode_table_get(uint64_t ino);
+
+inode *inode_table_get_stub(uint64_t ino);
+
+void inode_table_delete(inode *node);
+
+void inode_table_clear(void);
+
+void inode_table_for_each(void (*fn)(inode *node, void *arg), void *arg);
+
+#endif
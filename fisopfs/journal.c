@@ -0,0 +1,942 @@
+#include "journal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Append-only log of the mutating operations applied since the last
+// saved image. It starts with a header naming that image,
+//
+//   u32 JOURNAL_MAGIC | u64 image id
+//
+// (see image_new_id), and is only replayed onto the image with that id:
+// one left behind by an image that was deleted or replaced is dropped.
+// A journal from before headers existed belongs to an image from before
+// ids existed. Each record is
+//
+//   u32 checksum | u64 lsn | u8 op | u32 payload length | payload
+//
+// where the checksum covers everything after it and the payload is the
+// path (u16 length + bytes) followed by the arguments of the operation.
+// Records that address an inode by number have JOURNAL_BY_INODE set in
+// the op and start with it (u64); their path is then a name in that
+// directory, or empty, and mkdir and create end with the new inode's
+// number (u64), so replay gives it the same one. rename and link only
+// exist by number: rename ends with the directory it moves to (u64) and
+// the new name (u16 length + bytes), link with the inode linked (u64).
+// fallocate holds its mode (u32), offset and length (u64 each), copy
+// the inode copied from, its offset there, the offset in the inode of
+// the record and the length (u64 each).
+// A record that fails its checksum ends the log: it is the torn tail of
+// a crash and is cut off when the journal is reopened.
+//
+// Log sequence numbers (lsn) grow by one per record. The image stores
+// the lsn of the last record it includes, so replay skips anything at
+// or below it.
+//
+// Group commit: records are appended to an in-memory buffer while the
+// operation still holds its locks, which orders them like the changes
+// they describe. The callback then calls journal_commit after unlocking,
+// and the first caller to find pending records writes the whole buffer
+// for everyone waiting. The sync mode picks what else is waited for:
+//
+// - always: the leader also fdatasyncs, and the callback returns once
+//   its record is on disk.
+// - batch: the callback returns once its record reached the kernel, so
+//   it survives the process being killed. A flusher thread fdatasyncs
+//   every JOURNAL_SYNC_INTERVAL seconds.
+// - none: like batch but never syncs, the kernel flushes when it wants.
+//
+// Checkpoints written while operations go on cannot empty the journal,
+// it may already hold records they do not include. Instead, while taking
+// one, journal_rotate renames the journal to <path>.old and starts a new
+// one, and journal_trim removes the old one once the checkpoint is saved.
+// Replay reads both, in order.
+
+#define JOURNAL_MAGIC 0x4c4e524au
+#define JOURNAL_HEADER_SIZE (4 + 8)
+#define RECORD_HEADER_SIZE (4 + 8 + 1 + 4)
+#define MAX_RECORD_PAYLOAD (64 * 1024 * 1024)
+#define MAX_PATH_LEN PATH_MAX
+#define JOURNAL_SYNC_INTERVAL 1
+#define JOURNAL_BY_INODE 0x80
+#define CHECKSUM_SEED 2166136261u
+// Largest record without the data of a write: its header, an inode,
+// two names and the fixed-size arguments.
+#define MAX_RECORD_HEAD (RECORD_HEADER_SIZE + 2 * (2 + MAX_PATH_LEN) + 64)
+
+typedef struct journal {
+	int fd;  // -1 while closed, operations are then not logged
+	journal_sync mode;
+	uint64_t image_id;  // Written in the header
+	char path[PATH_MAX];
+	char old_path[PATH_MAX];  // Where journal_rotate moves it
+
+	pthread_mutex_t mutex;
+	pthread_cond_t flushed;
+	char *buffer;  // Records not yet written
+	size_t used;
+	size_t capacity;
+	char *spare;  // Buffer being written by the leader, then reused
+	size_t spare_capacity;
+	bool flushing;
+
+	uint64_t last_lsn;     // Last assigned
+	uint64_t written_lsn;  // Everything up to here was written
+	uint64_t synced_lsn;   // Everything up to here was fdatasync'd
+
+	pthread_t flusher;
+	bool stop;
+	pthread_cond_t stop_cond;
+} journal;
+
+static journal j = {
+	.fd = -1,
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.flushed = PTHREAD_COND_INITIALIZER,
+	.stop_cond = PTHREAD_COND_INITIALIZER,
+};
+
+// Continues the checksum `hash` of some bytes over the next `size`.
+static uint32_t
+checksum_more(uint32_t hash, const char *data, size_t size)
+{
+	for (size_t i = 0; i < size; i++) {
+		hash ^= (unsigned char) data[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static uint32_t
+checksum(const char *data, size_t size)
+{
+	return checksum_more(CHECKSUM_SEED, data, size);
+}
+
+int
+journal_parse_sync(const char *name, journal_sync *mode)
+{
+	if (strcmp(name, "always") == 0) {
+		*mode = JOURNAL_SYNC_ALWAYS;
+	} else if (strcmp(name, "batch") == 0) {
+		*mode = JOURNAL_SYNC_BATCH;
+	} else if (strcmp(name, "none") == 0) {
+		*mode = JOURNAL_SYNC_NONE;
+	} else {
+		return -EINVAL;
+	}
+	return 0;
+}
+
+// Encoding
+
+static size_t
+payload_size(const journal_record *record)
+{
+	size_t size = 2 + strlen(record->path);
+	if (record->ino != 0) {
+		size += 8;
+	}
+	switch (record->op) {
+	case JOURNAL_MKDIR:
+	case JOURNAL_CREATE:
+		return size + 4 + (record->ino != 0 ? 8 : 0);
+	case JOURNAL_WRITE:
+		return size + 8 + 4 + record->size;
+	case JOURNAL_TRUNCATE:
+		return size + 8;
+	case JOURNAL_UTIMENS:
+		return size + 8 + 8;
+	case JOURNAL_RENAME:
+		return size + 8 + 2 + strlen(record->name);
+	case JOURNAL_LINK:
+		return size + 8;
+	case JOURNAL_FALLOCATE:
+		return size + 4 + 8 + 8;
+	case JOURNAL_COPY:
+		return size + 8 + 8 + 8 + 8;
+	default:
+		return size;
+	}
+}
+
+static char *
+put(char *dst, const void *src, size_t size)
+{
+	memcpy(dst, src, size);
+	return dst + size;
+}
+
+// Copies the first `size` bytes spread over `iov`.
+static char *
+gather(char *dst, const struct iovec *iov, size_t size)
+{
+	for (; size > 0; iov++) {
+		size_t chunk = iov->iov_len < size ? iov->iov_len : size;
+		dst = put(dst, iov->iov_base, chunk);
+		size -= chunk;
+	}
+	return dst;
+}
+
+// Encodes everything in the record but its checksum and, for a write,
+// its data, which follows. Returns the end.
+static char *
+encode_head(char *dst, const journal_record *record, uint32_t payload)
+{
+	dst += 4;  // Checksum, filled in last
+	dst = put(dst, &record->lsn, 8);
+	uint8_t op = record->op | (record->ino != 0 ? JOURNAL_BY_INODE : 0);
+	dst = put(dst, &op, 1);
+	dst = put(dst, &payload, 4);
+
+	if (record->ino != 0) {
+		dst = put(dst, &record->ino, 8);
+	}
+	uint16_t path_len = strlen(record->path);
+	dst = put(dst, &path_len, 2);
+	dst = put(dst, record->path, path_len);
+
+	uint32_t mode = record->mode;
+	int64_t offset = record->offset;
+	uint32_t size = record->size;
+	uint64_t length = record->size;
+	int64_t src_offset = record->src_offset;
+	int64_t atime = record->atime;
+	int64_t mtime = record->mtime;
+	uint16_t name_len;
+	switch (record->op) {
+	case JOURNAL_MKDIR:
+	case JOURNAL_CREATE:
+		dst = put(dst, &mode, 4);
+		if (record->ino != 0) {
+			dst = put(dst, &record->new_ino, 8);
+		}
+		break;
+	case JOURNAL_WRITE:
+		dst = put(dst, &offset, 8);
+		dst = put(dst, &size, 4);
+		break;
+	case JOURNAL_TRUNCATE:
+		dst = put(dst, &offset, 8);
+		break;
+	case JOURNAL_UTIMENS:
+		dst = put(dst, &atime, 8);
+		dst = put(dst, &mtime, 8);
+		break;
+	case JOURNAL_RENAME:
+		name_len = strlen(record->name);
+		dst = put(dst, &record->new_ino, 8);
+		dst = put(dst, &name_len, 2);
+		dst = put(dst, record->name, name_len);
+		break;
+	case JOURNAL_LINK:
+		dst = put(dst, &record->new_ino, 8);
+		break;
+	case JOURNAL_FALLOCATE:
+		dst = put(dst, &mode, 4);
+		dst = put(dst, &offset, 8);
+		dst = put(dst, &length, 8);
+		break;
+	case JOURNAL_COPY:
+		dst = put(dst, &record->new_ino, 8);
+		dst = put(dst, &src_offset, 8);
+		dst = put(dst, &offset, 8);
+		dst = put(dst, &length, 8);
+		break;
+	default:
+		break;
+	}
+	return dst;
+}
+
+static void
+encode(char *dst, const journal_record *record, uint32_t payload)
+{
+	char *start = dst;
+	dst = encode_head(dst, record, payload);
+	if (record->op == JOURNAL_WRITE && record->data != NULL) {
+		dst = put(dst, record->data, record->size);
+	} else if (record->op == JOURNAL_WRITE) {
+		dst = gather(dst, record->iov, record->size);
+	}
+
+	uint32_t sum = checksum(start + 4, dst - start - 4);
+	memcpy(start, &sum, 4);
+}
+
+// Decodes a whole record, checksum already verified. The path is copied
+// to `path` (at least MAX_PATH_LEN + 1 bytes) and the new name of a
+// rename to `name` (NAME_MAX + 1 bytes), so they can be terminated.
+static bool
+decode(const char *src,
+       size_t total,
+       journal_record *record,
+       char *path,
+       char *name)
+{
+	const char *end = src + total;
+	uint8_t op;
+	memcpy(&record->lsn, src + 4, 8);
+	memcpy(&op, src + 12, 1);
+	record->op = op & ~JOURNAL_BY_INODE;
+	src += RECORD_HEADER_SIZE;
+
+	record->ino = 0;
+	if (op & JOURNAL_BY_INODE) {
+		if (end - src < 8) {
+			return false;
+		}
+		memcpy(&record->ino, src, 8);
+		src += 8;
+		if (record->ino == 0) {
+			return false;
+		}
+	}
+	uint16_t path_len;
+	if (end - src < 2) {
+		return false;
+	}
+	memcpy(&path_len, src, 2);
+	src += 2;
+	if (end - src < path_len || path_len > MAX_PATH_LEN) {
+		return false;
+	}
+	memcpy(path, src, path_len);
+	path[path_len] = '\0';
+	record->path = path;
+	src += path_len;
+
+	uint32_t mode, size;
+	uint64_t length;
+	int64_t offset, src_offset, atime, mtime;
+	uint16_t name_len;
+	switch (record->op) {
+	case JOURNAL_MKDIR:
+	case JOURNAL_CREATE:
+		if (end - src < 4) {
+			return false;
+		}
+		memcpy(&mode, src, 4);
+		record->mode = mode;
+		if (record->ino != 0) {
+			if (end - src < 4 + 8) {
+				return false;
+			}
+			memcpy(&record->new_ino, src + 4, 8);
+		}
+		break;
+	case JOURNAL_WRITE:
+		if (end - src < 12) {
+			return false;
+		}
+		memcpy(&offset, src, 8);
+		memcpy(&size, src + 8, 4);
+		if ((size_t) (end - src - 12) < size) {
+			return false;
+		}
+		record->offset = offset;
+		record->size = size;
+		record->data = src + 12;
+		break;
+	case JOURNAL_TRUNCATE:
+		if (end - src < 8) {
+			return false;
+		}
+		memcpy(&offset, src, 8);
+		record->offset = offset;
+		break;
+	case JOURNAL_UTIMENS:
+		if (end - src < 16) {
+			return false;
+		}
+		memcpy(&atime, src, 8);
+		memcpy(&mtime, src + 8, 8);
+		record->atime = atime;
+		record->mtime = mtime;
+		break;
+	case JOURNAL_UNLINK:
+	case JOURNAL_RMDIR:
+		break;
+	case JOURNAL_RENAME:
+		if (record->ino == 0 || end - src < 8 + 2) {
+			return false;
+		}
+		memcpy(&record->new_ino, src, 8);
+		memcpy(&name_len, src + 8, 2);
+		if (end - src - 10 < name_len || name_len > NAME_MAX) {
+			return false;
+		}
+		memcpy(name, src + 10, name_len);
+		name[name_len] = '\0';
+		record->name = name;
+		break;
+	case JOURNAL_LINK:
+		if (record->ino == 0 || end - src < 8) {
+			return false;
+		}
+		memcpy(&record->new_ino, src, 8);
+		break;
+	case JOURNAL_FALLOCATE:
+		if (end - src < 4 + 8 + 8) {
+			return false;
+		}
+		memcpy(&mode, src, 4);
+		memcpy(&offset, src + 4, 8);
+		memcpy(&length, src + 12, 8);
+		record->mode = mode;
+		record->offset = offset;
+		record->size = length;
+		break;
+	case JOURNAL_COPY:
+		if (record->ino == 0 || end - src < 8 + 8 + 8 + 8) {
+			return false;
+		}
+		memcpy(&record->new_ino, src, 8);
+		memcpy(&src_offset, src + 8, 8);
+		memcpy(&offset, src + 16, 8);
+		memcpy(&length, src + 24, 8);
+		record->src_offset = src_offset;
+		record->offset = offset;
+		record->size = length;
+		break;
+	default:
+		return false;
+	}
+	return true;
+}
+
+// Reading
+
+static bool
+read_all(int fd, char *buf, size_t size)
+{
+	size_t done = 0;
+	while (done < size) {
+		ssize_t n = read(fd, buf + done, size - done);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		done += n;
+	}
+	return true;
+}
+
+// Reads the header at the start of `fd` and tells whether the journal
+// belongs to the image `image_id`, leaving `fd` at its first record. One
+// without a header belongs to an image with no id (0).
+static bool
+read_header(int fd, uint64_t image_id)
+{
+	char header[JOURNAL_HEADER_SIZE];
+	uint32_t magic = 0;
+	uint64_t id = 0;
+	if (read_all(fd, header, sizeof(header))) {
+		memcpy(&magic, header, 4);
+		memcpy(&id, header + 4, 8);
+	}
+	if (magic != JOURNAL_MAGIC) {
+		lseek(fd, 0, SEEK_SET);
+		return image_id == 0;
+	}
+	return id == image_id;
+}
+
+// Reads the next record into `*buf`, growing it as needed. Returns the
+// size of the record, or 0 at the end of the valid prefix of the log.
+static size_t
+read_record(int fd, char **buf, size_t *capacity)
+{
+	char header[RECORD_HEADER_SIZE];
+	if (!read_all(fd, header, sizeof(header))) {
+		return 0;
+	}
+
+	uint32_t sum, payload;
+	memcpy(&sum, header, 4);
+	memcpy(&payload, header + 13, 4);
+	if (payload > MAX_RECORD_PAYLOAD) {
+		return 0;
+	}
+
+	size_t total = sizeof(header) + payload;
+	if (*capacity < total) {
+		char *grown = realloc(*buf, total);
+		if (grown == NULL) {
+			return 0;
+		}
+		*buf = grown;
+		*capacity = total;
+	}
+
+	memcpy(*buf, header, sizeof(header));
+	if (!read_all(fd, *buf + sizeof(header), payload) ||
+	    checksum(*buf + 4, total - 4) != sum) {
+		return 0;
+	}
+	return total;
+}
+
+static int
+rotated_path(const char *path, char *old_path)
+{
+	if (snprintf(old_path, PATH_MAX, "%s.old", path) >= PATH_MAX) {
+		return -ENAMETOOLONG;
+	}
+	return 0;
+}
+
+// Applies, in order, every valid record of the file at `path` with an
+// lsn above `after_lsn`, if it is a journal of the image `image_id`.
+// Returns the lsn of the last valid record, or after_lsn if there is
+// none.
+static uint64_t
+replay_file(const char *path,
+            uint64_t after_lsn,
+            uint64_t image_id,
+            journal_apply_fn apply)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return after_lsn;
+	}
+	if (!read_header(fd, image_id)) {
+		if (lseek(fd, 0, SEEK_END) > 0) {
+			fprintf(stderr,
+			        "Ignoring journal %s of another image\n",
+			        path);
+		}
+		close(fd);
+		return after_lsn;
+	}
+
+	uint64_t last = after_lsn;
+	size_t applied = 0;
+	char *buf = NULL;
+	size_t capacity = 0;
+	char record_path[MAX_PATH_LEN + 1];
+	char record_name[NAME_MAX + 1];
+
+	size_t total;
+	while ((total = read_record(fd, &buf, &capacity)) > 0) {
+		journal_record record = { 0 };
+		if (!decode(buf, total, &record, record_path, record_name)) {
+			break;
+		}
+		if (record.lsn > after_lsn) {
+			apply(&record);
+			applied++;
+		}
+		if (record.lsn > last) {
+			last = record.lsn;
+		}
+	}
+
+	free(buf);
+	close(fd);
+	if (applied > 0) {
+		printf("Replayed %zu journal records from %s\n", applied, path);
+	}
+	return last;
+}
+
+// Applies, in order, every valid record of the journal at `path`, and of
+// the one it was rotated from, with an lsn above `after_lsn`, as long as
+// they belong to the image `image_id`. Returns the lsn of the last valid
+// record, or after_lsn if there is none.
+uint64_t
+journal_replay(const char *path,
+               uint64_t after_lsn,
+               uint64_t image_id,
+               journal_apply_fn apply)
+{
+	char old_path[PATH_MAX];
+	if (rotated_path(path, old_path) == 0) {
+		after_lsn = replay_file(old_path, after_lsn, image_id, apply);
+	}
+	return replay_file(path, after_lsn, image_id, apply);
+}
+
+// Writing
+
+static bool
+write_all(int fd, const char *buf, size_t size)
+{
+	size_t done = 0;
+	while (done < size) {
+		ssize_t n = write(fd, buf + done, size - done);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			return false;
+		}
+		done += n;
+	}
+	return true;
+}
+
+// Writes the header of the journal at the start of the empty file `fd`.
+static bool
+write_header(int fd)
+{
+	char header[JOURNAL_HEADER_SIZE];
+	uint32_t magic = JOURNAL_MAGIC;
+	memcpy(header, &magic, 4);
+	memcpy(header + 4, &j.image_id, 8);
+	return write_all(fd, header, sizeof(header));
+}
+
+static void *
+flusher_loop(void *arg)
+{
+	pthread_mutex_lock(&j.mutex);
+	while (!j.stop) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += JOURNAL_SYNC_INTERVAL;
+		pthread_cond_timedwait(&j.stop_cond, &j.mutex, &deadline);
+
+		uint64_t written = j.written_lsn;
+		if (j.stop || written == j.synced_lsn) {
+			continue;
+		}
+		// A duplicate stays valid if journal_rotate closes j.fd.
+		int fd = dup(j.fd);
+		pthread_mutex_unlock(&j.mutex);
+		if (fd >= 0) {
+			fdatasync(fd);
+			close(fd);
+		}
+		pthread_mutex_lock(&j.mutex);
+		if (written > j.synced_lsn) {
+			j.synced_lsn = written;
+		}
+	}
+	pthread_mutex_unlock(&j.mutex);
+	return NULL;
+}
+
+// Opens the journal of the image `image_id` for appending, after it has
+// been replayed. Drops a torn tail left by a crash, so new records follow
+// the last valid one, and the journals of another image, which replay
+// ignored.
+int
+journal_open(const char *path,
+             journal_sync mode,
+             uint64_t last_lsn,
+             uint64_t image_id)
+{
+	if (snprintf(j.path, sizeof(j.path), "%s", path) >=
+	            (int) sizeof(j.path) ||
+	    rotated_path(path, j.old_path) != 0) {
+		fprintf(stderr, "Error: journal path too long\n");
+		return -ENAMETOOLONG;
+	}
+	j.image_id = image_id;
+
+	int old_fd = open(j.old_path, O_RDONLY);
+	if (old_fd >= 0) {
+		bool stale = !read_header(old_fd, image_id);
+		close(old_fd);
+		if (stale) {
+			journal_trim();
+		}
+	}
+
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		perror("Error: cannot open journal");
+		return -errno;
+	}
+	if (!read_header(fd, image_id) &&
+	    (ftruncate(fd, 0) != 0 || lseek(fd, 0, SEEK_SET) < 0 ||
+	     !write_header(fd))) {
+		perror("Error: cannot open journal");
+		close(fd);
+		return -EIO;
+	}
+
+	// Find the end of the valid prefix.
+	off_t valid = lseek(fd, 0, SEEK_CUR);
+	char *buf = NULL;
+	size_t capacity = 0;
+	size_t total;
+	while ((total = read_record(fd, &buf, &capacity)) > 0) {
+		valid += total;
+	}
+	free(buf);
+
+	if (ftruncate(fd, valid) != 0 || lseek(fd, valid, SEEK_SET) < 0) {
+		perror("Error: cannot open journal");
+		close(fd);
+		return -EIO;
+	}
+
+	pthread_mutex_lock(&j.mutex);
+	j.fd = fd;
+	j.mode = mode;
+	j.last_lsn = last_lsn;
+	j.written_lsn = last_lsn;
+	j.synced_lsn = last_lsn;
+	j.stop = false;
+	pthread_mutex_unlock(&j.mutex);
+
+	if (mode == JOURNAL_SYNC_BATCH) {
+		pthread_create(&j.flusher, NULL, flusher_loop, NULL);
+	}
+	return 0;
+}
+
+// Writes and syncs everything pending and closes the journal.
+void
+journal_close(void)
+{
+	if (j.fd < 0) {
+		return;
+	}
+	journal_commit(journal_last_lsn());
+
+	pthread_mutex_lock(&j.mutex);
+	j.stop = true;
+	pthread_cond_signal(&j.stop_cond);
+	pthread_mutex_unlock(&j.mutex);
+	if (j.mode == JOURNAL_SYNC_BATCH) {
+		pthread_join(j.flusher, NULL);
+	}
+
+	if (j.mode != JOURNAL_SYNC_NONE) {
+		fdatasync(j.fd);
+	}
+	close(j.fd);
+	j.fd = -1;
+	free(j.buffer);
+	free(j.spare);
+	j.buffer = j.spare = NULL;
+	j.used = j.capacity = j.spare_capacity = 0;
+}
+
+// Empties the journal once an image including all of it is safely on
+// disk. The caller must make sure no operation is running.
+int
+journal_reset(void)
+{
+	if (j.fd < 0) {
+		return 0;
+	}
+	journal_commit(journal_last_lsn());
+	if (ftruncate(j.fd, 0) != 0 || lseek(j.fd, 0, SEEK_SET) < 0 ||
+	    !write_header(j.fd)) {
+		perror("Error: cannot reset journal");
+		return -EIO;
+	}
+	if (j.mode != JOURNAL_SYNC_NONE) {
+		fdatasync(j.fd);
+	}
+	return journal_trim();
+}
+
+// Moves every record so far to <path>.old and starts an empty journal,
+// while a checkpoint including them is captured. The caller must make
+// sure no operation is running. If the previous rotation was not trimmed
+// yet, it keeps appending to the current journal instead.
+int
+journal_rotate(void)
+{
+	if (j.fd < 0) {
+		return 0;
+	}
+	journal_commit(journal_last_lsn());
+	if (access(j.old_path, F_OK) == 0) {
+		return 0;
+	}
+
+	if (rename(j.path, j.old_path) != 0) {
+		perror("Error: cannot rotate journal");
+		return -errno;
+	}
+	int fd = open(j.path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || !write_header(fd)) {
+		perror("Error: cannot rotate journal");
+		if (fd >= 0) {
+			close(fd);
+		}
+		rename(j.old_path, j.path);
+		return -EIO;
+	}
+
+	// Nobody is writing: every record was committed above and no
+	// operation can log a new one.
+	pthread_mutex_lock(&j.mutex);
+	int old_fd = j.fd;
+	j.fd = fd;
+	pthread_mutex_unlock(&j.mutex);
+	if (j.mode != JOURNAL_SYNC_NONE) {
+		fdatasync(old_fd);
+	}
+	close(old_fd);
+	return 0;
+}
+
+// Removes the journal moved away by journal_rotate, once a checkpoint
+// including all of it is safely on disk.
+int
+journal_trim(void)
+{
+	if (unlink(j.old_path) != 0 && errno != ENOENT) {
+		perror("Error: cannot trim journal");
+		return -errno;
+	}
+	return 0;
+}
+
+uint64_t
+journal_last_lsn(void)
+{
+	pthread_mutex_lock(&j.mutex);
+	uint64_t lsn = j.last_lsn;
+	pthread_mutex_unlock(&j.mutex);
+	return lsn;
+}
+
+// Writes the pending records and then `record` straight to the file,
+// for when the buffer cannot grow to hold it. The record is encoded in
+// place but for the data of a write, which is written from where it is.
+// Called with j.mutex held, so it goes after every earlier record and
+// before any later one. journal_commit still syncs it.
+static void
+write_now(const journal_record *record, uint32_t payload)
+{
+	static char head[MAX_RECORD_HEAD];
+
+	while (j.flushing) {
+		pthread_cond_wait(&j.flushed, &j.mutex);
+	}
+	bool ok = write_all(j.fd, j.buffer, j.used);
+	j.used = 0;
+
+	struct iovec single = { (void *) record->data, record->size };
+	const struct iovec *iov = record->data != NULL ? &single : record->iov;
+	size_t data_size = record->op == JOURNAL_WRITE ? record->size : 0;
+
+	char *end = encode_head(head, record, payload);
+	uint32_t sum = checksum(head + 4, end - head - 4);
+	size_t left = data_size;
+	for (const struct iovec *v = iov; left > 0; v++) {
+		size_t chunk = v->iov_len < left ? v->iov_len : left;
+		sum = checksum_more(sum, v->iov_base, chunk);
+		left -= chunk;
+	}
+	memcpy(head, &sum, 4);
+
+	ok = ok && write_all(j.fd, head, end - head);
+	left = data_size;
+	for (const struct iovec *v = iov; ok && left > 0; v++) {
+		size_t chunk = v->iov_len < left ? v->iov_len : left;
+		ok = write_all(j.fd, v->iov_base, chunk);
+		left -= chunk;
+	}
+	if (!ok) {
+		perror("Error: journal write failed");
+	}
+	j.written_lsn = j.last_lsn;
+}
+
+// Appends a record describing an operation that was just applied and
+// returns its lsn, to be passed to journal_commit. Must be called while
+// still holding the locks that ordered the operation. Returns 0 if the
+// journal is closed (for instance, while replaying). Without memory to
+// buffer the record, writes it right away (see write_now).
+uint64_t
+journal_log(const journal_record *record)
+{
+	if (j.fd < 0) {
+		return 0;
+	}
+
+	size_t payload = payload_size(record);
+	size_t size = RECORD_HEADER_SIZE + payload;
+
+	pthread_mutex_lock(&j.mutex);
+	if (j.used + size > j.capacity) {
+		size_t capacity = j.capacity > 0 ? j.capacity : 64 * 1024;
+		while (j.used + size > capacity) {
+			capacity *= 2;
+		}
+		char *buffer = realloc(j.buffer, capacity);
+		if (buffer != NULL) {
+			j.buffer = buffer;
+			j.capacity = capacity;
+		}
+	}
+
+	journal_record copy = *record;
+	copy.lsn = ++j.last_lsn;
+	if (j.used + size > j.capacity) {
+		write_now(&copy, payload);
+	} else {
+		encode(j.buffer + j.used, &copy, payload);
+		j.used += size;
+	}
+	pthread_mutex_unlock(&j.mutex);
+	return copy.lsn;
+}
+
+// Waits until the record `lsn`, and every one before it, is written (and
+// synced, depending on the mode). See group commit above.
+void
+journal_commit(uint64_t lsn)
+{
+	if (lsn == 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&j.mutex);
+	while (j.written_lsn < lsn ||
+	       (j.mode == JOURNAL_SYNC_ALWAYS && j.synced_lsn < lsn)) {
+		if (j.flushing) {
+			pthread_cond_wait(&j.flushed, &j.mutex);
+			continue;
+		}
+
+		// Become the leader: take every pending record.
+		j.flushing = true;
+		char *batch = j.buffer;
+		size_t batch_size = j.used;
+		size_t batch_capacity = j.capacity;
+		uint64_t batch_lsn = j.last_lsn;
+		j.buffer = j.spare;
+		j.capacity = j.spare_capacity;
+		j.used = 0;
+		pthread_mutex_unlock(&j.mutex);
+
+		bool ok = write_all(j.fd, batch, batch_size);
+		if (ok && j.mode == JOURNAL_SYNC_ALWAYS) {
+			ok = fdatasync(j.fd) == 0;
+		}
+		if (!ok) {
+			perror("Error: journal write failed");
+		}
+
+		pthread_mutex_lock(&j.mutex);
+		j.spare = batch;
+		j.spare_capacity = batch_capacity;
+		j.written_lsn = batch_lsn;
+		if (j.mode == JOURNAL_SYNC_ALWAYS) {
+			j.synced_lsn = batch_lsn;
+		}
+		j.flushing = false;
+		pthread_cond_broadcast(&j.flushed);
+	}
+	pthread_mutex_unlock(&j.mutex);
+}
@@ -0,0 +1,80 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+
+// When the journal reaches the disk, see journal.c.
+typedef enum journal_sync {
+	JOURNAL_SYNC_ALWAYS,
+	JOURNAL_SYNC_BATCH,
+	JOURNAL_SYNC_NONE,
+} journal_sync;
+
+typedef enum journal_op {
+	JOURNAL_MKDIR = 1,
+	JOURNAL_CREATE,
+	JOURNAL_WRITE,
+	JOURNAL_TRUNCATE,
+	JOURNAL_UNLINK,
+	JOURNAL_RMDIR,
+	JOURNAL_UTIMENS,
+	JOURNAL_RENAME,
+	JOURNAL_LINK,
+	JOURNAL_FALLOCATE,
+	JOURNAL_COPY,
+} journal_op;
+
+// A decoded record. Pointers refer to the replay buffer.
+typedef struct journal_record {
+	uint64_t lsn;
+	journal_op op;
+	uint64_t ino;      // Inode the record applies to, 0 if it has a path
+	const char *path;  // With ino, a name in that directory or empty
+	mode_t mode;       // mkdir, create, fallocate (its mode)
+	uint64_t new_ino;  // mkdir, create with ino: number of the new inode
+	                   // rename: directory it moves to
+	                   // link: inode linked
+	                   // copy: inode copied from
+	const char *name;  // rename: its name in the directory new_ino
+	off_t offset;      // write, truncate (new size), fallocate, copy
+	off_t src_offset;  // copy: offset in new_ino
+	const char *data;  // write
+	size_t size;       // write, fallocate (length), copy (length)
+	time_t atime;      // utimens
+	time_t mtime;      // utimens
+	// write with null data: the data, gathered from the first size bytes
+	const struct iovec *iov;
+} journal_record;
+
+typedef void (*journal_apply_fn)(const journal_record *record);
+
+int journal_parse_sync(const char *name, journal_sync *mode);
+
+uint64_t journal_replay(const char *path,
+                        uint64_t after_lsn,
+                        uint64_t image_id,
+                        journal_apply_fn apply);
+
+int journal_open(const char *path,
+                 journal_sync mode,
+                 uint64_t last_lsn,
+                 uint64_t image_id);
+
+void journal_close(void);
+
+int journal_reset(void);
+
+int journal_rotate(void);
+
+int journal_trim(void);
+
+uint64_t journal_last_lsn(void);
+
+uint64_t journal_log(const journal_record *record);
+
+void journal_commit(uint64_t lsn);
+
+#endif
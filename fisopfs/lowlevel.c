@@ -0,0 +1,565 @@
+#define FUSE_USE_VERSION 35
+
+#include "lowlevel.h"
+
+#include <errno.h>
+#include <fuse_lowlevel.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "defs.h"
+#include "operations.h"
+#include "stats.h"
+
+// Front end on the low-level FUSE API, chosen with --lowlevel. Requests
+// address inodes by number instead of by path, so nothing is resolved
+// twice and the path cache is not used: each callback turns into one
+// filesystem_ll_* call (see operations.c).
+//
+// Inode numbers are the ones the filesystem stores, the root being
+// ROOT_INO == FUSE_ROOT_ID. Every entry replied by lookup, mkdir,
+// create or readdirplus is a reference the kernel holds until it forgets
+// it, and an inode removed meanwhile stays in memory until then.
+//
+// Each callback counts itself for the stats file (see stats.c).
+
+// Seconds the kernel may cache attributes and entries. Every change goes
+// through the kernel, so it only matters for stat after a remount.
+#define LOWLEVEL_TIMEOUT 1.0
+
+static void
+reply_entry(fuse_req_t req, int ret, const struct stat *stbuf)
+{
+	if (ret != 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	struct fuse_entry_param entry = {
+		.ino = stbuf->st_ino,
+		.attr = *stbuf,
+		.attr_timeout = LOWLEVEL_TIMEOUT,
+		.entry_timeout = LOWLEVEL_TIMEOUT,
+	};
+	fuse_reply_entry(req, &entry);
+}
+
+static void
+ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+	// ll_read replies with the blocks, that may be spliced.
+	conn->want |= conn->capable & FUSE_CAP_SPLICE_WRITE;
+	uint64_t start = stats_now();
+	filesystem_init(conn);
+	stats_record(STATS_INIT, start, 0);
+}
+
+static void
+ll_destroy(void *userdata)
+{
+	uint64_t start = stats_now();
+	filesystem_destroy(userdata);
+	stats_record(STATS_DESTROY, start, 0);
+}
+
+static void
+ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	uint64_t start = stats_now();
+	struct stat stbuf;
+	int ret = filesystem_ll_lookup(parent, name, &stbuf);
+	stats_record(STATS_LOOKUP, start, ret);
+	reply_entry(req, ret, &stbuf);
+}
+
+static void
+ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+	uint64_t start = stats_now();
+	filesystem_ll_forget(ino, nlookup);
+	stats_record(STATS_FORGET, start, 0);
+	fuse_reply_none(req);
+}
+
+static void
+ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+	uint64_t start = stats_now();
+	for (size_t i = 0; i < count; i++) {
+		filesystem_ll_forget(forgets[i].ino, forgets[i].nlookup);
+	}
+	stats_record(STATS_FORGET, start, 0);
+	fuse_reply_none(req);
+}
+
+static void
+ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	uint64_t start = stats_now();
+	struct stat stbuf;
+	int ret = filesystem_ll_getattr(ino, &stbuf);
+	stats_record(STATS_GETATTR, start, ret);
+	if (ret != 0) {
+		fuse_reply_err(req, -ret);
+	} else {
+		fuse_reply_attr(req, &stbuf, LOWLEVEL_TIMEOUT);
+	}
+}
+
+// Only the size and the times can be changed, like with truncate and
+// utimens in the high-level front end.
+static void
+ll_setattr(fuse_req_t req,
+           fuse_ino_t ino,
+           struct stat *attr,
+           int to_set,
+           struct fuse_file_info *fi)
+{
+	const int times = FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME |
+	                  FUSE_SET_ATTR_ATIME_NOW | FUSE_SET_ATTR_MTIME_NOW;
+	if (to_set & ~(FUSE_SET_ATTR_SIZE | times)) {
+		fuse_reply_err(req, ENOSYS);
+		return;
+	}
+
+	uint64_t start = stats_now();
+	struct stat stbuf;
+	int ret = 0;
+	if (to_set & FUSE_SET_ATTR_SIZE) {
+		ret = filesystem_ll_truncate(ino, attr->st_size, fi);
+	}
+	if (ret == 0 && (to_set & times)) {
+		ret = filesystem_ll_getattr(ino, &stbuf);
+	}
+	if (ret == 0 && (to_set & times)) {
+		struct timespec tv[2] = { { .tv_sec = stbuf.st_atime },
+			                  { .tv_sec = stbuf.st_mtime } };
+		if (to_set & FUSE_SET_ATTR_ATIME_NOW) {
+			tv[0].tv_sec = time(NULL);
+		} else if (to_set & FUSE_SET_ATTR_ATIME) {
+			tv[0] = attr->st_atim;
+		}
+		if (to_set & FUSE_SET_ATTR_MTIME_NOW) {
+			tv[1].tv_sec = time(NULL);
+		} else if (to_set & FUSE_SET_ATTR_MTIME) {
+			tv[1] = attr->st_mtim;
+		}
+		ret = filesystem_ll_utimens(ino, tv);
+	}
+	if (ret == 0) {
+		ret = filesystem_ll_getattr(ino, &stbuf);
+	}
+	stats_record(STATS_SETATTR, start, ret);
+
+	if (ret != 0) {
+		fuse_reply_err(req, -ret);
+	} else {
+		fuse_reply_attr(req, &stbuf, LOWLEVEL_TIMEOUT);
+	}
+}
+
+static void
+ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+	uint64_t start = stats_now();
+	struct stat stbuf;
+	int ret = filesystem_ll_mkdir(parent, name, mode, &stbuf);
+	stats_record(STATS_MKDIR, start, ret);
+	reply_entry(req, ret, &stbuf);
+}
+
+static void
+ll_create(fuse_req_t req,
+          fuse_ino_t parent,
+          const char *name,
+          mode_t mode,
+          struct fuse_file_info *fi)
+{
+	uint64_t start = stats_now();
+	struct stat stbuf;
+	int ret = filesystem_ll_create(parent, name, mode, &stbuf, fi);
+	stats_record(STATS_CREATE, start, ret);
+	if (ret != 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	struct fuse_entry_param entry = {
+		.ino = stbuf.st_ino,
+		.attr = stbuf,
+		.attr_timeout = LOWLEVEL_TIMEOUT,
+		.entry_timeout = LOWLEVEL_TIMEOUT,
+	};
+	fuse_reply_create(req, &entry, fi);
+}
+
+static void
+ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	uint64_t start = stats_now();
+	int ret = filesystem_ll_unlink(parent, name);
+	stats_record(STATS_UNLINK, start, ret);
+	fuse_reply_err(req, -ret);
+}
+
+static void
+ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	uint64_t start = stats_now();
+	int ret = filesystem_ll_rmdir(parent, name);
+	stats_record(STATS_RMDIR, start, ret);
+	fuse_reply_err(req, -ret);
+}
+
+// RENAME_NOREPLACE and RENAME_EXCHANGE are not supported.
+static void
+ll_rename(fuse_req_t req,
+          fuse_ino_t parent,
+          const char *name,
+          fuse_ino_t new_parent,
+          const char *new_name,
+          unsigned int flags)
+{
+	uint64_t start = stats_now();
+	int ret = flags != 0 ? -EINVAL
+	                     : filesystem_ll_rename(
+	                               parent, name, new_parent, new_name);
+	stats_record(STATS_RENAME, start, ret);
+	fuse_reply_err(req, -ret);
+}
+
+static void
+ll_link(fuse_req_t req,
+        fuse_ino_t ino,
+        fuse_ino_t new_parent,
+        const char *new_name)
+{
+	uint64_t start = stats_now();
+	struct stat stbuf;
+	int ret = filesystem_ll_link(ino, new_parent, new_name, &stbuf);
+	stats_record(STATS_LINK, start, ret);
+	reply_entry(req, ret, &stbuf);
+}
+
+static void
+ll_fallocate(fuse_req_t req,
+             fuse_ino_t ino,
+             int mode,
+             off_t offset,
+             off_t length,
+             struct fuse_file_info *fi)
+{
+	uint64_t start = stats_now();
+	int ret = filesystem_ll_fallocate(ino, mode, offset, length, fi);
+	stats_record(STATS_FALLOCATE, start, ret);
+	fuse_reply_err(req, -ret);
+}
+
+static void
+ll_lseek(fuse_req_t req,
+         fuse_ino_t ino,
+         off_t off,
+         int whence,
+         struct fuse_file_info *fi)
+{
+	uint64_t start = stats_now();
+	off_t ret = filesystem_ll_lseek(ino, off, whence, fi);
+	stats_record(STATS_LSEEK, start, ret < 0 ? (int) ret : 0);
+	if (ret < 0) {
+		fuse_reply_err(req, (int) -ret);
+	} else {
+		fuse_reply_lseek(req, ret);
+	}
+}
+
+static void
+ll_copy_file_range(fuse_req_t req,
+                   fuse_ino_t ino_in,
+                   off_t off_in,
+                   struct fuse_file_info *fi_in,
+                   fuse_ino_t ino_out,
+                   off_t off_out,
+                   struct fuse_file_info *fi_out,
+                   size_t len,
+                   int flags)
+{
+	uint64_t start = stats_now();
+	ssize_t ret = filesystem_ll_copy_file_range(
+	        ino_in, off_in, fi_in, ino_out, off_out, fi_out, len, flags);
+	stats_record(STATS_COPY_FILE_RANGE, start, ret < 0 ? (int) ret : 0);
+	if (ret < 0) {
+		fuse_reply_err(req, (int) -ret);
+	} else {
+		fuse_reply_write(req, ret);
+	}
+}
+
+static void
+ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	uint64_t start = stats_now();
+	int ret = filesystem_ll_open(ino, fi);
+	stats_record(STATS_OPEN, start, ret);
+	if (ret != 0) {
+		fuse_reply_err(req, -ret);
+	} else {
+		fuse_reply_open(req, fi);
+	}
+}
+
+static void
+ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	stats_record(STATS_FLUSH, stats_now(), 0);
+	fuse_reply_err(req, 0);
+}
+
+static void
+ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	uint64_t start = stats_now();
+	filesystem_ll_release(fi);
+	stats_record(STATS_RELEASE, start, 0);
+	fuse_reply_err(req, 0);
+}
+
+// Replies a read with the blocks themselves (see send_inode): libfuse
+// writes them to /dev/fuse, or splices them if the kernel allows it. Not
+// FUSE_BUF_SPLICE_MOVE, the kernel must not keep their pages.
+static void
+reply_data(void *req, struct fuse_bufvec *data)
+{
+	stats_bytes(false, fuse_buf_size(data));
+	fuse_reply_data(req, data, 0);
+}
+
+static void
+ll_read(fuse_req_t req,
+        fuse_ino_t ino,
+        size_t size,
+        off_t off,
+        struct fuse_file_info *fi)
+{
+	uint64_t start = stats_now();
+	int ret = filesystem_ll_read_buf(ino, size, off, fi, reply_data, req);
+	stats_record(STATS_READ, start, ret);
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
+	}
+}
+
+static void
+ll_write_buf(fuse_req_t req,
+             fuse_ino_t ino,
+             struct fuse_bufvec *bufv,
+             off_t off,
+             struct fuse_file_info *fi)
+{
+	uint64_t start = stats_now();
+	int ret = filesystem_ll_write_buf(ino, bufv, off, fi);
+	stats_record(STATS_WRITE, start, ret);
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
+	} else {
+		stats_bytes(true, ret);
+		fuse_reply_write(req, ret);
+	}
+}
+
+// Reply buffer of readdir, filled through fill_dir.
+typedef struct dir_buffer {
+	fuse_req_t req;
+	char *data;
+	size_t size;
+	size_t used;
+} dir_buffer;
+
+static int
+fill_dir(void *buf,
+         const char *name,
+         const struct stat *stbuf,
+         off_t next,
+         enum fuse_fill_dir_flags flags)
+{
+	dir_buffer *b = buf;
+	size_t left = b->size - b->used;
+	size_t len = fuse_add_direntry(
+	        b->req, b->data + b->used, left, name, stbuf, next);
+	if (len > left) {
+		return 1;
+	}
+	b->used += len;
+	return 0;
+}
+
+// fill_dir for readdirplus. An entry filled without FUSE_FILL_DIR_PLUS,
+// a stub or a view, goes with number 0, which the kernel takes as just a
+// name, neither looked up nor forgotten.
+static int
+fill_dir_plus(void *buf,
+              const char *name,
+              const struct stat *stbuf,
+              off_t next,
+              enum fuse_fill_dir_flags flags)
+{
+	dir_buffer *b = buf;
+	struct fuse_entry_param entry = { .attr = *stbuf };
+	if (flags & FUSE_FILL_DIR_PLUS) {
+		entry.ino = stbuf->st_ino;
+		entry.attr_timeout = LOWLEVEL_TIMEOUT;
+		entry.entry_timeout = LOWLEVEL_TIMEOUT;
+	}
+	size_t left = b->size - b->used;
+	size_t len = fuse_add_direntry_plus(
+	        b->req, b->data + b->used, left, name, &entry, next);
+	if (len > left) {
+		return 1;
+	}
+	b->used += len;
+	return 0;
+}
+
+// readdir and readdirplus.
+static void
+reply_dir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, bool plus)
+{
+	dir_buffer b = { .req = req, .data = malloc(size), .size = size };
+	if (b.data == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	uint64_t start = stats_now();
+	int ret = plus ? filesystem_ll_readdirplus(ino, &b, fill_dir_plus, off)
+	               : filesystem_ll_readdir(ino, &b, fill_dir, off);
+	stats_record(STATS_READDIR, start, ret);
+	if (ret != 0) {
+		fuse_reply_err(req, -ret);
+	} else {
+		fuse_reply_buf(req, b.data, b.used);
+	}
+	free(b.data);
+}
+
+static void
+ll_readdir(fuse_req_t req,
+           fuse_ino_t ino,
+           size_t size,
+           off_t off,
+           struct fuse_file_info *fi)
+{
+	reply_dir(req, ino, size, off, false);
+}
+
+static void
+ll_readdirplus(fuse_req_t req,
+               fuse_ino_t ino,
+               size_t size,
+               off_t off,
+               struct fuse_file_info *fi)
+{
+	reply_dir(req, ino, size, off, true);
+}
+
+static void
+ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	uint64_t start = stats_now();
+	struct statvfs stbuf;
+	int ret = filesystem_ll_statfs(ino, &stbuf);
+	stats_record(STATS_STATFS, start, ret);
+	if (ret != 0) {
+		fuse_reply_err(req, -ret);
+	} else {
+		fuse_reply_statfs(req, &stbuf);
+	}
+}
+
+static struct fuse_lowlevel_ops lowlevel_operations = {
+	.init = ll_init,
+	.destroy = ll_destroy,
+	.lookup = ll_lookup,
+	.forget = ll_forget,
+	.forget_multi = ll_forget_multi,
+	.getattr = ll_getattr,
+	.setattr = ll_setattr,
+	.mkdir = ll_mkdir,
+	.create = ll_create,
+	.unlink = ll_unlink,
+	.rmdir = ll_rmdir,
+	.rename = ll_rename,
+	.link = ll_link,
+	.open = ll_open,
+	.flush = ll_flush,
+	.release = ll_release,
+	.read = ll_read,
+	.write_buf = ll_write_buf,
+	.readdir = ll_readdir,
+	.readdirplus = ll_readdirplus,
+	.fallocate = ll_fallocate,
+	.lseek = ll_lseek,
+	.copy_file_range = ll_copy_file_range,
+	.statfs = ll_statfs,
+};
+
+// Mounts the filesystem on the mountpoint of `opts` and serves it until
+// it is unmounted. Returns the result of the session loop, -1 if it did
+// not start.
+static int
+serve(struct fuse_args *args, const struct fuse_cmdline_opts *opts)
+{
+	struct fuse_loop_config config = {
+		.clone_fd = opts->clone_fd,
+		.max_idle_threads = opts->max_idle_threads,
+	};
+	int ret = -1;
+	struct fuse_session *session = fuse_session_new(
+	        args, &lowlevel_operations, sizeof(lowlevel_operations), NULL);
+	if (session == NULL) {
+		return -1;
+	}
+	if (fuse_set_signal_handlers(session) == 0) {
+		if (fuse_session_mount(session, opts->mountpoint) == 0) {
+			fuse_daemonize(opts->foreground);
+			if (opts->singlethread) {
+				ret = fuse_session_loop(session);
+			} else {
+				ret = fuse_session_loop_mt(session, &config);
+			}
+			fuse_session_unmount(session);
+		}
+		fuse_remove_signal_handlers(session);
+	}
+	fuse_session_destroy(session);
+	return ret;
+}
+
+// Mounts and serves the filesystem like fuse_main, with the low-level
+// operations.
+int
+lowlevel_main(int argc, char *argv[])
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_cmdline_opts opts;
+	int ret = -1;
+
+	if (fuse_parse_cmdline(&args, &opts) != 0) {
+		return EXIT_FAILURE;
+	}
+	if (opts.show_help) {
+		printf("usage: %s [options] <mountpoint>\n\n", argv[0]);
+		fuse_cmdline_help();
+		fuse_lowlevel_help();
+		ret = 0;
+	} else if (opts.show_version) {
+		fuse_lowlevel_version();
+		ret = 0;
+	} else if (opts.mountpoint == NULL) {
+		fprintf(stderr, "Error: no mountpoint given\n");
+	} else {
+		ret = serve(&args, &opts);
+	}
+	free(opts.mountpoint);
+	fuse_opt_free_args(&args);
+
+	return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,6 @@
+#ifndef LOWLEVEL_H
+#define LOWLEVEL_H
+
+int lowlevel_main(int argc, char *argv[]);
+
+#endif
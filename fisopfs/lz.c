@@ -0,0 +1,209 @@
+#include "lz.h"
+
+#include <stdint.h>
+#include <string.h>
+
+// A small LZ77 codec in the spirit of LZ4, used for blocks in memory and
+// in the image. The output is a list of sequences:
+//
+//   sequence = token | literal length* | literals | offset (u16 LE) |
+//              match length*
+//
+// The high nibble of the token is the number of literals and the low one
+// the match length minus LZ_MIN_MATCH. A nibble of 15 continues in the
+// bytes after it, added up until one is below 255. The match copies
+// `length` bytes from `offset` bytes back, which may overlap what it
+// writes. The last sequence ends after its literals, with no match.
+//
+// Matches are found through a table of the last position of each hash of
+// 4 bytes, so compressing is a single pass and decompressing only copies.
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_NIBBLE_MAX 15
+
+static uint32_t
+read32(const char *p)
+{
+	uint32_t value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static unsigned
+hash4(uint32_t value)
+{
+	return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Writes what is left of `length` after its nibble, null if it does not
+// fit before `end`.
+static char *
+put_length(char *out, const char *end, size_t length)
+{
+	if (length < LZ_NIBBLE_MAX) {
+		return out;
+	}
+	for (length -= LZ_NIBBLE_MAX;; length -= 255) {
+		if (out == end) {
+			return NULL;
+		}
+		if (length < 255) {
+			*out++ = (char) length;
+			return out;
+		}
+		*out++ = (char) 255;
+	}
+}
+
+static unsigned
+nibble(size_t length)
+{
+	return length < LZ_NIBBLE_MAX ? length : LZ_NIBBLE_MAX;
+}
+
+// Writes a sequence, the last one if `offset` is 0. Null if it does not
+// fit before `end`.
+static char *
+put_sequence(char *out,
+             const char *end,
+             const char *literals,
+             size_t nliterals,
+             size_t offset,
+             size_t length)
+{
+	size_t extra = offset != 0 ? length - LZ_MIN_MATCH : 0;
+	if (out == end) {
+		return NULL;
+	}
+	*out++ = (char) (nibble(nliterals) << 4 | nibble(extra));
+	out = put_length(out, end, nliterals);
+	if (out == NULL || (size_t) (end - out) < nliterals) {
+		return NULL;
+	}
+	memcpy(out, literals, nliterals);
+	out += nliterals;
+	if (offset == 0) {
+		return out;
+	}
+
+	if (end - out < 2) {
+		return NULL;
+	}
+	*out++ = (char) (offset & 0xff);
+	*out++ = (char) (offset >> 8);
+	return put_length(out, end, extra);
+}
+
+// Compresses the `size` bytes of `src` (at most LZ_MAX_INPUT) into `dst`.
+// Returns the compressed size, or 0 if it would take over `capacity`
+// bytes: passing a capacity below `size` only accepts a gain.
+size_t
+lz_compress(const char *src, size_t size, char *dst, size_t capacity)
+{
+	uint16_t table[1 << LZ_HASH_BITS];  // Position + 1, 0 if none
+	memset(table, 0, sizeof(table));
+
+	const char *end = dst + capacity;
+	char *out = dst;
+	size_t anchor = 0;  // First byte not written yet
+	size_t pos = 0;
+	while (out != NULL && pos + LZ_MIN_MATCH <= size) {
+		uint32_t sequence = read32(src + pos);
+		unsigned hash = hash4(sequence);
+		size_t candidate = table[hash];
+		table[hash] = pos + 1;
+		if (candidate == 0 || read32(src + candidate - 1) != sequence) {
+			pos++;
+			continue;
+		}
+
+		size_t match = candidate - 1;
+		size_t length = LZ_MIN_MATCH;
+		while (pos + length < size &&
+		       src[match + length] == src[pos + length]) {
+			length++;
+		}
+		out = put_sequence(out,
+		                   end,
+		                   src + anchor,
+		                   pos - anchor,
+		                   pos - match,
+		                   length);
+		pos += length;
+		anchor = pos;
+	}
+	if (out != NULL) {
+		out = put_sequence(out, end, src + anchor, size - anchor, 0, 0);
+	}
+	return out != NULL ? (size_t) (out - dst) : 0;
+}
+
+// Adds to `length` the bytes that continue a nibble of 15.
+static bool
+take_length(const unsigned char **in, const unsigned char *end, size_t *length)
+{
+	if (*length < LZ_NIBBLE_MAX) {
+		return true;
+	}
+	for (;;) {
+		if (*in == end) {
+			return false;
+		}
+		unsigned byte = *(*in)++;
+		*length += byte;
+		if (byte < 255) {
+			return true;
+		}
+	}
+}
+
+// Decompresses the `size` bytes of `src` into exactly `length` bytes of
+// `dst`. Returns false if they are not the output of lz_compress for
+// that length.
+bool
+lz_decompress(const char *src, size_t size, char *dst, size_t length)
+{
+	const unsigned char *in = (const unsigned char *) src;
+	const unsigned char *end = in + size;
+	size_t pos = 0;
+	while (in < end) {
+		unsigned token = *in++;
+		size_t nliterals = token >> 4;
+		if (!take_length(&in, end, &nliterals) ||
+		    (size_t) (end - in) < nliterals ||
+		    length - pos < nliterals) {
+			return false;
+		}
+		memcpy(dst + pos, in, nliterals);
+		in += nliterals;
+		pos += nliterals;
+		if (in == end) {
+			break;
+		}
+
+		if (end - in < 2) {
+			return false;
+		}
+		size_t offset = in[0] | (size_t) in[1] << 8;
+		size_t match = token & LZ_NIBBLE_MAX;
+		in += 2;
+		if (!take_length(&in, end, &match)) {
+			return false;
+		}
+		match += LZ_MIN_MATCH;
+		if (offset == 0 || offset > pos || length - pos < match) {
+			return false;
+		}
+		if (offset >= match) {
+			memcpy(dst + pos, dst + pos - offset, match);
+			pos += match;
+		} else {
+			// Overlaps what it writes, a run.
+			for (size_t i = 0; i < match; i++, pos++) {
+				dst[pos] = dst[pos - offset];
+			}
+		}
+	}
+	return pos == length;
+}
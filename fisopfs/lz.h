@@ -0,0 +1,14 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Largest input lz_compress takes, offsets are 16 bits.
+#define LZ_MAX_INPUT 65535
+
+size_t lz_compress(const char *src, size_t size, char *dst, size_t capacity);
+
+bool lz_decompress(const char *src, size_t size, char *dst, size_t length);
+
+#endif
@@ -1,3 +1,5 @@
+#define FUSE_USE_VERSION 35
+
 #include "operations.h"
 
 #include <stdbool.h>
@@ -5,14 +7,100 @@
 #include <string.h>
 #include <linux/limits.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <unistd.h>
 
 #include "errors.h"
 #include "defs.h"
 #include "persistence.h"
-
-extern filesystem fs;
-extern char *filedisk;
+#include "blocks.h"
+#include "directory.h"
+#include "path_cache.h"
+#include "journal.h"
+#include "checkpoint.h"
+#include "inode_table.h"
+#include "slab.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "usage.h"
+#include "workers.h"
+
+// Settings, changed by main before mounting.
+char *filedisk = DEFAULT_FILE_DISK;
+journal_sync journal_mode = JOURNAL_SYNC_BATCH;
+unsigned checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL;
+bool dedup = false;
+bool compression = false;
+uint64_t max_size = 0;
+uint64_t max_inodes = 0;
+unsigned worker_threads = 0;
+
+filesystem fs;
+
+// Locking
+//
+// FUSE runs the callbacks below on several threads. Two kinds of locks
+// protect the tree, always taken in this order:
+//
+// 1. fs.lock, the namespace lock. Every callback holds it for reading,
+//    except the ones that free inodes or change their links (rmdir,
+//    unlink, rename, link, the last forget), which hold it for writing,
+//    and copy_file_range, which changes a file while reading another,
+//    and taking a snapshot. So an inode reached while holding it for
+//    reading stays alive until it is released.
+// 2. inode->lock, one per inode. For a directory it protects its
+//    entries: lookups hold it for reading, adding an entry holds it for
+//    writing. For a file it protects its contents and attributes.
+//    At most a parent and one of its children are held at once, always
+//    parent first.
+//
+// atime is the only field written under a read lock (by read), so it is
+// accessed atomically.
+//
+// Everything that changes an inode calls snapshot_preserve first, with
+// the same locks, so the snapshots taken before keep it as it was (see
+// snapshot.c).
+//
+// Inode numbers
+//
+// Every inode in memory is in the inode table (see inode_table.c), so
+// the low-level front end can address them by number. Journal records
+// do too: they name the inode they change, or the directory and name for
+// mkdir, create, rmdir and unlink, and replay finds it the same way,
+// making stubs out of the image for inodes no lookup has reached yet.
+//
+// Journaling
+//
+// Mutating callbacks log themselves with journal_log while still holding
+// the locks above, so records are ordered like the changes, and wait for
+// the record with journal_commit once every lock is released.
+//
+// Checkpoints
+//
+// They also mark the inodes they change as dirty, see checkpoint.c.
+// save_checkpoint only holds fs.lock for writing while it captures the
+// changes, and rotates the journal then, so the journal records up to
+// the checkpoint can be dropped once it is written.
+//
+// Lazy loading
+//
+// Inodes of a mounted image start as stubs and the blocks of a file stay
+// in the image until they are used (see persistence.c). Lookups load
+// every inode they reach and lock_file loads the contents, each under
+// the lock of the inode for writing. stub and file->pending are checked
+// atomically first, so loaded inodes pay no extra locking.
+//
+// Packing
+//
+// With --compress, after every periodic checkpoint cool_files packs the
+// blocks of the files nobody used for checkpoint_interval seconds (see
+// blocks.c), and those of the least recently used ones while the rest
+// add up to more than HOT_BLOCKS_MAX. lock_contents unpacks a file before
+// using it, the same way it loads pending blocks, so the files used
+// lately are the hot cache.
+#define HOT_BLOCKS_MAX 16384  // 64 MiB
 
 // Functions and wrappers for the filesystem operations
 
@@ -24,25 +112,74 @@ inode_to_stat(const inode *inode, struct stat *stbuf)
 	stbuf->st_mode = inode->mode;
 	stbuf->st_uid = inode->uid;
 	stbuf->st_gid = inode->gid;
-	stbuf->st_atime = inode->atime;
+	stbuf->st_atime = __atomic_load_n(&inode->atime, __ATOMIC_RELAXED);
 	stbuf->st_mtime = inode->mtime;
 	stbuf->st_ctime = inode->ctime;
 	stbuf->st_nlink = inode->nlink;
 	stbuf->st_size = inode->size;
+	stbuf->st_ino = inode->ino;
+	// Holes take no blocks, see fallocate_inode.
+	stbuf->st_blksize = BLOCK_SIZE;
+	if (inode->file != NULL) {
+		stbuf->st_blocks = inode->file->used * (BLOCK_SIZE / 512);
+	}
 }
 
-// Search for an inode by path
-int
-search_inode(const char *path, inode **result)
+// Loads `node` from the image if it is still a stub.
+static int
+ensure_loaded(inode *node)
+{
+	if (!__atomic_load_n(&node->stub, __ATOMIC_ACQUIRE)) {
+		return EXIT_SUCCESS;
+	}
+
+	int ret = EXIT_SUCCESS;
+	pthread_rwlock_wrlock(&node->lock);
+	if (__atomic_load_n(&node->stub, __ATOMIC_RELAXED)) {
+		ret = image_load_inode(node);
+		if (ret == EXIT_SUCCESS) {
+			__atomic_store_n(&node->stub, false, __ATOMIC_RELEASE);
+		}
+	}
+	pthread_rwlock_unlock(&node->lock);
+	return ret != EXIT_SUCCESS ? -EIO : EXIT_SUCCESS;
+}
+
+// Loads the blocks of the file `node` still in the image and unpacks the
+// packed ones, if any.
+static int
+ensure_contents(inode *node)
+{
+	inode_file *file = node->file;
+	if (__atomic_load_n(&file->pending, __ATOMIC_ACQUIRE) == 0 &&
+	    __atomic_load_n(&file->packed, __ATOMIC_ACQUIRE) == 0) {
+		return EXIT_SUCCESS;
+	}
+
+	int ret = EXIT_SUCCESS;
+	pthread_rwlock_wrlock(&node->lock);
+	if (file->pending != 0) {
+		ret = image_load_blocks(node);
+	}
+	if (ret == EXIT_SUCCESS && file->packed != 0) {
+		ret = file_unpack(file);
+	}
+	pthread_rwlock_unlock(&node->lock);
+	return ret != EXIT_SUCCESS ? -EIO : EXIT_SUCCESS;
+}
+
+// Resolves `path` component by component, counting them in `depth`,
+// and caches the result. The caller must hold fs.lock.
+static int
+walk_path(const char *path, inode **result, unsigned *depth)
 {
+	int ret;
 	char path_copy[PATH_MAX];
 	strncpy(path_copy, path, sizeof(path_copy));
 	path_copy[PATH_MAX - 1] = '\0';
 
 	char *read_path = path_copy;
 	read_path++;  // Skip the leading '/'
-	char *ptr;
-
 
 	inode *current = fs.root;
 
@@ -52,52 +189,99 @@ search_inode(const char *path, inode **result)
 		return EXIT_SUCCESS;
 	}
 
-	while ((ptr = strchr(read_path, '/')) != NULL) {
-		*ptr = '\0';
-
-		bool found = false;
-		if (current->dir == NULL) {
-			return -ENOTDIR;
+	while (read_path != NULL) {
+		char *ptr = strchr(read_path, '/');
+		if (ptr != NULL) {
+			*ptr = '\0';
+		} else if (strlen(read_path) == 0) {
+			// Trailing '/'
+			break;
 		}
 
-		for (int i = 0; i < current->dir->size; i++) {
-			if (strcmp(read_path,
-			           current->dir->entries[i]->filename) == 0) {
-				found = true;
-				current = current->dir->entries[i]->inode;
-				break;
-			}
-		}
-		if (!found) {
-			return -ENOENT;
+		ret = ensure_loaded(current);
+		if (ret != EXIT_SUCCESS) {
+			return ret;
 		}
-		read_path = ptr + 1;
-	}
-	// After processing all parts of the path, check if we are at a file or a directory
-	if (strlen(read_path) != 0) {
-		bool found = false;
 		if (current->dir == NULL) {
 			return -ENOTDIR;
 		}
 
-		for (int i = 0; i < current->dir->size; i++) {
-			if (strcmp(read_path,
-			           current->dir->entries[i]->filename) == 0) {
-				found = true;
-				current = current->dir->entries[i]->inode;
-				break;
-			}
-		}
-		if (!found) {
+		(*depth)++;
+		pthread_rwlock_rdlock(&current->lock);
+		dentry *entry = dir_lookup(current->dir, read_path);
+		if (entry == NULL) {
+			// Cached before unlocking, so a concurrent create in
+			// this directory invalidates it after it is stored.
+			path_cache_put(path, NULL, -ENOENT);
+			pthread_rwlock_unlock(&current->lock);
 			return -ENOENT;
 		}
+		pthread_rwlock_unlock(&current->lock);
+
+		current = entry->inode;
+		read_path = ptr != NULL ? ptr + 1 : NULL;
+	}
+
+	ret = ensure_loaded(current);
+	if (ret != EXIT_SUCCESS) {
+		return ret;
 	}
 
+	// Positive entries can only go stale by removing the path, which
+	// needs fs.lock for writing.
+	path_cache_put(path, current, 0);
 	*result = current;
 
 	return EXIT_SUCCESS;
 }
 
+// Whether `path` is SNAPSHOTS_PATH or below it, which have no inode of
+// the tree (see the snapshots below).
+static bool
+in_snapshots(const char *path)
+{
+	size_t len = strlen(SNAPSHOTS_PATH);
+	return strncmp(path, SNAPSHOTS_PATH, len) == 0 &&
+	       (path[len] == '\0' || path[len] == '/');
+}
+
+// Whether `name` in `parent` is SNAPSHOTS_NAME in the root, which no
+// entry can take.
+static bool
+is_reserved(const inode *parent, const char *name)
+{
+	return parent->ino == ROOT_INO && strcmp(name, SNAPSHOTS_NAME) == 0;
+}
+
+// Whether the low-level front end numbers a file of a snapshot `ino`.
+static bool
+is_view(uint64_t ino)
+{
+	return ino >= SNAPSHOT_BASE && ino != STATS_INO;
+}
+
+// Search for an inode by path, going through the path cache first.
+// The caller must hold fs.lock.
+int
+search_inode(const char *path, inode **result)
+{
+	if (in_snapshots(path)) {
+		fprintf(stderr, READ_ONLY_SNAPSHOT, path);
+		return -EROFS;
+	}
+
+	int ret;
+	if (path_cache_get(path, result, &ret)) {
+		stats_path_hit();
+		return ret;
+	}
+
+	unsigned depth = 0;
+	ret = walk_path(path, result, &depth);
+	stats_walk(depth);
+	return ret;
+}
+
 int
 split_parent_child(const char *path, char *parent, char *child)
 {
@@ -121,483 +305,2958 @@ split_parent_child(const char *path, char *parent, char *child)
 	return EXIT_SUCCESS;
 }
 
-
-// Filesystem functions
-
-
-// Initialize the filesystem
-void *
-filesystem_init(struct fuse_conn_info *conn)
+// Looks up the parent directory of `path` and copies the last component
+// of `path` to `child`.
+static int
+find_parent(const char *path, inode **parent, char *child)
 {
-	printf("Initializing filesystem...\n");
+	char parent_path[PATH_MAX];
 
-	// Initialize the filesystem structure from file.
-	FILE *input = fopen(filedisk, "rb");
-	if (input) {
-		printf("Loading filesystem from disk: %s\n", filedisk);
-		fs.root = deserialize_inode(input);
-		fclose(input);
-		printf("Filesystem loaded from disk: %s\n", filedisk);
-		return &fs;
+	if (split_parent_child(path, parent_path, child) != EXIT_SUCCESS) {
+		return -ENOENT;
 	}
 
-	printf("No persistence file found, initializing new FS.\n");
-
-	// Fallback, initialize the filesystem structure from scratch.
-	fs.root = malloc(sizeof(inode));
-	fs.root->mode = __S_IFDIR |
-	                0755;  // Set mode to directory with rwxr-xr-x permissions
-	fs.root->nlink = 2;  // Root directory has 2 links (itself and its parent)
-	fs.root->uid = getuid();
-	fs.root->gid = getgid();
-	fs.root->atime = time(NULL);
-	fs.root->mtime = time(NULL);
-	fs.root->ctime = time(NULL);
-	fs.root->size = 0;
-
-	fs.root->file = NULL;
-	fs.root->dir = malloc(sizeof(inode_dir));
-	fs.root->dir->entries[0] = NULL;
-	fs.root->dir->size = 0;
-
-	printf("Filesystem initialized successfully.\n");
-	return &fs;
-}
-
-int
-filesystem_getattr(const char *path, struct stat *stbuf)
-{
-	inode *inode = NULL;
-	int ret = search_inode(path, &inode);
-	if (ret != EXIT_SUCCESS) {
-		fprintf(stderr, INODE_NOT_FOUND, path);
+	int ret = search_inode(parent_path, parent);
+	if (ret == -EROFS) {
+		return ret;
+	} else if (ret != EXIT_SUCCESS) {
+		fprintf(stderr, PARENT_DIRECTORY_NOT_FOUND);
 		return -ENOENT;
 	}
-
-	memset(stbuf, 0, sizeof(struct stat));
-
-	stbuf->st_mode = inode->mode;
-	stbuf->st_uid = inode->uid;
-	stbuf->st_gid = inode->gid;
-	stbuf->st_atime = inode->atime;
-	stbuf->st_mtime = inode->mtime;
-	stbuf->st_ctime = inode->ctime;
-	stbuf->st_nlink = inode->nlink;
-	stbuf->st_size = inode->size;
-
 	return EXIT_SUCCESS;
 }
 
-int
-filesystem_mkdir(const char *path, mode_t mode)
+// Looks up the inode numbered `ino`, loading it if it is a stub. The
+// caller must hold fs.lock.
+static int
+find_inode(uint64_t ino, inode **result)
 {
-	char new_directory[MAX_FILENAME];
-	char path_copy[PATH_MAX];
-
-	if (split_parent_child(path, path_copy, new_directory) != EXIT_SUCCESS) {
-		return -ENOENT;
+	if (is_view(ino)) {
+		// Only the snapshot functions below reach them.
+		return -EROFS;
 	}
-
-	inode *dir = NULL;
-	int ret = search_inode(path_copy, &dir);
-
-	if (ret != EXIT_SUCCESS) {
-		fprintf(stderr, PARENT_DIRECTORY_NOT_FOUND);
-		return -ENOENT;
-	} else if (!dir->dir) {
-		fprintf(stderr, PARENT_INODE_NOT_DIRECTORY);
+	*result = inode_table_get(ino);
+	if (*result == NULL) {
+		fprintf(stderr,
+		        INODE_NUMBER_NOT_FOUND,
+		        (unsigned long long) ino);
 		return -ENOENT;
-	} else if (dir->dir->size >= MAX_DENTRIES) {
-		fprintf(stderr, PARENT_DIRECTORY_FULL);
-		return -ENOSPC;
-	} else {
-		for (int i = 0; i < dir->dir->size; i++) {
-			if (strcmp(dir->dir->entries[i]->filename,
-			           new_directory) == 0) {
-				fprintf(stderr,
-				        DIRECTORY_ALREADY_EXISTS,
-				        new_directory);
-				return -EEXIST;
-			}
-		}
-	}
-	dir->mtime = time(NULL);
-	inode_dir *directory = dir->dir;
-
-	dentry *new_entry = malloc(sizeof(dentry));
-	strncpy(new_entry->filename, new_directory, MAX_FILENAME - 1);
-	new_entry->filename[MAX_FILENAME - 1] = '\0';
-
-	new_entry->inode = malloc(sizeof(inode));
-	new_entry->inode->mode =
-	        __S_IFDIR |
-	        0755;  // Set mode to directory with rwxr-xr-x permissions
-	new_entry->inode->nlink =
-	        2;  // New directory has 2 links (itself and its parent)
-	new_entry->inode->uid = getuid();
-	new_entry->inode->gid = getgid();
-	new_entry->inode->atime = time(NULL);
-	new_entry->inode->mtime = time(NULL);
-	new_entry->inode->ctime = time(NULL);
-	new_entry->inode->size = 0;
-	new_entry->inode->file = NULL;
-	new_entry->inode->dir = malloc(sizeof(inode_dir));
-	new_entry->inode->dir->size = 0;
-
-	directory->entries[directory->size] = new_entry;
-	directory->size++;
-	return EXIT_SUCCESS;
+	}
+	return ensure_loaded(*result);
 }
 
-int
-filesystem_readdir(const char *path,
-                   void *buf,
-                   fuse_fill_dir_t filler,
-                   off_t offset,
-                   struct fuse_file_info *fi)
+// Locks the file `node`, for writing if `write`, with all of its blocks
+// loaded. On success the caller must unlock it.
+static int
+lock_contents(inode *node, bool write)
 {
-	inode *directory = NULL;
-	int ret = search_inode(path, &directory);
-	if (ret != EXIT_SUCCESS) {
-		fprintf(stderr, PARENT_DIRECTORY_NOT_FOUND);
-		return -ENOENT;
-	} else if (!directory->dir) {
-		fprintf(stderr, PARENT_INODE_NOT_DIRECTORY);
+	if (!node->file) {
+		fprintf(stderr, INODE_NOT_FILE);
 		return -ENOENT;
 	}
 
-	filler(buf, ".", NULL, 0);
-	filler(buf, "..", NULL, 0);
-
-	for (int i = 0; i < directory->dir->size; i++) {
-		if (directory->dir->entries[i] == NULL) {
-			continue;
+	for (;;) {
+		int ret = ensure_contents(node);
+		if (ret != EXIT_SUCCESS) {
+			return ret;
 		}
-		struct stat stbuf;
-		inode_to_stat(directory->dir->entries[i]->inode, &stbuf);
 
-		filler(buf, directory->dir->entries[i]->filename, &stbuf, 0);
+		if (write) {
+			pthread_rwlock_wrlock(&node->lock);
+		} else {
+			pthread_rwlock_rdlock(&node->lock);
+		}
+		// cool_files may have packed it in between.
+		if (node->file->packed == 0) {
+			return EXIT_SUCCESS;
+		}
+		pthread_rwlock_unlock(&node->lock);
 	}
+}
 
-	return EXIT_SUCCESS;
+// Frees `node` and its contents, and takes it out of the inode table.
+static void
+free_inode(inode *node)
+{
+	// The inode owns its data blocks.
+	file_free(node->file);
+	dir_free(node->dir);
+	inode_table_delete(node);
 }
 
-int
-filesystem_rmdir(const char *path)
+// Frees an inode just removed from its directory. If the kernel still
+// references it (see node->refs) it lives on, unlinked, until put_refs
+// drops the last reference: nlink 0 keeps it out of checkpoints and of
+// the journal meanwhile, and its blocks count apart (see usage.c). The
+// caller must hold fs.lock for writing.
+static void
+drop_inode(inode *node)
 {
-	inode *parent = NULL;
-	char parent_path[PATH_MAX];
-	char child_name[MAX_FILENAME];
+	checkpoint_forget(node);
+	usage_drop_inode(node->dir != NULL,
+	                 node->file != NULL ? node->size : 0,
+	                 node->file != NULL ? node->file->used : 0);
+	node->nlink = 0;
+	if (__atomic_load_n(&node->refs, __ATOMIC_RELAXED) == 0) {
+		free_inode(node);
+	} else if (node->file != NULL) {
+		usage_orphan(node->file->used);
+	}
+}
 
-	if (split_parent_child(path, parent_path, child_name) != EXIT_SUCCESS) {
-		return -ENOENT;
+// Drops the link of `node` whose entry was just removed, freeing it with
+// its last one (see drop_inode). The caller must hold fs.lock for
+// writing.
+static void
+unlink_inode(inode *node)
+{
+	if (node->file != NULL && node->nlink > 1) {
+		node->nlink--;
+		node->ctime = time(NULL);
+		checkpoint_mark_dirty(node);
+		return;
 	}
+	drop_inode(node);
+}
 
+// Drops `count` references to `node`, freeing it if they were the last
+// and it was removed. The caller must not hold fs.lock.
+static void
+put_refs(inode *node, uint64_t count)
+{
+	pthread_rwlock_rdlock(&fs.lock);
+	uint64_t left =
+	        __atomic_sub_fetch(&node->refs, count, __ATOMIC_RELAXED);
+	bool unused = left == 0 && node->nlink == 0;
+	pthread_rwlock_unlock(&fs.lock);
+	if (!unused) {
+		return;
+	}
 
-	int ret = search_inode(parent_path, &parent);
-	if (ret != EXIT_SUCCESS) {
-		fprintf(stderr, PARENT_DIRECTORY_NOT_FOUND);
-		return -ENOENT;
-	} else if (!parent->dir) {
-		fprintf(stderr, PARENT_INODE_NOT_DIRECTORY);
-		return -ENOENT;
+	// Unlinked, so nothing can reach it again, and only this thread saw
+	// its last reference go.
+	pthread_rwlock_wrlock(&fs.lock);
+	if (node->file != NULL) {
+		usage_orphan(-(int64_t) node->file->used);
 	}
+	free_inode(node);
+	pthread_rwlock_unlock(&fs.lock);
+}
 
-	dentry *directory_to_remove = NULL;
-	int found = 0;
-	for (int i = 0; i < parent->dir->size; i++) {
-		if (strcmp(parent->dir->entries[i]->filename, child_name) == 0) {
-			directory_to_remove = parent->dir->entries[i];
-			found = i;
-			break;
-		}
+// Usage
+//
+// statfs answers from the counters of usage.c, which every change keeps
+// up to date: make_node and drop_inode count the inodes, and the
+// functions that change a file call reserve_blocks before and count_file
+// after, under the lock of the file.
+
+// Reserves the blocks that changing [offset, offset + size) of the file
+// `node` may allocate. Returns how many, to pass to count_file, or
+// -ENOSPC past --max-size, unlinked or not. The caller must hold the
+// file exclusively, with its blocks loaded.
+static int64_t
+reserve_blocks(const inode *node, off_t offset, off_t size)
+{
+	size_t count = file_holes(node->file, offset, size);
+	if (usage_reserve(count, node->nlink == 0) != EXIT_SUCCESS) {
+		fprintf(stderr, NO_SPACE_LEFT);
+		return -ENOSPC;
 	}
+	return count;
+}
 
-	if (directory_to_remove == NULL ||
-	    directory_to_remove->inode->dir == NULL) {
-		fprintf(stderr, DIRECTORY_NOT_FOUND, child_name);
-		return -ENOENT;
+// Counts the change of the file `node` since it had `size` bytes in
+// `used` blocks, `reserved` more of them counted already.
+static void
+count_file(const inode *node, off_t size, size_t used, int64_t reserved)
+{
+	int64_t blocks = (int64_t) node->file->used - (int64_t) used;
+	if (node->nlink > 0) {
+		usage_add(node->size - size, blocks - reserved);
+	} else {
+		// An unlinked file only counts its blocks (see drop_inode).
+		usage_orphan(blocks - reserved);
 	}
+}
 
-	if (directory_to_remove->inode->dir->size > 0) {
-		fprintf(stderr, DIRECTORY_NOT_EMPTY, child_name);
-		return -ENOTEMPTY;
+// Open files
+//
+// open and create store an open_file in fi->fh, so the callbacks on the
+// open file reach the inode directly instead of resolving its path (or
+// inode number) every time.
+
+// Opens the file `node` for `fi`. The caller must hold fs.lock.
+static int
+open_handle(inode *node, struct fuse_file_info *fi)
+{
+	open_file *file = slab_alloc(&open_file_slab);
+	if (file == NULL) {
+		return -ENOMEM;
 	}
+	file->node = node;
+	file->flags = fi->flags;
+	__atomic_add_fetch(&node->refs, 1, __ATOMIC_RELAXED);
+	fi->fh = (uintptr_t) file;
+	return EXIT_SUCCESS;
+}
 
-	parent->mtime = time(NULL);
-	for (int j = found; j < parent->dir->size - 1; j++) {
-		parent->dir->entries[j] = parent->dir->entries[j + 1];
+// Returns the open file of `fi`, or null if it has none.
+static open_file *
+handle_of(const struct fuse_file_info *fi)
+{
+	return fi != NULL ? (open_file *) (uintptr_t) fi->fh : NULL;
+}
+
+// Closes the open file of `fi`, if any. The caller must not hold fs.lock.
+static void
+release_handle(struct fuse_file_info *fi)
+{
+	open_file *file = handle_of(fi);
+	if (file == NULL) {
+		return;
+	}
+	fi->fh = 0;
+	if (file->node != NULL) {
+		put_refs(file->node, 1);
 	}
-	parent->dir->entries[parent->dir->size - 1] = NULL;
-	parent->dir->size--;
+	free(file->text);
+	slab_free(&open_file_slab, file);
+}
 
+// Stats file
+//
+// STATS_PATH, or STATS_INO in the low-level front end, is a read-only
+// file outside the tree, neither listed nor saved, with the counters of
+// stats.c. Each open takes a snapshot of them for its reads, with
+// direct_io, so that the kernel reads it to the end despite its size of
+// 0, like a file in /proc.
 
-	free(directory_to_remove->inode->dir);
-	free(directory_to_remove->inode);
-	free(directory_to_remove);
-	return EXIT_SUCCESS;
+static void
+stat_stats(struct stat *stbuf)
+{
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_mode = S_IFREG | 0444;
+	stbuf->st_uid = fs.root->uid;
+	stbuf->st_gid = fs.root->gid;
+	stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = time(NULL);
+	stbuf->st_nlink = 1;
+	stbuf->st_ino = STATS_INO;
 }
 
-int
-filesystem_utimens(const char *path, const struct timespec tv[2])
+// Opens the stats file for `fi`, only for reading.
+static int
+open_stats(struct fuse_file_info *fi)
 {
-	inode *inode = NULL;
-	int ret = search_inode(path, &inode);
-	if (ret != EXIT_SUCCESS) {
-		fprintf(stderr, INODE_NOT_FOUND, path);
-		return -ENOENT;
+	if (fi == NULL) {
+		return EXIT_SUCCESS;
+	}
+	if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+		return -EACCES;
 	}
 
-	inode->atime = tv[0].tv_sec;
-	inode->mtime = tv[1].tv_sec;
+	open_file *file = slab_alloc(&open_file_slab);
+	if (file == NULL) {
+		return -ENOMEM;
+	}
+	file->text = stats_format(&file->size);
+	if (file->text == NULL) {
+		slab_free(&open_file_slab, file);
+		return -ENOMEM;
+	}
+	file->flags = fi->flags;
+	fi->fh = (uintptr_t) file;
+	fi->direct_io = 1;
 	return EXIT_SUCCESS;
 }
 
-
-int
-filesystem_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+// Returns where the bytes of the snapshot of the stats file open in
+// `file` begin at `offset`, clamping `size` to the ones there are.
+static const char *
+stats_range(const open_file *file, size_t *size, off_t offset)
 {
-	char new_file[MAX_FILENAME];
-	char dir_parent[PATH_MAX];
-
-	if (split_parent_child(path, dir_parent, new_file) != EXIT_SUCCESS) {
-		return -ENOENT;
+	if (offset < 0 || offset > file->size) {
+		offset = file->size;
 	}
+	if (*size > file->size - offset) {
+		*size = file->size - offset;
+	}
+	return file->text + offset;
+}
 
-	inode *dir_copy_inode = NULL;
-	int ret = search_inode(dir_parent, &dir_copy_inode);
+// Marks `node` dirty and logs `record`, addressed to it, with the locks
+// that ordered the change still held. Returns the lsn of the record, 0
+// if `node` was removed (see drop_inode).
+static uint64_t
+log_change(inode *node, journal_record record)
+{
+	if (node->nlink == 0) {
+		return 0;
+	}
+	checkpoint_mark_dirty(node);
+	record.ino = node->ino;
+	record.path = "";
+	return journal_log(&record);
+}
 
-	if (ret != EXIT_SUCCESS) {
-		fprintf(stderr, PARENT_DIRECTORY_NOT_FOUND);
-		return -ENOENT;
-	} else if (!dir_copy_inode->dir) {
-		fprintf(stderr, PARENT_INODE_NOT_DIRECTORY);
-		return -ENOENT;
-	} else if (dir_copy_inode->dir->size >= MAX_DENTRIES) {
-		fprintf(stderr, PARENT_DIRECTORY_FULL);
-		return -ENOSPC;
-	} else {
-		for (int i = 0; i < dir_copy_inode->dir->size; i++) {
-			if (strcmp(dir_copy_inode->dir->entries[i]->filename,
-			           new_file) == 0) {
-				fprintf(stderr, FILE_ALREADY_EXISTS, new_file);
-				return -EEXIST;
-			}
-		}
+// Zero-copy data path
+//
+// write_inode and send_inode hand libfuse fuse_bufvecs that point
+// straight at the blocks of the file, so it moves the data between them
+// and /dev/fuse (spliced through a pipe, if the kernel allows it)
+// without a copy through a buffer of ours. The high-level API frees
+// every buffer read_buf returns, so reads only take this path through
+// the low-level front end.
+
+// Allocates a fuse_bufvec for `count` memory buffers, followed by the
+// `count` iovecs to fill in with file_read_iov or file_write_iov before
+// fill_bufvec. Null if out of memory.
+static struct fuse_bufvec *
+new_bufvec(size_t count, struct iovec **iov)
+{
+	// A bufvec has at least one buffer, empty if need be.
+	size_t slots = count > 0 ? count : 1;
+	struct fuse_bufvec *bufv =
+	        malloc(sizeof(*bufv) + slots * (sizeof(struct fuse_buf) +
+	                                        sizeof(struct iovec)));
+	if (bufv == NULL) {
+		return NULL;
 	}
+	*bufv = FUSE_BUFVEC_INIT(0);
+	bufv->count = slots;
+	*iov = (struct iovec *) (bufv->buf + slots);
+	(*iov)[0] = (struct iovec){ 0 };
+	return bufv;
+}
 
-	dir_copy_inode->mtime = time(NULL);
-	inode_dir *directory = dir_copy_inode->dir;
+// Points the buffers of `bufv` at the iovecs filled in after it.
+static void
+fill_bufvec(struct fuse_bufvec *bufv, const struct iovec *iov)
+{
+	for (size_t i = 0; i < bufv->count; i++) {
+		bufv->buf[i] = (struct fuse_buf){ .mem = iov[i].iov_base,
+			                          .size = iov[i].iov_len,
+			                          .fd = -1 };
+	}
+}
 
-	dentry *new_entry = malloc(sizeof(dentry));
-	strncpy(new_entry->filename, new_file, MAX_FILENAME - 1);
-	new_entry->filename[MAX_FILENAME - 1] = '\0';
 
+// Filesystem functions
 
-	new_entry->inode = malloc(sizeof(inode));
-	new_entry->inode->file = malloc(sizeof(inode_file));
-	memset(new_entry->inode->file->content, 0, MAX_CONTENT_SIZE);
-	new_entry->inode->dir = NULL;
 
-	new_entry->inode->mode =
-	        __S_IFREG |
-	        mode;  // Set mode to regular file with specified permissions
-	new_entry->inode->nlink = 1;  // New file has 1 link (itself)
-	new_entry->inode->uid = getuid();
-	new_entry->inode->gid = getgid();
-	new_entry->inode->atime = time(NULL);
-	new_entry->inode->mtime = time(NULL);
-	new_entry->inode->ctime = time(NULL);
-	new_entry->inode->size = 0;
+static void init_root(void);
 
-	new_entry->inode->file->content[0] = '\0';
+static void replay_record(const journal_record *record);
 
+static void periodic_checkpoint(void);
 
-	directory->entries[directory->size] = new_entry;
-	directory->size++;
-	return EXIT_SUCCESS;
-}
+static void write_first_image(uint64_t lsn);
 
-int
-filesystem_read(const char *path,
-                char *buf,
-                size_t size,
-                off_t offset,
-                struct fuse_file_info *fi)
+// Initialize the filesystem
+void *
+filesystem_init(struct fuse_conn_info *conn)
 {
-	inode *inode = NULL;
-	int ret = search_inode(path, &inode);
-	if (ret != EXIT_SUCCESS) {
-		fprintf(stderr, INODE_NOT_FOUND, path);
-		return -ENOENT;
-	} else if (!inode->file) {
-		fprintf(stderr, INODE_NOT_FILE);
-		return -ENOENT;
-	}
+	printf("Initializing filesystem...\n");
 
-	if (offset < 0 || offset > inode->size) {
-		fprintf(stderr, OFFSET_OUT_OF_BOUNDS);
-		return -EINVAL;
+	if (conn != NULL) {
+		// write_buf takes the data spliced from /dev/fuse.
+		conn->want |= conn->capable & FUSE_CAP_SPLICE_READ;
 	}
 
-	size_t bytes_to_read = inode->size - offset;
-	if (bytes_to_read > size) {
-		bytes_to_read = size;
+	pthread_rwlock_init(&fs.lock, NULL);
+	path_cache_init();
+	block_store_init(dedup);
+	image_set_compression(compression);
+	workers_start(worker_threads);
+
+	// Initialize the filesystem structure from file.
+	uint64_t lsn = 0;
+	uint64_t image_id = 0;
+	uint64_t last_snapshot = 0;
+	FILE *input = fopen(filedisk, "rb");
+	bool loaded = input != NULL;
+	if (input) {
+		printf("Loading filesystem from disk: %s\n", filedisk);
+		image_info info;
+		fs.root = deserialize_inode(input, &info);
+		fs.next_ino = info.next_ino;
+		lsn = info.lsn;
+		checkpoint_init(info.garbage);
+		usage_init(&info.usage);
+		image_id = info.id;
+		last_snapshot = info.last_snapshot;
+		fclose(input);
+		printf("Filesystem loaded from disk: %s\n", filedisk);
+	} else {
+		printf("No persistence file found, initializing new FS.\n");
+		init_root();
+		// A journal left without its image belongs to no image.
+		image_id = image_new_id();
+	}
+	snapshot_init(last_snapshot);
+
+	// Redo whatever happened after the image was saved, if the journal is
+	// the one of this image. Records by inode number bypass the path
+	// cache, so it is dropped afterwards.
+	char journal_path[PATH_MAX];
+	snprintf(journal_path, sizeof(journal_path), "%s.journal", filedisk);
+	lsn = journal_replay(journal_path, lsn, image_id, replay_record);
+	path_cache_clear();
+	if (!loaded || image_id == 0) {
+		if (image_id == 0) {
+			image_id = image_new_id();
+		}
+		write_first_image(lsn);
 	}
+	journal_open(journal_path, journal_mode, lsn, image_id);
+	usage_limit((max_size + BLOCK_SIZE - 1) / BLOCK_SIZE, max_inodes);
+	checkpoint_maybe_compact(filedisk);
+	checkpoint_start(checkpoint_interval, periodic_checkpoint);
 
-	memcpy(buf, inode->file->content + offset, bytes_to_read);
-	inode->atime = time(NULL);
-	return (int) bytes_to_read;
+	return &fs;
 }
 
-
-int
-filesystem_open(const char *path, struct fuse_file_info *fi)
+// Writes the whole tree to an image that does not have the id of the
+// journal about to be opened yet, new or older than ids, or exits: the
+// journal is only replayed onto an image with its id.
+static void
+write_first_image(uint64_t lsn)
 {
-	inode *inode = NULL;
-	int ret = search_inode(path, &inode);
-	if (ret != EXIT_SUCCESS) {
-		fprintf(stderr, INODE_NOT_FOUND, path);
+	pthread_rwlock_wrlock(&fs.lock);
+	checkpoint *cp = checkpoint_capture(fs.root, lsn);
+	pthread_rwlock_unlock(&fs.lock);
+	if (cp == NULL || checkpoint_write(filedisk, cp) != 0) {
+		fprintf(stderr, "Error: cannot write image: %s\n", filedisk);
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Creates an empty root directory
+static void
+init_root(void)
+{
+	// Fallback, initialize the filesystem structure from scratch.
+	fs.root = inode_table_new(ROOT_INO);
+	fs.next_ino = ROOT_INO + 1;
+	fs.root->mode = __S_IFDIR |
+	                0755;  // Set mode to directory with rwxr-xr-x permissions
+	fs.root->nlink = 2;  // Root directory has 2 links (itself and its parent)
+	fs.root->uid = getuid();
+	fs.root->gid = getgid();
+	fs.root->atime = time(NULL);
+	fs.root->mtime = time(NULL);
+	fs.root->ctime = time(NULL);
+	fs.root->size = 0;
+
+	fs.root->file = NULL;
+	fs.root->dir = dir_new();
+	checkpoint_mark_dirty(fs.root);
+	usage_init(&(fs_usage){ .dirs = 1 });
+
+	printf("Filesystem initialized successfully.\n");
+}
+
+// Operations on inodes
+//
+// Both front ends resolve their arguments to inodes, holding fs.lock as
+// described above, and share the functions below.
+
+static void
+stat_inode(inode *node, struct stat *stbuf)
+{
+	pthread_rwlock_rdlock(&node->lock);
+	inode_to_stat(node, stbuf);
+	pthread_rwlock_unlock(&node->lock);
+}
+
+// Adds to `parent` a directory (JOURNAL_MKDIR) or a file (JOURNAL_CREATE)
+// named `name`, numbered `ino` or, if 0, with the next free number.
+static int
+make_node(inode *parent,
+          const char *name,
+          journal_op op,
+          mode_t mode,
+          uint64_t ino,
+          inode **result,
+          uint64_t *lsn)
+{
+	if (!parent->dir) {
+		fprintf(stderr, PARENT_INODE_NOT_DIRECTORY);
 		return -ENOENT;
-	} else if (!inode->file) {
-		fprintf(stderr, INODE_NOT_FILE);
+	}
+
+	pthread_rwlock_wrlock(&parent->lock);
+	if (parent->nlink == 0) {
+		// Removed, but still referenced by the kernel.
+		pthread_rwlock_unlock(&parent->lock);
+		fprintf(stderr, PARENT_DIRECTORY_NOT_FOUND);
 		return -ENOENT;
 	}
+	if (dir_lookup(parent->dir, name) != NULL) {
+		pthread_rwlock_unlock(&parent->lock);
+		fprintf(stderr,
+		        op == JOURNAL_MKDIR ? DIRECTORY_ALREADY_EXISTS
+		                            : FILE_ALREADY_EXISTS,
+		        name);
+		return -EEXIST;
+	}
+	if (is_reserved(parent, name)) {
+		pthread_rwlock_unlock(&parent->lock);
+		fprintf(stderr, RESERVED_NAME, name);
+		return -EEXIST;
+	}
+	int ret = snapshot_preserve(parent);
+	if (ret != EXIT_SUCCESS) {
+		pthread_rwlock_unlock(&parent->lock);
+		return ret;
+	}
+	bool dir = op == JOURNAL_MKDIR;
+	if (usage_add_inode(dir) != EXIT_SUCCESS) {
+		pthread_rwlock_unlock(&parent->lock);
+		fprintf(stderr, NO_INODES_LEFT);
+		return -ENOSPC;
+	}
+
+	if (ino == 0) {
+		ino = __atomic_fetch_add(&fs.next_ino, 1, __ATOMIC_RELAXED);
+	} else if (ino >= fs.next_ino) {
+		// Replayed, nothing else runs.
+		fs.next_ino = ino + 1;
+	}
+	dentry *entry = slab_alloc(&dentry_slab);
+	inode *node = inode_table_new(ino);
+	if (entry == NULL || node == NULL) {
+		pthread_rwlock_unlock(&parent->lock);
+		usage_drop_inode(dir, 0, 0);
+		slab_free(&dentry_slab, entry);
+		if (node != NULL) {
+			inode_table_delete(node);
+		}
+		return -ENOMEM;
+	}
+	strncpy(entry->filename, name, MAX_FILENAME - 1);
+	entry->filename[MAX_FILENAME - 1] = '\0';
+	entry->inode = node;
+
+	if (dir) {
+		// Directories are always rwxr-xr-x, with 2 links (itself and
+		// its parent).
+		node->mode = __S_IFDIR | 0755;
+		node->nlink = 2;
+		node->dir = dir_new();
+	} else {
+		node->mode = __S_IFREG | mode;
+		node->nlink = 1;
+		node->file = file_new();
+	}
+	node->uid = getuid();
+	node->gid = getgid();
+	node->atime = time(NULL);
+	node->mtime = time(NULL);
+	node->ctime = time(NULL);
+	node->size = 0;
+	// In none of the snapshots taken so far.
+	node->snapshot = snapshot_epoch();
+
+	if (dir_add(parent->dir, entry) != 0) {
+		pthread_rwlock_unlock(&parent->lock);
+		fprintf(stderr, PARENT_DIRECTORY_FULL);
+		usage_drop_inode(dir, 0, 0);
+		free_inode(node);
+		slab_free(&dentry_slab, entry);
+		return -ENOSPC;
+	}
+	parent->mtime = time(NULL);
+	checkpoint_mark_dirty(node);
+	checkpoint_mark_dirty(parent);
+	*lsn = journal_log(&(journal_record){ .op = op,
+	                                      .ino = parent->ino,
+	                                      .path = name,
+	                                      .mode = mode,
+	                                      .new_ino = ino });
+
+	pthread_rwlock_unlock(&parent->lock);
+	*result = node;
 	return EXIT_SUCCESS;
 }
 
+// Removes from `parent` the directory (JOURNAL_RMDIR) or the file
+// (JOURNAL_UNLINK) named `name`. The caller must hold fs.lock for
+// writing, no other thread can be using the inode being freed.
+static int
+remove_node(inode *parent, const char *name, journal_op op, uint64_t *lsn)
+{
+	if (!parent->dir) {
+		fprintf(stderr, PARENT_INODE_NOT_DIRECTORY);
+		return -ENOENT;
+	}
 
-int
-filesystem_write(const char *path,
-                 const char *buf,
-                 size_t size,
-                 off_t offset,
-                 struct fuse_file_info *fi)
+	if (is_reserved(parent, name)) {
+		fprintf(stderr, READ_ONLY_SNAPSHOT, name);
+		return -EROFS;
+	}
+	dentry *entry = dir_lookup(parent->dir, name);
+	if (entry != NULL && ensure_loaded(entry->inode) != EXIT_SUCCESS) {
+		return -EIO;
+	}
+	inode *node = entry != NULL ? entry->inode : NULL;
+	if (op == JOURNAL_RMDIR) {
+		if (node == NULL || node->dir == NULL) {
+			fprintf(stderr, DIRECTORY_NOT_FOUND, name);
+			return -ENOENT;
+		}
+		if (node->dir->size > 0) {
+			fprintf(stderr, DIRECTORY_NOT_EMPTY, name);
+			return -ENOTEMPTY;
+		}
+	} else if (node == NULL || node->file == NULL) {
+		fprintf(stderr, INODE_NOT_FOUND, name);
+		return -ENOENT;
+	}
+	int ret = snapshot_preserve(parent);
+	if (ret == EXIT_SUCCESS) {
+		ret = snapshot_preserve(node);
+	}
+	if (ret != EXIT_SUCCESS) {
+		return ret;
+	}
+
+	parent->mtime = time(NULL);
+	dir_remove(parent->dir, name);
+	checkpoint_mark_dirty(parent);
+	*lsn = journal_log(&(journal_record){
+	        .op = op, .ino = parent->ino, .path = name });
+
+	slab_free(&dentry_slab, entry);
+	unlink_inode(node);
+	return EXIT_SUCCESS;
+}
+
+// Adds to `parent` an entry `name` for the file `node`, one more link to
+// it. The caller must hold fs.lock for writing.
+static int
+link_node(inode *node, inode *parent, const char *name, uint64_t *lsn)
 {
-	inode *inode = NULL;
-	int ret = search_inode(path, &inode);
+	if (!parent->dir) {
+		fprintf(stderr, PARENT_INODE_NOT_DIRECTORY);
+		return -ENOENT;
+	}
+	if (node->dir != NULL) {
+		fprintf(stderr, LINK_TO_DIRECTORY, name);
+		return -EPERM;
+	}
+	if (node->nlink == 0 || parent->nlink == 0) {
+		// Removed, but still referenced by the kernel.
+		fprintf(stderr, INODE_NOT_FOUND, name);
+		return -ENOENT;
+	}
+	if (dir_lookup(parent->dir, name) != NULL) {
+		fprintf(stderr, FILE_ALREADY_EXISTS, name);
+		return -EEXIST;
+	}
+	if (is_reserved(parent, name)) {
+		fprintf(stderr, RESERVED_NAME, name);
+		return -EEXIST;
+	}
+	int ret = snapshot_preserve(node);
+	if (ret == EXIT_SUCCESS) {
+		ret = snapshot_preserve(parent);
+	}
 	if (ret != EXIT_SUCCESS) {
-		fprintf(stderr, INODE_NOT_FOUND, path);
+		return ret;
+	}
+
+	dentry *entry = slab_alloc(&dentry_slab);
+	if (entry == NULL) {
+		return -ENOMEM;
+	}
+	strncpy(entry->filename, name, MAX_FILENAME - 1);
+	entry->filename[MAX_FILENAME - 1] = '\0';
+	entry->inode = node;
+	if (dir_add(parent->dir, entry) != 0) {
+		fprintf(stderr, PARENT_DIRECTORY_FULL);
+		slab_free(&dentry_slab, entry);
+		return -ENOSPC;
+	}
+
+	node->nlink++;
+	node->ctime = time(NULL);
+	parent->mtime = time(NULL);
+	checkpoint_mark_dirty(node);
+	checkpoint_mark_dirty(parent);
+	*lsn = journal_log(&(journal_record){ .op = JOURNAL_LINK,
+	                                      .ino = parent->ino,
+	                                      .path = name,
+	                                      .new_ino = node->ino });
+	return EXIT_SUCCESS;
+}
+
+// Moves the entry `name` of `parent` to `new_name` in `new_parent`,
+// replacing what was there, like rename(2). Only entries change, so it
+// costs the same whatever the inode holds. The caller must hold fs.lock
+// for writing, and check that a directory is not moved below itself.
+static int
+rename_node(inode *parent,
+            const char *name,
+            inode *new_parent,
+            const char *new_name,
+            uint64_t *lsn)
+{
+	if (!parent->dir || !new_parent->dir) {
+		fprintf(stderr, PARENT_INODE_NOT_DIRECTORY);
 		return -ENOENT;
-	} else if (!inode->file) {
-		fprintf(stderr, INODE_NOT_FILE);
+	}
+	if (new_parent->nlink == 0) {
+		fprintf(stderr, PARENT_DIRECTORY_NOT_FOUND);
+		return -ENOENT;
+	}
+	if (is_reserved(parent, name)) {
+		fprintf(stderr, READ_ONLY_SNAPSHOT, name);
+		return -EROFS;
+	}
+	if (is_reserved(new_parent, new_name)) {
+		fprintf(stderr, RESERVED_NAME, new_name);
+		return -EEXIST;
+	}
+
+	dentry *entry = dir_lookup(parent->dir, name);
+	dentry *target = dir_lookup(new_parent->dir, new_name);
+	if (entry == NULL) {
+		fprintf(stderr, INODE_NOT_FOUND, name);
+		return -ENOENT;
+	}
+	if (ensure_loaded(entry->inode) != EXIT_SUCCESS ||
+	    (target != NULL && ensure_loaded(target->inode) != EXIT_SUCCESS)) {
+		return -EIO;
+	}
+
+	inode *node = entry->inode;
+	inode *replaced = target != NULL ? target->inode : NULL;
+	if (replaced == node) {
+		// Both are links to the same inode.
+		return EXIT_SUCCESS;
+	}
+	if (replaced != NULL && replaced->dir == NULL && node->dir != NULL) {
+		fprintf(stderr, NOT_A_DIRECTORY, new_name);
+		return -ENOTDIR;
+	}
+	if (replaced != NULL && replaced->dir != NULL && node->dir == NULL) {
+		fprintf(stderr, IS_A_DIRECTORY, new_name);
+		return -EISDIR;
+	}
+	if (replaced != NULL && replaced->dir != NULL &&
+	    replaced->dir->size > 0) {
+		fprintf(stderr, DIRECTORY_NOT_EMPTY, new_name);
+		return -ENOTEMPTY;
+	}
+	int ret = snapshot_preserve(parent);
+	if (ret == EXIT_SUCCESS) {
+		ret = snapshot_preserve(new_parent);
+	}
+	if (ret == EXIT_SUCCESS) {
+		ret = snapshot_preserve(node);
+	}
+	if (ret == EXIT_SUCCESS && replaced != NULL) {
+		ret = snapshot_preserve(replaced);
+	}
+	if (ret != EXIT_SUCCESS) {
+		return ret;
+	}
+
+	if (target != NULL) {
+		// Takes over the entry, so nothing can fail.
+		target->inode = node;
+		dir_remove(parent->dir, name);
+		slab_free(&dentry_slab, entry);
+		unlink_inode(replaced);
+	} else {
+		dentry *moved = slab_alloc(&dentry_slab);
+		if (moved == NULL) {
+			return -ENOMEM;
+		}
+		strncpy(moved->filename, new_name, MAX_FILENAME - 1);
+		moved->filename[MAX_FILENAME - 1] = '\0';
+		moved->inode = node;
+		if (dir_add(new_parent->dir, moved) != 0) {
+			fprintf(stderr, PARENT_DIRECTORY_FULL);
+			slab_free(&dentry_slab, moved);
+			return -ENOSPC;
+		}
+		dir_remove(parent->dir, name);
+		slab_free(&dentry_slab, entry);
+	}
+
+	node->ctime = time(NULL);
+	parent->mtime = time(NULL);
+	new_parent->mtime = time(NULL);
+	checkpoint_mark_dirty(node);
+	checkpoint_mark_dirty(parent);
+	checkpoint_mark_dirty(new_parent);
+	*lsn = journal_log(&(journal_record){ .op = JOURNAL_RENAME,
+	                                      .ino = parent->ino,
+	                                      .path = name,
+	                                      .new_ino = new_parent->ino,
+	                                      .name = new_name });
+	return EXIT_SUCCESS;
+}
+
+// What readdir hands to the kernel for each entry: its number and type,
+// all its attributes (readdirplus), or those and a lookup of it too, that
+// the kernel forgets later (readdirplus in the low-level front end).
+typedef enum dirent_fill {
+	DIRENT_TYPE,
+	DIRENT_ATTR,
+	DIRENT_LOOKUP,
+} dirent_fill;
+
+// Fills in what readdir hands to the kernel for `node`, returning
+// FUSE_FILL_DIR_PLUS if that is all its attributes. A stub is not loaded
+// just for that, its type is left unknown.
+static enum fuse_fill_dir_flags
+dirent_stat(inode *node, dirent_fill fill, struct stat *stbuf)
+{
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_ino = node->ino;
+	if (__atomic_load_n(&node->stub, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+	if (fill != DIRENT_TYPE) {
+		stat_inode(node, stbuf);
+		return FUSE_FILL_DIR_PLUS;
+	}
+	pthread_rwlock_rdlock(&node->lock);
+	stbuf->st_mode = node->mode & S_IFMT;
+	pthread_rwlock_unlock(&node->lock);
+	return 0;
+}
+
+// Lists the entries of `node` after the cookie `offset` (see
+// directory.h), each with its own cookie as the offset to resume from,
+// until `filler` is full. `.` and `..` only carry their type, and are
+// never looked up.
+static int
+readdir_inode(inode *node,
+              void *buf,
+              fuse_fill_dir_t filler,
+              off_t offset,
+              dirent_fill fill)
+{
+	if (!node->dir) {
+		fprintf(stderr, PARENT_INODE_NOT_DIRECTORY);
 		return -ENOENT;
 	}
-	if (offset < 0 || offset > MAX_CONTENT_SIZE) {
+
+	struct stat stbuf;
+	dirent_stat(node, DIRENT_TYPE, &stbuf);
+	if (offset < DIR_DOT_COOKIE &&
+	    filler(buf, ".", &stbuf, DIR_DOT_COOKIE, 0) != 0) {
+		return EXIT_SUCCESS;
+	}
+	if (offset < DIR_DOTDOT_COOKIE &&
+	    filler(buf, "..", &stbuf, DIR_DOTDOT_COOKIE, 0) != 0) {
+		return EXIT_SUCCESS;
+	}
+
+	pthread_rwlock_rdlock(&node->lock);
+	inode_dir *dir = node->dir;
+	for (int i = dir_seek(dir, offset); i < dir->slots; i++) {
+		dentry *entry = dir->entries[i];
+		if (entry == NULL) {
+			continue;
+		}
+		enum fuse_fill_dir_flags flags =
+		        dirent_stat(entry->inode, fill, &stbuf);
+		if (filler(buf,
+		           entry->filename,
+		           &stbuf,
+		           entry->cookie,
+		           flags) != 0) {
+			break;
+		}
+		// Counted once in the reply, like a lookup (see hand_out).
+		if (flags == FUSE_FILL_DIR_PLUS && fill == DIRENT_LOOKUP) {
+			__atomic_add_fetch(
+			        &entry->inode->refs, 1, __ATOMIC_RELAXED);
+		}
+	}
+	pthread_rwlock_unlock(&node->lock);
+	return EXIT_SUCCESS;
+}
+
+// Reads from the file `node`, locked by the caller with its contents
+// (see lock_contents).
+static int
+read_locked(inode *node, char *buf, size_t size, off_t offset)
+{
+	if (offset < 0 || offset > node->size) {
 		fprintf(stderr, OFFSET_OUT_OF_BOUNDS);
 		return -EINVAL;
 	}
 
-	if (offset + size > MAX_CONTENT_SIZE) {
-		fprintf(stderr, WRITE_EXCEEDS_SIZE);
-		return -ENOSPC;
+	size_t bytes_to_read = node->size - offset;
+	if (bytes_to_read > size) {
+		bytes_to_read = size;
+	}
+
+	file_read_blocks(node->file, buf, bytes_to_read, offset);
+	return (int) bytes_to_read;
+}
+
+static int
+read_inode(inode *node, char *buf, size_t size, off_t offset)
+{
+	int ret = lock_contents(node, false);
+	if (ret != EXIT_SUCCESS) {
+		return ret;
+	}
+
+	ret = read_locked(node, buf, size, offset);
+	if (ret >= 0) {
+		__atomic_store_n(&node->atime, time(NULL), __ATOMIC_RELAXED);
 	}
 
-	if (offset > inode->size) {
-		memset(inode->file->content + inode->size, 0, offset - inode->size);
+	pthread_rwlock_unlock(&node->lock);
+	return ret;
+}
+
+// send_inode on the file `node`, locked by the caller with its contents.
+static int
+send_locked(inode *node,
+            size_t size,
+            off_t offset,
+            filesystem_send_fn send,
+            void *arg)
+{
+	if (offset < 0 || offset > node->size) {
+		fprintf(stderr, OFFSET_OUT_OF_BOUNDS);
+		return -EINVAL;
 	}
 
-	memcpy(inode->file->content + offset, buf, size);
+	size_t bytes_to_read = node->size - offset;
+	if (bytes_to_read > size) {
+		bytes_to_read = size;
+	}
 
-	off_t end_offset = offset + size;
-	if (end_offset > inode->size) {
-		inode->size = end_offset;
+	struct iovec *iov;
+	struct fuse_bufvec *data =
+	        new_bufvec(file_span(offset, bytes_to_read), &iov);
+	if (data == NULL) {
+		return -ENOMEM;
 	}
+	file_read_iov(node->file, iov, bytes_to_read, offset);
+	fill_bufvec(data, iov);
 
-	inode->mtime = time(NULL);
-	inode->ctime = time(NULL);
+	send(arg, data);
 
-	return (int) size;
+	free(data);
+	return EXIT_SUCCESS;
 }
 
-int
-filesystem_truncate(const char *path, off_t size)
+// Passes the bytes [offset, offset + size) of `node` to `send`, in a
+// fuse_bufvec that points at its blocks. They stay locked, so they do
+// not change, until `send` returns.
+static int
+send_inode(inode *node,
+           size_t size,
+           off_t offset,
+           filesystem_send_fn send,
+           void *arg)
 {
-	inode *inode = NULL;
-	int ret = search_inode(path, &inode);
+	int ret = lock_contents(node, false);
+	if (ret != EXIT_SUCCESS) {
+		return ret;
+	}
+
+	ret = send_locked(node, size, offset, send, arg);
+	if (ret == EXIT_SUCCESS) {
+		__atomic_store_n(&node->atime, time(NULL), __ATOMIC_RELAXED);
+	}
 
+	pthread_rwlock_unlock(&node->lock);
+	return ret;
+}
+
+// Writes the data of `src` at `offset` or, if `append`, at the end of
+// the file, copying it straight into the blocks (see send_inode).
+static int
+write_inode(inode *node,
+            struct fuse_bufvec *src,
+            off_t offset,
+            bool append,
+            uint64_t *lsn)
+{
+	size_t size = fuse_buf_size(src);
+	int ret = lock_contents(node, true);
 	if (ret != EXIT_SUCCESS) {
-		fprintf(stderr, INODE_NOT_FOUND, path);
-		return -ENOENT;
-	} else if (!inode->file) {
-		fprintf(stderr, INODE_NOT_FILE);
-		return -ENOENT;
+		return ret;
 	}
 
-	if (size < 0 || size > MAX_CONTENT_SIZE) {
+	if (append) {
+		offset = node->size;
+	}
+
+	if (offset < 0) {
+		pthread_rwlock_unlock(&node->lock);
+		fprintf(stderr, OFFSET_OUT_OF_BOUNDS);
 		return -EINVAL;
 	}
+	ret = snapshot_preserve(node);
+	if (ret != EXIT_SUCCESS) {
+		pthread_rwlock_unlock(&node->lock);
+		return ret;
+	}
+	off_t old_size = node->size;
+	size_t used = node->file->used;
+	int64_t reserved = reserve_blocks(node, offset, size);
+	if (reserved < 0) {
+		pthread_rwlock_unlock(&node->lock);
+		return (int) reserved;
+	}
 
-	if (size < inode->size) {
-		for (off_t i = size; i < MAX_CONTENT_SIZE; i++) {
-			inode->file->content[i] = '\0';
-		}
+	// Bytes between the old end of file and offset are already zero,
+	// blocks are cleared when allocated and when truncated.
+	struct iovec *iov;
+	struct fuse_bufvec *dst = new_bufvec(file_span(offset, size), &iov);
+	ret = dst != NULL ? file_write_iov(node->file, iov, size, offset)
+	                  : -ENOMEM;
+	if (ret != 0) {
+		count_file(node, old_size, used, reserved);
+		pthread_rwlock_unlock(&node->lock);
+		free(dst);
+		fprintf(stderr, FILE_GROW_FAILED);
+		return ret;
+	}
+	fill_bufvec(dst, iov);
+
+	// Reads straight from /dev/fuse if src is spliced into a pipe.
+	ssize_t copied = fuse_buf_copy(dst, src, 0);
+	if (copied < 0) {
+		count_file(node, old_size, used, reserved);
+		pthread_rwlock_unlock(&node->lock);
+		free(dst);
+		return (int) copied;
 	}
 
-	if (size > inode->size) {
-		memset(inode->file->content + inode->size, 0, size - inode->size);
+	off_t end_offset = offset + copied;
+	if (end_offset > node->size) {
+		node->size = end_offset;
 	}
+	count_file(node, old_size, used, reserved);
+
+	node->mtime = time(NULL);
+	node->ctime = time(NULL);
+	*lsn = log_change(node,
+	                  (journal_record){ .op = JOURNAL_WRITE,
+	                                    .iov = iov,
+	                                    .size = copied,
+	                                    .offset = offset });
+
+	pthread_rwlock_unlock(&node->lock);
+	free(dst);
+	return (int) copied;
+}
 
-	inode->size = size;
-	inode->mtime = time(NULL);
-	return 0;
+// Wraps the `size` bytes at `buf` for write_inode.
+static struct fuse_bufvec
+bufvec_at(const char *buf, size_t size)
+{
+	struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(size);
+	bufv.buf[0].mem = (void *) buf;
+	return bufv;
 }
 
-int
-filesystem_unlink(const char *path)
+static int
+truncate_inode(inode *node, off_t size, uint64_t *lsn)
 {
-	char file[MAX_FILENAME];
-	char parent_dir[PATH_MAX];
+	int ret = lock_contents(node, true);
+	if (ret != EXIT_SUCCESS) {
+		return ret;
+	}
 
-	if (split_parent_child(path, parent_dir, file) != EXIT_SUCCESS) {
-		return -ENOENT;
+	if (size < 0) {
+		pthread_rwlock_unlock(&node->lock);
+		return -EINVAL;
+	}
+	ret = snapshot_preserve(node);
+	if (ret != EXIT_SUCCESS) {
+		pthread_rwlock_unlock(&node->lock);
+		return ret;
 	}
 
-	inode *parent = NULL;
-	int ret = search_inode(parent_dir, &parent);
+	off_t old_size = node->size;
+	size_t used = node->file->used;
+	ret = file_truncate_blocks(node->file, node->size, size);
 	if (ret != EXIT_SUCCESS) {
-		fprintf(stderr, PARENT_DIRECTORY_NOT_FOUND);
-		return -ENOENT;
-	} else if (!parent->dir) {
-		fprintf(stderr, PARENT_INODE_NOT_DIRECTORY);
-		return -ENOENT;
+		pthread_rwlock_unlock(&node->lock);
+		return ret;
 	}
 
-	dentry *file_to_remove = NULL;
-	int found = 0;
-	for (int i = 0; i < parent->dir->size; i++) {
-		if (strcmp(parent->dir->entries[i]->filename, file) == 0) {
-			file_to_remove = parent->dir->entries[i];
-			found = i;
-			break;
+	node->size = size;
+	count_file(node, old_size, used, 0);
+	node->mtime = time(NULL);
+	*lsn = log_change(node,
+	                  (journal_record){ .op = JOURNAL_TRUNCATE,
+	                                    .offset = size });
+
+	pthread_rwlock_unlock(&node->lock);
+	return 0;
+}
+
+static int
+utimens_inode(inode *node, const struct timespec tv[2], uint64_t *lsn)
+{
+	pthread_rwlock_wrlock(&node->lock);
+	int ret = snapshot_preserve(node);
+	if (ret != EXIT_SUCCESS) {
+		pthread_rwlock_unlock(&node->lock);
+		return ret;
+	}
+	__atomic_store_n(&node->atime, tv[0].tv_sec, __ATOMIC_RELAXED);
+	node->mtime = tv[1].tv_sec;
+	*lsn = log_change(node,
+	                  (journal_record){ .op = JOURNAL_UTIMENS,
+	                                    .atime = tv[0].tv_sec,
+	                                    .mtime = tv[1].tv_sec });
+	pthread_rwlock_unlock(&node->lock);
+	return EXIT_SUCCESS;
+}
+
+// Sparse files
+//
+// The blocks of a file are indexed by a sparse tree (see blockmap.c): a
+// hole has no slot and reads as zeros, and neither writing past the end
+// nor truncating up takes memory for the blocks in between, however far
+// it goes. fallocate adds the two ways around it: allocating blocks
+// ahead, so later writes there find them (past the end too, with
+// FALLOC_FL_KEEP_SIZE), and punching holes, which frees whole blocks and
+// clears the parts of the others in the range. st_blocks counts the
+// slots that hold a block, and seek_inode answers SEEK_DATA and
+// SEEK_HOLE from them.
+
+// Runs fallocate on `node`: the default mode, with or without
+// FALLOC_FL_KEEP_SIZE, and FALLOC_FL_PUNCH_HOLE, which needs it.
+static int
+fallocate_inode(inode *node,
+                int mode,
+                off_t offset,
+                off_t length,
+                uint64_t *lsn)
+{
+	bool keep_size = mode & FALLOC_FL_KEEP_SIZE;
+	bool punch = mode & FALLOC_FL_PUNCH_HOLE;
+	if ((mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) != 0 ||
+	    (punch && !keep_size)) {
+		return -EOPNOTSUPP;
+	}
+	if (offset < 0 || length <= 0) {
+		fprintf(stderr, OFFSET_OUT_OF_BOUNDS);
+		return -EINVAL;
+	}
+	if (offset > INT64_MAX - length) {
+		return -EFBIG;
+	}
+
+	int ret = lock_contents(node, true);
+	if (ret == EXIT_SUCCESS) {
+		ret = snapshot_preserve(node);
+		if (ret != EXIT_SUCCESS) {
+			pthread_rwlock_unlock(&node->lock);
 		}
 	}
-	if (file_to_remove == NULL || file_to_remove->inode->file == NULL ||
-	    file_to_remove->inode->dir != NULL) {
-		fprintf(stderr, INODE_NOT_FOUND, path);
-		return -ENOENT;
+	if (ret != EXIT_SUCCESS) {
+		return ret;
 	}
 
-	parent->mtime = time(NULL);
-	for (int j = found; j < parent->dir->size - 1; j++) {
-		parent->dir->entries[j] = parent->dir->entries[j + 1];
+	off_t old_size = node->size;
+	size_t used = node->file->used;
+	int64_t reserved = punch ? 0 : reserve_blocks(node, offset, length);
+	if (reserved < 0) {
+		pthread_rwlock_unlock(&node->lock);
+		return (int) reserved;
+	}
+
+	// Only the bytes of the file can be punched.
+	off_t end = offset + length;
+	if (punch && offset < node->size) {
+		off_t size = end < node->size ? length : node->size - offset;
+		ret = file_punch_blocks(node->file, offset, size);
+	} else if (!punch) {
+		ret = file_allocate_blocks(node->file, offset, length);
+		if (ret != 0) {
+			fprintf(stderr, FILE_GROW_FAILED);
+			ret = -ENOSPC;
+		}
+	}
+	if (ret != 0) {
+		count_file(node, old_size, used, reserved);
+		pthread_rwlock_unlock(&node->lock);
+		return ret;
 	}
-	parent->dir->size--;
 
-	// TODO: ADD COMMENT
-	free(file_to_remove->inode->file);
-	free(file_to_remove->inode);
-	free(file_to_remove);
+	bool grows = !keep_size && end > node->size;
+	if (grows) {
+		node->size = end;
+	}
+	count_file(node, old_size, used, reserved);
+	if (punch || grows) {
+		node->mtime = time(NULL);
+		node->ctime = time(NULL);
+	}
+	*lsn = log_change(node,
+	                  (journal_record){ .op = JOURNAL_FALLOCATE,
+	                                    .mode = mode,
+	                                    .offset = offset,
+	                                    .size = length });
 
+	pthread_rwlock_unlock(&node->lock);
 	return EXIT_SUCCESS;
 }
 
-void
-filesystem_destroy(void *private_data)
+// Where lseek with SEEK_DATA or SEEK_HOLE lands from `offset` in `node`.
+// Blocks pending in the image or packed count as data without loading
+// them.
+static off_t
+seek_inode(inode *node, off_t offset, int whence)
 {
-	printf("Saving filesystem to disk: %s\n", filedisk);
-	FILE *output = fopen(filedisk, "wb");
-	serialize_inode(output, fs.root);
-	fclose(output);
-	printf("Filesystem saved to disk: %s\n", filedisk);
+	if (!node->file) {
+		fprintf(stderr, INODE_NOT_FILE);
+		return -EINVAL;
+	}
+	if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+		return -EINVAL;
+	}
+
+	pthread_rwlock_rdlock(&node->lock);
+	off_t size = node->size;
+	off_t found = -ENXIO;
+	bool data = whence == SEEK_DATA;
+	if (offset >= 0 && offset < size) {
+		found = file_seek(node->file, offset, size, data);
+		// The end of the file is a hole, but not data.
+		if (data && found == size) {
+			found = -ENXIO;
+		}
+	}
+	pthread_rwlock_unlock(&node->lock);
+	return found;
+}
+
+// Copies
+//
+// copy_inode copies a range of a file into another, or elsewhere in the
+// same one, sharing the blocks it can instead of copying their data (see
+// file_clone_blocks): copying a whole file costs a pointer and a count
+// per block, and a block is only copied once either side writes to it.
+// A shared block that is already saved keeps its record, so the image
+// grows by the inode record alone.
+//
+// It holds fs.lock for reading, like write, and the locks of both files:
+// the source for reading and the destination for writing, taken in the
+// order of their numbers so that copies between the same two files in
+// opposite directions do not deadlock. Each call only keeps those two
+// files locked, while it copies at most COPY_MAX.
+//
+// A source with no inode, the stats file or a file of a snapshot, is left
+// to the caller, which copies it through read and write: the kernel and
+// cp fall back on EOPNOTSUPP, not on the EROFS or EACCES of the lookup.
+//
+// FUSE replies the bytes copied in 32 bits, so a call copies at most
+// COPY_MAX, whole blocks so that the next call can share them too, and
+// the caller loops for the rest.
+#define COPY_MAX ((size_t) UINT32_MAX & ~(size_t) (BLOCK_SIZE - 1))
+
+// The error to copy a source that failed to resolve with `ret`.
+static ssize_t
+source_error(ssize_t ret)
+{
+	return ret == -EROFS || ret == -EACCES ? -EOPNOTSUPP : ret;
+}
+
+// Logs the `size` bytes copied at `offset` of `node` as writes, for a
+// source replay would not find.
+static uint64_t
+log_copied(inode *node, off_t offset, size_t size)
+{
+	char buf[BLOCK_SIZE];
+	uint64_t lsn = 0;
+	for (size_t done = 0; done < size; done += sizeof(buf)) {
+		size_t chunk = size - done < sizeof(buf) ? size - done
+		                                         : sizeof(buf);
+		file_read_blocks(node->file, buf, chunk, offset + done);
+		lsn = log_change(node,
+		                 (journal_record){ .op = JOURNAL_WRITE,
+		                                   .data = buf,
+		                                   .size = chunk,
+		                                   .offset = offset + done });
+	}
+	return lsn;
+}
+
+// Locks the files `src` for reading and `dst` for writing, in the order
+// of their numbers, with all of their blocks loaded; only `dst` if they
+// are the same. On success the caller must unlock both (see
+// unlock_copy).
+static int
+lock_copy(inode *src, inode *dst)
+{
+	if (src == dst) {
+		return lock_contents(dst, true);
+	}
+	inode *first = dst->ino < src->ino ? dst : src;
+	inode *second = first == dst ? src : dst;
+	int ret = lock_contents(first, first == dst);
+	if (ret != EXIT_SUCCESS) {
+		return ret;
+	}
+	ret = lock_contents(second, second == dst);
+	if (ret != EXIT_SUCCESS) {
+		pthread_rwlock_unlock(&first->lock);
+	}
+	return ret;
+}
+
+static void
+unlock_copy(inode *src, inode *dst)
+{
+	pthread_rwlock_unlock(&dst->lock);
+	if (src != dst) {
+		pthread_rwlock_unlock(&src->lock);
+	}
+}
+
+// copy_inode on files locked by the caller (see lock_copy).
+static ssize_t
+copy_locked(inode *src,
+            off_t src_offset,
+            inode *dst,
+            off_t dst_offset,
+            size_t size,
+            uint64_t *lsn)
+{
+	if (src_offset >= src->size) {
+		return 0;
+	}
+	if ((off_t) size > src->size - src_offset) {
+		size = src->size - src_offset;
+	}
+	if (size > COPY_MAX) {
+		size = COPY_MAX;
+	}
+	if (dst_offset > INT64_MAX - (off_t) size) {
+		return -EFBIG;
+	}
+	off_t dst_end = dst_offset + size;
+	if (src == dst && src_offset < dst_end &&
+	    dst_offset < src_offset + (off_t) size) {
+		return -EINVAL;
+	}
+
+	int ret = snapshot_preserve(dst);
+	if (ret != EXIT_SUCCESS) {
+		return ret;
+	}
+	off_t old_size = dst->size;
+	size_t used = dst->file->used;
+	int64_t reserved = reserve_blocks(dst, dst_offset, size);
+	if (reserved < 0) {
+		return reserved;
+	}
+	bool share_tail = src_offset + (off_t) size == src->size &&
+	                  dst_end >= dst->size;
+	ret = file_clone_blocks(
+	        dst->file, dst_offset, src->file, src_offset, size, share_tail);
+	if (ret != 0) {
+		count_file(dst, old_size, used, reserved);
+		fprintf(stderr, FILE_GROW_FAILED);
+		return ret;
+	}
+
+	if (dst_end > dst->size) {
+		dst->size = dst_end;
+	}
+	count_file(dst, old_size, used, reserved);
+	dst->mtime = time(NULL);
+	dst->ctime = time(NULL);
+	if (src->nlink == 0) {
+		*lsn = log_copied(dst, dst_offset, size);
+	} else {
+		*lsn = log_change(dst,
+		                  (journal_record){ .op = JOURNAL_COPY,
+		                                    .new_ino = src->ino,
+		                                    .src_offset = src_offset,
+		                                    .offset = dst_offset,
+		                                    .size = size });
+	}
+	return size;
+}
+
+// Copies up to `size` bytes at `src_offset` of `src` to `dst_offset` of
+// `dst`, as copy_file_range does. Returns the bytes copied. The caller
+// must hold fs.lock.
+static ssize_t
+copy_inode(inode *src,
+           off_t src_offset,
+           inode *dst,
+           off_t dst_offset,
+           size_t size,
+           uint64_t *lsn)
+{
+	if (!src->file || !dst->file) {
+		fprintf(stderr, INODE_NOT_FILE);
+		return -EISDIR;
+	}
+	if (src_offset < 0 || dst_offset < 0) {
+		fprintf(stderr, OFFSET_OUT_OF_BOUNDS);
+		return -EINVAL;
+	}
+	int ret = lock_copy(src, dst);
+	if (ret != EXIT_SUCCESS) {
+		return ret;
+	}
+	ssize_t copied =
+	        copy_locked(src, src_offset, dst, dst_offset, size, lsn);
+	unlock_copy(src, dst);
+	return copied;
+}
+
+// Snapshots
+//
+// SNAPSHOTS_PATH, or SNAPSHOTS_INO in the low-level front end, lists the
+// snapshots taken with mkdir in it (see snapshot.c). It is not listed in
+// the root, like the stats file. Everything below it is read-only and
+// has no inode of its own: the low-level front end numbers the inode
+// `ino` of the snapshot `id` SNAPSHOT_KEY(id, ino), a view, and every
+// callback resolves it again to the inode that holds it now, so no
+// reference is counted. The high-level one walks the path the same way.
+
+// Locks for reading the inode behind `view`, with its blocks loaded if
+// it is a file and `contents`. On success the caller must unlock it. The
+// caller must hold fs.lock.
+static int
+lock_view(uint64_t view, bool contents, inode **result)
+{
+	if (view == SNAPSHOTS_INO) {
+		*result = snapshot_dir();
+		pthread_rwlock_rdlock(&(*result)->lock);
+		return EXIT_SUCCESS;
+	}
+	uint64_t id = SNAPSHOT_ID(view);
+	if (!snapshot_exists(id)) {
+		return -ENOENT;
+	}
+
+	inode *stale = NULL;
+	for (;;) {
+		inode *node = snapshot_resolve(id, SNAPSHOT_INO(view));
+		if (node == NULL || node == stale) {
+			fprintf(stderr,
+			        INODE_NUMBER_NOT_FOUND,
+			        (unsigned long long) view);
+			return -ENOENT;
+		}
+		int ret = ensure_loaded(node);
+		if (ret == EXIT_SUCCESS && contents && node->file != NULL) {
+			ret = lock_contents(node, false);
+		} else if (ret == EXIT_SUCCESS) {
+			pthread_rwlock_rdlock(&node->lock);
+		}
+		if (ret != EXIT_SUCCESS) {
+			return ret;
+		}
+		if (snapshot_covers(node, id)) {
+			*result = node;
+			return EXIT_SUCCESS;
+		}
+		// Preserved and changed since it was resolved, the frozen
+		// copy holds it now.
+		pthread_rwlock_unlock(&node->lock);
+		stale = node;
+	}
+}
+
+// The view of the entry `entry` of the directory behind `view`.
+static uint64_t
+view_entry(uint64_t view, const dentry *entry)
+{
+	if (view == SNAPSHOTS_INO) {
+		return SNAPSHOT_KEY(entry->ino, ROOT_INO);
+	}
+	uint64_t ino = entry->inode != NULL ? entry->inode->ino : entry->ino;
+	return SNAPSHOT_KEY(SNAPSHOT_ID(view), ino);
+}
+
+static int
+stat_view(uint64_t view, struct stat *stbuf)
+{
+	inode *node = NULL;
+	int ret = lock_view(view, false, &node);
+	if (ret != EXIT_SUCCESS) {
+		return ret;
+	}
+	inode_to_stat(node, stbuf);
+	pthread_rwlock_unlock(&node->lock);
+	stbuf->st_ino = view;
+	stbuf->st_mode &= ~(S_IWUSR | S_IWGRP | S_IWOTH);
+	return EXIT_SUCCESS;
+}
+
+// Looks up `name` in the directory behind `view`, returning its view.
+static int
+lookup_view(uint64_t view, const char *name, uint64_t *result)
+{
+	inode *node = NULL;
+	int ret = lock_view(view, false, &node);
+	if (ret != EXIT_SUCCESS) {
+		return ret;
+	}
+	const dentry *entry = NULL;
+	if (node->dir == NULL) {
+		ret = -ENOTDIR;
+	} else if ((entry = dir_lookup(node->dir, name)) == NULL) {
+		ret = -ENOENT;
+	} else {
+		*result = view_entry(view, entry);
+	}
+	pthread_rwlock_unlock(&node->lock);
+	return ret;
+}
+
+// Resolves `path`, below SNAPSHOTS_PATH, to its view.
+static int
+view_of_path(const char *path, uint64_t *result)
+{
+	char name[MAX_FILENAME];
+	uint64_t view = SNAPSHOTS_INO;
+	const char *read_path = path + strlen(SNAPSHOTS_PATH);
+
+	while (*read_path != '\0') {
+		read_path++;  // Skip the '/'
+		size_t len = strcspn(read_path, "/");
+		if (len == 0) {
+			// Trailing '/'
+			continue;
+		}
+		if (len >= sizeof(name)) {
+			return -ENAMETOOLONG;
+		}
+		memcpy(name, read_path, len);
+		name[len] = '\0';
+		int ret = lookup_view(view, name, &view);
+		if (ret != EXIT_SUCCESS) {
+			return ret;
+		}
+		read_path += len;
+	}
+	*result = view;
+	return EXIT_SUCCESS;
+}
+
+// Lists the entries of `dir` after the cookie `offset`, numbered by
+// their views, until `filler` is full.
+static void
+fill_view_entries(uint64_t view,
+                  const inode_dir *dir,
+                  void *buf,
+                  fuse_fill_dir_t filler,
+                  off_t offset)
+{
+	struct stat stbuf;
+	memset(&stbuf, 0, sizeof(struct stat));
+	for (int i = dir_seek(dir, offset); i < dir->slots; i++) {
+		const dentry *entry = dir->entries[i];
+		if (entry == NULL) {
+			continue;
+		}
+		stbuf.st_ino = view_entry(view, entry);
+		if (filler(buf,
+		           entry->filename,
+		           &stbuf,
+		           entry->cookie,
+		           0) != 0) {
+			return;
+		}
+	}
+}
+
+// readdir_inode on the directory behind `view`. Types are left unknown,
+// as for stubs, even for readdirplus: views count no references.
+static int
+readdir_view(uint64_t view, void *buf, fuse_fill_dir_t filler, off_t offset)
+{
+	inode *node = NULL;
+	int ret = lock_view(view, false, &node);
+	if (ret != EXIT_SUCCESS) {
+		return ret;
+	}
+	if (!node->dir) {
+		pthread_rwlock_unlock(&node->lock);
+		fprintf(stderr, PARENT_INODE_NOT_DIRECTORY);
+		return -ENOENT;
+	}
+
+	struct stat stbuf;
+	memset(&stbuf, 0, sizeof(struct stat));
+	stbuf.st_ino = view;
+	if ((offset >= DIR_DOT_COOKIE ||
+	     filler(buf, ".", &stbuf, DIR_DOT_COOKIE, 0) == 0) &&
+	    (offset >= DIR_DOTDOT_COOKIE ||
+	     filler(buf, "..", &stbuf, DIR_DOTDOT_COOKIE, 0) == 0)) {
+		fill_view_entries(view, node->dir, buf, filler, offset);
+	}
+	pthread_rwlock_unlock(&node->lock);
+	return EXIT_SUCCESS;
+}
+
+// Opens the file behind `view` for `fi`, only for reading. The open file
+// keeps the view, not the inode (see open_file).
+static int
+open_view(uint64_t view, struct fuse_file_info *fi)
+{
+	if (fi != NULL && (fi->flags & O_ACCMODE) != O_RDONLY) {
+		fprintf(stderr, READ_ONLY_SNAPSHOT, "open");
+		return -EROFS;
+	}
+	inode *node = NULL;
+	int ret = lock_view(view, false, &node);
+	if (ret != EXIT_SUCCESS) {
+		return ret;
+	}
+	bool is_file = node->file != NULL;
+	pthread_rwlock_unlock(&node->lock);
+	if (!is_file) {
+		return -EISDIR;
+	}
+	if (fi == NULL) {
+		return EXIT_SUCCESS;
+	}
+
+	open_file *file = slab_alloc(&open_file_slab);
+	if (file == NULL) {
+		return -ENOMEM;
+	}
+	file->view = view;
+	file->flags = fi->flags;
+	fi->fh = (uintptr_t) file;
+	return EXIT_SUCCESS;
+}
+
+// Reads from the file behind `view`, leaving atime alone.
+static int
+read_view(uint64_t view, char *buf, size_t size, off_t offset)
+{
+	inode *node = NULL;
+	int ret = lock_view(view, true, &node);
+	if (ret != EXIT_SUCCESS) {
+		return ret;
+	}
+	if (node->file != NULL) {
+		ret = read_locked(node, buf, size, offset);
+	} else {
+		fprintf(stderr, INODE_NOT_FILE);
+		ret = -EISDIR;
+	}
+	pthread_rwlock_unlock(&node->lock);
+	return ret;
+}
+
+// send_inode on the file behind `view`, leaving atime alone.
+static int
+send_view(uint64_t view,
+          size_t size,
+          off_t offset,
+          filesystem_send_fn send,
+          void *arg)
+{
+	inode *node = NULL;
+	int ret = lock_view(view, true, &node);
+	if (ret != EXIT_SUCCESS) {
+		return ret;
+	}
+	if (node->file != NULL) {
+		ret = send_locked(node, size, offset, send, arg);
+	} else {
+		fprintf(stderr, INODE_NOT_FILE);
+		ret = -EISDIR;
+	}
+	pthread_rwlock_unlock(&node->lock);
+	return ret;
+}
+
+// Takes the snapshot `name`, returning its id in `id`.
+static int
+take_snapshot(const char *name, uint64_t *id)
+{
+	if (strlen(name) >= MAX_FILENAME) {
+		return -ENAMETOOLONG;
+	}
+
+	uint64_t lsn = 0;
+	pthread_rwlock_wrlock(&fs.lock);
+	int ret = snapshot_take(name, &lsn);
+	*id = snapshot_epoch();
+	pthread_rwlock_unlock(&fs.lock);
+	journal_commit(lsn);
+	return ret;
+}
+
+// Removes the snapshot `name`.
+static int
+remove_snapshot(const char *name)
+{
+	uint64_t lsn = 0;
+	pthread_rwlock_wrlock(&fs.lock);
+	int ret = snapshot_remove(name, &lsn);
+	pthread_rwlock_unlock(&fs.lock);
+	journal_commit(lsn);
+	return ret;
+}
+
+// Whether `path` names a snapshot, SNAPSHOTS_PATH/<name>, setting `name`
+// to where its name starts.
+static bool
+is_snapshot(const char *path, const char **name)
+{
+	*name = path + strlen(SNAPSHOTS_PATH "/");
+	return in_snapshots(path) && (*name)[-1] == '/' && **name != '\0' &&
+	       strchr(*name, '/') == NULL;
+}
+
+// High-level front end, by path
+
+int
+filesystem_getattr(const char *path, struct stat *stbuf)
+{
+	if (strcmp(path, STATS_PATH) == 0) {
+		stat_stats(stbuf);
+		return EXIT_SUCCESS;
+	}
+
+	pthread_rwlock_rdlock(&fs.lock);
+
+	if (in_snapshots(path)) {
+		uint64_t view = 0;
+		int ret = view_of_path(path, &view);
+		if (ret == EXIT_SUCCESS) {
+			ret = stat_view(view, stbuf);
+		}
+		pthread_rwlock_unlock(&fs.lock);
+		return ret;
+	}
+
+	inode *inode = NULL;
+	int ret = search_inode(path, &inode);
+	if (ret != EXIT_SUCCESS) {
+		pthread_rwlock_unlock(&fs.lock);
+		fprintf(stderr, INODE_NOT_FOUND, path);
+		return -ENOENT;
+	}
+	stat_inode(inode, stbuf);
+
+	pthread_rwlock_unlock(&fs.lock);
+	return EXIT_SUCCESS;
+}
+
+// mkdir and create, which opens the file for `fi` if not null.
+// Invalidating the path after the parent is unlocked is enough: a
+// negative entry for it can only have been stored before.
+static int
+make_path(const char *path,
+          journal_op op,
+          mode_t mode,
+          struct fuse_file_info *fi)
+{
+	char name[MAX_FILENAME];
+	inode *parent = NULL;
+	inode *node = NULL;
+	uint64_t lsn = 0;
+
+	pthread_rwlock_rdlock(&fs.lock);
+	int ret = find_parent(path, &parent, name);
+	if (ret == EXIT_SUCCESS) {
+		ret = make_node(parent, name, op, mode, 0, &node, &lsn);
+	}
+	if (ret == EXIT_SUCCESS) {
+		path_cache_invalidate(path);
+		if (fi != NULL) {
+			ret = open_handle(node, fi);
+		}
+	}
+	pthread_rwlock_unlock(&fs.lock);
+	journal_commit(lsn);
+	return ret;
+}
+
+int
+filesystem_mkdir(const char *path, mode_t mode)
+{
+	// Also replays the snapshots in the journal.
+	const char *name;
+	if (is_snapshot(path, &name)) {
+		uint64_t id;
+		return take_snapshot(name, &id);
+	}
+	return make_path(path, JOURNAL_MKDIR, mode, NULL);
+}
+
+int
+filesystem_readdir(const char *path,
+                   void *buf,
+                   fuse_fill_dir_t filler,
+                   off_t offset,
+                   struct fuse_file_info *fi,
+                   enum fuse_readdir_flags flags)
+{
+	pthread_rwlock_rdlock(&fs.lock);
+
+	if (in_snapshots(path)) {
+		uint64_t view = 0;
+		int ret = view_of_path(path, &view);
+		if (ret == EXIT_SUCCESS) {
+			ret = readdir_view(view, buf, filler, offset);
+		}
+		pthread_rwlock_unlock(&fs.lock);
+		return ret;
+	}
+
+	inode *directory = NULL;
+	int ret = search_inode(path, &directory);
+	if (ret != EXIT_SUCCESS) {
+		pthread_rwlock_unlock(&fs.lock);
+		fprintf(stderr, PARENT_DIRECTORY_NOT_FOUND);
+		return -ENOENT;
+	}
+	// libfuse counts the lookups of the high-level front end itself.
+	ret = readdir_inode(directory,
+	                    buf,
+	                    filler,
+	                    offset,
+	                    flags & FUSE_READDIR_PLUS ? DIRENT_ATTR : DIRENT_TYPE);
+
+	pthread_rwlock_unlock(&fs.lock);
+	return ret;
+}
+
+// rmdir and unlink.
+static int
+remove_path(const char *path, journal_op op)
+{
+	char name[MAX_FILENAME];
+	inode *parent = NULL;
+	uint64_t lsn = 0;
+
+	// Exclusive, no other thread can be using the inode being freed.
+	pthread_rwlock_wrlock(&fs.lock);
+	int ret = find_parent(path, &parent, name);
+	if (ret == EXIT_SUCCESS) {
+		ret = remove_node(parent, name, op, &lsn);
+	}
+	if (ret == EXIT_SUCCESS) {
+		path_cache_invalidate(path);
+	}
+	pthread_rwlock_unlock(&fs.lock);
+	journal_commit(lsn);
+	return ret;
+}
+
+int
+filesystem_rmdir(const char *path)
+{
+	// Also replays the removed snapshots in the journal.
+	const char *name;
+	if (is_snapshot(path, &name)) {
+		return remove_snapshot(name);
+	}
+	return remove_path(path, JOURNAL_RMDIR);
+}
+
+int
+filesystem_utimens(const char *path, const struct timespec tv[2])
+{
+	pthread_rwlock_rdlock(&fs.lock);
+
+	inode *inode = NULL;
+	int ret = search_inode(path, &inode);
+	if (ret != EXIT_SUCCESS) {
+		pthread_rwlock_unlock(&fs.lock);
+		if (ret == -EROFS) {
+			return ret;
+		}
+		fprintf(stderr, INODE_NOT_FOUND, path);
+		return -ENOENT;
+	}
+
+	uint64_t lsn = 0;
+	ret = utimens_inode(inode, tv, &lsn);
+
+	pthread_rwlock_unlock(&fs.lock);
+	journal_commit(lsn);
+	return ret;
+}
+
+int
+filesystem_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	return make_path(path, JOURNAL_CREATE, mode, fi);
+}
+
+// Looks up the inode a callback on `path` refers to: the one of its open
+// file, if it has one, so that path is only resolved when opening.
+static int
+resolve_path(const char *path, struct fuse_file_info *fi, inode **result)
+{
+	open_file *file = handle_of(fi);
+	if (file != NULL) {
+		*result = file->node;
+		// Only reads reach the stats file and the files of snapshots,
+		// which have no inode.
+		if (file->node != NULL) {
+			return EXIT_SUCCESS;
+		}
+		return file->view != 0 ? -EROFS : -EACCES;
+	}
+	int ret = search_inode(path, result);
+	if (ret == -EROFS) {
+		return ret;
+	} else if (ret != EXIT_SUCCESS) {
+		fprintf(stderr, INODE_NOT_FOUND, path);
+		return -ENOENT;
+	}
+	return EXIT_SUCCESS;
+}
+
+// Whether writes through `fi` go to the end of the file.
+static bool
+appends(const struct fuse_file_info *fi)
+{
+	open_file *file = handle_of(fi);
+	return file != NULL && (file->flags & O_APPEND);
+}
+
+int
+filesystem_read(const char *path,
+                char *buf,
+                size_t size,
+                off_t offset,
+                struct fuse_file_info *fi)
+{
+	open_file *file = handle_of(fi);
+	if (file != NULL && file->text != NULL) {
+		const char *text = stats_range(file, &size, offset);
+		memcpy(buf, text, size);
+		return (int) size;
+	}
+
+	pthread_rwlock_rdlock(&fs.lock);
+	inode *inode = NULL;
+	int ret;
+	if (file != NULL && file->view != 0) {
+		ret = read_view(file->view, buf, size, offset);
+	} else if ((ret = resolve_path(path, fi, &inode)) == EXIT_SUCCESS) {
+		ret = read_inode(inode, buf, size, offset);
+	}
+	pthread_rwlock_unlock(&fs.lock);
+	return ret;
+}
+
+
+int
+filesystem_open(const char *path, struct fuse_file_info *fi)
+{
+	if (strcmp(path, STATS_PATH) == 0) {
+		return open_stats(fi);
+	}
+
+	pthread_rwlock_rdlock(&fs.lock);
+
+	if (in_snapshots(path)) {
+		uint64_t view = 0;
+		int ret = view_of_path(path, &view);
+		if (ret == EXIT_SUCCESS) {
+			ret = open_view(view, fi);
+		}
+		pthread_rwlock_unlock(&fs.lock);
+		return ret;
+	}
+
+	inode *inode = NULL;
+	int ret = search_inode(path, &inode);
+	if (ret != EXIT_SUCCESS) {
+		pthread_rwlock_unlock(&fs.lock);
+		fprintf(stderr, INODE_NOT_FOUND, path);
+		return -ENOENT;
+	} else if (!inode->file) {
+		pthread_rwlock_unlock(&fs.lock);
+		fprintf(stderr, INODE_NOT_FILE);
+		return -ENOENT;
+	}
+	if (fi != NULL) {
+		ret = open_handle(inode, fi);
+	}
+
+	pthread_rwlock_unlock(&fs.lock);
+	return ret;
+}
+
+int
+filesystem_flush(const char *path, struct fuse_file_info *fi)
+{
+	// Nothing is buffered per open file: each write is in the journal
+	// (see journal_commit) by the time it returns.
+	return EXIT_SUCCESS;
+}
+
+int
+filesystem_release(const char *path, struct fuse_file_info *fi)
+{
+	release_handle(fi);
+	return EXIT_SUCCESS;
+}
+
+int
+filesystem_write(const char *path,
+                 const char *buf,
+                 size_t size,
+                 off_t offset,
+                 struct fuse_file_info *fi)
+{
+	struct fuse_bufvec src = bufvec_at(buf, size);
+	return filesystem_write_buf(path, &src, offset, fi);
+}
+
+int
+filesystem_write_buf(const char *path,
+                     struct fuse_bufvec *buf,
+                     off_t offset,
+                     struct fuse_file_info *fi)
+{
+	pthread_rwlock_rdlock(&fs.lock);
+	uint64_t lsn = 0;
+	inode *inode = NULL;
+	int ret = resolve_path(path, fi, &inode);
+	if (ret == EXIT_SUCCESS) {
+		ret = write_inode(inode, buf, offset, appends(fi), &lsn);
+	}
+	pthread_rwlock_unlock(&fs.lock);
+	journal_commit(lsn);
+	return ret;
+}
+
+int
+filesystem_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+	pthread_rwlock_rdlock(&fs.lock);
+	uint64_t lsn = 0;
+	inode *inode = NULL;
+	int ret = resolve_path(path, fi, &inode);
+	if (ret == EXIT_SUCCESS) {
+		ret = truncate_inode(inode, size, &lsn);
+	}
+	pthread_rwlock_unlock(&fs.lock);
+	journal_commit(lsn);
+	return ret;
+}
+
+int
+filesystem_truncate(const char *path, off_t size)
+{
+	return filesystem_ftruncate(path, size, NULL);
+}
+
+int
+filesystem_fallocate(const char *path,
+                     int mode,
+                     off_t offset,
+                     off_t length,
+                     struct fuse_file_info *fi)
+{
+	pthread_rwlock_rdlock(&fs.lock);
+	uint64_t lsn = 0;
+	inode *inode = NULL;
+	int ret = resolve_path(path, fi, &inode);
+	if (ret == EXIT_SUCCESS) {
+		ret = fallocate_inode(inode, mode, offset, length, &lsn);
+	}
+	pthread_rwlock_unlock(&fs.lock);
+	journal_commit(lsn);
+	return ret;
+}
+
+off_t
+filesystem_lseek(const char *path,
+                 off_t offset,
+                 int whence,
+                 struct fuse_file_info *fi)
+{
+	pthread_rwlock_rdlock(&fs.lock);
+	inode *inode = NULL;
+	off_t ret = resolve_path(path, fi, &inode);
+	if (ret == EXIT_SUCCESS) {
+		ret = seek_inode(inode, offset, whence);
+	}
+	pthread_rwlock_unlock(&fs.lock);
+	return ret;
+}
+
+ssize_t
+filesystem_copy_file_range(const char *path_in,
+                           struct fuse_file_info *fi_in,
+                           off_t offset_in,
+                           const char *path_out,
+                           struct fuse_file_info *fi_out,
+                           off_t offset_out,
+                           size_t size,
+                           int flags)
+{
+	if (flags != 0) {
+		return -EINVAL;
+	}
+
+	pthread_rwlock_rdlock(&fs.lock);
+	uint64_t lsn = 0;
+	inode *src = NULL;
+	inode *dst = NULL;
+	ssize_t ret = source_error(resolve_path(path_in, fi_in, &src));
+	if (ret == EXIT_SUCCESS) {
+		ret = resolve_path(path_out, fi_out, &dst);
+	}
+	if (ret == EXIT_SUCCESS) {
+		ret = copy_inode(src, offset_in, dst, offset_out, size, &lsn);
+	}
+	pthread_rwlock_unlock(&fs.lock);
+	journal_commit(lsn);
+	return ret;
+}
+
+int
+filesystem_unlink(const char *path)
+{
+	return remove_path(path, JOURNAL_UNLINK);
+}
+
+int
+filesystem_rename(const char *from, const char *to)
+{
+	char name[MAX_FILENAME];
+	char new_name[MAX_FILENAME];
+	inode *parent = NULL;
+	inode *new_parent = NULL;
+	uint64_t lsn = 0;
+
+	// Exclusive, it may free the inode it replaces.
+	pthread_rwlock_wrlock(&fs.lock);
+	int ret = find_parent(from, &parent, name);
+	if (ret == EXIT_SUCCESS) {
+		ret = find_parent(to, &new_parent, new_name);
+	}
+	inode *node = NULL;
+	if (ret == EXIT_SUCCESS) {
+		ret = search_inode(from, &node);
+	}
+	size_t len = strlen(from);
+	if (ret == EXIT_SUCCESS && node->dir != NULL &&
+	    strncmp(from, to, len) == 0 && to[len] == '/') {
+		fprintf(stderr, MOVE_INTO_ITSELF, to);
+		ret = -EINVAL;
+	}
+	if (ret == EXIT_SUCCESS) {
+		ret = rename_node(parent, name, new_parent, new_name, &lsn);
+	}
+	if (ret == EXIT_SUCCESS && node->dir != NULL) {
+		// Every path below it changed.
+		path_cache_invalidate_all();
+	} else if (ret == EXIT_SUCCESS) {
+		path_cache_invalidate(from);
+		path_cache_invalidate(to);
+	}
+	pthread_rwlock_unlock(&fs.lock);
+	journal_commit(lsn);
+	return ret;
+}
+
+int
+filesystem_link(const char *from, const char *to)
+{
+	char name[MAX_FILENAME];
+	inode *node = NULL;
+	inode *parent = NULL;
+	uint64_t lsn = 0;
+
+	pthread_rwlock_wrlock(&fs.lock);
+	int ret = search_inode(from, &node);
+	if (ret == EXIT_SUCCESS) {
+		ret = find_parent(to, &parent, name);
+	}
+	if (ret == EXIT_SUCCESS) {
+		ret = link_node(node, parent, name, &lsn);
+	}
+	if (ret == EXIT_SUCCESS) {
+		path_cache_invalidate(to);
+	}
+	pthread_rwlock_unlock(&fs.lock);
+	journal_commit(lsn);
+	return ret;
+}
+
+// Reports the usage counters, whatever `path` (see usage.c).
+int
+filesystem_statfs(const char *path, struct statvfs *stbuf)
+{
+	usage_statfs(stbuf);
+	return 0;
+}
+
+// Low-level front end, by inode number (see lowlevel.c)
+//
+// Inodes handed to the kernel by lookup, mkdir and create count a
+// reference in node->refs until filesystem_ll_forget drops it.
+
+// Counts a reference handed to the kernel and fills `stbuf`. The caller
+// must hold fs.lock.
+static void
+hand_out(inode *node, struct stat *stbuf)
+{
+	__atomic_add_fetch(&node->refs, 1, __ATOMIC_RELAXED);
+	stat_inode(node, stbuf);
+}
+
+int
+filesystem_ll_lookup(uint64_t parent, const char *name, struct stat *stbuf)
+{
+	if (parent == ROOT_INO && strcmp(name, STATS_NAME) == 0) {
+		stat_stats(stbuf);
+		return EXIT_SUCCESS;
+	}
+
+	pthread_rwlock_rdlock(&fs.lock);
+
+	// Views count no references (see the snapshots above).
+	uint64_t view = 0;
+	if (parent == ROOT_INO && strcmp(name, SNAPSHOTS_NAME) == 0) {
+		view = SNAPSHOTS_INO;
+	} else if (is_view(parent)) {
+		int ret = lookup_view(parent, name, &view);
+		if (ret != EXIT_SUCCESS) {
+			pthread_rwlock_unlock(&fs.lock);
+			return ret;
+		}
+	}
+	if (view != 0) {
+		int ret = stat_view(view, stbuf);
+		pthread_rwlock_unlock(&fs.lock);
+		return ret;
+	}
+
+	inode *dir = NULL;
+	int ret = find_inode(parent, &dir);
+	if (ret == EXIT_SUCCESS && !dir->dir) {
+		ret = -ENOTDIR;
+	}
+	inode *node = NULL;
+	if (ret == EXIT_SUCCESS) {
+		pthread_rwlock_rdlock(&dir->lock);
+		dentry *entry = dir_lookup(dir->dir, name);
+		node = entry != NULL ? entry->inode : NULL;
+		pthread_rwlock_unlock(&dir->lock);
+		ret = node != NULL ? ensure_loaded(node) : -ENOENT;
+	}
+	if (ret == EXIT_SUCCESS) {
+		hand_out(node, stbuf);
+	}
+
+	pthread_rwlock_unlock(&fs.lock);
+	return ret;
+}
+
+void
+filesystem_ll_forget(uint64_t ino, uint64_t nlookup)
+{
+	if (is_view(ino)) {
+		return;
+	}
+	// The references being dropped keep it in the table until then.
+	inode *node = inode_table_get(ino);
+	if (node != NULL) {
+		put_refs(node, nlookup);
+	}
+}
+
+int
+filesystem_ll_getattr(uint64_t ino, struct stat *stbuf)
+{
+	if (ino == STATS_INO) {
+		stat_stats(stbuf);
+		return EXIT_SUCCESS;
+	}
+
+	pthread_rwlock_rdlock(&fs.lock);
+	if (is_view(ino)) {
+		int ret = stat_view(ino, stbuf);
+		pthread_rwlock_unlock(&fs.lock);
+		return ret;
+	}
+	inode *node = NULL;
+	int ret = find_inode(ino, &node);
+	if (ret == EXIT_SUCCESS) {
+		stat_inode(node, stbuf);
+	}
+	pthread_rwlock_unlock(&fs.lock);
+	return ret;
+}
+
+// mkdir and create, which opens the file for `fi` if not null.
+static int
+make_ll(uint64_t parent,
+        const char *name,
+        journal_op op,
+        mode_t mode,
+        struct stat *stbuf,
+        struct fuse_file_info *fi)
+{
+	inode *dir = NULL;
+	inode *node = NULL;
+	uint64_t lsn = 0;
+
+	pthread_rwlock_rdlock(&fs.lock);
+	int ret = find_inode(parent, &dir);
+	if (ret == EXIT_SUCCESS) {
+		ret = make_node(dir, name, op, mode, 0, &node, &lsn);
+	}
+	if (ret == EXIT_SUCCESS && fi != NULL) {
+		ret = open_handle(node, fi);
+	}
+	if (ret == EXIT_SUCCESS) {
+		hand_out(node, stbuf);
+	}
+	pthread_rwlock_unlock(&fs.lock);
+	journal_commit(lsn);
+	return ret;
+}
+
+int
+filesystem_ll_mkdir(uint64_t parent,
+                    const char *name,
+                    mode_t mode,
+                    struct stat *stbuf)
+{
+	if (parent != SNAPSHOTS_INO) {
+		return make_ll(parent, name, JOURNAL_MKDIR, mode, stbuf, NULL);
+	}
+
+	uint64_t id;
+	int ret = take_snapshot(name, &id);
+	if (ret == EXIT_SUCCESS) {
+		pthread_rwlock_rdlock(&fs.lock);
+		ret = stat_view(SNAPSHOT_KEY(id, ROOT_INO), stbuf);
+		pthread_rwlock_unlock(&fs.lock);
+	}
+	return ret;
+}
+
+int
+filesystem_ll_create(uint64_t parent,
+                     const char *name,
+                     mode_t mode,
+                     struct stat *stbuf,
+                     struct fuse_file_info *fi)
+{
+	return make_ll(parent, name, JOURNAL_CREATE, mode, stbuf, fi);
+}
+
+// rmdir and unlink.
+static int
+remove_ll(uint64_t parent, const char *name, journal_op op)
+{
+	inode *dir = NULL;
+	uint64_t lsn = 0;
+
+	pthread_rwlock_wrlock(&fs.lock);
+	int ret = find_inode(parent, &dir);
+	if (ret == EXIT_SUCCESS) {
+		ret = remove_node(dir, name, op, &lsn);
+	}
+	pthread_rwlock_unlock(&fs.lock);
+	journal_commit(lsn);
+	return ret;
+}
+
+int
+filesystem_ll_unlink(uint64_t parent, const char *name)
+{
+	return remove_ll(parent, name, JOURNAL_UNLINK);
+}
+
+int
+filesystem_ll_rmdir(uint64_t parent, const char *name)
+{
+	if (parent == SNAPSHOTS_INO) {
+		return remove_snapshot(name);
+	}
+	return remove_ll(parent, name, JOURNAL_RMDIR);
+}
+
+// The kernel already refuses to move a directory below itself, it knows
+// the ancestors of every directory it handed out.
+int
+filesystem_ll_rename(uint64_t parent,
+                     const char *name,
+                     uint64_t new_parent,
+                     const char *new_name)
+{
+	inode *dir = NULL;
+	inode *new_dir = NULL;
+	uint64_t lsn = 0;
+
+	pthread_rwlock_wrlock(&fs.lock);
+	int ret = find_inode(parent, &dir);
+	if (ret == EXIT_SUCCESS) {
+		ret = find_inode(new_parent, &new_dir);
+	}
+	if (ret == EXIT_SUCCESS) {
+		ret = rename_node(dir, name, new_dir, new_name, &lsn);
+	}
+	pthread_rwlock_unlock(&fs.lock);
+	journal_commit(lsn);
+	return ret;
+}
+
+int
+filesystem_ll_link(uint64_t ino,
+                   uint64_t new_parent,
+                   const char *new_name,
+                   struct stat *stbuf)
+{
+	inode *node = NULL;
+	inode *dir = NULL;
+	uint64_t lsn = 0;
+
+	pthread_rwlock_wrlock(&fs.lock);
+	int ret = find_inode(ino, &node);
+	if (ret == EXIT_SUCCESS) {
+		ret = find_inode(new_parent, &dir);
+	}
+	if (ret == EXIT_SUCCESS) {
+		ret = link_node(node, dir, new_name, &lsn);
+	}
+	if (ret == EXIT_SUCCESS) {
+		hand_out(node, stbuf);
+	}
+	pthread_rwlock_unlock(&fs.lock);
+	journal_commit(lsn);
+	return ret;
+}
+
+int
+filesystem_ll_open(uint64_t ino, struct fuse_file_info *fi)
+{
+	if (ino == STATS_INO) {
+		return open_stats(fi);
+	}
+
+	pthread_rwlock_rdlock(&fs.lock);
+	if (is_view(ino)) {
+		int ret = open_view(ino, fi);
+		pthread_rwlock_unlock(&fs.lock);
+		return ret;
+	}
+	inode *node = NULL;
+	int ret = find_inode(ino, &node);
+	if (ret == EXIT_SUCCESS && !node->file) {
+		ret = -EISDIR;
+	}
+	if (ret == EXIT_SUCCESS) {
+		ret = open_handle(node, fi);
+	}
+	pthread_rwlock_unlock(&fs.lock);
+	return ret;
+}
+
+void
+filesystem_ll_release(struct fuse_file_info *fi)
+{
+	release_handle(fi);
+}
+
+// Looks up the inode `ino`, through the open file of `fi` if it has one.
+static int
+resolve_ino(uint64_t ino, struct fuse_file_info *fi, inode **result)
+{
+	open_file *file = handle_of(fi);
+	if (file != NULL) {
+		*result = file->node;
+		// Only reads reach the stats file and the files of snapshots,
+		// which have no inode.
+		if (file->node != NULL) {
+			return EXIT_SUCCESS;
+		}
+		return file->view != 0 ? -EROFS : -EACCES;
+	}
+	return find_inode(ino, result);
+}
+
+int
+filesystem_ll_read_buf(uint64_t ino,
+                       size_t size,
+                       off_t offset,
+                       struct fuse_file_info *fi,
+                       filesystem_send_fn send,
+                       void *arg)
+{
+	open_file *file = handle_of(fi);
+	if (file != NULL && file->text != NULL) {
+		struct fuse_bufvec data = FUSE_BUFVEC_INIT(size);
+		data.buf[0].mem = (char *) stats_range(file, &data.buf[0].size,
+		                                       offset);
+		send(arg, &data);
+		return EXIT_SUCCESS;
+	}
+
+	pthread_rwlock_rdlock(&fs.lock);
+	inode *node = NULL;
+	int ret;
+	if (is_view(ino)) {
+		ret = send_view(ino, size, offset, send, arg);
+	} else if ((ret = resolve_ino(ino, fi, &node)) == EXIT_SUCCESS) {
+		ret = send_inode(node, size, offset, send, arg);
+	}
+	pthread_rwlock_unlock(&fs.lock);
+	return ret;
+}
+
+int
+filesystem_ll_write_buf(uint64_t ino,
+                        struct fuse_bufvec *buf,
+                        off_t offset,
+                        struct fuse_file_info *fi)
+{
+	pthread_rwlock_rdlock(&fs.lock);
+	uint64_t lsn = 0;
+	inode *node = NULL;
+	int ret = resolve_ino(ino, fi, &node);
+	if (ret == EXIT_SUCCESS) {
+		ret = write_inode(node, buf, offset, appends(fi), &lsn);
+	}
+	pthread_rwlock_unlock(&fs.lock);
+	journal_commit(lsn);
+	return ret;
+}
+
+int
+filesystem_ll_truncate(uint64_t ino, off_t size, struct fuse_file_info *fi)
+{
+	pthread_rwlock_rdlock(&fs.lock);
+	uint64_t lsn = 0;
+	inode *node = NULL;
+	int ret = resolve_ino(ino, fi, &node);
+	if (ret == EXIT_SUCCESS) {
+		ret = truncate_inode(node, size, &lsn);
+	}
+	pthread_rwlock_unlock(&fs.lock);
+	journal_commit(lsn);
+	return ret;
+}
+
+int
+filesystem_ll_fallocate(uint64_t ino,
+                        int mode,
+                        off_t offset,
+                        off_t length,
+                        struct fuse_file_info *fi)
+{
+	pthread_rwlock_rdlock(&fs.lock);
+	uint64_t lsn = 0;
+	inode *node = NULL;
+	int ret = resolve_ino(ino, fi, &node);
+	if (ret == EXIT_SUCCESS) {
+		ret = fallocate_inode(node, mode, offset, length, &lsn);
+	}
+	pthread_rwlock_unlock(&fs.lock);
+	journal_commit(lsn);
+	return ret;
+}
+
+off_t
+filesystem_ll_lseek(uint64_t ino,
+                    off_t offset,
+                    int whence,
+                    struct fuse_file_info *fi)
+{
+	pthread_rwlock_rdlock(&fs.lock);
+	inode *node = NULL;
+	off_t ret = resolve_ino(ino, fi, &node);
+	if (ret == EXIT_SUCCESS) {
+		ret = seek_inode(node, offset, whence);
+	}
+	pthread_rwlock_unlock(&fs.lock);
+	return ret;
+}
+
+ssize_t
+filesystem_ll_copy_file_range(uint64_t ino_in,
+                              off_t offset_in,
+                              struct fuse_file_info *fi_in,
+                              uint64_t ino_out,
+                              off_t offset_out,
+                              struct fuse_file_info *fi_out,
+                              size_t size,
+                              int flags)
+{
+	if (flags != 0) {
+		return -EINVAL;
+	}
+
+	pthread_rwlock_rdlock(&fs.lock);
+	uint64_t lsn = 0;
+	inode *src = NULL;
+	inode *dst = NULL;
+	ssize_t ret = source_error(resolve_ino(ino_in, fi_in, &src));
+	if (ret == EXIT_SUCCESS) {
+		ret = resolve_ino(ino_out, fi_out, &dst);
+	}
+	if (ret == EXIT_SUCCESS) {
+		ret = copy_inode(src, offset_in, dst, offset_out, size, &lsn);
+	}
+	pthread_rwlock_unlock(&fs.lock);
+	journal_commit(lsn);
+	return ret;
+}
+
+int
+filesystem_ll_utimens(uint64_t ino, const struct timespec tv[2])
+{
+	pthread_rwlock_rdlock(&fs.lock);
+	uint64_t lsn = 0;
+	inode *node = NULL;
+	int ret = find_inode(ino, &node);
+	if (ret == EXIT_SUCCESS) {
+		ret = utimens_inode(node, tv, &lsn);
+	}
+	pthread_rwlock_unlock(&fs.lock);
+	journal_commit(lsn);
+	return ret;
+}
+
+// readdir and readdirplus.
+static int
+readdir_ino(uint64_t ino,
+            void *buf,
+            fuse_fill_dir_t filler,
+            off_t offset,
+            dirent_fill fill)
+{
+	pthread_rwlock_rdlock(&fs.lock);
+	if (is_view(ino)) {
+		int ret = readdir_view(ino, buf, filler, offset);
+		pthread_rwlock_unlock(&fs.lock);
+		return ret;
+	}
+	inode *node = NULL;
+	int ret = find_inode(ino, &node);
+	if (ret == EXIT_SUCCESS) {
+		ret = readdir_inode(node, buf, filler, offset, fill);
+	}
+	pthread_rwlock_unlock(&fs.lock);
+	return ret;
+}
+
+int
+filesystem_ll_readdir(uint64_t ino,
+                      void *buf,
+                      fuse_fill_dir_t filler,
+                      off_t offset)
+{
+	return readdir_ino(ino, buf, filler, offset, DIRENT_TYPE);
+}
+
+int
+filesystem_ll_readdirplus(uint64_t ino,
+                          void *buf,
+                          fuse_fill_dir_t filler,
+                          off_t offset)
+{
+	return readdir_ino(ino, buf, filler, offset, DIRENT_LOOKUP);
+}
+
+int
+filesystem_ll_statfs(uint64_t ino, struct statvfs *stbuf)
+{
+	usage_statfs(stbuf);
+	return 0;
+}
+
+// Saves the changes since the last checkpoint. Callbacks only wait for
+// them to be captured, not written.
+static int
+save_checkpoint(void)
+{
+	pthread_rwlock_wrlock(&fs.lock);
+	checkpoint *cp = checkpoint_capture(fs.root, journal_last_lsn());
+	if (cp != NULL) {
+		journal_rotate();
+	}
+	pthread_rwlock_unlock(&fs.lock);
+	if (cp == NULL) {
+		return -ENOMEM;
+	}
+
+	int ret = checkpoint_write(filedisk, cp);
+	if (ret == 0) {
+		journal_trim();
+	}
+	return ret;
+}
+
+// A file cool_files may pack, with when it was last used and about how
+// many of its blocks are loaded.
+typedef struct file_use {
+	inode *node;
+	time_t used;
+	size_t blocks;
+} file_use;
+
+typedef struct file_uses {
+	file_use *items;
+	size_t count;
+	size_t capacity;
+	bool failed;
+} file_uses;
+
+static void
+collect_file(inode *node, void *arg)
+{
+	file_uses *uses = arg;
+	if (uses->failed || __atomic_load_n(&node->stub, __ATOMIC_ACQUIRE) ||
+	    node->file == NULL) {
+		return;
+	}
+	if (uses->count == uses->capacity) {
+		size_t capacity = uses->capacity > 0 ? 2 * uses->capacity : 64;
+		file_use *bigger =
+		        realloc(uses->items, capacity * sizeof(file_use));
+		if (bigger == NULL) {
+			uses->failed = true;
+			return;
+		}
+		uses->items = bigger;
+		uses->capacity = capacity;
+	}
+	uses->items[uses->count++] = (file_use){ .node = node };
+}
+
+static int
+compare_use(const void *a, const void *b)
+{
+	time_t x = ((const file_use *) a)->used;
+	time_t y = ((const file_use *) b)->used;
+	return (x > y) - (x < y);
+}
+
+// Packs the files that went cold, least recently used first (see
+// Packing above). Files locked meanwhile are left for the next time.
+static void
+cool_files(void)
+{
+	file_uses uses = { 0 };
+	pthread_rwlock_rdlock(&fs.lock);
+	inode_table_for_each(collect_file, &uses);
+
+	size_t hot = 0;
+	for (size_t i = 0; i < uses.count; i++) {
+		file_use *use = &uses.items[i];
+		inode *node = use->node;
+		pthread_rwlock_rdlock(&node->lock);
+		time_t atime = __atomic_load_n(&node->atime, __ATOMIC_RELAXED);
+		use->used = atime > node->mtime ? atime : node->mtime;
+		if (node->file->pending == 0 && node->file->packed == 0) {
+			use->blocks =
+			        (node->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		}
+		pthread_rwlock_unlock(&node->lock);
+		hot += use->blocks;
+	}
+	qsort(uses.items, uses.count, sizeof(file_use), compare_use);
+
+	time_t idle = time(NULL) - (time_t) checkpoint_interval;
+	for (size_t i = 0; i < uses.count; i++) {
+		file_use *use = &uses.items[i];
+		if (use->used > idle && hot <= HOT_BLOCKS_MAX) {
+			break;
+		}
+		if (use->blocks == 0 ||
+		    pthread_rwlock_trywrlock(&use->node->lock) != 0) {
+			continue;
+		}
+		if (use->node->file->pending == 0) {
+			file_pack(use->node->file);
+		}
+		pthread_rwlock_unlock(&use->node->lock);
+		hot -= use->blocks;
+	}
+	pthread_rwlock_unlock(&fs.lock);
+	free(uses.items);
+}
+
+static void
+periodic_checkpoint(void)
+{
+	if (save_checkpoint() == 0) {
+		checkpoint_maybe_compact(filedisk);
+		// Packed blocks are only kept as records of a segmented image.
+		if (compression && image_is_segmented()) {
+			cool_files();
+		}
+	}
+}
+
+void
+filesystem_destroy(void *private_data)
+{
+	checkpoint_stop();
+	printf("Saving filesystem to disk: %s\n", filedisk);
+	int ret = save_checkpoint();
+
+	pthread_rwlock_wrlock(&fs.lock);
+	// The journal is only emptied once the image holding all of it is
+	// safely on disk. If saving fails it is kept for the next mount.
+	if (ret == 0) {
+		journal_reset();
+		printf("Filesystem saved to disk: %s\n", filedisk);
+	}
+	journal_close();
+	path_cache_clear();
+	inode_table_clear();
+	snapshot_clear();
+	block_store_clear();
+	pthread_rwlock_unlock(&fs.lock);
+	checkpoint_shutdown();
+	image_release();
+	workers_stop();
+}
+
+// Applies a record logged by path, before records addressed inodes by
+// number.
+static void
+replay_path_record(const journal_record *record)
+{
+	struct timespec tv[2] = { { .tv_sec = record->atime },
+		                  { .tv_sec = record->mtime } };
+
+	switch (record->op) {
+	case JOURNAL_MKDIR:
+		filesystem_mkdir(record->path, record->mode);
+		break;
+	case JOURNAL_CREATE:
+		filesystem_create(record->path, record->mode, NULL);
+		break;
+	case JOURNAL_WRITE:
+		filesystem_write(
+		        record->path, record->data, record->size, record->offset, NULL);
+		break;
+	case JOURNAL_TRUNCATE:
+		filesystem_truncate(record->path, record->offset);
+		break;
+	case JOURNAL_UNLINK:
+		filesystem_unlink(record->path);
+		break;
+	case JOURNAL_RMDIR:
+		filesystem_rmdir(record->path);
+		break;
+	case JOURNAL_UTIMENS:
+		filesystem_utimens(record->path, tv);
+		break;
+	case JOURNAL_RENAME:
+	case JOURNAL_LINK:
+	case JOURNAL_FALLOCATE:
+	case JOURNAL_COPY:
+		// Only logged by inode number.
+		break;
+	}
+}
+
+// Applies a journal record on mount. The journal is not open yet, so the
+// operations are not logged again. Nothing else runs meanwhile, so
+// fs.lock is simply held for writing.
+static void
+replay_record(const journal_record *record)
+{
+	if (record->ino == 0) {
+		replay_path_record(record);
+		return;
+	}
+
+	struct timespec tv[2] = { { .tv_sec = record->atime },
+		                  { .tv_sec = record->mtime } };
+	struct fuse_bufvec data = bufvec_at(record->data, record->size);
+	inode *created = NULL;
+	inode *other = NULL;
+	uint64_t lsn = 0;
+
+	pthread_rwlock_wrlock(&fs.lock);
+	inode *node = image_find_inode(record->ino);
+	if (node == NULL || ensure_loaded(node) != EXIT_SUCCESS) {
+		pthread_rwlock_unlock(&fs.lock);
+		fprintf(stderr,
+		        INODE_NUMBER_NOT_FOUND,
+		        (unsigned long long) record->ino);
+		return;
+	}
+
+	switch (record->op) {
+	case JOURNAL_MKDIR:
+	case JOURNAL_CREATE:
+		make_node(node,
+		          record->path,
+		          record->op,
+		          record->mode,
+		          record->new_ino,
+		          &created,
+		          &lsn);
+		break;
+	case JOURNAL_WRITE:
+		write_inode(node, &data, record->offset, false, &lsn);
+		break;
+	case JOURNAL_TRUNCATE:
+		truncate_inode(node, record->offset, &lsn);
+		break;
+	case JOURNAL_UNLINK:
+	case JOURNAL_RMDIR:
+		remove_node(node, record->path, record->op, &lsn);
+		break;
+	case JOURNAL_UTIMENS:
+		utimens_inode(node, tv, &lsn);
+		break;
+	case JOURNAL_RENAME:
+		other = image_find_inode(record->new_ino);
+		if (other != NULL && ensure_loaded(other) == EXIT_SUCCESS) {
+			rename_node(node,
+			            record->path,
+			            other,
+			            record->name,
+			            &lsn);
+		}
+		break;
+	case JOURNAL_LINK:
+		other = image_find_inode(record->new_ino);
+		if (other != NULL && ensure_loaded(other) == EXIT_SUCCESS) {
+			link_node(other, node, record->path, &lsn);
+		}
+		break;
+	case JOURNAL_FALLOCATE:
+		fallocate_inode(node,
+		                record->mode,
+		                record->offset,
+		                record->size,
+		                &lsn);
+		break;
+	case JOURNAL_COPY:
+		other = image_find_inode(record->new_ino);
+		if (other != NULL && ensure_loaded(other) == EXIT_SUCCESS) {
+			copy_inode(other,
+			           record->src_offset,
+			           node,
+			           record->offset,
+			           record->size,
+			           &lsn);
+		}
+		break;
+	}
+	pthread_rwlock_unlock(&fs.lock);
 }
@@ -2,8 +2,26 @@
 #define OPERATIONS_H
 
 #include <fuse.h>
+#include <stdint.h>
+#include <sys/statvfs.h>
 #include <sys/types.h>
 
+#include "defs.h"
+#include "journal.h"
+
+extern char *filedisk;
+extern journal_sync journal_mode;
+extern unsigned checkpoint_interval;
+extern bool dedup;
+extern bool compression;
+extern uint64_t max_size;
+extern uint64_t max_inodes;
+extern unsigned worker_threads;
+
+extern filesystem fs;
+
+int search_inode(const char *path, inode **result);
+
 void *filesystem_init(struct fuse_conn_info *conn);
 
 int filesystem_getattr(const char *path, struct stat *stbuf);
@@ -14,12 +32,17 @@ int filesystem_readdir(const char *path,
                        void *buf,
                        fuse_fill_dir_t filler,
                        off_t offset,
-                       struct fuse_file_info *fi);
+                       struct fuse_file_info *fi,
+                       enum fuse_readdir_flags flags);
 
 int filesystem_unlink(const char *path);
 
 int filesystem_rmdir(const char *path);
 
+int filesystem_rename(const char *from, const char *to);
+
+int filesystem_link(const char *from, const char *to);
+
 int filesystem_utimens(const char *path, const struct timespec tv[2]);
 
 int filesystem_create(const char *path, mode_t mode, struct fuse_file_info *fi);
@@ -32,14 +55,143 @@ int filesystem_write(const char *path,
                      off_t offset,
                      struct fuse_file_info *fi);
 
+int filesystem_write_buf(const char *path,
+                         struct fuse_bufvec *buf,
+                         off_t offset,
+                         struct fuse_file_info *fi);
+
 int filesystem_truncate(const char *path, off_t size);
 
+int filesystem_ftruncate(const char *path,
+                         off_t size,
+                         struct fuse_file_info *fi);
+
+int filesystem_fallocate(const char *path,
+                         int mode,
+                         off_t offset,
+                         off_t length,
+                         struct fuse_file_info *fi);
+
+// lseek with SEEK_DATA or SEEK_HOLE, the new offset or -ENXIO.
+off_t filesystem_lseek(const char *path,
+                       off_t offset,
+                       int whence,
+                       struct fuse_file_info *fi);
+
+// copy_file_range, sharing the blocks it can (see operations.c).
+ssize_t filesystem_copy_file_range(const char *path_in,
+                                   struct fuse_file_info *fi_in,
+                                   off_t offset_in,
+                                   const char *path_out,
+                                   struct fuse_file_info *fi_out,
+                                   off_t offset_out,
+                                   size_t size,
+                                   int flags);
+
+int filesystem_flush(const char *path, struct fuse_file_info *fi);
+
+int filesystem_release(const char *path, struct fuse_file_info *fi);
+
 int filesystem_read(const char *path,
                     char *buf,
                     size_t size,
                     off_t offset,
                     struct fuse_file_info *fi);
 
+int filesystem_statfs(const char *path, struct statvfs *stbuf);
+
 void filesystem_destroy(void *private_data);
 
+// The same operations by inode number, for the low-level front end.
+
+int filesystem_ll_lookup(uint64_t parent, const char *name, struct stat *stbuf);
+
+void filesystem_ll_forget(uint64_t ino, uint64_t nlookup);
+
+int filesystem_ll_getattr(uint64_t ino, struct stat *stbuf);
+
+int filesystem_ll_mkdir(uint64_t parent,
+                        const char *name,
+                        mode_t mode,
+                        struct stat *stbuf);
+
+int filesystem_ll_create(uint64_t parent,
+                         const char *name,
+                         mode_t mode,
+                         struct stat *stbuf,
+                         struct fuse_file_info *fi);
+
+int filesystem_ll_unlink(uint64_t parent, const char *name);
+
+int filesystem_ll_rmdir(uint64_t parent, const char *name);
+
+int filesystem_ll_rename(uint64_t parent,
+                         const char *name,
+                         uint64_t new_parent,
+                         const char *new_name);
+
+int filesystem_ll_link(uint64_t ino,
+                       uint64_t new_parent,
+                       const char *new_name,
+                       struct stat *stbuf);
+
+int filesystem_ll_open(uint64_t ino, struct fuse_file_info *fi);
+
+void filesystem_ll_release(struct fuse_file_info *fi);
+
+// Replies a read with `data`, which is only valid during the call.
+typedef void (*filesystem_send_fn)(void *arg, struct fuse_bufvec *data);
+
+int filesystem_ll_read_buf(uint64_t ino,
+                           size_t size,
+                           off_t offset,
+                           struct fuse_file_info *fi,
+                           filesystem_send_fn send,
+                           void *arg);
+
+int filesystem_ll_write_buf(uint64_t ino,
+                            struct fuse_bufvec *buf,
+                            off_t offset,
+                            struct fuse_file_info *fi);
+
+int filesystem_ll_truncate(uint64_t ino,
+                           off_t size,
+                           struct fuse_file_info *fi);
+
+int filesystem_ll_fallocate(uint64_t ino,
+                            int mode,
+                            off_t offset,
+                            off_t length,
+                            struct fuse_file_info *fi);
+
+off_t filesystem_ll_lseek(uint64_t ino,
+                          off_t offset,
+                          int whence,
+                          struct fuse_file_info *fi);
+
+ssize_t filesystem_ll_copy_file_range(uint64_t ino_in,
+                                      off_t offset_in,
+                                      struct fuse_file_info *fi_in,
+                                      uint64_t ino_out,
+                                      off_t offset_out,
+                                      struct fuse_file_info *fi_out,
+                                      size_t size,
+                                      int flags);
+
+int filesystem_ll_utimens(uint64_t ino, const struct timespec tv[2]);
+
+int filesystem_ll_readdir(uint64_t ino,
+                          void *buf,
+                          fuse_fill_dir_t filler,
+                          off_t offset);
+
+// readdir that also hands out the attributes of each loaded entry,
+// counting a lookup of it as filesystem_ll_lookup does.
+int filesystem_ll_readdirplus(uint64_t ino,
+                              void *buf,
+                              fuse_fill_dir_t filler,
+                              off_t offset);
+
+int filesystem_ll_statfs(uint64_t ino, struct statvfs *stbuf);
+
 #endif
@@ -0,0 +1,166 @@
+#include "path_cache.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Direct-mapped cache from full path to the result of search_inode. A
+// slot either maps the path to its inode (positive entry) or records
+// that the path does not exist (negative entry, node is null).
+//
+// Entries are dropped by path: creating or removing a path must call
+// path_cache_invalidate for it. Only -ENOENT results are cached as
+// negative entries, so creating a parent never makes a cached negative
+// entry below it wrong, and removing a non-empty directory is not
+// possible. Renaming a directory changes every path below it, so it
+// drops the whole cache at once with path_cache_invalidate_all: slots
+// stored before the current generation are simply misses.
+//
+// Slots are guarded by PATH_CACHE_STRIPES mutexes, slot i by stripe
+// i % PATH_CACHE_STRIPES, so lookups of different paths rarely contend.
+#define PATH_CACHE_SLOTS 16384
+#define PATH_CACHE_STRIPES 64
+
+typedef struct cache_slot {
+	uint64_t hash;
+	char *path;       // Null if the slot is empty
+	size_t path_cap;  // Allocated bytes for path
+	inode *node;      // Null for negative entries
+	int error;        // Result of search_inode for negative entries
+
+	uint64_t generation;  // Of the cache when it was stored
+} cache_slot;
+
+static cache_slot slots[PATH_CACHE_SLOTS];
+static pthread_mutex_t stripes[PATH_CACHE_STRIPES];
+static uint64_t generation;  // Atomic
+
+// 64-bit FNV-1a hash of the full path.
+static uint64_t
+hash_path(const char *path)
+{
+	uint64_t hash = 14695981039346656037ull;
+	for (const unsigned char *p = (const unsigned char *) path; *p; p++) {
+		hash ^= *p;
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+static pthread_mutex_t *
+stripe_of(uint64_t hash)
+{
+	return &stripes[(hash % PATH_CACHE_SLOTS) % PATH_CACHE_STRIPES];
+}
+
+// Returns the slot caching `path`, or null. The caller must hold its
+// stripe.
+static cache_slot *
+find_slot(const char *path, uint64_t hash)
+{
+	cache_slot *slot = &slots[hash % PATH_CACHE_SLOTS];
+	if (slot->path == NULL || slot->hash != hash ||
+	    slot->generation !=
+	            __atomic_load_n(&generation, __ATOMIC_ACQUIRE) ||
+	    strcmp(slot->path, path) != 0) {
+		return NULL;
+	}
+	return slot;
+}
+
+void
+path_cache_init(void)
+{
+	for (int i = 0; i < PATH_CACHE_STRIPES; i++) {
+		pthread_mutex_init(&stripes[i], NULL);
+	}
+}
+
+// Returns true on a hit, filling either `result` (positive entry) or
+// `error` (negative entry).
+bool
+path_cache_get(const char *path, inode **result, int *error)
+{
+	uint64_t hash = hash_path(path);
+	pthread_mutex_lock(stripe_of(hash));
+
+	cache_slot *slot = find_slot(path, hash);
+	if (slot != NULL) {
+		if (slot->node == NULL) {
+			*error = slot->error;
+		} else {
+			*result = slot->node;
+			*error = 0;
+		}
+	}
+
+	pthread_mutex_unlock(stripe_of(hash));
+	return slot != NULL;
+}
+
+// Caches the result of resolving `path`: either `node`, or `error` if
+// node is null. Evicts whatever was in the slot.
+void
+path_cache_put(const char *path, inode *node, int error)
+{
+	uint64_t hash = hash_path(path);
+	pthread_mutex_lock(stripe_of(hash));
+
+	cache_slot *slot = &slots[hash % PATH_CACHE_SLOTS];
+	size_t len = strlen(path) + 1;
+	if (slot->path_cap < len) {
+		char *buffer = realloc(slot->path, len);
+		if (buffer == NULL) {
+			// Caching is best effort.
+			pthread_mutex_unlock(stripe_of(hash));
+			return;
+		}
+		slot->path = buffer;
+		slot->path_cap = len;
+	}
+	memcpy(slot->path, path, len);
+	slot->hash = hash;
+	slot->node = node;
+	slot->error = error;
+	slot->generation = __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+
+	pthread_mutex_unlock(stripe_of(hash));
+}
+
+// Drops the entry for `path`, if cached.
+void
+path_cache_invalidate(const char *path)
+{
+	uint64_t hash = hash_path(path);
+	pthread_mutex_lock(stripe_of(hash));
+
+	cache_slot *slot = find_slot(path, hash);
+	if (slot != NULL) {
+		free(slot->path);
+		slot->path = NULL;
+		slot->path_cap = 0;
+	}
+
+	pthread_mutex_unlock(stripe_of(hash));
+}
+
+// Drops every entry in O(1), by starting a new generation. The caller
+// must hold fs.lock for writing, so that no result resolved before is
+// stored after.
+void
+path_cache_invalidate_all(void)
+{
+	__atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+}
+
+// Drops every entry. Only called with the filesystem quiesced.
+void
+path_cache_clear(void)
+{
+	for (int i = 0; i < PATH_CACHE_SLOTS; i++) {
+		free(slots[i].path);
+		slots[i].path = NULL;
+		slots[i].path_cap = 0;
+	}
+}
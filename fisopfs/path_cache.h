@@ -0,0 +1,20 @@
+#ifndef PATH_CACHE_H
+#define PATH_CACHE_H
+
+#include <stdbool.h>
+
+#include "defs.h"
+
+void path_cache_init(void);
+
+bool path_cache_get(const char *path, inode **result, int *error);
+
+void path_cache_put(const char *path, inode *node, int error);
+
+void path_cache_invalidate(const char *path);
+
+void path_cache_invalidate_all(void);
+
+void path_cache_clear(void);
+
+#endif
@@ -1,67 +1,2163 @@
 #include "persistence.h"
 
+#include <errno.h>
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blockmap.h"
+#include "blocks.h"
+#include "checkpoint.h"
+#include "directory.h"
+#include "idmap.h"
+#include "inode_table.h"
+#include "lz.h"
+#include "slab.h"
+#include "snapshot.h"
+#include "workers.h"
 
 #define FILE_INDICATOR 'F'
 #define DIR_INDICATOR 'D'
 
-void
-fread_checked(void *ptr, size_t size, size_t count, FILE *stream)
+// Every image starts with IMAGE_MAGIC followed by the format version.
+// Images written before the header existed start directly with the root
+// directory indicator and store MAX_CONTENT_SIZE_V0 bytes per file.
+// Versions 1 and 2 are a depth-first dump of the tree, version 2 adds
+// the lsn of the last journal record included in the image.
+//
+// Since version 3 the image is a log of segments, so a checkpoint only
+// appends what changed since the previous one. Segments hold records:
+//
+//   record = u8 type | u32 body length | body
+//
+// An inode record (keyed by inode number) holds the attributes and, for
+// a directory, its entries as (name, child inode number) or, for a file,
+// its blocks as (block index, block id). A block record (keyed by block
+// id) holds the data of one block. For each key the last record wins,
+// and anything not reachable from ROOT_INO is garbage. Compaction
+// rewrites the live records into a single segment.
+//
+// Since version 4 the image is read in place, through a read-only
+// mapping, and segments are addressed by offset:
+//
+//   segment = segment_header | record* | padding to 8 |
+//             index_entry[ninodes] | index_entry[nblocks]
+//
+// The two indexes are sorted by key and give the offset and checksum of
+// every record in the segment, so finding the latest record of a key is
+// a binary search per segment, newest first. Mounting only walks the
+// segment headers and loads the root, every other inode is a stub until
+// a lookup reaches it, and the blocks of a file are only read when its
+// contents are. The header is written last, once the rest of the segment
+// is on disk, so a segment torn by a crash has no valid header: it is
+// ignored and overwritten by the next append.
+//
+// Since version 5 records are packed: the body length and every integer
+// in a body are varints (LEB128, signed ones zigzag encoded first), and
+// a block record drops the trailing zeros of its data, so the tail block
+// of a file only takes the bytes up to its size.
+//
+//   inode body = ino | mode | nlink | uid | gid | atime | mtime | ctime |
+//                size | count | (name length | name | child ino)* or
+//                (block index | block id)*
+//   block body = id | data
+//
+// Since version 6 a block body also holds the length of the data, which
+// is stored compressed (see lz.c) when that is shorter, with --compress:
+//
+//   block body = id | length | data or compressed data
+//
+// A file with several links has a single inode record, which the entries
+// of every directory linking it refer to by number. It is captured and
+// loaded once, stubs being unique by number (see inode_table.c).
+//
+// Frozen inodes, and the directory listing the snapshots, are numbered
+// from SNAPSHOT_BASE (see snapshot.c) and reachable from no directory.
+// Compaction keeps the directory and the frozen inodes some snapshot it
+// lists resolves to, but not the children of frozen directories, which
+// are live inodes or frozen ones themselves. Their numbers do not count
+// for the next free one.
+//
+// Since version 7 the segment header also holds the usage counters at
+// its lsn (see usage.c), so mounting does not count them. They are
+// counted while loading older images.
+//
+// Since version 8 the image header ends with a random id, given to the
+// image when it is first written and kept by every later one, which the
+// journal records too so that it is only replayed onto its own image
+// (see journal.c):
+//
+//   image header = magic | version | u32 reserved | u64 id
+//
+// Version 3 segments have no index (u32 SEGMENT_MAGIC | u64 lsn |
+// record* | u8 RECORD_END | u32 checksum). Images of versions 3 and 4,
+// which store every integer and block whole, are loaded whole and
+// rewritten by the first checkpoint, and so are images of versions 5
+// to 7, the frozen inodes included.
+#define IMAGE_MAGIC "FISOPFS"
+#define IMAGE_VERSION 8
+#define IMAGE_HEADER_SIZE 24
+#define IMAGE_HEADER_SIZE_V7 16
+#define IMAGE_HEADER_SIZE_V3 (sizeof(IMAGE_MAGIC) + sizeof(int))
+#define MAX_CONTENT_SIZE_V0 1024
+
+#define SEGMENT_MAGIC 0x4d474553u
+#define SEGMENT_HEADER_SIZE_V3 (4 + 8)
+#define SEGMENT_HEADER_SIZE_V6 40
+#define RECORD_INODE 'I'
+#define RECORD_BLOCK 'B'
+#define RECORD_END 'E'
+#define RECORD_HEADER_SIZE_V4 (1 + 4)
+#define BLOCK_RECORD_SIZE_V4 (RECORD_HEADER_SIZE_V4 + 8 + BLOCK_SIZE)
+#define MAX_RECORD_SIZE (1u << 30)
+#define MAX_VARINT_SIZE 10
+
+#define CHECKSUM_INIT 2166136261u
+
+// Records are gathered in a buffer of this size before writing them.
+#define WRITE_BUFFER_SIZE (1 << 20)
+
+// Block records are encoded by the workers (see workers.c) in batches
+// that fill a write buffer, ENCODE_BATCHES of them at a time, and
+// decoded in batches of DECODE_BATCH.
+#define MAX_BLOCK_RECORD_SIZE (1 + 3 * MAX_VARINT_SIZE + BLOCK_SIZE)
+#define ENCODE_BATCH (WRITE_BUFFER_SIZE / MAX_BLOCK_RECORD_SIZE)
+#define ENCODE_BATCHES 16
+#define DECODE_BATCH 64
+
+typedef struct segment_header {
+	uint32_t magic;
+	uint32_t checksum;  // Of the fields below
+	uint64_t lsn;       // Last journal record included in the image
+	uint64_t garbage;   // Estimated dead bytes up to this segment
+	uint64_t records_size;
+	uint32_t ninodes;  // Entries in the inode index
+	uint32_t nblocks;  // Entries in the block index
+	fs_usage usage;    // At lsn, since version 7
+} segment_header;
+
+typedef struct index_entry {
+	uint64_t key;
+	uint64_t offset;    // Of the record, from the start of the segment
+	uint32_t size;      // Of the record, including its header
+	uint32_t checksum;  // Of the record
+} index_entry;
+
+_Static_assert(sizeof(segment_header) == 72, "unexpected padding");
+_Static_assert(offsetof(segment_header, usage) == SEGMENT_HEADER_SIZE_V6,
+               "unexpected padding");
+_Static_assert(sizeof(index_entry) == 24, "unexpected padding");
+
+// A version 4 segment of a mapped image.
+typedef struct segment {
+	const char *base;
+	const index_entry *inodes;
+	uint32_t ninodes;
+	const index_entry *blocks;
+	uint32_t nblocks;
+} segment;
+
+// Where a version 3 record lives in the mapping.
+typedef struct record_ref {
+	uint64_t offset;
+	uint32_t size;  // Including the record header
+} record_ref;
+
+// A mapped image and what is needed to find the latest record of a key:
+// the segments of a version 4 image, or for version 3, which has no
+// index of its own, the latest record of every key found by a scan.
+typedef struct image_index {
+	const char *map;
+	size_t map_size;
+	int version;
+
+	segment *segments;
+	size_t nsegments;
+
+	idmap inodes;  // Inode number -> position in refs
+	idmap blocks;  // Block id -> position in refs
+	record_ref *refs;
+	size_t nrefs;
+	size_t capacity;
+
+	uint64_t lsn;
+	uint64_t garbage;
+	fs_usage usage;
+	uint64_t max_ino;
+	uint64_t max_block_id;
+	uint64_t end;  // Of the last complete segment
+} image_index;
+
+// Segment being written. The header is written by finish_segment, once
+// the records and the indexes are. Until attach_segment gives it a file,
+// records are kept in memory.
+typedef struct segment_writer {
+	FILE *file;
+	uint64_t start;         // Offset of the segment in the file
+	uint64_t records_size;  // Written so far
+	char *buf;              // Records not handed to file yet
+	size_t used;
+	size_t capacity;
+	char *body;  // Body of the record being encoded
+	size_t body_size;
+	size_t body_capacity;
+	index_entry *indexes[2];  // Inode and block index
+	size_t counts[2];
+	size_t capacities[2];
+	int error;
+} segment_writer;
+
+// What a checkpoint saves, captured while fs.lock is held for writing
+// and written after it is released: the inode records, already encoded,
+// and the blocks to write, frozen meanwhile (see blocks.c).
+struct image_snapshot {
+	segment_writer writer;
+	block **blocks;
+	size_t nblocks;
+	size_t capacity;
+	bool whole;           // Replaces the image instead of appending
+	uint64_t lsn;
+	fs_usage usage;
+	uint64_t superseded;  // Bytes of the older records replaced
+};
+
+typedef struct cursor {
+	const char *pos;
+	const char *end;
+} cursor;
+
+// Decoded inode record, `items` points to its entries or blocks.
+typedef struct inode_record {
+	uint64_t ino;
+	uint32_t mode;
+	uint32_t nlink;
+	uint32_t uid;
+	uint32_t gid;
+	int64_t atime;
+	int64_t mtime;
+	int64_t ctime;
+	int64_t size;
+	uint32_t count;
+	cursor items;
+	bool packed;  // Items are varints, from version 5 on
+} inode_record;
+
+// State of the image at the filedisk path.
+static struct {
+	pthread_mutex_t lock;  // Orders appends with the end of a compaction
+	bool segmented;        // The image on disk is the current version
+	uint64_t size;         // Bytes up to the end of the last segment
+	size_t nsegments;
+	uint64_t next_block_id;  // Atomic
+	bool compress;           // Compress block records
+	uint64_t id;             // Written in the header, see image_new_id
+
+	// The image as it was mounted, stubs are loaded from it. Its
+	// records stay valid after later checkpoints or compactions: an
+	// inode that is still a stub has not changed since, and neither have
+	// the pending blocks of a file.
+	image_index mounted;
+} image = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.next_block_id = 1,
+};
+
+void
+fread_checked(void *ptr, size_t size, size_t count, FILE *stream)
+{
+	// This should not fail. Added mostly to silence
+	// compiler warnings.
+	if (fread(ptr, size, count, stream) != count) {
+		fprintf(stderr,
+		        "Deserialization error: failed to read %zu bytes\n",
+		        size * count);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void
+corrupt_image(void)
+{
+	fprintf(stderr, "Deserialization error: corrupt image record\n");
+	exit(EXIT_FAILURE);
+}
+
+static void
+out_of_memory(void)
+{
+	fprintf(stderr, "Deserialization error: out of memory\n");
+	exit(EXIT_FAILURE);
+}
+
+static uint32_t
+checksum_update(uint32_t hash, const void *data, size_t size)
+{
+	const unsigned char *bytes = data;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// Size of the segment header of a version 4 image or later.
+static size_t
+header_size(int version)
+{
+	return version >= 7 ? sizeof(segment_header) : SEGMENT_HEADER_SIZE_V6;
+}
+
+// Checksum of the first `size` bytes of `header` after the checksum.
+static uint32_t
+header_checksum(const segment_header *header, size_t size)
+{
+	return checksum_update(CHECKSUM_INIT,
+	                       &header->lsn,
+	                       size - offsetof(segment_header, lsn));
+}
+
+// Writing
+
+static void
+flush_buffer(segment_writer *writer)
+{
+	size_t used = writer->used;
+	if (used > 0 && fwrite(writer->buf, 1, used, writer->file) != used) {
+		writer->error = -EIO;
+	}
+	writer->used = 0;
+}
+
+// Starts a segment kept in memory.
+static void
+begin_capture(segment_writer *writer)
+{
+	memset(writer, 0, sizeof(*writer));
+	writer->buf = malloc(WRITE_BUFFER_SIZE);
+	if (writer->buf == NULL) {
+		writer->error = -ENOMEM;
+	} else {
+		writer->capacity = WRITE_BUFFER_SIZE;
+	}
+}
+
+// Places the segment at the current position of `file` and writes the
+// records gathered so far.
+static void
+attach_segment(segment_writer *writer, FILE *file)
+{
+	const segment_header placeholder = { 0 };
+
+	writer->file = file;
+	writer->start = ftello(file);
+	fwrite(&placeholder, sizeof(placeholder), 1, file);
+	if (writer->error == 0) {
+		flush_buffer(writer);
+	}
+}
+
+static void
+begin_segment(segment_writer *writer, FILE *file)
+{
+	begin_capture(writer);
+	attach_segment(writer, file);
+}
+
+static void
+free_writer(segment_writer *writer)
+{
+	free(writer->buf);
+	free(writer->body);
+	free(writer->indexes[0]);
+	free(writer->indexes[1]);
+	writer->buf = writer->body = NULL;
+	writer->indexes[0] = writer->indexes[1] = NULL;
+}
+
+static void
+grow_buffer(segment_writer *writer, size_t size)
+{
+	size_t capacity = 2 * writer->capacity;
+	while (size > capacity - writer->used) {
+		capacity *= 2;
+	}
+	char *buf = realloc(writer->buf, capacity);
+	if (buf == NULL) {
+		writer->error = -ENOMEM;
+		return;
+	}
+	writer->buf = buf;
+	writer->capacity = capacity;
+}
+
+// Adds `size` bytes to the records of the segment.
+static void
+put(segment_writer *writer, const void *data, size_t size)
+{
+	if (writer->error != 0) {
+		return;
+	}
+	if (size > writer->capacity - writer->used) {
+		if (writer->file != NULL) {
+			flush_buffer(writer);
+		} else {
+			grow_buffer(writer, size);
+		}
+		if (writer->error != 0) {
+			return;
+		}
+	}
+	if (size > writer->capacity - writer->used) {
+		if (fwrite(data, 1, size, writer->file) != size) {
+			writer->error = -EIO;
+		}
+	} else {
+		memcpy(writer->buf + writer->used, data, size);
+		writer->used += size;
+	}
+	writer->records_size += size;
+}
+
+static size_t
+varint_encode(uint64_t value, unsigned char *out)
+{
+	size_t len = 0;
+	while (value >= 0x80) {
+		out[len++] = (unsigned char) (value | 0x80);
+		value >>= 7;
+	}
+	out[len++] = (unsigned char) value;
+	return len;
+}
+
+// Adds `size` bytes to the body of the record being encoded.
+static void
+encode(segment_writer *writer, const void *data, size_t size)
+{
+	if (size > writer->body_capacity - writer->body_size) {
+		size_t capacity = 2 * writer->body_capacity + size + 256;
+		char *body = realloc(writer->body, capacity);
+		if (body == NULL) {
+			writer->error = -ENOMEM;
+			return;
+		}
+		writer->body = body;
+		writer->body_capacity = capacity;
+	}
+	memcpy(writer->body + writer->body_size, data, size);
+	writer->body_size += size;
+}
+
+static void
+encode_varint(segment_writer *writer, uint64_t value)
+{
+	unsigned char bytes[MAX_VARINT_SIZE];
+	encode(writer, bytes, varint_encode(value, bytes));
+}
+
+static void
+encode_svarint(segment_writer *writer, int64_t value)
+{
+	encode_varint(writer,
+	              ((uint64_t) value << 1) ^ (uint64_t) (value >> 63));
+}
+
+// Adds `entry` to the index of inodes (0) or of blocks (1).
+static void
+add_entry(segment_writer *writer, int which, index_entry entry)
+{
+	if (writer->counts[which] == writer->capacities[which]) {
+		size_t capacity = 2 * writer->capacities[which] + 64;
+		index_entry *entries = realloc(writer->indexes[which],
+		                               capacity * sizeof(index_entry));
+		if (entries == NULL) {
+			writer->error = -ENOMEM;
+			return;
+		}
+		writer->indexes[which] = entries;
+		writer->capacities[which] = capacity;
+	}
+	writer->indexes[which][writer->counts[which]++] = entry;
+}
+
+// Adds a record of `size` bytes, with the given checksum, to the index
+// of its type.
+static void
+index_record(segment_writer *writer,
+             char type,
+             uint64_t key,
+             uint32_t size,
+             uint32_t checksum)
+{
+	add_entry(writer,
+	          type == RECORD_INODE ? 0 : 1,
+	          (index_entry){
+	                  .key = key,
+	                  .offset = sizeof(segment_header) +
+	                            writer->records_size,
+	                  .size = size,
+	                  .checksum = checksum,
+	          });
+}
+
+// Writes the record encoded in writer->body and returns its size.
+static uint32_t
+emit_record(segment_writer *writer, char type, uint64_t key)
+{
+	unsigned char header[1 + MAX_VARINT_SIZE];
+	header[0] = type;
+	size_t header_size = 1 + varint_encode(writer->body_size, header + 1);
+	uint32_t size = header_size + writer->body_size;
+
+	uint32_t sum = checksum_update(CHECKSUM_INIT, header, header_size);
+	sum = checksum_update(sum, writer->body, writer->body_size);
+	index_record(writer, type, key, size, sum);
+	put(writer, header, header_size);
+	put(writer, writer->body, writer->body_size);
+	writer->body_size = 0;
+	return size;
+}
+
+static int
+compare_entries(const void *a, const void *b)
+{
+	uint64_t x = ((const index_entry *) a)->key;
+	uint64_t y = ((const index_entry *) b)->key;
+	return x < y ? -1 : x > y;
+}
+
+// Writes the indexes and then the header, and returns the size of the
+// segment or an error. With `sync` the segment is synced before and
+// after writing the header, otherwise the caller syncs the file.
+static int64_t
+finish_segment(segment_writer *writer,
+               uint64_t lsn,
+               uint64_t garbage,
+               const fs_usage *usage,
+               bool sync)
+{
+	static const char padding[8];
+	FILE *file = writer->file;
+
+	if (writer->error == 0) {
+		flush_buffer(writer);
+	}
+	int ret = writer->error;
+
+	uint64_t size = sizeof(segment_header) + writer->records_size;
+	fwrite(padding, 1, (8 - size % 8) % 8, file);
+	size += (8 - size % 8) % 8;
+
+	for (int which = 0; which < 2; which++) {
+		if (writer->counts[which] > 0) {
+			qsort(writer->indexes[which],
+			      writer->counts[which],
+			      sizeof(index_entry),
+			      compare_entries);
+			fwrite(writer->indexes[which],
+			       sizeof(index_entry),
+			       writer->counts[which],
+			       file);
+		}
+		size += writer->counts[which] * sizeof(index_entry);
+	}
+	free_writer(writer);
+
+	segment_header header = {
+		.magic = SEGMENT_MAGIC,
+		.lsn = lsn,
+		.garbage = garbage,
+		.records_size = writer->records_size,
+		.ninodes = writer->counts[0],
+		.nblocks = writer->counts[1],
+		.usage = *usage,
+	};
+	header.checksum = header_checksum(&header, sizeof(header));
+
+	if (ret == 0 && fflush(file) != 0) {
+		ret = -EIO;
+	}
+	if (ret == 0 && sync && fdatasync(fileno(file)) != 0) {
+		ret = -EIO;
+	}
+	if (ret == 0 && (fseeko(file, writer->start, SEEK_SET) != 0 ||
+	                 fwrite(&header, sizeof(header), 1, file) != 1 ||
+	                 fseeko(file, writer->start + size, SEEK_SET) != 0 ||
+	                 fflush(file) != 0)) {
+		ret = -EIO;
+	}
+	if (ret == 0 && sync && fdatasync(fileno(file)) != 0) {
+		ret = -EIO;
+	}
+	return ret != 0 ? ret : (int64_t) size;
+}
+
+static void
+write_image_header(FILE *file)
+{
+	const int version = IMAGE_VERSION;
+	const uint32_t reserved = 0;
+	fwrite(IMAGE_MAGIC, 1, sizeof(IMAGE_MAGIC), file);
+	fwrite(&version, sizeof(int), 1, file);
+	fwrite(&reserved, sizeof(reserved), 1, file);
+	fwrite(&image.id, sizeof(image.id), 1, file);
+}
+
+// Id of the saved block in `slot`, loaded, packed or still pending. 0 if
+// none.
+static uint64_t
+saved_block_id(const block_slot *slot)
+{
+	if (slot->block != NULL) {
+		return slot->block->id;
+	}
+	if (slot->packed != NULL) {
+		return slot->packed->id;
+	}
+	return slot->pending;
+}
+
+// Writes the inode record of `node` and returns its size. Blocks must
+// have been given an id already.
+static uint32_t
+write_inode_record(segment_writer *writer, const inode *node)
+{
+	encode_varint(writer, node->ino);
+	encode_varint(writer, node->mode);
+	encode_varint(writer, node->nlink);
+	encode_varint(writer, node->uid);
+	encode_varint(writer, node->gid);
+	encode_svarint(writer, __atomic_load_n(&node->atime, __ATOMIC_RELAXED));
+	encode_svarint(writer, node->mtime);
+	encode_svarint(writer, node->ctime);
+	encode_varint(writer, node->size);
+
+	if (node->dir != NULL) {
+		encode_varint(writer, node->dir->size);
+		for (int i = 0; i < node->dir->slots; i++) {
+			const dentry *entry = node->dir->entries[i];
+			if (entry == NULL) {
+				continue;
+			}
+			size_t len = strlen(entry->filename);
+			encode_varint(writer, len);
+			encode(writer, entry->filename, len);
+			encode_varint(writer,
+			              entry->inode != NULL ? entry->inode->ino
+			                                   : entry->ino);
+		}
+	} else {
+		const blockmap *blocks = &node->file->blocks;
+		const block_slot *slot;
+		uint32_t count = 0;
+		size_t i = 0;
+		for (; (slot = blockmap_next(blocks, &i)) != NULL; i++) {
+			count += saved_block_id(slot) != 0;
+		}
+		encode_varint(writer, count);
+		i = 0;
+		for (; (slot = blockmap_next(blocks, &i)) != NULL; i++) {
+			uint64_t id = saved_block_id(slot);
+			if (id != 0) {
+				encode_varint(writer, i);
+				encode_varint(writer, id);
+			}
+		}
+	}
+	return emit_record(writer, RECORD_INODE, node->ino);
+}
+
+// Bytes of the data of `b` up to its last non-zero one.
+static size_t
+data_length(const block *b)
+{
+	size_t len = BLOCK_SIZE;
+	while (len > 0 && b->data[len - 1] == 0) {
+		len--;
+	}
+	return len;
+}
+
+// Size of the record write_block_record writes for `b`, or a bound of
+// it if it is compressed.
+static uint32_t
+block_record_size(const block *b)
+{
+	unsigned char bytes[MAX_VARINT_SIZE];
+	size_t length = data_length(b);
+	size_t body = varint_encode(b->id, bytes) +
+	              varint_encode(length, bytes) + length;
+	return 1 + varint_encode(body, bytes) + body;
+}
+
+// Writes the record of `b`, without the zeros at the end of its data,
+// and returns its size.
+static uint32_t
+write_block_record(segment_writer *writer, const block *b)
+{
+	char packed[BLOCK_SIZE];
+	size_t length = data_length(b);
+	size_t size = 0;
+	if (image.compress && length > 0) {
+		size = lz_compress(b->data, length, packed, length - 1);
+	}
+
+	encode_varint(writer, b->id);
+	encode_varint(writer, length);
+	if (size > 0) {
+		encode(writer, packed, size);
+	} else {
+		encode(writer, b->data, length);
+	}
+	return emit_record(writer, RECORD_BLOCK, b->id);
+}
+
+static int
+grow_stack(void **stack, size_t *capacity, size_t item_size)
+{
+	void *bigger = realloc(*stack, 2 * *capacity * item_size);
+	if (bigger == NULL) {
+		return -ENOMEM;
+	}
+	*stack = bigger;
+	*capacity *= 2;
+	return 0;
+}
+
+// Adds `b` to the blocks the snapshot writes: gives it an id if it has
+// none or has changed, sets the size of its new record and freezes it.
+static int
+capture_block(image_snapshot *snapshot, block *b)
+{
+	if (__atomic_load_n(&b->cow, __ATOMIC_RELAXED) & BLOCK_FROZEN) {
+		// Shared with a file captured before (see blocks.c).
+		return 0;
+	}
+	if (snapshot->nblocks == snapshot->capacity &&
+	    grow_stack((void **) &snapshot->blocks,
+	               &snapshot->capacity,
+	               sizeof(block *)) != 0) {
+		return -ENOMEM;
+	}
+
+	if (!snapshot->whole) {
+		snapshot->superseded += b->record_size;
+	}
+	// The old record of a changed block may be shared by other files,
+	// so it is left to them.
+	if (b->id == 0 || b->dirty) {
+		b->id = __atomic_fetch_add(
+		        &image.next_block_id, 1, __ATOMIC_RELAXED);
+	}
+	b->record_size = block_record_size(b);
+	block_freeze(b);
+	snapshot->blocks[snapshot->nblocks++] = b;
+	return 0;
+}
+
+// Adds `node` to the snapshot: encodes its record and captures the
+// blocks saved with it, every one for a whole image and only the changed
+// ones otherwise.
+static int
+capture_inode(image_snapshot *snapshot, inode *node)
+{
+	blockmap *blocks = node->file != NULL ? &node->file->blocks : NULL;
+	block_slot *slot;
+	for (size_t i = 0;
+	     blocks != NULL && (slot = blockmap_next(blocks, &i)) != NULL;
+	     i++) {
+		block *b = slot->block;
+		if (b == NULL ||
+		    (!snapshot->whole && b->id != 0 && !b->dirty)) {
+			continue;
+		}
+		// It may turn out to be a copy of a saved block.
+		b = block_dedup(&slot->block);
+		if (!snapshot->whole && b->id != 0 && !b->dirty) {
+			continue;
+		}
+		int ret = capture_block(snapshot, b);
+		if (ret != 0) {
+			return ret;
+		}
+	}
+
+	if (!snapshot->whole) {
+		snapshot->superseded += node->record_size;
+	}
+	node->record_size = write_inode_record(&snapshot->writer, node);
+	return snapshot->writer.error;
+}
+
+// Captures the tree under `root`, which must be fully loaded, walking it
+// with an explicit stack. A file with several links is captured once.
+static int
+capture_tree(image_snapshot *snapshot, inode *root)
+{
+	size_t capacity = 64;
+	size_t depth = 0;
+	inode **stack = malloc(capacity * sizeof(inode *));
+	if (stack == NULL) {
+		return -ENOMEM;
+	}
+	stack[depth++] = root;
+	idmap linked;  // Numbers of the files with links captured so far
+	idmap_init(&linked);
+
+	int ret = 0;
+	while (ret == 0 && depth > 0) {
+		inode *node = stack[--depth];
+		uint64_t unused;
+		if (node->nlink > 1 && node->file != NULL) {
+			if (idmap_get(&linked, node->ino, &unused)) {
+				continue;
+			}
+			ret = idmap_put(&linked, node->ino, 0);
+			if (ret != 0) {
+				break;
+			}
+		}
+		inode_dir *dir = node->dir;
+		for (int i = 0; dir != NULL && i < dir->slots; ++i) {
+			if (dir->entries[i] == NULL) {
+				continue;
+			}
+			if (depth == capacity &&
+			    grow_stack((void **) &stack,
+			               &capacity,
+			               sizeof(inode *)) != 0) {
+				idmap_destroy(&linked);
+				free(stack);
+				return -ENOMEM;
+			}
+			stack[depth++] = dir->entries[i]->inode;
+		}
+		ret = capture_inode(snapshot, node);
+	}
+
+	idmap_destroy(&linked);
+	free(stack);
+	return ret;
+}
+
+// Thaws the blocks of the snapshot, marking them clean if it was saved,
+// and frees it.
+static void
+release_snapshot(image_snapshot *snapshot, bool saved)
+{
+	for (size_t i = 0; i < snapshot->nblocks; i++) {
+		// Nobody else touches a block before it is thawed.
+		if (saved) {
+			snapshot->blocks[i]->dirty = false;
+		}
+		block_thaw(snapshot->blocks[i]);
+	}
+	free(snapshot->blocks);
+	free_writer(&snapshot->writer);
+	free(snapshot);
+}
+
+// Captures what the next checkpoint saves: the whole tree under `root` if
+// the image on disk is not the current version (or there is none), with
+// the snapshots taken meanwhile, or else the inodes of the `dirty` list
+// (linked by dirty_next). The caller must hold fs.lock for writing and
+// pass the snapshot to image_write.
+image_snapshot *
+image_capture(inode *root, inode *dirty, uint64_t lsn)
+{
+	image_snapshot *snapshot = calloc(1, sizeof(image_snapshot));
+	if (snapshot == NULL) {
+		return NULL;
+	}
+	snapshot->whole = !image_is_segmented();
+	snapshot->lsn = lsn;
+	usage_get(&snapshot->usage);
+	snapshot->capacity = 64;
+	snapshot->blocks = malloc(snapshot->capacity * sizeof(block *));
+	begin_capture(&snapshot->writer);
+
+	int ret = snapshot->blocks == NULL ? -ENOMEM : snapshot->writer.error;
+	if (ret == 0 && snapshot->whole) {
+		ret = capture_tree(snapshot, root);
+	}
+	// Frozen inodes are outside the tree, and new since no current
+	// image was saved, so all of them are dirty.
+	for (inode *node = dirty; ret == 0 && node != NULL;
+	     node = node->dirty_next) {
+		if (!snapshot->whole || node->ino >= SNAPSHOT_BASE) {
+			ret = capture_inode(snapshot, node);
+		}
+	}
+
+	if (ret != 0) {
+		release_snapshot(snapshot, false);
+		return NULL;
+	}
+	return snapshot;
+}
+
+// Blocks of a snapshot being encoded, each batch into its own writer.
+typedef struct encode_task {
+	block **blocks;
+	size_t nblocks;
+	segment_writer batches[ENCODE_BATCHES];
+} encode_task;
+
+// Encodes the block records of batch `index`, a job of write_snapshot.
+static void
+encode_batch(void *arg, size_t index)
+{
+	encode_task *task = arg;
+	segment_writer *batch = &task->batches[index];
+	size_t end = (index + 1) * ENCODE_BATCH;
+	if (end > task->nblocks) {
+		end = task->nblocks;
+	}
+
+	begin_capture(batch);
+	for (size_t i = index * ENCODE_BATCH; i < end; i++) {
+		block *b = task->blocks[i];
+		// Compressed, it takes less than capture_block counted.
+		__atomic_store_n(&b->record_size,
+		                 write_block_record(batch, b),
+		                 __ATOMIC_RELAXED);
+	}
+}
+
+// Adds the records encoded in `batch` to `writer`, moving their index
+// entries after the records already there, and frees it.
+static void
+append_batch(segment_writer *writer, segment_writer *batch)
+{
+	if (writer->error == 0) {
+		writer->error = batch->error;
+	}
+	for (size_t i = 0; i < batch->counts[1] && writer->error == 0; i++) {
+		index_entry entry = batch->indexes[1][i];
+		entry.offset += writer->records_size;
+		add_entry(writer, 1, entry);
+	}
+	put(writer, batch->buf, batch->used);
+	free_writer(batch);
+}
+
+// Writes the inode records captured and then the blocks into `file`, and
+// returns the size of the segment or an error. The block records, which
+// take most of the work, are encoded by the workers in parallel, and
+// written in order as they would be by a single thread.
+static int64_t
+write_snapshot(image_snapshot *snapshot,
+               FILE *file,
+               uint64_t garbage,
+               bool sync)
+{
+	segment_writer *writer = &snapshot->writer;
+	attach_segment(writer, file);
+
+	encode_task task;
+	size_t per_round = ENCODE_BATCHES * ENCODE_BATCH;
+	for (size_t first = 0; first < snapshot->nblocks; first += per_round) {
+		task.blocks = snapshot->blocks + first;
+		task.nblocks = snapshot->nblocks - first;
+		if (task.nblocks > per_round) {
+			task.nblocks = per_round;
+		}
+		size_t nbatches =
+		        (task.nblocks + ENCODE_BATCH - 1) / ENCODE_BATCH;
+		workers_run(nbatches, encode_batch, &task);
+		for (size_t i = 0; i < nbatches; i++) {
+			append_batch(writer, &task.batches[i]);
+		}
+	}
+	return finish_segment(
+	        writer, snapshot->lsn, garbage, &snapshot->usage, sync);
+}
+
+// Writes a whole image atomically: it goes to a temporary file that
+// replaces `path` only once it is complete and synced, so a crash leaves
+// either the old image or the new one.
+static int
+replace_image(const char *path, image_snapshot *snapshot)
+{
+	char tmp_path[PATH_MAX];
+	if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >=
+	    (int) sizeof(tmp_path)) {
+		return -ENAMETOOLONG;
+	}
+
+	FILE *output = fopen(tmp_path, "wb");
+	if (output == NULL) {
+		perror("Error: cannot create image");
+		return -errno;
+	}
+
+	pthread_mutex_lock(&image.lock);
+	write_image_header(output);
+	if (write_snapshot(snapshot, output, 0, false) < 0 ||
+	    fflush(output) != 0 || fsync(fileno(output)) != 0) {
+		pthread_mutex_unlock(&image.lock);
+		perror("Error: cannot write image");
+		fclose(output);
+		unlink(tmp_path);
+		return -EIO;
+	}
+	uint64_t size = ftello(output);
+	fclose(output);
+
+	if (rename(tmp_path, path) != 0) {
+		pthread_mutex_unlock(&image.lock);
+		perror("Error: cannot replace image");
+		unlink(tmp_path);
+		return -errno;
+	}
+	image.segmented = true;
+	image.size = size;
+	image.nsegments = 1;
+	pthread_mutex_unlock(&image.lock);
+	return 0;
+}
+
+// Appends the snapshot as a segment to the image at `path`, which must be
+// segmented. The header is written last, once the rest is synced.
+static int
+append_image(const char *path, image_snapshot *snapshot, uint64_t garbage)
+{
+	pthread_mutex_lock(&image.lock);
+
+	FILE *output = fopen(path, "r+b");
+	if (output == NULL) {
+		pthread_mutex_unlock(&image.lock);
+		perror("Error: cannot open image");
+		return -errno;
+	}
+
+	// Drop a segment torn by an earlier failure.
+	if (ftruncate(fileno(output), image.size) != 0 ||
+	    fseeko(output, image.size, SEEK_SET) != 0) {
+		pthread_mutex_unlock(&image.lock);
+		perror("Error: cannot append to image");
+		fclose(output);
+		return -EIO;
+	}
+
+	int64_t size = write_snapshot(snapshot, output, garbage, true);
+	fclose(output);
+	if (size < 0) {
+		pthread_mutex_unlock(&image.lock);
+		fprintf(stderr, "Error: cannot write image\n");
+		return (int) size;
+	}
+	image.size += size;
+	image.nsegments++;
+	pthread_mutex_unlock(&image.lock);
+	return 0;
+}
+
+// Writes a snapshot taken by image_capture, then releases it. Needs no
+// lock of the tree. `garbage` is the garbage in the image so far, it is
+// updated with the bytes of the records replaced and saved with them.
+int
+image_write(const char *path, image_snapshot *snapshot, uint64_t *garbage)
+{
+	int ret;
+	if (snapshot->whole) {
+		ret = replace_image(path, snapshot);
+		if (ret == 0) {
+			*garbage = 0;
+		}
+	} else {
+		uint64_t total = *garbage + snapshot->superseded;
+		ret = append_image(path, snapshot, total);
+		if (ret == 0) {
+			*garbage = total;
+		}
+	}
+	release_snapshot(snapshot, ret == 0);
+	return ret;
+}
+
+bool
+image_is_segmented(void)
+{
+	pthread_mutex_lock(&image.lock);
+	bool segmented = image.segmented;
+	pthread_mutex_unlock(&image.lock);
+	return segmented;
+}
+
+uint64_t
+image_size(void)
+{
+	pthread_mutex_lock(&image.lock);
+	uint64_t size = image.size;
+	pthread_mutex_unlock(&image.lock);
+	return size;
+}
+
+size_t
+image_segment_count(void)
+{
+	pthread_mutex_lock(&image.lock);
+	size_t count = image.nsegments;
+	pthread_mutex_unlock(&image.lock);
+	return count;
+}
+
+// Finding records
+
+static bool
+take(cursor *cur, void *data, size_t size)
+{
+	if ((size_t) (cur->end - cur->pos) < size) {
+		return false;
+	}
+	memcpy(data, cur->pos, size);
+	cur->pos += size;
+	return true;
+}
+
+static void
+index_init(image_index *index)
+{
+	memset(index, 0, sizeof(*index));
+	idmap_init(&index->inodes);
+	idmap_init(&index->blocks);
+}
+
+// Unmaps the image and frees the index, which can be used again.
+static void
+index_destroy(image_index *index)
+{
+	if (index->map != NULL) {
+		munmap((void *) index->map, index->map_size);
+	}
+	free(index->segments);
+	idmap_destroy(&index->inodes);
+	idmap_destroy(&index->blocks);
+	free(index->refs);
+	index_init(index);
+}
+
+static int
+map_image(FILE *file, image_index *index)
+{
+	struct stat st;
+	if (fstat(fileno(file), &st) != 0) {
+		return -errno;
+	}
+	if (st.st_size == 0) {
+		return -EINVAL;
+	}
+
+	void *map =
+	        mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(file), 0);
+	if (map == MAP_FAILED) {
+		return -errno;
+	}
+	index->map = map;
+	index->map_size = st.st_size;
+	return 0;
+}
+
+// Position of the first of the sorted `entries` with a key of at least
+// `key`, or `count` if none.
+static uint32_t
+first_entry(const index_entry *entries, uint32_t count, uint64_t key)
+{
+	uint32_t low = 0;
+	uint32_t high = count;
+	while (low < high) {
+		uint32_t mid = low + (high - low) / 2;
+		if (entries[mid].key < key) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
+static void
+note_key(image_index *index, char type, uint64_t key)
+{
+	// Frozen inodes are numbered apart (see snapshot.c).
+	if (type == RECORD_INODE && key < SNAPSHOT_BASE &&
+	    key > index->max_ino) {
+		index->max_ino = key;
+	} else if (type == RECORD_BLOCK && key > index->max_block_id) {
+		index->max_block_id = key;
+	}
+}
+
+// Finds the complete version 4 segments in the first `limit` bytes of
+// the mapping. Only their headers and the last key of each index are
+// read.
+static int
+index_segments(image_index *index, uint64_t limit)
+{
+	size_t capacity = 0;
+	uint64_t offset = index->version >= 8 ? IMAGE_HEADER_SIZE
+	                                      : IMAGE_HEADER_SIZE_V7;
+	if (limit < offset) {
+		index->end = limit;
+		return 0;
+	}
+
+	size_t header_bytes = header_size(index->version);
+	while (limit - offset >= header_bytes) {
+		segment_header header = { 0 };
+		memcpy(&header, index->map + offset, header_bytes);
+		if (header.magic != SEGMENT_MAGIC ||
+		    header.checksum != header_checksum(&header, header_bytes) ||
+		    header.records_size > limit - offset) {
+			break;
+		}
+
+		uint64_t size = header_bytes + header.records_size;
+		uint64_t indexes = size + (8 - size % 8) % 8;
+		size = indexes + ((uint64_t) header.ninodes + header.nblocks) *
+		                         sizeof(index_entry);
+		if (size > limit - offset) {
+			break;
+		}
+
+		if (index->nsegments == capacity) {
+			capacity = 2 * capacity + 16;
+			segment *segments = realloc(index->segments,
+			                            capacity * sizeof(segment));
+			if (segments == NULL) {
+				return -ENOMEM;
+			}
+			index->segments = segments;
+		}
+		const char *base = index->map + offset;
+		const index_entry *entries =
+		        (const index_entry *) (base + indexes);
+		index->segments[index->nsegments++] = (segment){
+			.base = base,
+			.inodes = entries,
+			.ninodes = header.ninodes,
+			.blocks = entries + header.ninodes,
+			.nblocks = header.nblocks,
+		};
+
+		uint32_t live =
+		        first_entry(entries, header.ninodes, SNAPSHOT_BASE);
+		if (live > 0) {
+			note_key(index, RECORD_INODE, entries[live - 1].key);
+		}
+		if (header.nblocks > 0) {
+			const index_entry *blocks = entries + header.ninodes;
+			note_key(index,
+			         RECORD_BLOCK,
+			         blocks[header.nblocks - 1].key);
+		}
+		index->lsn = header.lsn;
+		index->garbage = header.garbage;
+		index->usage = header.usage;
+		offset += size;
+	}
+
+	index->end = offset;
+	return 0;
+}
+
+static int
+index_add(image_index *index, char type, uint64_t key, record_ref ref)
+{
+	if (index->nrefs == index->capacity) {
+		size_t capacity = index->capacity > 0 ? index->capacity * 2
+		                                      : 64;
+		record_ref *refs =
+		        realloc(index->refs, capacity * sizeof(record_ref));
+		if (refs == NULL) {
+			return -ENOMEM;
+		}
+		index->refs = refs;
+		index->capacity = capacity;
+	}
+
+	idmap *map = type == RECORD_INODE ? &index->inodes : &index->blocks;
+	if (idmap_put(map, key, index->nrefs) != 0) {
+		return -ENOMEM;
+	}
+	index->refs[index->nrefs++] = ref;
+	note_key(index, type, key);
+	return 0;
+}
+
+// Returns where the version 3 segment at `offset` ends, or 0 if it is
+// torn or does not match its checksum.
+static uint64_t
+segment_end_v3(const char *map, uint64_t offset, uint64_t limit)
+{
+	uint64_t pos = offset + SEGMENT_HEADER_SIZE_V3;
+	while (pos < limit && map[pos] != RECORD_END) {
+		uint32_t len;
+		if (limit - pos < RECORD_HEADER_SIZE_V4) {
+			return 0;
+		}
+		memcpy(&len, map + pos + 1, sizeof(len));
+		if (len < 8 || len > MAX_RECORD_SIZE ||
+		    len > limit - pos - RECORD_HEADER_SIZE_V4) {
+			return 0;
+		}
+		pos += RECORD_HEADER_SIZE_V4 + len;
+	}
+
+	uint32_t stored;
+	if (pos >= limit || limit - pos < 1 + sizeof(stored)) {
+		return 0;
+	}
+	memcpy(&stored, map + pos + 1, sizeof(stored));
+	uint32_t sum =
+	        checksum_update(CHECKSUM_INIT, map + offset, pos + 1 - offset);
+	if (stored != sum) {
+		return 0;
+	}
+	return pos + 1 + sizeof(stored);
+}
+
+// Indexes the records of the complete version 3 segments of the mapping.
+static void
+index_segments_v3(image_index *index)
+{
+	const char *map = index->map;
+	uint64_t offset = IMAGE_HEADER_SIZE_V3;
+
+	while (index->map_size - offset >= SEGMENT_HEADER_SIZE_V3) {
+		uint32_t magic;
+		memcpy(&magic, map + offset, sizeof(magic));
+		uint64_t end = 0;
+		if (magic == SEGMENT_MAGIC) {
+			end = segment_end_v3(map, offset, index->map_size);
+		}
+		if (end == 0) {
+			break;
+		}
+
+		uint64_t pos = offset + SEGMENT_HEADER_SIZE_V3;
+		while (map[pos] != RECORD_END) {
+			char type = map[pos];
+			uint32_t len;
+			uint64_t key;
+			memcpy(&len, map + pos + 1, sizeof(len));
+			memcpy(&key,
+			       map + pos + RECORD_HEADER_SIZE_V4,
+			       sizeof(key));
+			record_ref ref = { pos, RECORD_HEADER_SIZE_V4 + len };
+			if ((type == RECORD_INODE || type == RECORD_BLOCK) &&
+			    index_add(index, type, key, ref) != 0) {
+				out_of_memory();
+			}
+			pos += RECORD_HEADER_SIZE_V4 + len;
+		}
+		memcpy(&index->lsn, map + offset + 4, sizeof(index->lsn));
+		offset = end;
+	}
+
+	index->end = offset;
+}
+
+static const index_entry *
+search_entries(const index_entry *entries,
+               uint32_t count,
+               uint64_t key)
+{
+	uint32_t low = first_entry(entries, count, key);
+	return low < count && entries[low].key == key ? &entries[low] : NULL;
+}
+
+// Points `record` at the latest record of `key`, header included.
+// Version 4 records are checked against their checksum first.
+static int
+find_record(const image_index *index,
+            char type,
+            uint64_t key,
+            cursor *record)
+{
+	if (index->version == 3) {
+		const idmap *map = type == RECORD_INODE ? &index->inodes
+		                                        : &index->blocks;
+		uint64_t position;
+		if (!idmap_get(map, key, &position)) {
+			return -ENOENT;
+		}
+		record->pos = index->map + index->refs[position].offset;
+		record->end = record->pos + index->refs[position].size;
+		return 0;
+	}
+
+	for (size_t i = index->nsegments; i-- > 0;) {
+		const segment *seg = &index->segments[i];
+		const index_entry *entry;
+		if (type == RECORD_INODE) {
+			entry = search_entries(seg->inodes, seg->ninodes, key);
+		} else {
+			entry = search_entries(seg->blocks, seg->nblocks, key);
+		}
+		if (entry == NULL) {
+			continue;
+		}
+
+		// Records lie between the header and the indexes.
+		uint64_t records_end = (const char *) seg->inodes - seg->base;
+		if (entry->offset < header_size(index->version) ||
+		    entry->offset > records_end ||
+		    entry->size < 2 ||
+		    entry->size > records_end - entry->offset) {
+			return -EIO;
+		}
+		record->pos = seg->base + entry->offset;
+		record->end = record->pos + entry->size;
+		if (checksum_update(CHECKSUM_INIT, record->pos, entry->size) !=
+		            entry->checksum ||
+		    record->pos[0] != type) {
+			return -EIO;
+		}
+		return 0;
+	}
+	return -ENOENT;
+}
+
+// Loading
+
+static bool
+take_varint(cursor *cur, uint64_t *value)
+{
+	uint64_t result = 0;
+	for (int shift = 0; shift < 64 && cur->pos < cur->end; shift += 7) {
+		unsigned char byte = *cur->pos++;
+		result |= (uint64_t) (byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0) {
+			*value = result;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Takes a varint that must fit in `max`.
+static bool
+take_bounded(cursor *cur, uint64_t max, uint64_t *value)
+{
+	return take_varint(cur, value) && *value <= max;
+}
+
+static bool
+take_svarint(cursor *cur, int64_t *value)
+{
+	uint64_t zigzag;
+	if (!take_varint(cur, &zigzag)) {
+		return false;
+	}
+	*value = (int64_t) (zigzag >> 1) ^ -(int64_t) (zigzag & 1);
+	return true;
+}
+
+// Sets `body` to the body of a record of an image of `version`.
+static bool
+record_body(int version, cursor record, cursor *body)
+{
+	if (version < 5) {
+		body->pos = record.pos + RECORD_HEADER_SIZE_V4;
+		body->end = record.end;
+		return body->pos <= body->end;
+	}
+
+	uint64_t len;
+	record.pos++;
+	if (!take_varint(&record, &len) ||
+	    len != (uint64_t) (record.end - record.pos)) {
+		return false;
+	}
+	*body = record;
+	return true;
+}
+
+static bool
+parse_inode_record(int version, cursor record, inode_record *out)
 {
-	// This should not fail. Added mostly to silence
-	// compiler warnings.
-	if (fread(ptr, size, count, stream) != count) {
+	cursor body;
+	if (!record_body(version, record, &body)) {
+		return false;
+	}
+	out->packed = version >= 5;
+	if (!out->packed) {
+		bool ok = take(&body, &out->ino, 8) &&
+		          take(&body, &out->mode, 4) &&
+		          take(&body, &out->nlink, 4) &&
+		          take(&body, &out->uid, 4) &&
+		          take(&body, &out->gid, 4) &&
+		          take(&body, &out->atime, 8) &&
+		          take(&body, &out->mtime, 8) &&
+		          take(&body, &out->ctime, 8) &&
+		          take(&body, &out->size, 8) &&
+		          take(&body, &out->count, 4);
+		out->items = body;
+		return ok;
+	}
+
+	uint64_t mode = 0, nlink = 0, uid = 0, gid = 0, size = 0, count = 0;
+	bool ok = take_varint(&body, &out->ino) &&
+	          take_bounded(&body, UINT32_MAX, &mode) &&
+	          take_bounded(&body, UINT32_MAX, &nlink) &&
+	          take_bounded(&body, UINT32_MAX, &uid) &&
+	          take_bounded(&body, UINT32_MAX, &gid) &&
+	          take_svarint(&body, &out->atime) &&
+	          take_svarint(&body, &out->mtime) &&
+	          take_svarint(&body, &out->ctime) &&
+	          take_bounded(&body, INT64_MAX, &size) &&
+	          take_bounded(&body, UINT32_MAX, &count);
+	out->mode = mode;
+	out->nlink = nlink;
+	out->uid = uid;
+	out->gid = gid;
+	out->size = size;
+	out->count = count;
+	out->items = body;
+	return ok;
+}
+
+static bool
+next_dir_item(inode_record *record, char *name, uint64_t *child)
+{
+	cursor *items = &record->items;
+	uint64_t len;
+	if (record->packed) {
+		if (!take_bounded(items, MAX_FILENAME - 1, &len) ||
+		    !take(items, name, len)) {
+			return false;
+		}
+		name[len] = '\0';
+		return take_varint(items, child);
+	}
+
+	uint16_t len16;
+	if (!take(items, &len16, sizeof(len16)) || len16 >= MAX_FILENAME ||
+	    !take(items, name, len16)) {
+		return false;
+	}
+	name[len16] = '\0';
+	return take(items, child, sizeof(*child));
+}
+
+static bool
+next_file_item(inode_record *record, uint64_t *index, uint64_t *id)
+{
+	cursor *items = &record->items;
+	if (record->packed) {
+		return take_varint(items, index) && take_varint(items, id);
+	}
+	return take(items, index, sizeof(*index)) &&
+	       take(items, id, sizeof(*id));
+}
+
+// Copies the data of a block record into `data`, BLOCK_SIZE bytes long
+// and zeroed, decompressing it if needed.
+static bool
+parse_block_record(int version, cursor record, uint64_t *id, char *data)
+{
+	cursor body;
+	if (!record_body(version, record, &body)) {
+		return false;
+	}
+	if (version < 5) {
+		return take(&body, id, sizeof(*id)) &&
+		       take(&body, data, BLOCK_SIZE) && body.pos == body.end;
+	}
+
+	uint64_t length = 0;
+	if (!take_varint(&body, id)) {
+		return false;
+	}
+	if (version < 6) {
+		length = body.end - body.pos;
+		if (length > BLOCK_SIZE) {
+			return false;
+		}
+	} else if (!take_bounded(&body, BLOCK_SIZE, &length)) {
+		return false;
+	}
+
+	size_t size = body.end - body.pos;
+	if (size == length) {
+		return take(&body, data, size);
+	}
+	return size < length && lz_decompress(body.pos, size, data, length);
+}
+
+// Returns the inode `ino` as a stub, or the one already in the inode
+// table: replay may have reached it by number before its directory.
+static inode *
+new_stub(uint64_t ino)
+{
+	return inode_table_get_stub(ino);
+}
+
+// Frees a stub made by new_stub, unless something else got hold of it.
+static void
+drop_stub(inode *node)
+{
+	if (node != NULL && node->stub &&
+	    __atomic_load_n(&node->refs, __ATOMIC_RELAXED) == 0) {
+		inode_table_delete(node);
+	}
+}
+
+// Undoes a load_inode that failed halfway, `node` is a stub again.
+static void
+unload_inode(inode *node)
+{
+	if (node->dir != NULL) {
+		for (int i = 0; i < node->dir->slots; i++) {
+			dentry *entry = node->dir->entries[i];
+			drop_stub(entry->inode);
+			slab_free(&dentry_slab, entry);
+		}
+		dir_free(node->dir);
+		node->dir = NULL;
+	}
+	if (node->file != NULL) {
+		blockmap_destroy(&node->file->blocks);
+		slab_free(&file_slab, node->file);
+		node->file = NULL;
+	}
+}
+
+// Adds the entries of a directory record to `node`, as stubs, or just
+// by number if it is frozen (see snapshot.c).
+static int
+load_entries(inode *node, inode_record *record)
+{
+	bool frozen = node->ino >= SNAPSHOT_BASE;
+	node->dir = dir_new();
+	if (node->dir == NULL) {
+		return -ENOMEM;
+	}
+
+	// Keeps the entries of the directory, and their stubs, together.
+	slab_reserve(&dentry_slab, record->count);
+	slab_reserve(&inode_slab, record->count);
+	for (uint32_t i = 0; i < record->count; i++) {
+		uint64_t child;
+		dentry *entry = slab_alloc(&dentry_slab);
+		if (entry == NULL) {
+			return -ENOMEM;
+		}
+		if (!next_dir_item(record, entry->filename, &child)) {
+			slab_free(&dentry_slab, entry);
+			return -EIO;
+		}
+		if (frozen) {
+			entry->inode = NULL;
+			entry->ino = child;
+		} else {
+			entry->inode = new_stub(child);
+			if (entry->inode == NULL) {
+				slab_free(&dentry_slab, entry);
+				return -ENOMEM;
+			}
+		}
+		if (dir_add(node->dir, entry) != 0) {
+			drop_stub(entry->inode);
+			slab_free(&dentry_slab, entry);
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+// Sets up the block slots of a file record in `node`. The blocks are
+// left in the image, their ids pending in the slots.
+static int
+load_block_ids(inode *node, inode_record *record)
+{
+	inode_file *file = file_new();
+	node->file = file;
+	if (file == NULL) {
+		return -ENOMEM;
+	}
+
+	uint64_t index, id;
+	for (uint32_t i = 0; i < record->count; i++) {
+		if (!next_file_item(record, &index, &id) || id == 0 ||
+		    index > INT64_MAX / BLOCK_SIZE) {
+			return -EIO;
+		}
+		block_slot *slot = blockmap_slot(&file->blocks, index);
+		if (slot == NULL) {
+			return -ENOMEM;
+		}
+		if (slot->pending == 0) {
+			file->used++;
+			file->pending++;
+		}
+		slot->pending = id;
+	}
+	return 0;
+}
+
+// Loads the stub `node` from its record: the attributes and either the
+// entries, as stubs, or the ids of the blocks.
+static int
+load_inode(const image_index *index, inode *node)
+{
+	cursor bytes;
+	inode_record record;
+	int ret = find_record(index, RECORD_INODE, node->ino, &bytes);
+	if (ret != 0) {
+		return -EIO;
+	}
+	if (!parse_inode_record(index->version, bytes, &record) ||
+	    record.ino != node->ino) {
+		return -EIO;
+	}
+
+	node->mode = record.mode;
+	node->nlink = record.nlink;
+	node->uid = record.uid;
+	node->gid = record.gid;
+	node->atime = record.atime;
+	node->mtime = record.mtime;
+	node->ctime = record.ctime;
+	node->size = record.size;
+	node->record_size = bytes.end - bytes.pos;
+
+	ret = S_ISDIR(record.mode) ? load_entries(node, &record)
+	                           : load_block_ids(node, &record);
+	if (ret != 0) {
+		unload_inode(node);
+	}
+	return ret;
+}
+
+// Reads the block pending in `slot`, if any.
+static int
+load_block(const image_index *index, block_slot *slot)
+{
+	uint64_t id = slot->pending;
+	uint64_t stored_id;
+	cursor bytes;
+	if (id == 0) {
+		return 0;
+	}
+	if (find_record(index, RECORD_BLOCK, id, &bytes) != 0) {
+		return -EIO;
+	}
+
+	block *b = calloc(1, sizeof(block));
+	if (b == NULL) {
+		return -ENOMEM;
+	}
+	if (!parse_block_record(index->version, bytes, &stored_id, b->data) ||
+	    stored_id != id) {
+		free(b);
+		return -EIO;
+	}
+	b->id = id;
+	b->record_size = bytes.end - bytes.pos;
+	slot->block = b;
+	slot->pending = 0;
+	block_dedup(&slot->block);
+	return 0;
+}
+
+// Blocks of a file being loaded, by batches of DECODE_BATCH.
+typedef struct decode_task {
+	const image_index *index;
+	block_slot **slots;  // Those with a block pending
+	size_t count;
+	int error;  // Atomic, of a batch that failed
+} decode_task;
+
+// Reads the blocks of batch `index`, a job of load_blocks.
+static void
+decode_batch(void *arg, size_t index)
+{
+	decode_task *task = arg;
+	size_t end = (index + 1) * DECODE_BATCH;
+	if (end > task->count) {
+		end = task->count;
+	}
+
+	for (size_t i = index * DECODE_BATCH; i < end; i++) {
+		int ret = load_block(task->index, task->slots[i]);
+		if (ret != 0) {
+			__atomic_store_n(&task->error, ret, __ATOMIC_RELAXED);
+			return;
+		}
+	}
+}
+
+// Reads the pending blocks of the file `node`, those of a large one by
+// the workers in parallel. If it fails, the blocks read so far stay
+// loaded and the rest pending.
+static int
+load_blocks(const image_index *index, inode *node)
+{
+	inode_file *file = node->file;
+	decode_task task = {
+		.index = index,
+		.slots = malloc(file->pending * sizeof(block_slot *)),
+	};
+	if (task.slots == NULL) {
+		return -ENOMEM;
+	}
+	size_t i = 0;
+	block_slot *slot;
+	for (; (slot = blockmap_next(&file->blocks, &i)) != NULL; i++) {
+		if (slot->pending != 0) {
+			task.slots[task.count++] = slot;
+		}
+	}
+
+	workers_run((task.count + DECODE_BATCH - 1) / DECODE_BATCH,
+	            decode_batch,
+	            &task);
+	size_t left = 0;
+	for (i = 0; task.error != 0 && i < task.count; i++) {
+		left += task.slots[i]->pending != 0;
+	}
+	free(task.slots);
+	__atomic_store_n(&file->pending, left, __ATOMIC_RELEASE);
+	return task.error;
+}
+
+// Loads the stub `node` from the mounted image. The caller must hold its
+// lock for writing, and clear node->stub if it succeeds.
+int
+image_load_inode(inode *node)
+{
+	int ret = load_inode(&image.mounted, node);
+	if (ret != 0) {
 		fprintf(stderr,
-		        "Deserialization error: failed to read %zu bytes\n",
-		        size * count);
+		        "Error: cannot load inode %llu from the image\n",
+		        (unsigned long long) node->ino);
+	}
+	return ret;
+}
+
+// Loads the blocks of the file `node` still pending in the mounted
+// image. The caller must hold its lock for writing.
+int
+image_load_blocks(inode *node)
+{
+	int ret = load_blocks(&image.mounted, node);
+	if (ret != 0) {
+		fprintf(stderr,
+		        "Error: cannot load the blocks of inode %llu\n",
+		        (unsigned long long) node->ino);
+	}
+	return ret;
+}
+
+// Returns the inode `ino`: the one in the inode table or, if the mounted
+// image has it, a new stub. Null if neither. Replay uses it to reach
+// inodes by number before their directory is loaded.
+inode *
+image_find_inode(uint64_t ino)
+{
+	cursor bytes;
+	inode *node = inode_table_get(ino);
+	if (node != NULL || image.mounted.map == NULL ||
+	    find_record(&image.mounted, RECORD_INODE, ino, &bytes) != 0) {
+		return node;
+	}
+	return new_stub(ino);
+}
+
+// Reads the numbers of the frozen inodes the mounted image has records
+// of into `*keys`, which the caller frees, in no order and some maybe
+// more than once.
+int
+image_frozen_keys(uint64_t **keys, size_t *count)
+{
+	const image_index *index = &image.mounted;
+	size_t total = 0;
+	for (size_t i = 0; i < index->nsegments; i++) {
+		const segment *seg = &index->segments[i];
+		total += seg->ninodes - first_entry(seg->inodes,
+		                                    seg->ninodes,
+		                                    SNAPSHOT_BASE);
+	}
+	*keys = malloc((total > 0 ? total : 1) * sizeof(uint64_t));
+	if (*keys == NULL) {
+		return -ENOMEM;
+	}
+	*count = 0;
+	for (size_t i = 0; i < index->nsegments; i++) {
+		const segment *seg = &index->segments[i];
+		uint32_t j =
+		        first_entry(seg->inodes, seg->ninodes, SNAPSHOT_BASE);
+		for (; j < seg->ninodes; j++) {
+			// The directory of snapshots is no copy.
+			if (seg->inodes[j].key != SNAPSHOTS_INO) {
+				(*keys)[(*count)++] = seg->inodes[j].key;
+			}
+		}
+	}
+	return 0;
+}
+
+// Counts the live inode `node`, just loaded whole, in `usage`.
+static void
+count_loaded(fs_usage *usage, const inode *node)
+{
+	if (node->dir != NULL) {
+		usage->dirs++;
+		return;
+	}
+	usage->files++;
+	usage->bytes += node->size;
+	usage->blocks += node->file->used;
+}
+
+// Loads the stub `root` and everything under it, walking the tree with
+// an explicit stack, and counts it in `usage`. A file with several links
+// is loaded and counted once.
+static void
+load_tree(const image_index *index, inode *root, fs_usage *usage)
+{
+	size_t capacity = 64;
+	size_t depth = 0;
+	inode **stack = malloc(capacity * sizeof(inode *));
+	if (stack == NULL) {
+		out_of_memory();
+	}
+	stack[depth++] = root;
+
+	while (depth > 0) {
+		inode *node = stack[--depth];
+		if (!node->stub) {
+			continue;
+		}
+		if (load_inode(index, node) != 0) {
+			corrupt_image();
+		}
+		node->stub = false;
+		count_loaded(usage, node);
+
+		if (node->file != NULL) {
+			if (node->file->pending != 0 &&
+			    load_blocks(index, node) != 0) {
+				corrupt_image();
+			}
+			continue;
+		}
+		for (int i = 0; i < node->dir->slots; i++) {
+			if (depth == capacity &&
+			    grow_stack((void **) &stack,
+			               &capacity,
+			               sizeof(inode *)) != 0) {
+				out_of_memory();
+			}
+			stack[depth++] = node->dir->entries[i]->inode;
+		}
+	}
+	free(stack);
+}
+
+// Loads the frozen inodes of an image loaded whole, and the directory of
+// snapshots, which no directory of the tree leads to. They are marked
+// dirty, for the checkpoint that rewrites the image to save them too.
+static void
+load_frozen(const image_index *index)
+{
+	for (size_t i = 0; i < index->nsegments; i++) {
+		const segment *seg = &index->segments[i];
+		uint32_t j =
+		        first_entry(seg->inodes, seg->ninodes, SNAPSHOT_BASE);
+		for (; j < seg->ninodes; j++) {
+			inode *node = new_stub(seg->inodes[j].key);
+			if (node == NULL) {
+				out_of_memory();
+			}
+			// Saved again by a later segment.
+			if (!node->stub) {
+				continue;
+			}
+			if (load_inode(index, node) != 0) {
+				corrupt_image();
+			}
+			node->stub = false;
+			const inode_file *file = node->file;
+			if (file != NULL && file->pending != 0 &&
+			    load_blocks(index, node) != 0) {
+				corrupt_image();
+			}
+			checkpoint_mark_dirty(node);
+		}
+	}
+}
+
+// Highest snapshot id of the frozen inodes of `index`, 0 if none.
+static uint64_t
+last_snapshot(const image_index *index)
+{
+	uint64_t last = 0;
+	for (size_t i = 0; i < index->nsegments; i++) {
+		const segment *seg = &index->segments[i];
+		// The directory of snapshots comes after every frozen inode.
+		uint32_t j =
+		        first_entry(seg->inodes, seg->ninodes, SNAPSHOTS_INO);
+		if (j > 0 && seg->inodes[j - 1].key >= SNAPSHOT_BASE &&
+		    SNAPSHOT_ID(seg->inodes[j - 1].key) > last) {
+			last = SNAPSHOT_ID(seg->inodes[j - 1].key);
+		}
+	}
+	return last;
+}
+
+// Maps a segmented image and loads its root. The rest of a current image
+// is left to be loaded on demand, an older one is loaded whole and
+// unmapped, since the next checkpoint replaces it.
+static inode *
+deserialize_segments(FILE *file, int version, image_info *info)
+{
+	image_index *index = &image.mounted;
+	index_destroy(index);
+	index->version = version;
+	if (map_image(file, index) != 0) {
+		fprintf(stderr, "Deserialization error: cannot map image\n");
 		exit(EXIT_FAILURE);
 	}
+	if (version == 3) {
+		index_segments_v3(index);
+	} else if (index_segments(index, index->map_size) != 0) {
+		out_of_memory();
+	}
+	if (version >= 8) {
+		if (index->map_size < IMAGE_HEADER_SIZE) {
+			corrupt_image();
+		}
+		memcpy(&info->id, index->map + IMAGE_HEADER_SIZE_V7, 8);
+	}
+
+	inode *root = new_stub(ROOT_INO);
+	if (root == NULL) {
+		out_of_memory();
+	}
+	info->last_snapshot = last_snapshot(index);
+	bool whole = version < IMAGE_VERSION;
+	if (whole) {
+		load_tree(index, root, &info->usage);
+		load_frozen(index);
+	} else if (load_inode(index, root) != 0) {
+		corrupt_image();
+	} else {
+		info->usage = index->usage;
+	}
+	root->stub = false;
+
+	info->lsn = index->lsn;
+	info->next_ino = index->max_ino + 1;
+	info->garbage = index->garbage;
+
+	pthread_mutex_lock(&image.lock);
+	image.segmented = version == IMAGE_VERSION;
+	image.id = info->id;
+	image.size = index->end;
+	image.nsegments = index->nsegments;
+	image.next_block_id = index->max_block_id + 1;
+	pthread_mutex_unlock(&image.lock);
+
+	if (whole) {
+		index_destroy(index);
+	}
+	return root;
 }
 
-// Serializes the inode in a recursive depth-first
-// manner and saves it into the file.
-// NOTE: This simplifies and centralizes code, but
-// if stack overflows are a problem, switch to an
-// iterative/breath-first serialization.
+// Unmaps the mounted image. Stubs cannot be loaded afterwards.
 void
-serialize_inode(FILE *file, const inode *node)
+image_release(void)
 {
-	// This should never fail, so no fallback
-	// case is added.
-	fputc(node->file != NULL ? FILE_INDICATOR : DIR_INDICATOR, file);
+	index_destroy(&image.mounted);
+}
 
-	// Shared fields.
-	fwrite(&node->mode, sizeof(mode_t), 1, file);
-	fwrite(&node->nlink, sizeof(nlink_t), 1, file);
-	fwrite(&node->uid, sizeof(uid_t), 1, file);
-	fwrite(&node->gid, sizeof(gid_t), 1, file);
-	fwrite(&node->atime, sizeof(time_t), 1, file);
-	fwrite(&node->mtime, sizeof(time_t), 1, file);
-	fwrite(&node->ctime, sizeof(time_t), 1, file);
-	fwrite(&node->size, sizeof(off_t), 1, file);
+// Gives the image a new random id, for an image not written yet or one
+// that has none, which the next checkpoint writes. Never 0, which stands
+// for no id.
+uint64_t
+image_new_id(void)
+{
+	uint64_t id = 0;
+	while (id == 0) {
+		if (getrandom(&id, sizeof(id), 0) != sizeof(id)) {
+			id = (uint64_t) time(NULL) << 32 ^ (uint64_t) getpid();
+		}
+	}
+	pthread_mutex_lock(&image.lock);
+	image.id = id;
+	pthread_mutex_unlock(&image.lock);
+	return id;
+}
 
-	if (node->file != NULL) {
-		fwrite(node->file->content, 1, MAX_CONTENT_SIZE, file);
-	} else {
-		fwrite(&node->dir->size, sizeof(int), 1, file);
-		for (int i = 0; i < node->dir->size; ++i) {
-			const dentry *entry = node->dir->entries[i];
-			size_t len = strlen(entry->filename);
-			fwrite(&len, sizeof(len), 1, file);
-			fwrite(entry->filename, 1, len, file);
-			serialize_inode(file, entry->inode);
+// Makes checkpoints and compactions store blocks compressed when that
+// takes less space. Images are read the same either way.
+void
+image_set_compression(bool compress)
+{
+	image.compress = compress;
+}
+
+// Reading versions 0 to 2
+
+static void
+deserialize_content(FILE *file, inode *node, int version)
+{
+	node->file = file_new();
+	if (node->file == NULL) {
+		out_of_memory();
+	}
+
+	if (version == 0) {
+		char content[MAX_CONTENT_SIZE_V0];
+		fread_checked(content, 1, MAX_CONTENT_SIZE_V0, file);
+		if (node->size > MAX_CONTENT_SIZE_V0) {
+			node->size = MAX_CONTENT_SIZE_V0;
+		}
+		file_write_blocks(node->file, content, node->size, 0);
+		return;
+	}
+
+	char buf[BLOCK_SIZE];
+	off_t done = 0;
+	while (done < node->size) {
+		size_t chunk = node->size - done < BLOCK_SIZE
+		                       ? (size_t) (node->size - done)
+		                       : BLOCK_SIZE;
+		fread_checked(buf, 1, chunk, file);
+		if (file_write_blocks(node->file, buf, chunk, done) != 0) {
+			out_of_memory();
 		}
+		done += chunk;
 	}
 }
 
-// Deserializes the inode from the file.
-inode *
-deserialize_inode(FILE *file)
+// Deserializes the inode from the file, and counts it in `usage`. Inode
+// numbers did not exist before version 3, so they are handed out in the
+// order inodes are read.
+static inode *
+deserialize_node(FILE *file,
+                 int version,
+                 uint64_t *next_ino,
+                 fs_usage *usage)
 {
 	const char type = (char) fgetc(file);
 
-	inode *node = malloc(sizeof(inode));
+	inode *node = inode_table_new((*next_ino)++);
+	if (node == NULL) {
+		out_of_memory();
+	}
 
 	// Shared fields.
 	fread_checked(&node->mode, sizeof(mode_t), 1, file);
@@ -76,24 +2172,336 @@ deserialize_inode(FILE *file)
 	// This should never fail, so no fallback
 	// case is added.
 	if (type == FILE_INDICATOR) {
-		node->file = malloc(sizeof(inode_file));
 		node->dir = NULL;
-		fread_checked(node->file->content, 1, MAX_CONTENT_SIZE, file);
+		deserialize_content(file, node, version);
 	} else {
 		node->file = NULL;
-		node->dir = malloc(sizeof(inode_dir));
-		fread_checked(&node->dir->size, sizeof(int), 1, file);
+		node->dir = dir_new();
+		int size;
+		fread_checked(&size, sizeof(int), 1, file);
 
-		for (int i = 0; i < node->dir->size; ++i) {
-			dentry *entry = malloc(sizeof(dentry));
+		if (size > 0) {
+			slab_reserve(&dentry_slab, size);
+		}
+		for (int i = 0; i < size; ++i) {
+			dentry *entry = slab_alloc(&dentry_slab);
 			size_t len;
 			fread_checked(&len, sizeof(len), 1, file);
 			fread_checked(entry->filename, 1, len, file);
 			entry->filename[len] = '\0';
-			entry->inode = deserialize_inode(file);
-			node->dir->entries[i] = entry;
+			entry->inode = deserialize_node(
+			        file, version, next_ino, usage);
+			if (dir_add(node->dir, entry) != 0) {
+				out_of_memory();
+			}
 		}
 	}
 
+	count_loaded(usage, node);
 	return node;
 }
+
+// Reads the image header, if any, and the tree. Only the root of a
+// current image is loaded, older images are read whole and rewritten by
+// the first checkpoint.
+inode *
+deserialize_inode(FILE *file, image_info *info)
+{
+	int version = 0;
+	int first = fgetc(file);
+	memset(info, 0, sizeof(*info));
+
+	if (first == DIR_INDICATOR) {
+		// Headerless image from before versioning.
+		ungetc(first, file);
+	} else {
+		char magic[sizeof(IMAGE_MAGIC)];
+		magic[0] = (char) first;
+		fread_checked(magic + 1, 1, sizeof(magic) - 1, file);
+		fread_checked(&version, sizeof(int), 1, file);
+		if (memcmp(magic, IMAGE_MAGIC, sizeof(magic)) != 0 ||
+		    version > IMAGE_VERSION) {
+			fprintf(stderr,
+			        "Deserialization error: unknown image format\n");
+			exit(EXIT_FAILURE);
+		}
+		if (version >= 3) {
+			return deserialize_segments(file, version, info);
+		}
+		if (version >= 2) {
+			fread_checked(&info->lsn, sizeof(uint64_t), 1, file);
+		}
+	}
+
+	info->next_ino = ROOT_INO;
+	pthread_mutex_lock(&image.lock);
+	image.segmented = false;
+	pthread_mutex_unlock(&image.lock);
+	return deserialize_node(file, version, &info->next_ino, &info->usage);
+}
+
+// Compaction
+
+static void
+copy_record(segment_writer *writer,
+            char type,
+            uint64_t key,
+            cursor record)
+{
+	size_t size = record.end - record.pos;
+	index_record(writer,
+	             type,
+	             key,
+	             size,
+	             checksum_update(CHECKSUM_INIT, record.pos, size));
+	put(writer, record.pos, size);
+}
+
+// Reads the ids of the snapshots the image lists into `*ids`, which the
+// caller frees. -ENOENT if it has no directory of snapshots.
+static int
+read_snapshot_ids(const image_index *index, uint64_t **ids, size_t *count)
+{
+	cursor bytes;
+	inode_record record;
+	int ret = find_record(index, RECORD_INODE, SNAPSHOTS_INO, &bytes);
+	if (ret != 0) {
+		return ret;
+	}
+	if (!parse_inode_record(index->version, bytes, &record)) {
+		return -EIO;
+	}
+	*ids = malloc((record.count > 0 ? record.count : 1) * sizeof(uint64_t));
+	if (*ids == NULL) {
+		return -ENOMEM;
+	}
+	for (*count = 0; *count < record.count; (*count)++) {
+		char name[MAX_FILENAME];
+		if (!next_dir_item(&record, name, &(*ids)[*count])) {
+			return -EIO;
+		}
+	}
+	return 0;
+}
+
+// Pushes onto `stack` the number of the directory of snapshots and of
+// every frozen inode in the image some snapshot it lists resolves to
+// (see snapshot_needed): they are live too, though no directory of the
+// tree leads to them. Those only removed snapshots needed are dropped.
+static int
+push_frozen(const image_index *index,
+            uint64_t **stack,
+            size_t *depth,
+            size_t *capacity)
+{
+	size_t first = *depth;
+	for (size_t i = 0; i < index->nsegments; i++) {
+		const segment *seg = &index->segments[i];
+		uint32_t j =
+		        first_entry(seg->inodes, seg->ninodes, SNAPSHOT_BASE);
+		for (; j < seg->ninodes; j++) {
+			if (*depth == *capacity &&
+			    grow_stack((void **) stack,
+			               capacity,
+			               sizeof(uint64_t)) != 0) {
+				return -ENOMEM;
+			}
+			(*stack)[(*depth)++] = seg->inodes[j].key;
+		}
+	}
+
+	uint64_t *ids = NULL;
+	size_t count = 0;
+	int ret = read_snapshot_ids(index, &ids, &count);
+	if (ret == 0) {
+		size_t kept = snapshot_needed(
+		        *stack + first, *depth - first, ids, count);
+		// The directory was pushed too, so it has room.
+		*depth = first + kept;
+		(*stack)[(*depth)++] = SNAPSHOTS_INO;
+	}
+	free(ids);
+	// With no directory of snapshots, there is nothing to drop.
+	return ret == -ENOENT ? 0 : ret;
+}
+
+// Copies the records reachable from the root into `writer`, walking the
+// tree with an explicit stack, and those of the snapshots. Each key is
+// copied once.
+static int
+copy_live_records(const image_index *index, segment_writer *writer)
+{
+	uint64_t *stack = malloc(64 * sizeof(uint64_t));
+	size_t depth = 0;
+	size_t stack_capacity = 64;
+	idmap copied[2];  // Keys of the inodes and blocks copied so far
+	int ret = 0;
+
+	if (stack == NULL) {
+		return -ENOMEM;
+	}
+	idmap_init(&copied[0]);
+	idmap_init(&copied[1]);
+	stack[depth++] = ROOT_INO;
+	ret = push_frozen(index, &stack, &depth, &stack_capacity);
+
+	while (depth > 0 && ret == 0) {
+		uint64_t ino = stack[--depth];
+		uint64_t unused;
+		cursor bytes;
+		inode_record record;
+		if (idmap_get(&copied[0], ino, &unused)) {
+			continue;
+		}
+		if (find_record(index, RECORD_INODE, ino, &bytes) != 0 ||
+		    !parse_inode_record(index->version, bytes, &record)) {
+			ret = -EIO;
+			break;
+		}
+		copy_record(writer, RECORD_INODE, ino, bytes);
+		ret = idmap_put(&copied[0], ino, 0);
+		if (S_ISDIR(record.mode) && ino >= SNAPSHOT_BASE) {
+			// Its entries are frozen or live inodes, kept anyway,
+			// or snapshot ids.
+			continue;
+		}
+
+		for (uint32_t i = 0; i < record.count && ret == 0; i++) {
+			uint64_t key, value;
+			char name[MAX_FILENAME];
+			if (S_ISDIR(record.mode)) {
+				if (!next_dir_item(&record, name, &key)) {
+					ret = -EIO;
+					break;
+				}
+				if (depth == stack_capacity &&
+				    grow_stack((void **) &stack,
+				               &stack_capacity,
+				               sizeof(uint64_t)) != 0) {
+					ret = -ENOMEM;
+					break;
+				}
+				stack[depth++] = key;
+				continue;
+			}
+
+			if (!next_file_item(&record, &value, &key)) {
+				ret = -EIO;
+				break;
+			}
+			if (idmap_get(&copied[1], key, &unused)) {
+				continue;
+			}
+			ret = find_record(index, RECORD_BLOCK, key, &bytes);
+			if (ret != 0) {
+				ret = -EIO;
+				break;
+			}
+			copy_record(writer, RECORD_BLOCK, key, bytes);
+			ret = idmap_put(&copied[1], key, 0);
+		}
+	}
+
+	free(stack);
+	idmap_destroy(&copied[0]);
+	idmap_destroy(&copied[1]);
+	return ret;
+}
+
+// Rewrites the image at `path` keeping only the live records. Runs
+// without blocking checkpoints until the very end, when the segments
+// they appended meanwhile are copied over and the new image replaces the
+// old one. Sets `reclaimed` to the bytes it dropped.
+int
+compact_image(const char *path, uint64_t *reclaimed)
+{
+	char tmp_path[PATH_MAX];
+	if (snprintf(tmp_path, sizeof(tmp_path), "%s.compact", path) >=
+	    (int) sizeof(tmp_path)) {
+		return -ENAMETOOLONG;
+	}
+
+	pthread_mutex_lock(&image.lock);
+	bool segmented = image.segmented;
+	uint64_t start = image.size;
+	pthread_mutex_unlock(&image.lock);
+	*reclaimed = 0;
+	if (!segmented) {
+		return 0;
+	}
+
+	FILE *input = fopen(path, "rb");
+	if (input == NULL) {
+		return -errno;
+	}
+	FILE *output = fopen(tmp_path, "wb");
+	if (output == NULL) {
+		int ret = -errno;
+		fclose(input);
+		return ret;
+	}
+
+	image_index index;
+	index_init(&index);
+	index.version = IMAGE_VERSION;
+	int ret = map_image(input, &index);
+	if (ret == 0) {
+		ret = index_segments(&index, start);
+	}
+	size_t compacted = index.nsegments;
+
+	segment_writer writer;
+	write_image_header(output);
+	begin_segment(&writer, output);
+	if (ret == 0) {
+		ret = copy_live_records(&index, &writer);
+	}
+	int64_t size =
+	        finish_segment(&writer, index.lsn, 0, &index.usage, false);
+	if (ret == 0 && size < 0) {
+		ret = (int) size;
+	}
+	index_destroy(&index);
+
+	pthread_mutex_lock(&image.lock);
+	// Segments appended since the scan are copied as they are, their
+	// records are addressed from the start of their segment.
+	char buf[BLOCK_SIZE];
+	uint64_t tail = start;
+	if (ret == 0 && fseeko(input, start, SEEK_SET) != 0) {
+		ret = -EIO;
+	}
+	while (ret == 0 && tail < image.size) {
+		size_t chunk = sizeof(buf);
+		if (image.size - tail < chunk) {
+			chunk = image.size - tail;
+		}
+		if (fread(buf, 1, chunk, input) != chunk) {
+			ret = -EIO;
+			break;
+		}
+		fwrite(buf, 1, chunk, output);
+		tail += chunk;
+	}
+	if (ret == 0 && (fflush(output) != 0 || fsync(fileno(output)) != 0)) {
+		ret = -EIO;
+	}
+	if (ret == 0 && rename(tmp_path, path) != 0) {
+		ret = -errno;
+	}
+	if (ret == 0) {
+		uint64_t new_size =
+		        IMAGE_HEADER_SIZE + size + (image.size - start);
+		*reclaimed = image.size - new_size;
+		image.size = new_size;
+		image.nsegments = 1 + (image.nsegments - compacted);
+	}
+	pthread_mutex_unlock(&image.lock);
+
+	fclose(input);
+	fclose(output);
+	if (ret != 0) {
+		unlink(tmp_path);
+	}
+	return ret;
+}
@@ -4,9 +4,50 @@
 #include <stdio.h>
 
 #include "defs.h"
+#include "usage.h"
 
-void serialize_inode(FILE *file, const inode *node);
+// Largest block record in an image (see persistence.c).
+#define IMAGE_MAX_BLOCK_RECORD_SIZE (1 + 5 + 10 + 2 + BLOCK_SIZE)
 
-inode *deserialize_inode(FILE *file);
+// What a loaded image tells about the filesystem besides the tree.
+typedef struct image_info {
+	uint64_t lsn;            // Last journal record included in the image
+	uint64_t next_ino;       // Lowest inode number not used by the image
+	uint64_t garbage;        // Bytes of records superseded by later ones
+	fs_usage usage;          // Of the tree saved, see usage.c
+	uint64_t id;             // Of the image, 0 if older than ids
+	uint64_t last_snapshot;  // Highest id of its frozen inodes
+} image_info;
+
+// Changes captured by a checkpoint, see image_capture.
+typedef struct image_snapshot image_snapshot;
+
+inode *deserialize_inode(FILE *file, image_info *info);
+
+image_snapshot *image_capture(inode *root, inode *dirty, uint64_t lsn);
+
+int image_write(const char *path, image_snapshot *snapshot, uint64_t *garbage);
+
+int compact_image(const char *path, uint64_t *reclaimed);
+
+bool image_is_segmented(void);
+
+uint64_t image_size(void);
+
+size_t image_segment_count(void);
+
+int image_load_inode(inode *node);
+
+int image_load_blocks(inode *node);
+
+inode *image_find_inode(uint64_t ino);
+
+int image_frozen_keys(uint64_t **keys, size_t *count);
+
+void image_release(void);
+
+void image_set_compression(bool compress);
+
+uint64_t image_new_id(void);
 
 #endif
@@ -0,0 +1,96 @@
+#include "slab.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Objects are carved from chunks of SLAB_CHUNK_OBJECTS, allocated with
+// malloc, and freed ones are kept in a free list to be reused first. So
+// creating and removing files does not go through malloc, and the
+// metadata of the tree stays packed in a few chunks instead of being
+// spread over the heap. Chunks are never given back.
+//
+// Loading a directory from the image reserves room for all of its
+// entries at once (slab_reserve), so its dentries and inodes end up next
+// to each other.
+
+#define SLAB_CHUNK_OBJECTS 256
+
+slab_pool inode_slab = SLAB_POOL_INIT(inode);
+slab_pool dentry_slab = SLAB_POOL_INIT(dentry);
+slab_pool dir_slab = SLAB_POOL_INIT(inode_dir);
+slab_pool file_slab = SLAB_POOL_INIT(inode_file);
+slab_pool open_file_slab = SLAB_POOL_INIT(open_file);
+
+// Gives the rest of the current chunk to the free list and starts one
+// for at least `count` objects. The caller holds the pool lock.
+static void
+new_chunk(slab_pool *pool, size_t count)
+{
+	if (count < SLAB_CHUNK_OBJECTS) {
+		count = SLAB_CHUNK_OBJECTS;
+	}
+	char *chunk = malloc(count * pool->object_size);
+	if (chunk == NULL) {
+		return;
+	}
+
+	while (pool->left > 0) {
+		*(void **) pool->chunk = pool->free_list;
+		pool->free_list = pool->chunk;
+		pool->chunk += pool->object_size;
+		pool->left--;
+	}
+	pool->chunk = chunk;
+	pool->left = count;
+}
+
+// Returns a zeroed object, or null if out of memory.
+void *
+slab_alloc(slab_pool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	void *object = pool->free_list;
+	if (object != NULL) {
+		pool->free_list = *(void **) object;
+	} else {
+		if (pool->left == 0) {
+			new_chunk(pool, SLAB_CHUNK_OBJECTS);
+		}
+		if (pool->left > 0) {
+			object = pool->chunk;
+			pool->chunk += pool->object_size;
+			pool->left--;
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	if (object != NULL) {
+		memset(object, 0, pool->object_size);
+	}
+	return object;
+}
+
+// Returns `object`, which may be null, to the pool.
+void
+slab_free(slab_pool *pool, void *object)
+{
+	if (object == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&pool->lock);
+	*(void **) object = pool->free_list;
+	pool->free_list = object;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+// Makes the next `count` allocations that do not reuse a freed object
+// contiguous.
+void
+slab_reserve(slab_pool *pool, size_t count)
+{
+	pthread_mutex_lock(&pool->lock);
+	if (pool->left < count) {
+		new_chunk(pool, count);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
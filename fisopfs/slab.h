@@ -0,0 +1,34 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include "defs.h"
+
+// Pool of objects of one size, see slab.c.
+typedef struct slab_pool {
+	pthread_mutex_t lock;  // Protects the fields below
+	size_t object_size;
+	void *free_list;  // Freed objects, linked through their first word
+	char *chunk;      // Unused part of the last chunk
+	size_t left;      // Objects that still fit in chunk
+} slab_pool;
+
+#define SLAB_POOL_INIT(type)                                              \
+	{ .lock = PTHREAD_MUTEX_INITIALIZER, .object_size = sizeof(type) }
+
+// Pools of the tree metadata
+extern slab_pool inode_slab;
+extern slab_pool dentry_slab;
+extern slab_pool dir_slab;
+extern slab_pool file_slab;
+extern slab_pool open_file_slab;
+
+void *slab_alloc(slab_pool *pool);
+
+void slab_free(slab_pool *pool, void *object);
+
+void slab_reserve(slab_pool *pool, size_t count);
+
+#endif
@@ -0,0 +1,721 @@
+#include "snapshot.h"
+
+#include <errno.h>
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blocks.h"
+#include "checkpoint.h"
+#include "directory.h"
+#include "errors.h"
+#include "idmap.h"
+#include "inode_table.h"
+#include "journal.h"
+#include "persistence.h"
+#include "slab.h"
+
+// Snapshots
+//
+// mkdir SNAPSHOTS_PATH/<name> takes a snapshot of the whole tree, shown
+// read-only under that path. Taking one only adds an entry to the
+// directory of snapshots and counts it in snapshots.epoch, so it costs
+// the same whatever the size of the tree: nothing is copied until it
+// changes.
+//
+// Every inode keeps in node->snapshot how many snapshots had been taken
+// when it was created or last preserved. Before anything of an inode
+// but atime changes, snapshot_preserve checks whether snapshots were
+// taken since and, if so, copies it as it is into a frozen inode
+// numbered SNAPSHOT_KEY(epoch, ino), which stands for it in each of
+// them. A frozen file shares the blocks of the live one (see file_share),
+// which copies them on its next write to each, and a frozen directory
+// keeps the numbers of its entries (dentry->ino), as they may be freed or
+// changed later.
+//
+// So the inode `ino` of snapshot `id` is the first frozen copy
+// SNAPSHOT_KEY(j, ino) with j >= id or, if there is none, the live inode,
+// unchanged since (see snapshot_resolve). snapshots.frozen indexes the
+// ids j of the copies of each inode, sorted, so finding it takes one
+// binary search whatever the number of snapshots. Readers check
+// snapshot_covers once they hold the lock of a live inode: it may be
+// preserved and changed in between.
+//
+// Frozen inodes never change. They are saved as inode records keyed by
+// their number, like the live ones. Their blocks are the records of the
+// live files until either side changes, so a snapshot only takes the
+// space of the changes made after it. The directory of snapshots
+// (SNAPSHOTS_INO) is saved the same way, its entries giving the id of
+// each snapshot, and loaded on mount. Taking a snapshot is logged as the
+// mkdir of its path.
+//
+// rmdir SNAPSHOTS_PATH/<name> removes a snapshot, logged as such. Its id
+// is not given again while frozen inodes may carry it, so epoch does not
+// go back. The copy SNAPSHOT_KEY(j, ino) stands for ino in the snapshots
+// after the previous copy of ino, up to j: once none of them is left
+// nothing reaches it, and it is freed and taken out of the index (see
+// snapshot_needed). Compaction leaves its record behind the same way
+// (see persistence.c). Until then the image keeps the record of a freed
+// copy, which nothing looks up again: the index is built on mount from
+// the copies of the image and those loaded with it, without the freed
+// ones.
+//
+// Inodes loaded from the image start at snapshot 0, as if unchanged
+// since before every snapshot, so preserving one first looks for the
+// frozen copy in the index.
+//
+// snapshots.lock orders making frozen inodes with finding them, so that
+// a reader never finds one half made, and protects the index. Taking a snapshot needs fs.lock
+// for writing. Preserving an inode needs it too, or fs.lock and the lock
+// of the inode for writing.
+
+static struct {
+	pthread_mutex_t lock;  // Orders making and finding frozen inodes
+	inode *dir;            // SNAPSHOTS_INO
+	uint64_t epoch;        // Highest id given to a snapshot
+	uint64_t *ids;         // Of the snapshots in dir, sorted
+	size_t count;
+	size_t capacity;
+	idmap frozen;  // Inode number -> its frozen_ids
+} snapshots = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static int
+compare_ids(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+// By inode, then by snapshot.
+static int
+compare_keys(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+	if (SNAPSHOT_INO(x) != SNAPSHOT_INO(y)) {
+		return SNAPSHOT_INO(x) < SNAPSHOT_INO(y) ? -1 : 1;
+	}
+	return x < y ? -1 : x > y;
+}
+
+// Position of the first of the sorted `ids` above `id`, or `count`.
+static size_t
+first_above(const uint64_t *ids, size_t count, uint64_t id)
+{
+	size_t low = 0;
+	size_t high = count;
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+		if (ids[mid] <= id) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
+// Sorts the snapshot `ids` and the frozen inode numbers `keys`, and
+// moves first the copies some of those snapshots resolve to, returning
+// how many. The other ones follow.
+size_t
+snapshot_needed(uint64_t *keys, size_t count, uint64_t *ids, size_t nids)
+{
+	if (count == 0) {
+		return 0;
+	}
+	qsort(ids, nids, sizeof(uint64_t), compare_ids);
+	qsort(keys, count, sizeof(uint64_t), compare_keys);
+
+	size_t kept = 0;
+	uint64_t previous = 0;
+	for (size_t i = 0; i < count; i++) {
+		uint64_t key = keys[i];
+		// The snapshots after the previous copy, 0 for the first one.
+		uint64_t after = 0;
+		if (i > 0 && SNAPSHOT_INO(previous) == SNAPSHOT_INO(key)) {
+			after = SNAPSHOT_ID(previous);
+		}
+		size_t next = first_above(ids, nids, after);
+		if (next < nids && ids[next] <= SNAPSHOT_ID(key)) {
+			keys[i] = keys[kept];
+			keys[kept++] = key;
+		}
+		previous = key;
+	}
+	return kept;
+}
+
+// Ids of the snapshots of the frozen copies of an inode, sorted, as
+// snapshots.frozen has them.
+typedef struct frozen_ids {
+	uint64_t *ids;
+	size_t count;
+	size_t capacity;
+} frozen_ids;
+
+static frozen_ids *
+frozen_of(uint64_t ino)
+{
+	uint64_t value;
+	if (!idmap_get(&snapshots.frozen, ino, &value)) {
+		return NULL;
+	}
+	return (frozen_ids *) (uintptr_t) value;
+}
+
+// Position in `list` of the first id at least `id`, or its count.
+static size_t
+first_from(const frozen_ids *list, uint64_t id)
+{
+	return first_above(list->ids, list->count, id - 1);
+}
+
+// Whether the index has the frozen copy `key`.
+static bool
+is_frozen(uint64_t key)
+{
+	const frozen_ids *list = frozen_of(SNAPSHOT_INO(key));
+	if (list == NULL) {
+		return false;
+	}
+	size_t at = first_from(list, SNAPSHOT_ID(key));
+	return at < list->count && list->ids[at] == SNAPSHOT_ID(key);
+}
+
+// Adds the frozen copy `key` to the index, if it is not there yet.
+static int
+index_frozen(uint64_t key)
+{
+	uint64_t ino = SNAPSHOT_INO(key);
+	uint64_t id = SNAPSHOT_ID(key);
+	frozen_ids *list = frozen_of(ino);
+	if (list == NULL) {
+		list = calloc(1, sizeof(frozen_ids));
+		if (list == NULL ||
+		    idmap_put(&snapshots.frozen, ino, (uintptr_t) list) != 0) {
+			free(list);
+			return -ENOMEM;
+		}
+	}
+	size_t at = first_from(list, id);
+	if (at < list->count && list->ids[at] == id) {
+		return EXIT_SUCCESS;
+	}
+	if (list->count == list->capacity) {
+		size_t capacity = list->capacity > 0 ? 2 * list->capacity : 2;
+		uint64_t *bigger =
+		        realloc(list->ids, capacity * sizeof(uint64_t));
+		if (bigger == NULL) {
+			return -ENOMEM;
+		}
+		list->ids = bigger;
+		list->capacity = capacity;
+	}
+	memmove(list->ids + at + 1,
+	        list->ids + at,
+	        (list->count - at) * sizeof(uint64_t));
+	list->ids[at] = id;
+	list->count++;
+	return EXIT_SUCCESS;
+}
+
+// Takes the frozen copy `key` out of the index.
+static void
+unindex_frozen(uint64_t key)
+{
+	uint64_t ino = SNAPSHOT_INO(key);
+	frozen_ids *list = frozen_of(ino);
+	if (list == NULL) {
+		return;
+	}
+	size_t at = first_from(list, SNAPSHOT_ID(key));
+	if (at == list->count || list->ids[at] != SNAPSHOT_ID(key)) {
+		return;
+	}
+	memmove(list->ids + at,
+	        list->ids + at + 1,
+	        (list->count - at - 1) * sizeof(uint64_t));
+	list->count--;
+	if (list->count == 0) {
+		idmap_remove(&snapshots.frozen, ino);
+		free(list->ids);
+		free(list);
+	}
+}
+
+// Makes room for one more id. The caller must hold fs.lock for writing.
+static int
+reserve_id(void)
+{
+	if (snapshots.count == snapshots.capacity) {
+		size_t capacity = snapshots.capacity > 0
+		                          ? 2 * snapshots.capacity
+		                          : 16;
+		uint64_t *bigger =
+		        realloc(snapshots.ids, capacity * sizeof(uint64_t));
+		if (bigger == NULL) {
+			return -ENOMEM;
+		}
+		snapshots.ids = bigger;
+		snapshots.capacity = capacity;
+	}
+	return EXIT_SUCCESS;
+}
+
+// Whether the snapshot `id` exists, it may have been removed. The caller
+// must hold fs.lock.
+bool
+snapshot_exists(uint64_t id)
+{
+	size_t next = first_above(snapshots.ids, snapshots.count, id - 1);
+	return next < snapshots.count && snapshots.ids[next] == id;
+}
+
+// Adds the frozen inodes loaded with the image to the index.
+static void
+index_loaded(inode *node, void *arg)
+{
+	int *ret = arg;
+	if (*ret == EXIT_SUCCESS && node->ino >= SNAPSHOT_BASE &&
+	    node->ino != SNAPSHOTS_INO) {
+		*ret = index_frozen(node->ino);
+	}
+}
+
+// Builds the index of the frozen copies on mount, from the records of
+// the image and the copies loaded with it.
+static int
+index_image(void)
+{
+	uint64_t *keys = NULL;
+	size_t count = 0;
+	int ret = image_frozen_keys(&keys, &count);
+	for (size_t i = 0; ret == EXIT_SUCCESS && i < count; i++) {
+		ret = index_frozen(keys[i]);
+	}
+	free(keys);
+	if (ret == EXIT_SUCCESS) {
+		inode_table_for_each(index_loaded, &ret);
+	}
+	return ret;
+}
+
+// Numbers of all the frozen copies in the index into `*keys`, which the
+// caller frees.
+static int
+frozen_keys(uint64_t **keys, size_t *count)
+{
+	const idmap *map = &snapshots.frozen;
+	size_t total = 0;
+	for (size_t i = 0; i < map->capacity; i++) {
+		if (map->keys[i] != 0) {
+			total += frozen_of(map->keys[i])->count;
+		}
+	}
+	*keys = malloc((total > 0 ? total : 1) * sizeof(uint64_t));
+	if (*keys == NULL) {
+		return -ENOMEM;
+	}
+	*count = 0;
+	for (size_t i = 0; i < map->capacity; i++) {
+		if (map->keys[i] == 0) {
+			continue;
+		}
+		const frozen_ids *list = frozen_of(map->keys[i]);
+		for (size_t j = 0; j < list->count; j++) {
+			(*keys)[(*count)++] =
+			        SNAPSHOT_KEY(list->ids[j], map->keys[i]);
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+// Empties the index.
+static void
+clear_index(void)
+{
+	idmap *map = &snapshots.frozen;
+	for (size_t i = 0; i < map->capacity; i++) {
+		if (map->keys[i] != 0) {
+			frozen_ids *list = frozen_of(map->keys[i]);
+			free(list->ids);
+			free(list);
+		}
+	}
+	idmap_destroy(map);
+}
+
+static void
+free_frozen_dir(inode_dir *dir)
+{
+	for (int i = 0; i < dir->slots; i++) {
+		slab_free(&dentry_slab, dir->entries[i]);
+	}
+	dir_free(dir);
+}
+
+// Frees the frozen inodes no snapshot resolves to anymore, and takes
+// them out of the index, with those only the image has. Out of memory
+// they are left for the next time. The caller must hold fs.lock for
+// writing.
+static void
+drop_unneeded(void)
+{
+	uint64_t *keys = NULL;
+	size_t count = 0;
+	if (frozen_keys(&keys, &count) != EXIT_SUCCESS) {
+		return;
+	}
+
+	size_t kept =
+	        snapshot_needed(keys, count, snapshots.ids, snapshots.count);
+	for (size_t i = kept; i < count; i++) {
+		unindex_frozen(keys[i]);
+		inode *copy = inode_table_get(keys[i]);
+		if (copy == NULL) {
+			continue;
+		}
+		checkpoint_forget(copy);
+		if (copy->dir != NULL) {
+			free_frozen_dir(copy->dir);
+		}
+		file_free(copy->file);
+		inode_table_delete(copy);
+	}
+	free(keys);
+}
+
+static inode *
+new_snapshots_dir(void)
+{
+	inode *node = inode_table_new(SNAPSHOTS_INO);
+	if (node == NULL) {
+		return NULL;
+	}
+	node->dir = dir_new();
+	if (node->dir == NULL) {
+		inode_table_delete(node);
+		return NULL;
+	}
+	node->mode = __S_IFDIR | 0555;
+	node->nlink = 2;
+	node->uid = getuid();
+	node->gid = getgid();
+	node->atime = time(NULL);
+	node->mtime = time(NULL);
+	node->ctime = time(NULL);
+	return node;
+}
+
+// Loads the directory of snapshots from the image or, if it has none,
+// creates it, on mount and before replaying the journal. `last` is the
+// highest id of the frozen inodes of the image.
+void
+snapshot_init(uint64_t last)
+{
+	snapshots.epoch = last;
+	snapshots.count = 0;
+	snapshots.dir = image_find_inode(SNAPSHOTS_INO);
+	if (snapshots.dir == NULL) {
+		snapshots.dir = new_snapshots_dir();
+		if (snapshots.dir == NULL) {
+			fprintf(stderr, "Error: cannot create the snapshots\n");
+			exit(EXIT_FAILURE);
+		}
+		checkpoint_mark_dirty(snapshots.dir);
+		return;
+	}
+	if (snapshots.dir->stub) {
+		if (image_load_inode(snapshots.dir) != 0 ||
+		    snapshots.dir->dir == NULL) {
+			fprintf(stderr,
+			        "Deserialization error: cannot load the "
+			        "snapshots\n");
+			exit(EXIT_FAILURE);
+		}
+		snapshots.dir->stub = false;
+	}
+
+	const inode_dir *dir = snapshots.dir->dir;
+	snapshots.capacity = dir->size + 1;
+	snapshots.ids = malloc(snapshots.capacity * sizeof(uint64_t));
+	if (snapshots.ids == NULL) {
+		fprintf(stderr, "Error: cannot load the snapshots\n");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < dir->slots; i++) {
+		if (dir->entries[i] == NULL) {
+			continue;
+		}
+		snapshots.ids[snapshots.count++] = dir->entries[i]->ino;
+		if (dir->entries[i]->ino > snapshots.epoch) {
+			snapshots.epoch = dir->entries[i]->ino;
+		}
+	}
+	qsort(snapshots.ids, snapshots.count, sizeof(uint64_t), compare_ids);
+	if (index_image() != EXIT_SUCCESS) {
+		fprintf(stderr, "Error: cannot load the snapshots\n");
+		exit(EXIT_FAILURE);
+	}
+	// The image may still have the copies of the snapshots removed
+	// before it was saved, an older one loads them whole.
+	drop_unneeded();
+}
+
+// Forgets the snapshots on unmount, their inodes go with the table.
+void
+snapshot_clear(void)
+{
+	snapshots.dir = NULL;
+	snapshots.epoch = 0;
+	free(snapshots.ids);
+	snapshots.ids = NULL;
+	snapshots.count = 0;
+	snapshots.capacity = 0;
+	clear_index();
+}
+
+// Highest id given to a snapshot. The caller must hold fs.lock.
+uint64_t
+snapshot_epoch(void)
+{
+	return snapshots.epoch;
+}
+
+// The directory of snapshots. The caller must hold fs.lock, and not
+// change it.
+inode *
+snapshot_dir(void)
+{
+	return snapshots.dir;
+}
+
+// Id of the snapshot `name`, 0 if there is none. The caller must hold
+// fs.lock.
+uint64_t
+snapshot_find(const char *name)
+{
+	const dentry *entry = dir_lookup(snapshots.dir->dir, name);
+	return entry != NULL ? entry->ino : 0;
+}
+
+// Takes the snapshot `name` of the tree. The caller must hold fs.lock for
+// writing.
+int
+snapshot_take(const char *name, uint64_t *lsn)
+{
+	if (snapshots.epoch == SNAPSHOT_MAX) {
+		fprintf(stderr, TOO_MANY_SNAPSHOTS);
+		return -ENOSPC;
+	}
+	inode *node = snapshots.dir;
+	if (dir_lookup(node->dir, name) != NULL) {
+		fprintf(stderr, SNAPSHOT_ALREADY_EXISTS, name);
+		return -EEXIST;
+	}
+
+	if (reserve_id() != EXIT_SUCCESS) {
+		return -ENOMEM;
+	}
+	dentry *entry = slab_alloc(&dentry_slab);
+	if (entry == NULL) {
+		return -ENOMEM;
+	}
+	strncpy(entry->filename, name, MAX_FILENAME - 1);
+	entry->filename[MAX_FILENAME - 1] = '\0';
+	entry->ino = snapshots.epoch + 1;
+	if (dir_add(node->dir, entry) != 0) {
+		fprintf(stderr, PARENT_DIRECTORY_FULL);
+		slab_free(&dentry_slab, entry);
+		return -ENOSPC;
+	}
+
+	// Every inode now predates it, nothing else to do.
+	snapshots.epoch++;
+	snapshots.ids[snapshots.count++] = snapshots.epoch;
+	node->mtime = time(NULL);
+	checkpoint_mark_dirty(node);
+
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), SNAPSHOTS_PATH "/%s", entry->filename);
+	*lsn = journal_log(&(journal_record){
+	        .op = JOURNAL_MKDIR, .path = path, .mode = node->mode });
+	return EXIT_SUCCESS;
+}
+
+// Removes the snapshot `name`, freeing the frozen inodes only it
+// needed. The caller must hold fs.lock for writing.
+int
+snapshot_remove(const char *name, uint64_t *lsn)
+{
+	inode *node = snapshots.dir;
+	dentry *entry = dir_lookup(node->dir, name);
+	if (entry == NULL) {
+		fprintf(stderr, SNAPSHOT_NOT_FOUND, name);
+		return -ENOENT;
+	}
+
+	size_t at =
+	        first_above(snapshots.ids, snapshots.count, entry->ino - 1);
+	memmove(snapshots.ids + at,
+	        snapshots.ids + at + 1,
+	        (snapshots.count - at - 1) * sizeof(uint64_t));
+	snapshots.count--;
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), SNAPSHOTS_PATH "/%s", entry->filename);
+	dir_remove(node->dir, name);
+	slab_free(&dentry_slab, entry);
+	node->mtime = time(NULL);
+	checkpoint_mark_dirty(node);
+	*lsn = journal_log(
+	        &(journal_record){ .op = JOURNAL_RMDIR, .path = path });
+
+	drop_unneeded();
+	return EXIT_SUCCESS;
+}
+
+// Copies the entries of the live directory `dir` by number. Null if out
+// of memory.
+static inode_dir *
+freeze_dir(const inode_dir *dir)
+{
+	inode_dir *copy = dir_new();
+	if (copy == NULL) {
+		return NULL;
+	}
+
+	slab_reserve(&dentry_slab, dir->size);
+	for (int i = 0; i < dir->slots; i++) {
+		const dentry *entry = dir->entries[i];
+		if (entry == NULL) {
+			continue;
+		}
+		dentry *frozen = slab_alloc(&dentry_slab);
+		if (frozen == NULL) {
+			free_frozen_dir(copy);
+			return NULL;
+		}
+		memcpy(frozen->filename, entry->filename, MAX_FILENAME);
+		frozen->ino = entry->inode->ino;
+		if (dir_add(copy, frozen) != 0) {
+			slab_free(&dentry_slab, frozen);
+			free_frozen_dir(copy);
+			return NULL;
+		}
+		// The same cookies, so a listing goes on across the copy.
+		frozen->cookie = entry->cookie;
+	}
+	copy->cookies = dir->cookies;
+	return copy;
+}
+
+// Makes the frozen copy `key` of `node`. The caller holds
+// snapshots.lock.
+static int
+freeze(const inode *node, uint64_t key)
+{
+	// A stub until it is complete, which keeps cool_files off it.
+	inode *copy = inode_table_get_stub(key);
+	if (copy == NULL) {
+		return -ENOMEM;
+	}
+	if (node->dir != NULL) {
+		copy->dir = freeze_dir(node->dir);
+	} else {
+		copy->file = file_share(node->file);
+	}
+	if (copy->dir == NULL && copy->file == NULL) {
+		inode_table_delete(copy);
+		return -ENOMEM;
+	}
+
+	copy->mode = node->mode;
+	copy->nlink = node->nlink;
+	copy->uid = node->uid;
+	copy->gid = node->gid;
+	copy->atime = __atomic_load_n(&node->atime, __ATOMIC_RELAXED);
+	copy->mtime = node->mtime;
+	copy->ctime = node->ctime;
+	copy->size = node->size;
+	checkpoint_mark_dirty(copy);
+	__atomic_store_n(&copy->stub, false, __ATOMIC_RELEASE);
+	return EXIT_SUCCESS;
+}
+
+// Preserves `node` as it is for the snapshots taken since it last
+// changed, before it changes again. The caller must hold fs.lock for
+// writing, or fs.lock and the lock of `node` for writing.
+int
+snapshot_preserve(inode *node)
+{
+	uint64_t epoch = snapshots.epoch;
+	// A removed inode is in no later snapshot, and the earlier ones
+	// got their copy when it was removed.
+	if (node->snapshot >= epoch || node->nlink == 0 ||
+	    node->ino >= SNAPSHOT_BASE) {
+		return EXIT_SUCCESS;
+	}
+	// Nor do the snapshots removed since it last changed need a copy.
+	if (snapshots.count == 0 ||
+	    snapshots.ids[snapshots.count - 1] <= node->snapshot) {
+		node->snapshot = epoch;
+		return EXIT_SUCCESS;
+	}
+
+	uint64_t key = SNAPSHOT_KEY(epoch, node->ino);
+	int ret = EXIT_SUCCESS;
+	pthread_mutex_lock(&snapshots.lock);
+	if (!is_frozen(key)) {
+		// Indexed first, so that a failure leaves neither.
+		ret = index_frozen(key);
+		if (ret == EXIT_SUCCESS) {
+			ret = freeze(node, key);
+		}
+		if (ret != EXIT_SUCCESS) {
+			unindex_frozen(key);
+		}
+	}
+	pthread_mutex_unlock(&snapshots.lock);
+	if (ret == EXIT_SUCCESS) {
+		node->snapshot = epoch;
+	}
+	return ret;
+}
+
+// Returns the inode `ino` as the snapshot `id` saw it: the first frozen
+// copy made since or else the live inode, if any, which the caller must
+// check with snapshot_covers once locked. It may be a stub. The caller
+// must hold fs.lock.
+inode *
+snapshot_resolve(uint64_t id, uint64_t ino)
+{
+	inode *node = NULL;
+	pthread_mutex_lock(&snapshots.lock);
+	const frozen_ids *list = frozen_of(ino);
+	if (list != NULL) {
+		size_t at = first_from(list, id);
+		if (at < list->count) {
+			node = image_find_inode(
+			        SNAPSHOT_KEY(list->ids[at], ino));
+		}
+	}
+	pthread_mutex_unlock(&snapshots.lock);
+	return node != NULL ? node : image_find_inode(ino);
+}
+
+// Whether `node`, as it is now, is what the snapshot `id` holds. The
+// caller must hold its lock.
+bool
+snapshot_covers(const inode *node, uint64_t id)
+{
+	return node->ino >= SNAPSHOT_BASE || node->snapshot < id;
+}
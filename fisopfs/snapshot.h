@@ -0,0 +1,53 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "defs.h"
+
+// Inode numbers below SNAPSHOT_BASE belong to the live tree. The ones
+// above it carry the id of a snapshot in their upper bits: they number
+// the frozen inodes in the inode table and the image, and the files of
+// snapshots in the low-level front end (see snapshot.c).
+#define SNAPSHOT_SHIFT 48
+#define SNAPSHOT_BASE (UINT64_C(1) << SNAPSHOT_SHIFT)
+#define SNAPSHOT_MAX 0xfffe  // Snapshots a filesystem can take
+#define SNAPSHOT_KEY(id, ino) (((uint64_t) (id) << SNAPSHOT_SHIFT) | (ino))
+#define SNAPSHOT_ID(key) ((key) >> SNAPSHOT_SHIFT)
+#define SNAPSHOT_INO(key) ((key) & (SNAPSHOT_BASE - 1))
+
+// The directory listing the snapshots, by name.
+#define SNAPSHOTS_NAME ".snapshots"
+#define SNAPSHOTS_PATH "/" SNAPSHOTS_NAME
+#define SNAPSHOTS_INO SNAPSHOT_KEY(SNAPSHOT_MAX + 1, 0)
+
+void snapshot_init(uint64_t last);
+
+void snapshot_clear(void);
+
+uint64_t snapshot_epoch(void);
+
+int snapshot_take(const char *name, uint64_t *lsn);
+
+int snapshot_remove(const char *name, uint64_t *lsn);
+
+bool snapshot_exists(uint64_t id);
+
+size_t snapshot_needed(uint64_t *keys,
+                       size_t count,
+                       uint64_t *ids,
+                       size_t nids);
+
+int snapshot_preserve(inode *node);
+
+inode *snapshot_dir(void);
+
+uint64_t snapshot_find(const char *name);
+
+inode *snapshot_resolve(uint64_t id, uint64_t ino);
+
+bool snapshot_covers(const inode *node, uint64_t id);
+
+#endif
@@ -0,0 +1,266 @@
+#include "stats.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Counters of what the mount does, read through the stats file (see
+// operations.c):
+//
+//   bytes_read <n>
+//   bytes_written <n>
+//   path_cache_hits <n>
+//   path_walks <depth>:<n> ...
+//   <op> calls <n> errors <n> total_ns <n> latency_ns <bound>:<n> ...
+//
+// Only the buckets that are not empty are listed: path_walks by number
+// of components walked, the last one being STATS_DEPTHS - 1 or more, and
+// latencies by the bound (exclusive) of their log2 bucket, "inf" for the
+// last one.
+//
+// Every thread counts into a shard of its own, so recording takes no
+// lock and no atomic read-modify-write: only the owner writes a shard,
+// and stats_format sums all of them. Each counter is exact, but the
+// totals are not a consistent snapshot of all of them. Shards outlive
+// their threads: when libfuse ends an idle worker its shard goes to a
+// free list, for the next thread to go on counting into it.
+#define STATS_BUCKETS 36  // The last one counts 2^34 ns (17 s) and more
+#define STATS_DEPTHS 16
+
+typedef struct stats_shard {
+	uint64_t calls[STATS_OPS];
+	uint64_t errors[STATS_OPS];
+	uint64_t total_ns[STATS_OPS];
+	uint64_t latency[STATS_OPS][STATS_BUCKETS];
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+	uint64_t path_hits;
+	uint64_t walks[STATS_DEPTHS];
+	struct stats_shard *next;       // In shards
+	struct stats_shard *next_free;  // In free_shards
+} stats_shard;
+
+static const char *const op_names[STATS_OPS] = {
+	[STATS_INIT] = "init",         [STATS_DESTROY] = "destroy",
+	[STATS_LOOKUP] = "lookup",     [STATS_FORGET] = "forget",
+	[STATS_GETATTR] = "getattr",   [STATS_SETATTR] = "setattr",
+	[STATS_MKDIR] = "mkdir",       [STATS_CREATE] = "create",
+	[STATS_UNLINK] = "unlink",     [STATS_RMDIR] = "rmdir",
+	[STATS_OPEN] = "open",         [STATS_FLUSH] = "flush",
+	[STATS_RELEASE] = "release",   [STATS_READ] = "read",
+	[STATS_WRITE] = "write",       [STATS_TRUNCATE] = "truncate",
+	[STATS_UTIMENS] = "utimens",   [STATS_READDIR] = "readdir",
+	[STATS_RENAME] = "rename",     [STATS_LINK] = "link",
+	[STATS_FALLOCATE] = "fallocate", [STATS_STATFS] = "statfs",
+	[STATS_LSEEK] = "lseek",
+	[STATS_COPY_FILE_RANGE] = "copy_file_range",
+};
+
+static pthread_mutex_t shards_mutex = PTHREAD_MUTEX_INITIALIZER;
+static stats_shard *shards;       // Every shard ever made
+static stats_shard *free_shards;  // The ones no thread owns
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t shard_key;
+static __thread stats_shard *own;
+
+// Destructor of shard_key: puts the shard of an exiting thread back.
+static void
+return_shard(void *value)
+{
+	stats_shard *shard = value;
+	pthread_mutex_lock(&shards_mutex);
+	shard->next_free = free_shards;
+	free_shards = shard;
+	pthread_mutex_unlock(&shards_mutex);
+}
+
+static void
+create_key(void)
+{
+	pthread_key_create(&shard_key, return_shard);
+}
+
+// Returns the shard of this thread, taking one on its first call. Null
+// if out of memory, then nothing is counted.
+static stats_shard *
+own_shard(void)
+{
+	if (own != NULL) {
+		return own;
+	}
+	pthread_once(&key_once, create_key);
+
+	pthread_mutex_lock(&shards_mutex);
+	stats_shard *shard = free_shards;
+	if (shard != NULL) {
+		free_shards = shard->next_free;
+	} else {
+		shard = calloc(1, sizeof(stats_shard));
+		if (shard != NULL) {
+			shard->next = shards;
+			shards = shard;
+		}
+	}
+	pthread_mutex_unlock(&shards_mutex);
+
+	if (shard != NULL) {
+		own = shard;
+		pthread_setspecific(shard_key, shard);
+	}
+	return shard;
+}
+
+// Adds `n` to a counter of the own shard.
+static void
+add(uint64_t *counter, uint64_t n)
+{
+	__atomic_store_n(counter,
+	                 __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+	                 __ATOMIC_RELAXED);
+}
+
+// Adds the counters of `from` to `to`, a private copy.
+static void
+sum_into(stats_shard *to, const stats_shard *from)
+{
+	const uint64_t *src = (const uint64_t *) from;
+	uint64_t *dst = (uint64_t *) to;
+	size_t count = offsetof(stats_shard, next) / sizeof(uint64_t);
+	for (size_t i = 0; i < count; i++) {
+		dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+	}
+}
+
+// Monotonic clock in nanoseconds, to pass to stats_record.
+uint64_t
+stats_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Counts a call to `op` that began at `start` (see stats_now) and
+// returned `ret`, an error if negative.
+void
+stats_record(stats_op op, uint64_t start, int ret)
+{
+	stats_shard *shard = own_shard();
+	if (shard == NULL) {
+		return;
+	}
+
+	uint64_t ns = stats_now() - start;
+	unsigned bucket = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+	if (bucket >= STATS_BUCKETS) {
+		bucket = STATS_BUCKETS - 1;
+	}
+
+	add(&shard->calls[op], 1);
+	if (ret < 0) {
+		add(&shard->errors[op], 1);
+	}
+	add(&shard->total_ns[op], ns);
+	add(&shard->latency[op][bucket], 1);
+}
+
+// Counts `count` bytes read or, if `write`, written.
+void
+stats_bytes(bool write, size_t count)
+{
+	stats_shard *shard = own_shard();
+	if (shard != NULL) {
+		add(write ? &shard->bytes_written : &shard->bytes_read, count);
+	}
+}
+
+// Counts a search_inode answered by the path cache.
+void
+stats_path_hit(void)
+{
+	stats_shard *shard = own_shard();
+	if (shard != NULL) {
+		add(&shard->path_hits, 1);
+	}
+}
+
+// Counts a search_inode that walked `depth` components.
+void
+stats_walk(unsigned depth)
+{
+	stats_shard *shard = own_shard();
+	if (shard != NULL) {
+		add(&shard->walks[depth < STATS_DEPTHS ? depth
+		                                        : STATS_DEPTHS - 1],
+		    1);
+	}
+}
+
+// Returns the text of the stats file, allocated, and its length in
+// `size`. Null if out of memory.
+char *
+stats_format(size_t *size)
+{
+	stats_shard *total = calloc(1, sizeof(stats_shard));
+	if (total == NULL) {
+		return NULL;
+	}
+	pthread_mutex_lock(&shards_mutex);
+	for (stats_shard *shard = shards; shard != NULL; shard = shard->next) {
+		sum_into(total, shard);
+	}
+	pthread_mutex_unlock(&shards_mutex);
+
+	char *text = NULL;
+	FILE *out = open_memstream(&text, size);
+	if (out == NULL) {
+		free(total);
+		return NULL;
+	}
+
+	fprintf(out, "bytes_read %" PRIu64 "\n", total->bytes_read);
+	fprintf(out, "bytes_written %" PRIu64 "\n", total->bytes_written);
+	fprintf(out, "path_cache_hits %" PRIu64 "\n", total->path_hits);
+	fprintf(out, "path_walks");
+	for (unsigned i = 0; i < STATS_DEPTHS; i++) {
+		if (total->walks[i] != 0) {
+			fprintf(out, " %u:%" PRIu64, i, total->walks[i]);
+		}
+	}
+	fprintf(out, "\n");
+
+	for (int op = 0; op < STATS_OPS; op++) {
+		fprintf(out,
+		        "%s calls %" PRIu64 " errors %" PRIu64
+		        " total_ns %" PRIu64 " latency_ns",
+		        op_names[op],
+		        total->calls[op],
+		        total->errors[op],
+		        total->total_ns[op]);
+		for (unsigned i = 0; i < STATS_BUCKETS; i++) {
+			uint64_t count = total->latency[op][i];
+			if (count == 0) {
+				continue;
+			}
+			if (i < STATS_BUCKETS - 1) {
+				fprintf(out,
+				        " %" PRIu64 ":%" PRIu64,
+				        (uint64_t) 1 << i,
+				        count);
+			} else {
+				fprintf(out, " inf:%" PRIu64, count);
+			}
+		}
+		fprintf(out, "\n");
+	}
+
+	free(total);
+	if (fclose(out) != 0) {
+		free(text);
+		return NULL;
+	}
+	return text;
+}
@@ -0,0 +1,54 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Read-only virtual file with the counters below, see operations.c.
+#define STATS_NAME ".fisopfs_stats"
+#define STATS_PATH "/" STATS_NAME
+#define STATS_INO UINT64_MAX  // Its number in the low-level front end
+
+// Callbacks counted, of either front end.
+typedef enum stats_op {
+	STATS_INIT,
+	STATS_DESTROY,
+	STATS_LOOKUP,
+	STATS_FORGET,
+	STATS_GETATTR,
+	STATS_SETATTR,
+	STATS_MKDIR,
+	STATS_CREATE,
+	STATS_UNLINK,
+	STATS_RMDIR,
+	STATS_OPEN,
+	STATS_FLUSH,
+	STATS_RELEASE,
+	STATS_READ,
+	STATS_WRITE,
+	STATS_TRUNCATE,
+	STATS_UTIMENS,
+	STATS_READDIR,
+	STATS_RENAME,
+	STATS_LINK,
+	STATS_FALLOCATE,
+	STATS_STATFS,
+	STATS_LSEEK,
+	STATS_COPY_FILE_RANGE,
+	STATS_OPS,
+} stats_op;
+
+uint64_t stats_now(void);
+
+void stats_record(stats_op op, uint64_t start, int ret);
+
+void stats_bytes(bool write, size_t count);
+
+void stats_path_hit(void);
+
+void stats_walk(unsigned depth);
+
+char *stats_format(size_t *size);
+
+#endif
@@ -0,0 +1,15 @@
+#!/bin/bash
+set -euo pipefail
+
+MOUNT=tests/mount
+
+mkdir "$MOUNT"/dir
+echo hello >"$MOUNT"/dir/file
+mv "$MOUNT"/dir/file "$MOUNT"/moved
+mv "$MOUNT"/dir "$MOUNT"/renamed
+ls "$MOUNT"
+cat "$MOUNT"/moved
+echo other >"$MOUNT"/other
+mv "$MOUNT"/other "$MOUNT"/moved
+cat "$MOUNT"/moved
+ls "$MOUNT"
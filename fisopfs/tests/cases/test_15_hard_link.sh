@@ -0,0 +1,13 @@
+#!/bin/bash
+set -euo pipefail
+
+MOUNT=tests/mount
+
+echo hello >"$MOUNT"/file
+ln "$MOUNT"/file "$MOUNT"/link
+stat -c %h "$MOUNT"/file
+echo world >>"$MOUNT"/link
+cat "$MOUNT"/file
+rm "$MOUNT"/file
+stat -c %h "$MOUNT"/link
+cat "$MOUNT"/link
@@ -0,0 +1,14 @@
+#!/bin/bash
+set -euo pipefail
+
+MOUNT=tests/mount
+
+truncate -s 1M "$MOUNT"/sparse
+stat -c '%s %b' "$MOUNT"/sparse
+fallocate -o 0 -l 8192 "$MOUNT"/sparse
+stat -c '%s %b' "$MOUNT"/sparse
+fallocate -p -o 0 -l 4096 "$MOUNT"/sparse
+stat -c '%s %b' "$MOUNT"/sparse
+fallocate -l 2M "$MOUNT"/sparse
+stat -c '%s %b' "$MOUNT"/sparse
+tr -d '\0' <"$MOUNT"/sparse | wc -c
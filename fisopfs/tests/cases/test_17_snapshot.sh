@@ -0,0 +1,14 @@
+#!/bin/bash
+set -uo pipefail
+
+MOUNT=tests/mount
+
+echo hello >"$MOUNT"/testfile
+mkdir "$MOUNT"/.snapshots/first
+echo goodbye >"$MOUNT"/testfile
+rm "$MOUNT"/testfile
+ls "$MOUNT"/.snapshots
+ls "$MOUNT"/.snapshots/first
+cat "$MOUNT"/.snapshots/first/testfile
+touch "$MOUNT"/.snapshots/first/other 2>&1
+ls "$MOUNT"
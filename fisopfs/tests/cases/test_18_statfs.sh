@@ -0,0 +1,17 @@
+#!/bin/bash
+set -uo pipefail
+
+MOUNT=tests/mount
+
+# Blocks and inodes in use, from a single statfs.
+used() {
+	stat -f -c '%b %f %c %d' "$MOUNT" | awk '{ print $1 - $2, $3 - $4 }'
+}
+
+stat -f -c '%S %l' "$MOUNT"
+before=$(used)
+mkdir "$MOUNT"/dir
+head -c 10000 /dev/zero >"$MOUNT"/dir/file
+echo "$before $(used)" | awk '{ print $3 - $1, $4 - $2 }'
+rm -r "$MOUNT"/dir
+echo "$before $(used)" | awk '{ print $3 - $1, $4 - $2 }'
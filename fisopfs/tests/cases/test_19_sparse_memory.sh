@@ -0,0 +1,21 @@
+#!/bin/bash
+set -euo pipefail
+
+MOUNT=tests/mount
+
+# Resident memory of the filesystem, in KiB.
+rss() {
+	awk '/^VmRSS:/ { print $2 }' /proc/"$(pgrep -n -x fisopfs)"/status
+}
+
+before=$(rss)
+printf x | dd of="$MOUNT"/far bs=1 seek=1T conv=notrunc status=none
+printf y | dd of="$MOUNT"/far bs=1 seek=2T conv=notrunc status=none
+stat -c '%s %b' "$MOUNT"/far
+dd if="$MOUNT"/far bs=1 skip=1T count=1 status=none
+echo
+if [ $(($(rss) - before)) -lt 8192 ]; then
+	echo flat
+fi
+truncate -s 0 "$MOUNT"/far
+stat -c '%s %b' "$MOUNT"/far
@@ -0,0 +1,21 @@
+#!/bin/bash
+set -euo pipefail
+
+MOUNT=tests/mount
+
+# Where lseek with SEEK_DATA (3) or SEEK_HOLE (4) lands from each offset,
+# or the error.
+seek() {
+	perl -e '
+		open(my $f, "<", shift) or die "$!\n";
+		my $whence = shift;
+		for my $offset (@ARGV) {
+			my $pos = sysseek($f, $offset, $whence);
+			print defined $pos ? $pos + 0 : $!, "\n";
+		}' "$@"
+}
+
+truncate -s 1M "$MOUNT"/sparse
+printf x | dd of="$MOUNT"/sparse bs=1 seek=512K conv=notrunc status=none
+seek "$MOUNT"/sparse 3 0 524288 600000
+seek "$MOUNT"/sparse 4 0 524289
@@ -0,0 +1,21 @@
+#!/bin/bash
+set -euo pipefail
+
+MOUNT=tests/mount
+
+# copy_file_range calls the filesystem has answered.
+copies() {
+	awk '$1 == "copy_file_range" { print $3 }' "$MOUNT"/.fisopfs_stats
+}
+
+seq 1 20000 >"$MOUNT"/src
+before=$(copies)
+cp "$MOUNT"/src "$MOUNT"/dst
+if [ "$(copies)" -gt "$before" ]; then
+	echo copied with copy_file_range
+fi
+cmp "$MOUNT"/src "$MOUNT"/dst && echo same
+stat -c '%s %b' "$MOUNT"/dst
+echo 20001 >>"$MOUNT"/dst
+tail -n 1 "$MOUNT"/src
+tail -n 1 "$MOUNT"/dst
@@ -0,0 +1,20 @@
+#!/bin/bash
+set -uo pipefail
+
+MOUNT=tests/mount
+
+echo one >"$MOUNT"/testfile
+mkdir "$MOUNT"/.snapshots/older
+echo two >"$MOUNT"/testfile
+mkdir "$MOUNT"/.snapshots/newer
+echo three >"$MOUNT"/testfile
+rmdir "$MOUNT"/.snapshots/older
+ls "$MOUNT"/.snapshots | grep -e older -e newer
+cat "$MOUNT"/.snapshots/newer/testfile
+cp "$MOUNT"/.snapshots/newer/testfile "$MOUNT"/restored
+cat "$MOUNT"/restored
+rm "$MOUNT"/restored
+rmdir "$MOUNT"/.snapshots/older 2>&1
+rmdir "$MOUNT"/.snapshots/newer
+ls "$MOUNT"/.snapshots | grep -c -e older -e newer
+cat "$MOUNT"/testfile
@@ -0,0 +1,238 @@
+# Performance workloads, sourced by tests/run.sh --perf with the
+# filesystem mounted on $MOUNT. Every metric is a throughput, so higher
+# is always better. Sizes can be changed through the environment.
+
+PERF_FILES=${PERF_FILES:-100000}
+PERF_LS_ROUNDS=${PERF_LS_ROUNDS:-10}
+PERF_MB=${PERF_MB:-256}
+PERF_RANDOM_OPS=${PERF_RANDOM_OPS:-20000}
+PERF_DEPTH=${PERF_DEPTH:-64}
+PERF_LOOKUPS=${PERF_LOOKUPS:-20000}
+PERF_IMAGE_FILES=${PERF_IMAGE_FILES:-50000}
+
+METRIC_NAMES=()
+METRIC_VALUES=()
+
+now_ns() {
+	date +%s%N
+}
+
+# per_second COUNT START END: COUNT divided by the seconds between two
+# now_ns timestamps.
+per_second() {
+	awk -v n="$1" -v a="$2" -v b="$3" \
+		'BEGIN { t = (b - a) / 1e9; if (t <= 0) t = 1e-9; printf "%.1f", n / t }'
+}
+
+record() {
+	METRIC_NAMES+=("$1")
+	METRIC_VALUES+=("$2")
+	printf "%-24s %14s\n" "$1" "$2"
+}
+
+# Create, stat, list and unlink PERF_FILES files in a single directory.
+perf_metadata() {
+	local dir="$MOUNT/metadata" start end i
+
+	mkdir "$dir"
+	start=$(now_ns)
+	for ((i = 0; i < PERF_FILES; i++)); do
+		: >"$dir/f$i"
+	done
+	end=$(now_ns)
+	record create_per_s "$(per_second "$PERF_FILES" "$start" "$end")"
+
+	start=$(now_ns)
+	find "$dir" -type f -exec stat -c %s {} + >/dev/null
+	end=$(now_ns)
+	record stat_per_s "$(per_second "$PERF_FILES" "$start" "$end")"
+
+	start=$(now_ns)
+	for ((i = 0; i < PERF_LS_ROUNDS; i++)); do
+		ls -f "$dir" >/dev/null
+	done
+	end=$(now_ns)
+	record ls_entries_per_s \
+		"$(per_second $((PERF_FILES * PERF_LS_ROUNDS)) "$start" "$end")"
+
+	start=$(now_ns)
+	find "$dir" -type f -delete
+	end=$(now_ns)
+	record unlink_per_s "$(per_second "$PERF_FILES" "$start" "$end")"
+
+	rmdir "$dir"
+}
+
+# Write and read back a PERF_MB file in 1 MiB requests.
+perf_sequential() {
+	local file="$MOUNT/sequential" start end
+
+	start=$(now_ns)
+	dd if=/dev/zero of="$file" bs=1M count="$PERF_MB" status=none
+	end=$(now_ns)
+	record seq_write_mb_per_s "$(per_second "$PERF_MB" "$start" "$end")"
+
+	start=$(now_ns)
+	dd if="$file" of=/dev/null bs=1M status=none
+	end=$(now_ns)
+	record seq_read_mb_per_s "$(per_second "$PERF_MB" "$start" "$end")"
+
+	rm "$file"
+}
+
+# PERF_RANDOM_OPS 4 KiB writes and then reads at random aligned offsets
+# of a 64 MiB file.
+perf_random() {
+	local file="$MOUNT/random" start end
+
+	dd if=/dev/zero of="$file" bs=1M count=64 status=none
+
+	start=$(now_ns)
+	perl -e '
+		my ($file, $ops) = @ARGV;
+		srand(1);
+		open(my $fh, "+<", $file) or die "$file: $!";
+		my $block = "x" x 4096;
+		for (1 .. $ops) {
+			sysseek($fh, int(rand(16384)) * 4096, 0);
+			syswrite($fh, $block) == 4096 or die "write: $!";
+		}
+	' "$file" "$PERF_RANDOM_OPS"
+	end=$(now_ns)
+	record random_write_per_s \
+		"$(per_second "$PERF_RANDOM_OPS" "$start" "$end")"
+
+	start=$(now_ns)
+	perl -e '
+		my ($file, $ops) = @ARGV;
+		srand(2);
+		open(my $fh, "<", $file) or die "$file: $!";
+		my $block;
+		for (1 .. $ops) {
+			sysseek($fh, int(rand(16384)) * 4096, 0);
+			sysread($fh, $block, 4096) == 4096 or die "read: $!";
+		}
+	' "$file" "$PERF_RANDOM_OPS"
+	end=$(now_ns)
+	record random_read_per_s \
+		"$(per_second "$PERF_RANDOM_OPS" "$start" "$end")"
+
+	rm "$file"
+}
+
+# Stat a file PERF_DEPTH directories deep PERF_LOOKUPS times. The mount
+# has no entry cache, so each stat walks the whole path.
+perf_deep_lookup() {
+	local path="$MOUNT/deep" start end i
+
+	for ((i = 0; i < PERF_DEPTH; i++)); do
+		path="$path/d$i"
+	done
+	mkdir -p "$path"
+	: >"$path/leaf"
+
+	start=$(now_ns)
+	perl -e '
+		my ($file, $n) = @ARGV;
+		for (1 .. $n) { stat($file) or die "$file: $!"; }
+	' "$path/leaf" "$PERF_LOOKUPS"
+	end=$(now_ns)
+	record deep_lookup_per_s "$(per_second "$PERF_LOOKUPS" "$start" "$end")"
+
+	rm -rf "$MOUNT/deep"
+}
+
+# Unmount and mount an image of PERF_IMAGE_FILES 4 KiB files, then read
+# all of them, which loads the lazily mapped blocks.
+perf_remount() {
+	local dir="$MOUNT/image" start end i
+
+	mkdir "$dir"
+	head -c 4096 /dev/urandom >"$OUTPUT/block"
+	for ((i = 0; i < PERF_IMAGE_FILES; i++)); do
+		cp "$OUTPUT/block" "$dir/f$i"
+	done
+
+	start=$(now_ns)
+	unmount_fs
+	end=$(now_ns)
+	record unmount_files_per_s \
+		"$(per_second "$PERF_IMAGE_FILES" "$start" "$end")"
+
+	start=$(now_ns)
+	mount_fs "${MOUNT_OPTIONS[@]}"
+	end=$(now_ns)
+	record mount_files_per_s \
+		"$(per_second "$PERF_IMAGE_FILES" "$start" "$end")"
+
+	start=$(now_ns)
+	cat "$dir"/* >/dev/null
+	end=$(now_ns)
+	record cold_read_files_per_s \
+		"$(per_second "$PERF_IMAGE_FILES" "$start" "$end")"
+
+	rm -rf "$dir" "$OUTPUT/block"
+}
+
+write_json() {
+	local i sep=
+
+	echo "{"
+	for i in "${!METRIC_NAMES[@]}"; do
+		printf '%s\t"%s": %s' "$sep" "${METRIC_NAMES[$i]}" \
+			"${METRIC_VALUES[$i]}"
+		sep=$',\n'
+	done
+	printf '\n}\n'
+}
+
+run_workloads() {
+	perf_metadata
+	perf_sequential
+	perf_random
+	perf_deep_lookup
+	perf_remount
+
+	write_json >"$OUTPUT/perf.json"
+}
+
+# Compares $OUTPUT/perf.json against $BASELINE and fails when a metric
+# dropped more than $threshold percent. Without a baseline, or with
+# --update-baseline, the results become the new baseline.
+compare_baseline() {
+	if $update_baseline || [ ! -f "$BASELINE" ]; then
+		cp "$OUTPUT/perf.json" "$BASELINE"
+		echo "Baseline saved to $BASELINE"
+		return 0
+	fi
+
+	printf "%-24s %14s %14s %8s\n" metric baseline current change
+	awk -v threshold="$threshold" -v red="$RED" -v green="$GREEN" \
+		-v reset="$RESET" '
+		# Lines look like "name": value, as written by write_json.
+		!/":/ { next }
+		{
+			name = $1
+			gsub(/[":]/, "", name)
+			value = $2 + 0
+		}
+		NR == FNR { base[name] = value; next }
+		{ now[name] = value; order[n++] = name }
+		END {
+			failed = 0
+			for (i = 0; i < n; i++) {
+				name = order[i]
+				if (!(name in base) || base[name] == 0)
+					continue
+				change = (now[name] - base[name]) * 100 / base[name]
+				if (change < -threshold) {
+					color = red; failed = 1
+				} else {
+					color = green
+				}
+				printf "%s%-24s %14s %14s %+7.1f%%%s\n", color, name,
+					base[name], now[name], change, reset
+			}
+			exit failed
+		}' "$BASELINE" "$OUTPUT/perf.json"
+}
@@ -2,10 +2,27 @@
 set -euo pipefail
 
 verbose=false
+perf=false
+update_baseline=false
+# Percentage a metric may drop below its baseline before failing.
+threshold=20
 
 while [[ "$#" -gt 0 ]]; do
 	case "$1" in
 	-v | --verbose) verbose=true ;;
+	-p | --perf) perf=true ;;
+	--update-baseline)
+		perf=true
+		update_baseline=true
+		;;
+	--threshold)
+		threshold="$2"
+		shift
+		;;
+	--baseline)
+		baseline="$2"
+		shift
+		;;
 	*) echo "Unknown option: $1" ;;
 	esac
 	shift
@@ -42,27 +59,56 @@ EXPECTED="$TESTDIR/expected"
 OUTPUT="$TESTDIR/output"
 DISK="$TESTDIR/testdisk.fisopfs"
 FS_BINARY=./fisopfs
+PERF="$TESTDIR/perf"
+BASELINE="${baseline:-$PERF/baseline.json}"
+
+# The filesystem runs in the foreground, so that unmount_fs can wait for
+# it to save the image. Extra arguments go to fisopfs.
+mount_fs() {
+	log "Mounting filesystem..."
+	$FS_BINARY -f --filedisk "$DISK" "$MOUNT" "$@" >>"$OUTPUT/fisopfs.log" 2>&1 &
+	FS_PID=$!
+
+	for _ in {1..500}; do
+		if mountpoint -q "$MOUNT"; then
+			break
+		fi
+		sleep 0.01
+	done
+
+	if ! mountpoint -q "$MOUNT"; then
+		echo -e "${RED}Filesystem did not mount properly${RESET}"
+		exit 1
+	fi
+}
+
+unmount_fs() {
+	log "Unmounting $MOUNT..."
+	umount "$MOUNT"
+	wait "$FS_PID"
+	FS_PID=
+}
 
 rm -rf "$MOUNT" "$OUTPUT"
 mkdir -p "$MOUNT" "$OUTPUT"
-rm -f "$DISK"
+rm -f "$DISK" "$DISK.journal" "$DISK.journal.old"
 
-log "Mounting filesystem..."
-$FS_BINARY --filedisk "$DISK" "$MOUNT" &
-FS_PID=$!
+if $perf; then
+	# Without caching in the kernel, every lookup and stat reaches the
+	# filesystem, which is what the workloads measure.
+	MOUNT_OPTIONS=(-o entry_timeout=0,attr_timeout=0,negative_timeout=0)
+	mount_fs "${MOUNT_OPTIONS[@]}"
 
-for _ in {1..10}; do
-	if mountpoint -q "$MOUNT"; then
-		break
-	fi
-	sleep 0.5
-done
+	source "$PERF/workloads.sh"
+	run_workloads
 
-if ! mountpoint -q "$MOUNT"; then
-	log -e "${RED}Filesystem did not mount properly${RESET}"
-	exit 1
+	unmount_fs
+	compare_baseline
+	exit $?
 fi
 
+mount_fs
+
 EXIT_CODE=0
 
 for script in "$CASES"/test_*.sh; do
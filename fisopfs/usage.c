@@ -0,0 +1,181 @@
+#include "usage.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "defs.h"
+
+// Usage counters, what statfs reports. They are never computed from the
+// tree: make_node and drop_inode count the inodes they add and take out
+// of it, and the callbacks that change a file count the difference in
+// its size and in its blocks (see operations.c). So statfs costs the
+// same whatever the size of the tree, and so does mounting: each
+// checkpoint saves the counters in its segment header (see
+// persistence.c), and replaying the journal counts the changes made
+// since, like any others.
+//
+// Blocks are counted per file, like st_blocks: a block shared by several
+// files (see blocks.c) counts once for each. Frozen inodes (see
+// snapshot.c) do not count.
+//
+// Neither does a file unlinked while still open, from the moment it is
+// unlinked, since no checkpoint saves it. Its blocks move to a counter
+// of their own, not saved either, which goes on counting them, and what
+// they grow, until the last release frees it (see drop_inode and
+// put_refs in operations.c). At mount there are no open files, and that
+// counter starts at 0.
+//
+// So the counters, and the limits below, only cover the live tree and
+// the files unlinked from it still open. The blocks a snapshot keeps
+// once the live files replace or drop them are outside both, and a
+// filesystem with snapshots can take more memory and image than
+// --max-size: they are given back by removing the snapshots that hold
+// them.
+//
+// --max-size and --max-inodes limit them. Growing past a limit fails
+// with ENOSPC: usage_add_inode and usage_reserve count the inode or the
+// blocks first and take them back if that goes over, so concurrent
+// callbacks never go past it together. --max-size covers the blocks of
+// the tree and those of unlinked open files together. Replaying the
+// journal is not limited, the limits are set afterwards.
+//
+// The counters are updated atomically, each on its own. A checkpoint
+// reads them all while holding fs.lock for writing, when no callback
+// runs, so it saves them as they were at its lsn.
+
+static struct {
+	fs_usage used;        // Atomic
+	uint64_t orphaned;    // Blocks of unlinked open files, atomic
+	uint64_t max_blocks;  // 0 if unlimited
+	uint64_t max_inodes;  // 0 if unlimited
+} usage;
+
+// Sets the counters to those of the image just loaded, with no limits.
+void
+usage_init(const fs_usage *loaded)
+{
+	usage.used = *loaded;
+	usage.orphaned = 0;
+	usage.max_blocks = 0;
+	usage.max_inodes = 0;
+}
+
+// Sets the limits, 0 for none, once the journal is replayed.
+void
+usage_limit(uint64_t max_blocks, uint64_t max_inodes)
+{
+	usage.max_blocks = max_blocks;
+	usage.max_inodes = max_inodes;
+}
+
+void
+usage_get(fs_usage *out)
+{
+	out->files = __atomic_load_n(&usage.used.files, __ATOMIC_RELAXED);
+	out->dirs = __atomic_load_n(&usage.used.dirs, __ATOMIC_RELAXED);
+	out->bytes = __atomic_load_n(&usage.used.bytes, __ATOMIC_RELAXED);
+	out->blocks = __atomic_load_n(&usage.used.blocks, __ATOMIC_RELAXED);
+}
+
+// Counts a new file or directory, or fails with -ENOSPC if there are
+// --max-inodes already.
+int
+usage_add_inode(bool dir)
+{
+	uint64_t *count = dir ? &usage.used.dirs : &usage.used.files;
+	uint64_t *other = dir ? &usage.used.files : &usage.used.dirs;
+	uint64_t inodes = __atomic_add_fetch(count, 1, __ATOMIC_RELAXED) +
+	                  __atomic_load_n(other, __ATOMIC_RELAXED);
+	if (usage.max_inodes != 0 && inodes > usage.max_inodes) {
+		__atomic_sub_fetch(count, 1, __ATOMIC_RELAXED);
+		return -ENOSPC;
+	}
+	return EXIT_SUCCESS;
+}
+
+// Takes out of the counters a file or directory that leaves the tree,
+// with the `bytes` and `blocks` it held.
+void
+usage_drop_inode(bool dir, int64_t bytes, uint64_t blocks)
+{
+	__atomic_sub_fetch(dir ? &usage.used.dirs : &usage.used.files,
+	                   1,
+	                   __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&usage.used.bytes, bytes, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&usage.used.blocks, blocks, __ATOMIC_RELAXED);
+}
+
+// Counts `blocks` about to be allocated to a file of the tree, or to an
+// unlinked one if `orphan`, or fails with -ENOSPC if that goes past
+// --max-size. The caller counts the difference with the ones it did
+// allocate afterwards (see usage_add and usage_orphan).
+int
+usage_reserve(uint64_t blocks, bool orphan)
+{
+	uint64_t *count = orphan ? &usage.orphaned : &usage.used.blocks;
+	uint64_t *other = orphan ? &usage.used.blocks : &usage.orphaned;
+	uint64_t total = __atomic_add_fetch(count, blocks, __ATOMIC_RELAXED) +
+	                 __atomic_load_n(other, __ATOMIC_RELAXED);
+	if (usage.max_blocks != 0 && blocks > 0 && total > usage.max_blocks) {
+		__atomic_sub_fetch(count, blocks, __ATOMIC_RELAXED);
+		return -ENOSPC;
+	}
+	return EXIT_SUCCESS;
+}
+
+// Counts a change in the size and the blocks of a file.
+void
+usage_add(int64_t bytes, int64_t blocks)
+{
+	__atomic_add_fetch(&usage.used.bytes, bytes, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&usage.used.blocks, blocks, __ATOMIC_RELAXED);
+}
+
+// Counts a change in the blocks of unlinked open files.
+void
+usage_orphan(int64_t blocks)
+{
+	__atomic_add_fetch(&usage.orphaned, blocks, __ATOMIC_RELAXED);
+}
+
+// Fills in what statfs reports. Without --max-size the free blocks are
+// the memory still available, and without --max-inodes there are as many
+// free inodes as free blocks.
+void
+usage_statfs(struct statvfs *stbuf)
+{
+	fs_usage used;
+	usage_get(&used);
+	uint64_t inodes = used.files + used.dirs;
+	used.blocks += __atomic_load_n(&usage.orphaned, __ATOMIC_RELAXED);
+
+	uint64_t free_blocks = 0;
+	if (usage.max_blocks == 0) {
+		long pages = sysconf(_SC_AVPHYS_PAGES);
+		long page_size = sysconf(_SC_PAGESIZE);
+		if (pages > 0 && page_size > 0) {
+			free_blocks = (uint64_t) pages * page_size / BLOCK_SIZE;
+		}
+	} else if (used.blocks < usage.max_blocks) {
+		free_blocks = usage.max_blocks - used.blocks;
+	}
+	uint64_t free_inodes = free_blocks;
+	if (usage.max_inodes != 0) {
+		free_inodes = inodes < usage.max_inodes
+		                      ? usage.max_inodes - inodes
+		                      : 0;
+	}
+
+	memset(stbuf, 0, sizeof(*stbuf));
+	stbuf->f_bsize = BLOCK_SIZE;
+	stbuf->f_frsize = BLOCK_SIZE;
+	stbuf->f_blocks = used.blocks + free_blocks;
+	stbuf->f_bfree = free_blocks;
+	stbuf->f_bavail = free_blocks;
+	stbuf->f_files = inodes + free_inodes;
+	stbuf->f_ffree = free_inodes;
+	stbuf->f_favail = free_inodes;
+	stbuf->f_namemax = MAX_FILENAME - 1;
+}
@@ -0,0 +1,35 @@
+#ifndef USAGE_H
+#define USAGE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/statvfs.h>
+
+// What the tree holds, kept up to date by every change (see usage.c) and
+// saved with each checkpoint.
+typedef struct fs_usage {
+	uint64_t files;   // Regular files
+	uint64_t dirs;    // Directories, the root included
+	uint64_t bytes;   // Sum of the sizes of the files
+	uint64_t blocks;  // Block slots holding data, as in st_blocks
+} fs_usage;
+
+void usage_init(const fs_usage *usage);
+
+void usage_limit(uint64_t max_blocks, uint64_t max_inodes);
+
+void usage_get(fs_usage *usage);
+
+int usage_add_inode(bool dir);
+
+void usage_drop_inode(bool dir, int64_t bytes, uint64_t blocks);
+
+int usage_reserve(uint64_t blocks, bool orphan);
+
+void usage_add(int64_t bytes, int64_t blocks);
+
+void usage_orphan(int64_t blocks);
+
+void usage_statfs(struct statvfs *stbuf);
+
+#endif
@@ -0,0 +1,136 @@
+#include "workers.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+// Threads that encode and decode the image in parallel (see
+// persistence.c). workers_run hands out the jobs of a task, one at a
+// time, to the workers and to its own caller, which runs them too, and
+// returns once all of them are done. One task runs at a time: if another
+// is running, a checkpoint and a read at once say, workers_run runs the
+// jobs on its caller alone instead of waiting for it.
+
+#define MAX_THREADS 64
+
+static struct {
+	pthread_mutex_t run_lock;  // Held while a task runs
+	pthread_mutex_t lock;      // Protects the fields below
+	pthread_cond_t work_cond;  // A task was handed out, or stopping
+	pthread_cond_t done_cond;  // The last job of the task is done
+	workers_job job;
+	void *arg;
+	size_t count;    // Jobs of the task
+	size_t next;     // First job not taken yet
+	size_t pending;  // Jobs not done yet
+	bool stopping;
+	pthread_t threads[MAX_THREADS];
+	unsigned nthreads;
+} workers = {
+	.run_lock = PTHREAD_MUTEX_INITIALIZER,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work_cond = PTHREAD_COND_INITIALIZER,
+	.done_cond = PTHREAD_COND_INITIALIZER,
+};
+
+// Runs jobs of the current task until none is left to take. Called, and
+// returns, with workers.lock held.
+static void
+run_jobs(void)
+{
+	while (workers.next < workers.count) {
+		size_t index = workers.next++;
+		workers_job job = workers.job;
+		void *arg = workers.arg;
+		pthread_mutex_unlock(&workers.lock);
+		job(arg, index);
+		pthread_mutex_lock(&workers.lock);
+		if (--workers.pending == 0) {
+			pthread_cond_signal(&workers.done_cond);
+		}
+	}
+}
+
+static void *
+work(void *unused)
+{
+	(void) unused;
+	pthread_mutex_lock(&workers.lock);
+	while (!workers.stopping) {
+		run_jobs();
+		pthread_cond_wait(&workers.work_cond, &workers.lock);
+	}
+	pthread_mutex_unlock(&workers.lock);
+	return NULL;
+}
+
+// Starts the workers, so that tasks run on `threads` threads counting
+// the caller of workers_run, or on one per CPU if 0. With 1 they run on
+// the caller alone.
+void
+workers_start(unsigned threads)
+{
+	if (threads == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus > 0 ? (unsigned) cpus : 1;
+	}
+	if (threads > MAX_THREADS) {
+		threads = MAX_THREADS;
+	}
+
+	workers.stopping = false;
+	workers.nthreads = 0;
+	// Failing to start one only runs tasks on fewer threads.
+	while (workers.nthreads < threads - 1 &&
+	       pthread_create(&workers.threads[workers.nthreads],
+	                      NULL,
+	                      work,
+	                      NULL) == 0) {
+		workers.nthreads++;
+	}
+}
+
+// Runs `job` with `arg` for every index below `count`, in parallel, and
+// returns once all of them are done. Jobs must not call workers_run.
+void
+workers_run(size_t count, workers_job job, void *arg)
+{
+	if (workers.nthreads == 0 || count < 2 ||
+	    pthread_mutex_trylock(&workers.run_lock) != 0) {
+		for (size_t i = 0; i < count; i++) {
+			job(arg, i);
+		}
+		return;
+	}
+
+	pthread_mutex_lock(&workers.lock);
+	workers.job = job;
+	workers.arg = arg;
+	workers.count = count;
+	workers.next = 0;
+	workers.pending = count;
+	pthread_cond_broadcast(&workers.work_cond);
+	run_jobs();
+	while (workers.pending > 0) {
+		pthread_cond_wait(&workers.done_cond, &workers.lock);
+	}
+	workers.count = 0;
+	workers.next = 0;
+	pthread_mutex_unlock(&workers.lock);
+	pthread_mutex_unlock(&workers.run_lock);
+}
+
+// Stops the workers, once the task running, if any, is done.
+void
+workers_stop(void)
+{
+	pthread_mutex_lock(&workers.lock);
+	workers.stopping = true;
+	pthread_cond_broadcast(&workers.work_cond);
+	pthread_mutex_unlock(&workers.lock);
+
+	for (unsigned i = 0; i < workers.nthreads; i++) {
+		pthread_join(workers.threads[i], NULL);
+	}
+	workers.nthreads = 0;
+}
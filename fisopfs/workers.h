@@ -0,0 +1,15 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#include <stddef.h>
+
+// Runs job `index` of a task, see workers_run.
+typedef void (*workers_job)(void *arg, size_t index);
+
+void workers_start(unsigned threads);
+
+void workers_run(size_t count, workers_job job, void *arg);
+
+void workers_stop(void);
+
+#endif